@@ -0,0 +1,643 @@
+/*
+ * Benchmark of the parser and the splitter
+ *
+ * Measures the hot paths over a directory of real photos and over
+ * synthetic picture lists, and writes one JSON document to stdout (or
+ * the -o file):
+ *
+ *   createIfdTableArray/cold : every file read from the device (see -c)
+ *   createIfdTableArray/warm : files already in the page cache
+ *   getImgData, getImgOrientation
+ *   getTagInfo, findTagInfo  : lookups of a fixed tag set in parsed tables,
+ *                              copied / in place
+ *   splitpicsOntime/<rule>/<n> : n synthetic photos in random order
+ *
+ *   Usage:
+ *
+ *   bench [-p passes] [-s 10000,1000000,10000000] [-c evict|direct|none]
+ *         [-o out.json] [dir|file]...
+ *
+ * The cold pass gets its cold files one of two ways, neither of which
+ * needs root:
+ *
+ *   evict  : POSIX_FADV_DONTNEED on the whole corpus before each pass
+ *            (default).  Only clean pages can be dropped, so the corpus
+ *            is synced first, and the fraction still resident after the
+ *            eviction is reported to show whether it worked.
+ *   direct : the parser opens the files with O_DIRECT (READ_HINT_DIRECT),
+ *            so nothing is served from the cache even when it could not
+ *            be dropped.  File systems without O_DIRECT (tmpfs) are read
+ *            normally; direct_files tells how many were really direct.
+ *
+ * The parse results also carry per-file latency percentiles, and a
+ * cold_vs_warm summary compares the two passes.
+ *
+ * Every result reports ns/file and files/s of the fastest pass, and
+ * allocations/file and bytes read/file averaged over all passes.  The
+ * allocation count comes from wrapping malloc() and friends, which needs
+ * glibc; elsewhere it is reported as -1.  Photos are only needed for the
+ * parser results; gencorpus makes a reproducible set.  Splitting 10M
+ * photos needs about 4GB of memory; pass smaller sizes with -s on small
+ * machines.
+ *
+ * Messages the library prints while parsing go to /dev/null so they
+ * don't end up in the JSON.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include "exif.hpp"
+#include "fastCluster.h"
+#include "dirwalk.h"
+
+#define BENCH_DEFAULT_PASSES  3
+
+static const char *ruleNames[6] = { "year", "month", "day", "hour", "minute", "second" };
+
+static std::atomic<unsigned long long> allocCount(0);
+
+#if defined(__GLIBC__)
+#define BENCH_COUNT_ALLOCS  1
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+extern "C" void __libc_free(void *p);
+
+// every allocation of the process, operator new included, ends up here
+extern "C" void *malloc(size_t size)
+{
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t size)
+{
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+
+extern "C" void free(void *p)
+{
+    __libc_free(p);
+}
+#else
+#define BENCH_COUNT_ALLOCS  0
+#endif
+
+typedef struct {
+    std::string name;
+    unsigned long long files;     // per pass
+    int passes;
+    unsigned long long bestNs;    // fastest pass
+    unsigned long long allocs;    // all passes
+    unsigned long long bytesRead; // all passes
+    ExifAllocStats sites;         // the parser's own allocations, all passes
+    std::vector<unsigned long long> latencyNs; // per file, all passes (parse only)
+} BenchResult;
+
+typedef enum {
+    COLD_EVICT = 0,
+    COLD_DIRECT,
+    COLD_NONE
+} COLD_MODE;
+
+static const char *coldModeNames[] = { "evict", "direct", "none" };
+
+// how the cold pass went
+typedef struct {
+    COLD_MODE mode;
+    double residentBefore;         // fraction of the corpus cached at the start
+    unsigned long long directFiles;
+} ColdInfo;
+
+// counters at the start of a measured section
+typedef struct {
+    std::chrono::steady_clock::time_point start;
+    unsigned long long allocs;
+    unsigned long long bytes;
+    ExifAllocStats sites;
+} BenchMark;
+
+// what one pass cost
+typedef struct {
+    unsigned long long ns;
+    unsigned long long allocs;
+    unsigned long long bytes;
+    ExifAllocStats sites;
+} BenchPass;
+
+static void beginMeasure(BenchMark *m)
+{
+    ReadStats rs;
+    getReadStats(&rs);
+    m->bytes = rs.bytesRead;
+    m->allocs = allocCount.load();
+    getThreadAllocStats(&m->sites);
+    m->start = std::chrono::steady_clock::now();
+}
+
+// add the cost since beginMeasure() to a pass
+static void endMeasure(const BenchMark *m, BenchPass *pass)
+{
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    unsigned long long allocs = allocCount.load();
+    ExifAllocStats sites;
+    ReadStats rs;
+    getReadStats(&rs);
+    getThreadAllocStats(&sites);
+    pass->ns += (unsigned long long)
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - m->start).count();
+    pass->allocs += allocs - m->allocs;
+    pass->bytes += rs.bytesRead - m->bytes;
+    for (int s = 0; s < ALLOC_SITE_COUNT; s++) {
+        pass->sites.allocs[s] += sites.allocs[s] - m->sites.allocs[s];
+        pass->sites.bytes[s] += sites.bytes[s] - m->sites.bytes[s];
+    }
+}
+
+static void recordPass(BenchResult *r, const BenchPass& pass)
+{
+    if (r->passes == 0 || pass.ns < r->bestNs) {
+        r->bestNs = pass.ns;
+    }
+    r->allocs += pass.allocs;
+    r->bytesRead += pass.bytes;
+    for (int s = 0; s < ALLOC_SITE_COUNT; s++) {
+        r->sites.allocs[s] += pass.sites.allocs[s];
+        r->sites.bytes[s] += pass.sites.bytes[s];
+    }
+    r->passes++;
+}
+
+static BenchResult newResult(const std::string& name, unsigned long long files)
+{
+    BenchResult r;
+    r.name = name;
+    r.files = files;
+    r.passes = 0;
+    r.bestNs = 0;
+    r.allocs = 0;
+    r.bytesRead = 0;
+    memset(&r.sites, 0, sizeof(r.sites));
+    return r;
+}
+
+// drop the clean page cache of the corpus
+static void evictCorpus(const std::vector<std::string>& paths)
+{
+    for (size_t i = 0; i < paths.size(); i++) {
+        int fd = open(paths[i].c_str(), O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+}
+
+// fraction of the corpus in the page cache
+static double residentFraction(const std::vector<std::string>& paths)
+{
+    unsigned long long total = 0, resident = 0;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> vec;
+    for (size_t i = 0; i < paths.size(); i++) {
+        struct stat st;
+        int fd = open(paths[i].c_str(), O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            size_t pages = ((size_t)st.st_size + pageSize - 1) / pageSize;
+            void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                vec.resize(pages);
+                if (mincore(p, (size_t)st.st_size, &vec[0]) == 0) {
+                    for (size_t k = 0; k < pages; k++) {
+                        resident += (vec[k] & 1);
+                    }
+                    total += pages;
+                }
+                munmap(p, (size_t)st.st_size);
+            }
+        }
+        close(fd);
+    }
+    return total ? (double)resident / total : 0.0;
+}
+
+static void benchParse(const std::vector<std::string>& paths, int passes, int cold,
+                       ColdInfo *info, std::vector<BenchResult>& results)
+{
+    BenchResult r = newResult(cold ? "createIfdTableArray/cold" : "createIfdTableArray/warm",
+                              paths.size());
+    ReadStats rs;
+    r.latencyNs.reserve(paths.size() * passes);
+    if (cold) {
+        info->residentBefore = 0.0;
+        info->directFiles = 0;
+        resetReadStats();
+    }
+    for (int p = 0; p < passes; p++) {
+        BenchPass pass = {};
+        if (cold && info->mode == COLD_EVICT) {
+            evictCorpus(paths);
+            info->residentBefore += residentFraction(paths) / passes;
+        }
+        if (cold && info->mode == COLD_DIRECT) {
+            setReadHints(READ_HINT_DIRECT, 0);
+        }
+        for (size_t i = 0; i < paths.size(); i++) {
+            BenchMark m;
+            unsigned long long before = pass.ns;
+            int result;
+            beginMeasure(&m);
+            void **ifdArray = createIfdTableArray(paths[i].c_str(), &result);
+            if (ifdArray) {
+                freeIfdTableArray(ifdArray);
+            }
+            endMeasure(&m, &pass);
+            r.latencyNs.push_back(pass.ns - before);
+        }
+        setReadHints(0, 0);
+        recordPass(&r, pass);
+    }
+    if (cold) {
+        getReadStats(&rs);
+        info->directFiles = rs.directFiles;
+    }
+    results.push_back(r);
+}
+
+static void benchGetImgData(const std::vector<std::string>& paths, int passes,
+                            std::vector<BenchResult>& results)
+{
+    BenchResult r = newResult("getImgData", paths.size());
+    size_t dated = 0;
+    for (int p = 0; p < passes; p++) {
+        BenchPass pass = {};
+        BenchMark m;
+        beginMeasure(&m);
+        for (size_t i = 0; i < paths.size(); i++) {
+            dated += !getImgData(paths[i].c_str()).empty();
+        }
+        endMeasure(&m, &pass);
+        recordPass(&r, pass);
+    }
+    results.push_back(r);
+}
+
+static void benchGetImgOrientation(const std::vector<std::string>& paths, int passes,
+                                   std::vector<BenchResult>& results)
+{
+    BenchResult r = newResult("getImgOrientation", paths.size());
+    long long sum = 0;
+    for (int p = 0; p < passes; p++) {
+        BenchPass pass = {};
+        BenchMark m;
+        beginMeasure(&m);
+        for (size_t i = 0; i < paths.size(); i++) {
+            sum += getImgOrientation(paths[i].c_str());
+        }
+        endMeasure(&m, &pass);
+        recordPass(&r, pass);
+    }
+    results.push_back(r);
+}
+
+static void benchGetTagInfo(const std::vector<std::string>& paths, int passes,
+                            int copy, std::vector<BenchResult>& results)
+{
+    // what the splitter and a typical viewer ask for, plus a miss
+    static const struct {
+        IFD_TYPE ifd;
+        unsigned short tag;
+    } lookups[] = {
+        { IFD_EXIF, TAG_DateTimeOriginal },
+        { IFD_0TH, TAG_Orientation },
+        { IFD_0TH, TAG_Make },
+        { IFD_0TH, TAG_Model },
+        { IFD_EXIF, TAG_ExposureTime },
+        { IFD_GPS, TAG_GPSLatitude },
+        { IFD_EXIF, 0xFFFF },
+    };
+    const size_t nLookups = sizeof(lookups) / sizeof(lookups[0]);
+    std::vector<void**> tables;
+    int result;
+    for (size_t i = 0; i < paths.size(); i++) {
+        void **ifdArray = createIfdTableArray(paths[i].c_str(), &result);
+        if (ifdArray) {
+            tables.push_back(ifdArray);
+        }
+    }
+    BenchResult r = newResult(copy ? "getTagInfo" : "findTagInfo",
+                              tables.size() * nLookups);
+    size_t found = 0;
+    for (int p = 0; p < passes; p++) {
+        BenchPass pass = {};
+        BenchMark m;
+        beginMeasure(&m);
+        for (size_t i = 0; i < tables.size(); i++) {
+            for (size_t k = 0; k < nLookups; k++) {
+                if (copy) {
+                    TagNodeInfo *tag = getTagInfo(tables[i], lookups[k].ifd, lookups[k].tag);
+                    if (tag) {
+                        found++;
+                        freeTagInfo(tag);
+                    }
+                } else if (findTagInfo(tables[i], lookups[k].ifd, lookups[k].tag)) {
+                    found++;
+                }
+            }
+        }
+        endMeasure(&m, &pass);
+        recordPass(&r, pass);
+    }
+    for (size_t i = 0; i < tables.size(); i++) {
+        freeIfdTableArray(tables[i]);
+    }
+    results.push_back(r);
+}
+
+// n photos over ten years in random order, with short (SSO) paths so
+// the list itself costs no allocation per photo
+static void makePictures(size_t n, std::vector<picture>& pics)
+{
+    std::mt19937_64 rng(20160104);
+    std::uniform_int_distribution<int> year(2010, 2019), month(1, 12), day(1, 28),
+        hour(0, 23), minsec(0, 59);
+    char name[16];
+    pics.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        picture& pic = pics[i];
+        pic.date[0] = year(rng);
+        pic.date[1] = month(rng);
+        pic.date[2] = day(rng);
+        pic.date[3] = hour(rng);
+        pic.date[4] = minsec(rng);
+        pic.date[5] = minsec(rng);
+        snprintf(name, sizeof(name), "p%08zu.jpg", i % 100000000);
+        pic.filename = name;
+        pic.filepath = name;
+        pic.orien = 1;
+    }
+}
+
+static void benchSplit(const std::vector<size_t>& sizes, int passes,
+                       std::vector<BenchResult>& results)
+{
+    for (size_t s = 0; s < sizes.size(); s++) {
+        std::vector<picture> base;
+        makePictures(sizes[s], base);
+        // the big lists take seconds per pass; one is enough there
+        int n = (sizes[s] >= 1000000) ? 1 : passes;
+        for (int rule = 0; rule < 6; rule++) {
+            BenchResult r = newResult(std::string("splitpicsOntime/") + ruleNames[rule] + "/" +
+                                      std::to_string(sizes[s]), sizes[s]);
+            for (int p = 0; p < n; p++) {
+                std::vector<picture> pics(base);
+                std::vector<picsInoneTime> picsOT;
+                BenchPass pass = {};
+                BenchMark m;
+                beginMeasure(&m);
+                splitpicsOntime(pics, rule, picsOT);
+                endMeasure(&m, &pass);
+                recordPass(&r, pass);
+            }
+            results.push_back(r);
+        }
+    }
+}
+
+static void writeJsonString(FILE *fp, const std::string& s)
+{
+    fputc('"', fp);
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+// nearest-rank percentile of sorted values
+static unsigned long long percentile(const std::vector<unsigned long long>& sorted, double p)
+{
+    size_t rank = (size_t)(p / 100.0 * sorted.size() + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > sorted.size()) {
+        rank = sorted.size();
+    }
+    return sorted[rank - 1];
+}
+
+static const BenchResult *findResult(const std::vector<BenchResult>& results, const char *name)
+{
+    for (size_t i = 0; i < results.size(); i++) {
+        if (results[i].name == name) {
+            return &results[i];
+        }
+    }
+    return NULL;
+}
+
+static void writeJson(FILE *fp, const std::vector<BenchResult>& results, size_t corpus,
+                      const ColdInfo *cold)
+{
+    fprintf(fp, "{\n  \"corpus_files\": %zu,\n  \"allocs_counted\": %s,\n",
+            corpus, BENCH_COUNT_ALLOCS ? "true" : "false");
+    const BenchResult *c = findResult(results, "createIfdTableArray/cold");
+    const BenchResult *w = findResult(results, "createIfdTableArray/warm");
+    if (c && w && c->bestNs > 0 && w->bestNs > 0) {
+        double coldRate = 1e9 * c->files / c->bestNs;
+        double warmRate = 1e9 * w->files / w->bestNs;
+        fprintf(fp, "  \"cold_vs_warm\": {\"mode\": \"%s\", \"cold_files_per_s\": %.1f, "
+                "\"warm_files_per_s\": %.1f, \"slowdown\": %.2f",
+                coldModeNames[cold->mode], coldRate, warmRate, warmRate / coldRate);
+        if (cold->mode == COLD_EVICT) {
+            fprintf(fp, ", \"resident_before_cold\": %.4f", cold->residentBefore);
+        } else {
+            fprintf(fp, ", \"direct_files\": %llu", cold->directFiles);
+        }
+        fprintf(fp, "},\n");
+    }
+    fprintf(fp, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        double total = (double)r.files * r.passes;
+        double nsPerFile = r.files ? (double)r.bestNs / r.files : 0.0;
+        fprintf(fp, "    {\"name\": ");
+        writeJsonString(fp, r.name);
+        fprintf(fp, ", \"files\": %llu, \"passes\": %d, \"ns_per_file\": %.1f, "
+                "\"files_per_s\": %.1f, \"allocs_per_file\": %.3f, "
+                "\"bytes_read_per_file\": %.1f",
+                r.files, r.passes, nsPerFile,
+                (nsPerFile > 0.0) ? 1e9 / nsPerFile : 0.0,
+                (BENCH_COUNT_ALLOCS && total > 0) ? r.allocs / total : -1.0,
+                (total > 0) ? r.bytesRead / total : 0.0);
+        int sites = 0;
+        for (int s = 0; s < ALLOC_SITE_COUNT && total > 0; s++) {
+            if (r.sites.allocs[s] == 0) {
+                continue;
+            }
+            fprintf(fp, "%s\"%s\": {\"allocs_per_file\": %.3f, \"bytes_per_file\": %.1f}",
+                    (sites++ == 0) ? ", \"alloc_sites\": {" : ", ",
+                    getAllocSiteName((ALLOC_SITE)s),
+                    r.sites.allocs[s] / total, r.sites.bytes[s] / total);
+        }
+        if (sites > 0) {
+            fprintf(fp, "}");
+        }
+        if (!r.latencyNs.empty()) {
+            std::vector<unsigned long long> sorted(r.latencyNs);
+            std::sort(sorted.begin(), sorted.end());
+            fprintf(fp, ", \"latency_ns\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, "
+                    "\"p999\": %llu, \"max\": %llu}",
+                    percentile(sorted, 50), percentile(sorted, 90), percentile(sorted, 99),
+                    percentile(sorted, 99.9), sorted.back());
+        }
+        fprintf(fp, "}%s\n", (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+static int parseSizes(const char *arg, std::vector<size_t>& sizes)
+{
+    sizes.clear();
+    while (*arg) {
+        char *end;
+        unsigned long long n = strtoull(arg, &end, 10);
+        if (end == arg || (*end != ',' && *end != '\0')) {
+            return 0;
+        }
+        if (n > 0) {
+            sizes.push_back((size_t)n);
+        }
+        arg = (*end == ',') ? end + 1 : end;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<size_t> sizes = { 10000, 1000000, 10000000 };
+    std::vector<std::string> roots, paths;
+    std::vector<BenchResult> results;
+    int passes = BENCH_DEFAULT_PASSES;
+    const char *outPath = NULL;
+    ColdInfo cold = { COLD_EVICT, 0.0, 0 };
+    FILE *out;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:s:c:o:")) != -1) {
+        switch (c) {
+        case 'p':
+            passes = atoi(optarg);
+            break;
+        case 's':
+            if (!parseSizes(optarg, sizes)) {
+                fprintf(stderr, "bad size list: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            if (strcmp(optarg, "evict") == 0) {
+                cold.mode = COLD_EVICT;
+            } else if (strcmp(optarg, "direct") == 0) {
+                cold.mode = COLD_DIRECT;
+            } else if (strcmp(optarg, "none") == 0) {
+                cold.mode = COLD_NONE;
+            } else {
+                fprintf(stderr, "bad cold mode: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            outPath = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p passes] [-s n,n,...] [-c evict|direct|none] "
+                    "[-o out.json] [dir|file]...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (passes < 1) {
+        passes = 1;
+    }
+    for (int i = optind; i < argc; i++) {
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            roots.push_back(argv[i]);
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+    if (!roots.empty()) {
+        std::vector<WalkEntry> found;
+        walkPhotoTrees(roots, NULL, 0, found);
+        for (size_t i = 0; i < found.size(); i++) {
+            paths.push_back(found[i].filepath);
+        }
+    }
+
+    // keep the JSON away from what the library prints
+    if (outPath) {
+        out = fopen(outPath, "w");
+    } else {
+        out = fdopen(dup(STDOUT_FILENO), "w");
+    }
+    if (!out) {
+        fprintf(stderr, "can't open the output\n");
+        return 1;
+    }
+    fflush(stdout);
+    int devNull = open("/dev/null", O_WRONLY);
+    if (devNull >= 0) {
+        dup2(devNull, STDOUT_FILENO);
+        close(devNull);
+    }
+
+    setExifAllocCounting(1);
+    if (!paths.empty()) {
+        if (cold.mode == COLD_EVICT) {
+            // a synced file has only clean pages, which can be dropped
+            sync();
+        }
+        if (cold.mode != COLD_NONE) {
+            benchParse(paths, passes, 1, &cold, results);
+        }
+        benchParse(paths, passes, 0, &cold, results);
+        benchGetImgData(paths, passes, results);
+        benchGetImgOrientation(paths, passes, results);
+        benchGetTagInfo(paths, passes, 1, results);
+        benchGetTagInfo(paths, passes, 0, results);
+    }
+    benchSplit(sizes, passes, results);
+
+    writeJson(out, results, paths.size(), &cold);
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,438 @@
+/*
+ * Photo catalogue
+ */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <string>
+#include "exif.hpp"
+#include "datekey.h"
+#include "catalogue.h"
+
+#define CATALOGUE_MAGIC    "EXMCATLG"
+#define CATALOGUE_VERSION  1
+#define CATALOGUE_RULES    6
+
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int ruleMask;
+    unsigned long long count;
+    unsigned long long fileSize;
+    unsigned long long dateKeyOfs;
+    unsigned long long orientationOfs;
+    unsigned long long pathIdOfs;
+    unsigned long long pathOffsetOfs;
+    unsigned long long arenaOfs;
+    unsigned long long arenaSize;
+    unsigned long long groupOfs[CATALOGUE_RULES];
+    unsigned long long groupCount[CATALOGUE_RULES];
+} CATALOGUE_HEADER;
+
+struct _catalogue {
+    void *map;
+    size_t mapLen;
+    const CATALOGUE_HEADER *hdr;
+    const unsigned long long *dateKeys;
+    const short *orientations;
+    const unsigned int *pathIds;
+    const unsigned long long *pathOffsets;
+    const char *arena;
+    // group table of each rule: 0 = not checked yet, 1 = valid, -1 = corrupt
+    mutable std::atomic<int> groupState[CATALOGUE_RULES];
+};
+
+static unsigned long long align8(unsigned long long n)
+{
+    return (n + 7) & ~7ULL;
+}
+
+// write len bytes, then zeros up to the next multiple of 8
+static int writePadded(FILE *fp, const void *data, size_t len)
+{
+    static const char zeros[8] = { 0 };
+    size_t pad = (size_t)(align8(len) - len);
+    if ((len > 0 && fwrite(data, 1, len, fp) != len) ||
+        (pad > 0 && fwrite(zeros, 1, pad, fp) != pad)) {
+        return ERR_WRITE_FILE;
+    }
+    return 0;
+}
+
+/**
+ * writeCatalogue()
+ *
+ * Write a catalogue of the pictures
+ */
+int writeCatalogue(const char *path, const std::vector<picture>& pics, int ruleMask)
+{
+    size_t count = pics.size();
+    std::vector<unsigned long long> keys(count);
+    std::vector<unsigned int> rows(count); // row -> index into pics
+    std::vector<unsigned long long> column;
+    std::vector<short> orient(count);
+    std::vector<unsigned long long> pathOffsets(count + 1);
+    std::vector<unsigned long long> groups[CATALOGUE_RULES];
+    std::string part = std::string(path) + ".part";
+    CATALOGUE_HEADER hdr;
+    unsigned long long ofs;
+    FILE *fp;
+    int sts = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = packDateKey(pics[i].date);
+        rows[i] = (unsigned int)i;
+    }
+    std::sort(rows.begin(), rows.end(), [&](unsigned int a, unsigned int b) {
+        if (keys[a] != keys[b]) {
+            return keys[a] < keys[b];
+        }
+        return pics[a].filepath < pics[b].filepath;
+    });
+
+    // the path table stays in input order; pathId links a row to it
+    memset(&hdr, 0, sizeof(hdr));
+    pathOffsets[0] = 0;
+    for (size_t i = 0; i < count; i++) {
+        pathOffsets[i + 1] = pathOffsets[i] + pics[i].filepath.size() + 1;
+    }
+    for (int rule = 0; rule < CATALOGUE_RULES; rule++) {
+        if (!(ruleMask & CATALOGUE_RULE(rule))) {
+            continue;
+        }
+        for (size_t r = 0; r < count; r++) {
+            if (r == 0 || truncateDateKey(keys[rows[r]], rule) !=
+                          truncateDateKey(keys[rows[r - 1]], rule)) {
+                groups[rule].push_back(r);
+            }
+        }
+        groups[rule].push_back(count);
+    }
+
+    memcpy(hdr.magic, CATALOGUE_MAGIC, sizeof(hdr.magic));
+    hdr.version = CATALOGUE_VERSION;
+    hdr.ruleMask = (unsigned int)(ruleMask & CATALOGUE_ALL_RULES);
+    hdr.count = count;
+    ofs = align8(sizeof(hdr));
+    hdr.dateKeyOfs = ofs;
+    ofs += align8(count * sizeof(unsigned long long));
+    hdr.orientationOfs = ofs;
+    ofs += align8(count * sizeof(short));
+    hdr.pathIdOfs = ofs;
+    ofs += align8(count * sizeof(unsigned int));
+    hdr.pathOffsetOfs = ofs;
+    ofs += align8((count + 1) * sizeof(unsigned long long));
+    hdr.arenaOfs = ofs;
+    hdr.arenaSize = pathOffsets[count];
+    ofs += align8(hdr.arenaSize);
+    for (int rule = 0; rule < CATALOGUE_RULES; rule++) {
+        if (groups[rule].empty()) {
+            continue;
+        }
+        hdr.groupOfs[rule] = ofs;
+        hdr.groupCount[rule] = groups[rule].size() - 1;
+        ofs += groups[rule].size() * sizeof(unsigned long long);
+    }
+    hdr.fileSize = ofs;
+
+    fp = fopen(part.c_str(), "wb");
+    if (!fp) {
+        return ERR_WRITE_FILE;
+    }
+    sts = writePadded(fp, &hdr, sizeof(hdr));
+    if (sts == 0) {
+        column.resize(count);
+        for (size_t r = 0; r < count; r++) {
+            column[r] = keys[rows[r]];
+            orient[r] = (short)pics[rows[r]].orien;
+        }
+        sts = writePadded(fp, column.data(), count * sizeof(unsigned long long));
+    }
+    if (sts == 0) {
+        sts = writePadded(fp, orient.data(), count * sizeof(short));
+    }
+    if (sts == 0) {
+        sts = writePadded(fp, rows.data(), count * sizeof(unsigned int));
+    }
+    if (sts == 0) {
+        sts = writePadded(fp, pathOffsets.data(), (count + 1) * sizeof(unsigned long long));
+    }
+    for (size_t i = 0; i < count && sts == 0; i++) {
+        const std::string& p = pics[i].filepath;
+        if (fwrite(p.c_str(), 1, p.size() + 1, fp) != p.size() + 1) {
+            sts = ERR_WRITE_FILE;
+        }
+    }
+    if (sts == 0) {
+        static const char zeros[8] = { 0 };
+        size_t pad = (size_t)(align8(hdr.arenaSize) - hdr.arenaSize);
+        if (pad > 0 && fwrite(zeros, 1, pad, fp) != pad) {
+            sts = ERR_WRITE_FILE;
+        }
+    }
+    for (int rule = 0; rule < CATALOGUE_RULES && sts == 0; rule++) {
+        if (!groups[rule].empty()) {
+            sts = writePadded(fp, groups[rule].data(),
+                              groups[rule].size() * sizeof(unsigned long long));
+        }
+    }
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        sts = ERR_WRITE_FILE;
+    }
+    fclose(fp);
+    if (sts == 0 && rename(part.c_str(), path) != 0) {
+        sts = ERR_WRITE_FILE;
+    }
+    if (sts != 0) {
+        unlink(part.c_str());
+    }
+    return sts;
+}
+
+// a section [ofs, ofs + len) lies inside the file
+static int inFile(const CATALOGUE_HEADER *hdr, unsigned long long ofs, unsigned long long len)
+{
+    return ofs <= hdr->fileSize && len <= hdr->fileSize - ofs;
+}
+
+// an aligned array of n elements at ofs lies inside the file; n * size
+// is only formed once it is known not to overflow
+static int arrayInFile(const CATALOGUE_HEADER *hdr, unsigned long long ofs,
+                       unsigned long long n, unsigned long long size)
+{
+    return (ofs % 8) == 0 && n <= hdr->fileSize / size && inFile(hdr, ofs, n * size);
+}
+
+// a group table starts at row 0, ends at the row count and never goes back
+static int validGroups(const unsigned long long *starts, unsigned long long groups,
+                       unsigned long long count)
+{
+    if (starts[0] != 0 || starts[groups] != count) {
+        return 0;
+    }
+    for (unsigned long long g = 0; g < groups; g++) {
+        if (starts[g + 1] < starts[g]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * openCatalogue()
+ *
+ * Map a catalogue into memory
+ */
+Catalogue *openCatalogue(const char *path, int *pResult)
+{
+    struct stat st;
+    const CATALOGUE_HEADER *hdr;
+    Catalogue *cat;
+    int sts = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        sts = ERR_READ_FILE;
+        goto ERR;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CATALOGUE_HEADER)) {
+        close(fd);
+        sts = ERR_INVALID_ID;
+        goto ERR;
+    }
+    cat = new (std::nothrow) Catalogue();
+    if (!cat) {
+        close(fd);
+        sts = ERR_MEMALLOC;
+        goto ERR;
+    }
+    cat->mapLen = (size_t)st.st_size;
+    cat->map = mmap(NULL, cat->mapLen, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cat->map == MAP_FAILED) {
+        delete cat;
+        sts = ERR_MEMALLOC;
+        goto ERR;
+    }
+    hdr = (const CATALOGUE_HEADER*)cat->map;
+    cat->hdr = hdr;
+    if (memcmp(hdr->magic, CATALOGUE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != CATALOGUE_VERSION ||
+        hdr->fileSize != (unsigned long long)st.st_size ||
+        hdr->count >= hdr->fileSize ||
+        !arrayInFile(hdr, hdr->dateKeyOfs, hdr->count, sizeof(unsigned long long)) ||
+        !arrayInFile(hdr, hdr->orientationOfs, hdr->count, sizeof(short)) ||
+        !arrayInFile(hdr, hdr->pathIdOfs, hdr->count, sizeof(unsigned int)) ||
+        !arrayInFile(hdr, hdr->pathOffsetOfs, hdr->count + 1, sizeof(unsigned long long)) ||
+        !inFile(hdr, hdr->arenaOfs, hdr->arenaSize) ||
+        (hdr->arenaSize > 0 &&
+         ((const char*)cat->map)[hdr->arenaOfs + hdr->arenaSize - 1] != '\0')) {
+        closeCatalogue(cat);
+        sts = ERR_INVALID_ID;
+        goto ERR;
+    }
+    // only the placement of the group tables: their contents can be one
+    // entry per photo (rules 4 and 5) and are checked on first use
+    for (int rule = 0; rule < CATALOGUE_RULES; rule++) {
+        cat->groupState[rule] = 0;
+        if ((hdr->ruleMask & CATALOGUE_RULE(rule)) &&
+            (hdr->groupCount[rule] >= hdr->fileSize ||
+             !arrayInFile(hdr, hdr->groupOfs[rule], hdr->groupCount[rule] + 1,
+                          sizeof(unsigned long long)))) {
+            closeCatalogue(cat);
+            sts = ERR_INVALID_ID;
+            goto ERR;
+        }
+    }
+    cat->dateKeys = (const unsigned long long*)((const char*)cat->map + hdr->dateKeyOfs);
+    cat->orientations = (const short*)((const char*)cat->map + hdr->orientationOfs);
+    cat->pathIds = (const unsigned int*)((const char*)cat->map + hdr->pathIdOfs);
+    cat->pathOffsets = (const unsigned long long*)((const char*)cat->map + hdr->pathOffsetOfs);
+    cat->arena = (const char*)cat->map + hdr->arenaOfs;
+    if (pResult) {
+        *pResult = 0;
+    }
+    return cat;
+ERR:
+    if (pResult) {
+        *pResult = sts;
+    }
+    return NULL;
+}
+
+/**
+ * closeCatalogue()
+ *
+ * Unmap a catalogue
+ */
+void closeCatalogue(Catalogue *cat)
+{
+    if (!cat) {
+        return;
+    }
+    munmap(cat->map, cat->mapLen);
+    delete cat;
+}
+
+/**
+ * getCatalogueSize()
+ *
+ * Number of rows
+ */
+size_t getCatalogueSize(const Catalogue *cat)
+{
+    return (size_t)cat->hdr->count;
+}
+
+const unsigned long long *getCatalogueDateKeys(const Catalogue *cat)
+{
+    return cat->dateKeys;
+}
+
+const short *getCatalogueOrientations(const Catalogue *cat)
+{
+    return cat->orientations;
+}
+
+const unsigned int *getCataloguePathIds(const Catalogue *cat)
+{
+    return cat->pathIds;
+}
+
+/**
+ * getCataloguePath()
+ *
+ * Path of a row
+ */
+const char *getCataloguePath(const Catalogue *cat, size_t row)
+{
+    // checked here rather than when opening, which would touch every
+    // page of both columns; the arena ends with a NUL (openCatalogue())
+    unsigned long long count = cat->hdr->count;
+    unsigned int id;
+    if (row >= count) {
+        return "";
+    }
+    id = cat->pathIds[row];
+    if (id >= count || cat->pathOffsets[id] >= cat->hdr->arenaSize) {
+        return "";
+    }
+    return cat->arena + cat->pathOffsets[id];
+}
+
+/**
+ * getCatalogueGroups()
+ *
+ * Group table of a rule
+ */
+size_t getCatalogueGroups(const Catalogue *cat, int rule, const unsigned long long **starts)
+{
+    const CATALOGUE_HEADER *hdr = cat->hdr;
+    const unsigned long long *table;
+    int state;
+    if (rule < 0 || rule >= CATALOGUE_RULES || !(hdr->ruleMask & CATALOGUE_RULE(rule))) {
+        return 0;
+    }
+    table = (const unsigned long long*)((const char*)cat->map + hdr->groupOfs[rule]);
+    state = cat->groupState[rule].load(std::memory_order_relaxed);
+    if (state == 0) {
+        // racing first callers both check; the result is the same
+        state = validGroups(table, hdr->groupCount[rule], hdr->count) ? 1 : -1;
+        cat->groupState[rule].store(state, std::memory_order_relaxed);
+    }
+    if (state < 0) {
+        return 0;
+    }
+    if (starts) {
+        *starts = table;
+    }
+    return (size_t)hdr->groupCount[rule];
+}
+
+/**
+ * getCataloguePicture()
+ *
+ * Row as a struct picture
+ */
+void getCataloguePicture(const Catalogue *cat, size_t row, picture& pic)
+{
+    const char *path = getCataloguePath(cat, row);
+    const char *slash = strrchr(path, '/');
+    unpackDateKey(cat->dateKeys[row], pic.date);
+    pic.filepath = path;
+    pic.filename = slash ? slash + 1 : path;
+    pic.orien = cat->orientations[row];
+}
+
+/**
+ * catalogueToGroups()
+ *
+ * Build the groups splitpicsOntime() would produce
+ */
+int catalogueToGroups(const Catalogue *cat, int rule, std::vector<picsInoneTime>& picsOT)
+{
+    const unsigned long long *starts;
+    size_t groups = getCatalogueGroups(cat, rule, &starts);
+    picsOT.clear();
+    if (rule < 0 || rule >= CATALOGUE_RULES || !(cat->hdr->ruleMask & CATALOGUE_RULE(rule))) {
+        return ERR_NOT_EXIST;
+    }
+    if (cat->groupState[rule] < 0) {
+        return ERR_INVALID_ID;
+    }
+    picsOT.resize(groups);
+    for (size_t g = 0; g < groups; g++) {
+        std::vector<picture>& pics = picsOT[g].pic;
+        pics.resize((size_t)(starts[g + 1] - starts[g]));
+        for (size_t k = 0; k < pics.size(); k++) {
+            getCataloguePicture(cat, (size_t)starts[g] + k, pics[k]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Photo catalogue
+ *
+ * A versioned, column oriented snapshot of a split: everything a later
+ * stage (the clusterer, the gallery) needs to start without parsing a
+ * single photo or re-deriving the groups.  The file is used in place
+ * through mmap(), so opening it costs one page fault per column touched,
+ * whatever the number of photos.
+ *
+ * Rows are ordered by (date key, path).  File layout, every section
+ * aligned to 8 bytes, host byte order:
+ *
+ *   CATALOGUE_HEADER
+ *   u64 dateKey[count]            packDateKey() of the shooting date
+ *   i16 orientation[count]
+ *   u32 pathId[count]             row -> entry of the path table
+ *   u64 pathOffset[count + 1]     path table: offsets into the arena
+ *   char arena[]                  NUL terminated paths
+ *   u64 groupStart[groups + 1]    one table per rule in ruleMask; group g
+ *                                 is rows [groupStart[g], groupStart[g+1])
+ *
+ *   Typical Usage:
+ *
+ *   writeCatalogue("photos.cat", pics, CATALOGUE_ALL_RULES);
+ *   ...
+ *   Catalogue *cat = openCatalogue("photos.cat", &result);
+ *   const unsigned long long *starts;
+ *   size_t days = getCatalogueGroups(cat, 2, &starts);
+ *   for (size_t g = 0; g < days; g++) {
+ *       for (unsigned long long r = starts[g]; r < starts[g + 1]; r++) {
+ *           const char *path = getCataloguePath(cat, r);
+ *           ...
+ *       }
+ *   }
+ *   closeCatalogue(cat);
+ */
+#if !defined(_CATALOGUE_H_)
+#define _CATALOGUE_H_
+
+#include <vector>
+#include "fastCluster.h"
+
+#define CATALOGUE_RULE(rule)   (1 << (rule))
+#define CATALOGUE_ALL_RULES    0x3F
+
+typedef struct _catalogue Catalogue;
+
+/**
+ * writeCatalogue()
+ *
+ * Write a catalogue of the pictures
+ *
+ * parameters
+ *  [in] path : catalogue file (replaced atomically if it exists)
+ *  [in] pics : pictures in any order
+ *  [in] ruleMask : CATALOGUE_RULE() of every rule to store groups for
+ *
+ * return
+ *   0: OK
+ *  -n: error
+ *      ERR_WRITE_FILE
+ *      ERR_MEMALLOC
+ */
+int writeCatalogue(const char *path, const std::vector<picture>& pics, int ruleMask);
+
+/**
+ * openCatalogue()
+ *
+ * Map a catalogue into memory
+ *
+ * parameters
+ *  [in] path : catalogue file
+ *  [out] pResult : result status
+ *   0: OK
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_INVALID_ID (not a catalogue, another version, or corrupt)
+ *      ERR_MEMALLOC
+ *
+ * return
+ *  NULL: error
+ * !NULL: the catalogue handle
+ */
+Catalogue *openCatalogue(const char *path, int *pResult);
+
+/**
+ * closeCatalogue()
+ *
+ * Unmap a catalogue; pointers obtained from it become invalid
+ */
+void closeCatalogue(Catalogue *cat);
+
+/**
+ * getCatalogueSize()
+ *
+ * Number of rows
+ */
+size_t getCatalogueSize(const Catalogue *cat);
+
+/**
+ * getCatalogueDateKeys()
+ * getCatalogueOrientations()
+ * getCataloguePathIds()
+ *
+ * The columns, getCatalogueSize() elements each
+ */
+const unsigned long long *getCatalogueDateKeys(const Catalogue *cat);
+const short *getCatalogueOrientations(const Catalogue *cat);
+const unsigned int *getCataloguePathIds(const Catalogue *cat);
+
+/**
+ * getCataloguePath()
+ *
+ * Path of a row
+ *
+ * parameters
+ *  [in] cat : the catalogue handle
+ *  [in] row : row number
+ *
+ * return
+ *  NUL terminated path inside the mapping, "" if the row or its path
+ *  table entry is out of range
+ *
+ * note
+ * openCatalogue() checks the layout but not the pathId and pathOffset
+ * columns, which would mean reading all of them; each lookup checks its
+ * own entries instead, so a corrupt file gives wrong or empty paths,
+ * never a read outside the mapping.
+ */
+const char *getCataloguePath(const Catalogue *cat, size_t row);
+
+/**
+ * getCatalogueGroups()
+ *
+ * Group table of a rule
+ *
+ * parameters
+ *  [in] cat : the catalogue handle
+ *  [in] rule : split rule as for splitpicsOntime()
+ *  [out] starts : first row of every group, plus the row count at the end
+ *
+ * return
+ *  number of groups, 0 if the rule was not stored or its table is corrupt
+ *
+ * note
+ * The table is checked on the first call for the rule rather than by
+ * openCatalogue(), which then touches only the header whatever the number
+ * of groups.
+ */
+size_t getCatalogueGroups(const Catalogue *cat, int rule, const unsigned long long **starts);
+
+/**
+ * getCataloguePicture()
+ *
+ * Row as a struct picture
+ */
+void getCataloguePicture(const Catalogue *cat, size_t row, picture& pic);
+
+/**
+ * catalogueToGroups()
+ *
+ * Build the groups splitpicsOntime() would produce, for code that wants
+ * the vectors rather than the columns
+ *
+ * parameters
+ *  [in] cat : the catalogue handle
+ *  [in] rule : split rule
+ *  [out] picsOT : the groups
+ *
+ * return
+ *   0: OK
+ *  -n: error
+ *      ERR_NOT_EXIST (the rule was not stored)
+ *      ERR_INVALID_ID (the group table is corrupt)
+ */
+int catalogueToGroups(const Catalogue *cat, int rule, std::vector<picsInoneTime>& picsOT);
+
+#endif // _CATALOGUE_H_
@@ -0,0 +1,184 @@
+/*
+ * Date-range index
+ */
+#include <algorithm>
+#include <new>
+#include <vector>
+#include "exif.hpp"
+#include "dateindex.h"
+
+struct _dateIndex {
+    const unsigned long long *keys;
+    size_t count;
+    size_t blocks;
+    std::vector<unsigned long long> eytz;  // 1-based, eytz[0] unused
+    std::vector<size_t> block;             // block number of eytz[k]
+};
+
+// fill the Eytzinger array with the first key of every block: an
+// in-order walk of the implicit tree visits the blocks in order
+static void buildEytzinger(DateIndex *idx, size_t *next, size_t k)
+{
+    if (k > idx->blocks) {
+        return;
+    }
+    buildEytzinger(idx, next, 2 * k);
+    idx->eytz[k] = idx->keys[*next * DATEINDEX_BLOCK];
+    idx->block[k] = *next;
+    (*next)++;
+    buildEytzinger(idx, next, 2 * k + 1);
+}
+
+/**
+ * createDateIndex()
+ *
+ * Build the index of a sorted key column
+ */
+DateIndex *createDateIndex(const unsigned long long *keys, size_t count, int *pResult)
+{
+    size_t next = 0;
+    DateIndex *idx = new (std::nothrow) DateIndex();
+    if (!idx) {
+        if (pResult) {
+            *pResult = ERR_MEMALLOC;
+        }
+        return NULL;
+    }
+    idx->keys = keys;
+    idx->count = count;
+    idx->blocks = (count + DATEINDEX_BLOCK - 1) / DATEINDEX_BLOCK;
+    try {
+        idx->eytz.resize(idx->blocks + 1);
+        idx->block.resize(idx->blocks + 1);
+    } catch (...) {
+        delete idx;
+        if (pResult) {
+            *pResult = ERR_MEMALLOC;
+        }
+        return NULL;
+    }
+    buildEytzinger(idx, &next, 1);
+    if (pResult) {
+        *pResult = 0;
+    }
+    return idx;
+}
+
+/**
+ * destroyDateIndex()
+ *
+ * Free the index
+ */
+void destroyDateIndex(DateIndex *idx)
+{
+    delete idx;
+}
+
+/**
+ * lowerBoundDateKey()
+ *
+ * First row whose key is >= key
+ */
+size_t lowerBoundDateKey(const DateIndex *idx, unsigned long long key)
+{
+    const unsigned long long *eytz = idx->eytz.data();
+    size_t n = idx->blocks;
+    size_t k = 1, first, lo, hi;
+
+    if (n == 0) {
+        return 0;
+    }
+    while (k <= n) {
+        // the node four levels down is 16 keys (two lines) wide
+        __builtin_prefetch(eytz + 16 * k);
+        k = 2 * k + (eytz[k] < key);
+    }
+    // strip the trailing right turns: k is the first block start >= key
+    k >>= __builtin_ffsll(~(long long)k);
+    first = (k == 0) ? n : idx->block[k];
+    if (first == 0) {
+        return 0;
+    }
+    // the answer is in the block before it, or its first row
+    lo = (first - 1) * DATEINDEX_BLOCK;
+    hi = first * DATEINDEX_BLOCK;
+    if (hi > idx->count) {
+        hi = idx->count;
+    }
+    while (lo < hi && idx->keys[lo] < key) {
+        lo++;
+    }
+    return lo;
+}
+
+/**
+ * queryDateRange()
+ *
+ * Rows whose key is in [from, to)
+ */
+void queryDateRange(const DateIndex *idx, unsigned long long from,
+                    unsigned long long to, size_t *begin, size_t *end)
+{
+    *begin = lowerBoundDateKey(idx, from);
+    *end = (to > from) ? lowerBoundDateKey(idx, to) : *begin;
+}
+
+// first row >= key at or after pos, searching outwards from pos
+static size_t gallop(const unsigned long long *keys, size_t count, size_t pos,
+                     unsigned long long key)
+{
+    size_t step = 1, lo = pos, hi;
+    if (pos >= count || keys[pos] >= key) {
+        return pos;
+    }
+    // keys[lo] < key; double the step until keys[hi] >= key
+    for (;;) {
+        hi = lo + step;
+        if (hi >= count) {
+            hi = count;
+            break;
+        }
+        if (keys[hi] >= key) {
+            break;
+        }
+        lo = hi;
+        step <<= 1;
+    }
+    return std::lower_bound(keys + lo + 1, keys + hi, key) - keys;
+}
+
+/**
+ * queryDateRanges()
+ *
+ * Answer many ranges in one sweep over the column
+ */
+int queryDateRanges(const DateIndex *idx, DateRangeQuery *queries, size_t count)
+{
+    std::vector<std::pair<unsigned long long, size_t> > bounds;
+    size_t pos = 0;
+    try {
+        bounds.reserve(count * 2);
+    } catch (...) {
+        for (size_t q = 0; q < count; q++) {
+            queryDateRange(idx, queries[q].from, queries[q].to,
+                           &queries[q].begin, &queries[q].end);
+        }
+        return ERR_MEMALLOC;
+    }
+    // bound 2q is the start of query q, 2q+1 its end
+    for (size_t q = 0; q < count; q++) {
+        bounds.push_back(std::make_pair(queries[q].from, 2 * q));
+        bounds.push_back(std::make_pair(std::max(queries[q].from, queries[q].to), 2 * q + 1));
+    }
+    std::sort(bounds.begin(), bounds.end());
+    for (size_t b = 0; b < bounds.size(); b++) {
+        pos = gallop(idx->keys, idx->count, pos, bounds[b].first);
+        DateRangeQuery& q = queries[bounds[b].second / 2];
+        if (bounds[b].second & 1) {
+            q.end = pos;
+        } else {
+            q.begin = pos;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * Date-range index
+ *
+ * Answers "which rows have a date in [from, to)" over a sorted date-key
+ * column (e.g. getCatalogueDateKeys()) in O(log n) without touching more
+ * than a handful of cache lines.
+ *
+ * Every DATEINDEX_BLOCK-th key is copied into an Eytzinger (BFS order)
+ * array: the binary search over it walks the array front to back, the
+ * top levels share cache lines and the next levels can be prefetched.
+ * The search ends in one block of the column, which is a single cache
+ * line.  The index costs about 2 bytes per row.
+ *
+ * Ranges are half-open on the packed date keys; to include the whole of
+ * a day, pass the key of the next day (or day | 0x1FFFF + 1) as `to`.
+ *
+ *   Typical Usage:
+ *
+ *   DateIndex *idx = createDateIndex(getCatalogueDateKeys(cat),
+ *                                    getCatalogueSize(cat), &result);
+ *   size_t begin, end;
+ *   queryDateRange(idx, packDateKey(t1), packDateKey(t2), &begin, &end);
+ *   for (size_t r = begin; r < end; r++) {
+ *       ... getCataloguePath(cat, r) ...
+ *   }
+ *   destroyDateIndex(idx);
+ */
+#if !defined(_DATEINDEX_H_)
+#define _DATEINDEX_H_
+
+#include <stddef.h>
+
+#define DATEINDEX_BLOCK  8   // keys per leaf block: one 64-byte line
+
+typedef struct _dateIndex DateIndex;
+
+// one range of a batched query
+typedef struct {
+    unsigned long long from;  // [in] first key included
+    unsigned long long to;    // [in] first key excluded
+    size_t begin;             // [out] first row in range
+    size_t end;               // [out] one past the last row in range
+} DateRangeQuery;
+
+/**
+ * createDateIndex()
+ *
+ * Build the index of a sorted key column
+ *
+ * parameters
+ *  [in] keys : date keys in ascending order; must stay valid (and
+ *              mapped) for the life of the index
+ *  [in] count : number of keys
+ *  [out] pResult : result status
+ *   0: OK
+ *  -n: error
+ *      ERR_MEMALLOC
+ *
+ * return
+ *  NULL: error
+ * !NULL: the index
+ */
+DateIndex *createDateIndex(const unsigned long long *keys, size_t count, int *pResult);
+
+/**
+ * destroyDateIndex()
+ *
+ * Free the index (the key column is not touched)
+ */
+void destroyDateIndex(DateIndex *idx);
+
+/**
+ * lowerBoundDateKey()
+ *
+ * First row whose key is >= key (count if there is none)
+ */
+size_t lowerBoundDateKey(const DateIndex *idx, unsigned long long key);
+
+/**
+ * queryDateRange()
+ *
+ * Rows whose key is in [from, to)
+ *
+ * parameters
+ *  [in] idx : the index
+ *  [in] from : first key included
+ *  [in] to : first key excluded
+ *  [out] begin : first row
+ *  [out] end : one past the last row (begin == end: none)
+ */
+void queryDateRange(const DateIndex *idx, unsigned long long from,
+                    unsigned long long to, size_t *begin, size_t *end);
+
+/**
+ * queryDateRanges()
+ *
+ * Answer many ranges in one sweep over the column: the bounds are
+ * sorted and each one is found by galloping forward from the previous
+ * one, so a batch costs O(q log q + q log(n / q)) instead of q searches
+ * from the root
+ *
+ * parameters
+ *  [in] idx : the index
+ *  [in,out] queries : ranges to answer, in any order
+ *  [in] count : number of queries
+ *
+ * return
+ *   0: OK
+ *  -n: error
+ *      ERR_MEMALLOC (the queries are then answered one by one)
+ */
+int queryDateRanges(const DateIndex *idx, DateRangeQuery *queries, size_t count);
+
+#endif // _DATEINDEX_H_
@@ -0,0 +1,177 @@
+/*
+ * Packed date keys.
+ *
+ * A shooting date "YYYY:MM:DD hh:mm:ss" is packed into a single 64-bit
+ * integer whose numeric order is the chronological order, so it can be
+ * stored, sorted and compared without touching the std::array<int, 6>
+ * representation used by struct picture.
+ *
+ *   bits 26..39 year   (14 bits)
+ *   bits 22..25 month  ( 4 bits)
+ *   bits 17..21 day    ( 5 bits)
+ *   bits 12..16 hour   ( 5 bits)
+ *   bits  6..11 minute ( 6 bits)
+ *   bits  0.. 5 second ( 6 bits)
+ *
+ * The value 0 means "no date".
+ */
+#if !defined(_DATEKEY_H_)
+#define _DATEKEY_H_
+
+#include <stddef.h>
+#include <array>
+
+#define DATEKEY_NONE 0ULL
+
+// bit position of each date field, indexed like picture::date
+static const int DateKeyShift[6] = { 26, 22, 17, 12, 6, 0 };
+static const int DateKeyBits[6]  = { 14,  4,  5,  5, 6, 6 };
+
+/**
+ * packDateKey()
+ *
+ * Pack {year, month, day, hour, minute, second} into a date key
+ */
+inline unsigned long long packDateKey(const std::array<int, 6>& date)
+{
+    unsigned long long key = 0;
+    for (int i = 0; i < 6; i++) {
+        unsigned long long v = (unsigned long long)date[i] &
+                               ((1ULL << DateKeyBits[i]) - 1);
+        key |= v << DateKeyShift[i];
+    }
+    return key;
+}
+
+/**
+ * unpackDateKey()
+ *
+ * Unpack a date key into {year, month, day, hour, minute, second}
+ */
+inline void unpackDateKey(unsigned long long key, std::array<int, 6>& date)
+{
+    for (int i = 0; i < 6; i++) {
+        date[i] = (int)((key >> DateKeyShift[i]) & ((1ULL << DateKeyBits[i]) - 1));
+    }
+}
+
+/**
+ * truncateDateKey()
+ *
+ * Clear the fields finer than the split rule, so that two photos fall
+ * into the same group of splitpicsOntime() iff their truncated keys
+ * are equal.
+ *
+ * parameters
+ *  [in] key : date key
+ *  [in] rule : 0=year 1=month 2=day 3=hour 4=minute 5=second
+ */
+inline unsigned long long truncateDateKey(unsigned long long key, int rule)
+{
+    if (rule < 0 || rule >= 5) {
+        return key;
+    }
+    return key & ~((1ULL << DateKeyShift[rule]) - 1);
+}
+
+/**
+ * parseExifDate()
+ *
+ * Parse the Exif date string "YYYY:MM:DD hh:mm:ss"
+ *
+ * parameters
+ *  [in] s : date string as returned by getImgData(), need not be
+ *           NUL-terminated
+ *  [in] len : bytes readable at s (the tag's count)
+ *  [out] date : parsed fields
+ *
+ * return
+ *   1: OK
+ *   0: not a valid date string
+ */
+inline int parseExifDate(const char *s, size_t len, std::array<int, 6>& date)
+{
+    static const int width[6] = { 4, 2, 2, 2, 2, 2 };
+    if (!s || len < 19) {
+        return 0;
+    }
+    for (int i = 0; i < 6; i++) {
+        int v = 0;
+        for (int j = 0; j < width[i]; j++, s++) {
+            if (*s < '0' || *s > '9') {
+                return 0;
+            }
+            v = v * 10 + (*s - '0');
+        }
+        date[i] = v;
+        if (i < 5) {
+            if (*s != ':' && *s != ' ') {
+                return 0;
+            }
+            s++;
+        }
+    }
+    return 1;
+}
+
+/**
+ * daysFromCivil()
+ *
+ * Days since 1970-01-01 of a proleptic Gregorian date
+ * (H. Hinnant's algorithm: no tables, no loops)
+ */
+inline long long daysFromCivil(long long y, int m, int d)
+{
+    y -= (m <= 2);
+    long long era = (y >= 0 ? y : y - 399) / 400;
+    long long yoe = y - era * 400;
+    long long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/**
+ * civilFromDays()
+ *
+ * Inverse of daysFromCivil()
+ */
+inline void civilFromDays(long long z, int *y, int *m, int *d)
+{
+    z += 719468;
+    long long era = (z >= 0 ? z : z - 146096) / 146097;
+    long long doe = z - era * 146097;
+    long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long long mp = (5 * doy + 2) / 153;
+    *d = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *m = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *y = (int)(yoe + era * 400 + (*m <= 2));
+}
+
+/**
+ * dateToSeconds()
+ *
+ * Seconds since 1970-01-01 00:00:00 of a date taken as UTC
+ */
+inline long long dateToSeconds(const std::array<int, 6>& date)
+{
+    return daysFromCivil(date[0], date[1], date[2]) * 86400LL +
+           date[3] * 3600LL + date[4] * 60LL + date[5];
+}
+
+/**
+ * secondsToDate()
+ *
+ * Inverse of dateToSeconds()
+ */
+inline void secondsToDate(long long t, std::array<int, 6>& date)
+{
+    long long days = (t >= 0) ? t / 86400 : -((-t + 86399) / 86400);
+    long long rem = t - days * 86400;
+    civilFromDays(days, &date[0], &date[1], &date[2]);
+    date[3] = (int)(rem / 3600);
+    date[4] = (int)(rem / 60 % 60);
+    date[5] = (int)(rem % 60);
+}
+
+#endif // _DATEKEY_H_
@@ -0,0 +1,209 @@
+/*
+ * Fast directory walker
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "exif.hpp"
+#include "dirwalk.h"
+#include "parallel.h"
+#include "trace.h"
+
+// the kernel's record layout for getdents64()
+typedef struct {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+} LINUX_DIRENT64;
+
+static const char *DefaultExtensions[] = { ".jpg", ".jpeg", NULL };
+
+typedef struct {
+    const char **extensions;
+    int flags;
+    size_t bufferSize;
+    char *buf;
+    unsigned long long rootDev;
+    std::vector<WalkEntry> *out;
+    int found;
+} WalkState;
+
+/**
+ * hasPhotoExtension()
+ *
+ * Check a file name against the extension list
+ */
+int hasPhotoExtension(const char *name, const char **extensions)
+{
+    const char *dot = strrchr(name, '.');
+    if (!dot) {
+        return 0;
+    }
+    if (!extensions) {
+        extensions = DefaultExtensions;
+    }
+    for (int i = 0; extensions[i] != NULL; i++) {
+        if (strcasecmp(dot, extensions[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// walk the directory open as dirFd; path is its name for the output
+static void walkDir(WalkState *ws, int dirFd, const std::string& path)
+{
+    struct stat st;
+    std::vector<std::string> subdirs;
+    unsigned long long dev = 0;
+    long n;
+
+    if (fstat(dirFd, &st) == 0) {
+        dev = (unsigned long long)st.st_dev;
+    }
+    for (;;) {
+        n = syscall(SYS_getdents64, dirFd, ws->buf, ws->bufferSize);
+        if (n <= 0) {
+            break;
+        }
+        for (long pos = 0; pos < n; ) {
+            LINUX_DIRENT64 *de = (LINUX_DIRENT64*)(ws->buf + pos);
+            const char *name = de->d_name;
+            unsigned char type = de->d_type;
+            pos += de->d_reclen;
+
+            if (name[0] == '.') {
+                if (name[1] == '\0' || (name[1] == '.' && name[2] == '\0') ||
+                    !(ws->flags & WALK_HIDDEN)) {
+                    continue;
+                }
+            }
+            if (type == DT_UNKNOWN) {
+                // some file systems (XFS v4, older NFS) don't fill d_type
+                if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR :
+                       S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+            }
+            if (type == DT_DIR) {
+                subdirs.push_back(name);
+            } else if (type == DT_REG && hasPhotoExtension(name, ws->extensions)) {
+                WalkEntry e;
+                e.filename = name;
+                e.filepath = path + "/" + name;
+                e.ino = de->d_ino;
+                e.dev = dev;
+                ws->out->push_back(e);
+                ws->found++;
+            }
+        }
+    }
+    // the buffer is free again; descend relative to this directory
+    for (size_t i = 0; i < subdirs.size(); i++) {
+        int fd = openat(dirFd, subdirs[i].c_str(),
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        if ((ws->flags & WALK_ONE_FILESYSTEM) &&
+            fstat(fd, &st) == 0 && (unsigned long long)st.st_dev != ws->rootDev) {
+            close(fd);
+            continue;
+        }
+        walkDir(ws, fd, path + "/" + subdirs[i]);
+        close(fd);
+    }
+}
+
+/**
+ * walkPhotoTree()
+ *
+ * Walk a single root
+ */
+int walkPhotoTree(const char *root, const WalkOptions *opt, std::vector<WalkEntry>& out)
+{
+    WalkState ws;
+    struct stat st;
+    std::string path(root);
+    int fd;
+    TRACE_SCOPE_ARG("walk", root);
+
+    ws.extensions = (opt) ? opt->extensions : NULL;
+    ws.flags = (opt) ? opt->flags : 0;
+    ws.bufferSize = (opt && opt->bufferSize > 0) ? opt->bufferSize : WALK_DEFAULT_BUFFER;
+    ws.out = &out;
+    ws.found = 0;
+    while (path.size() > 1 && path[path.size() - 1] == '/') {
+        path.erase(path.size() - 1);
+    }
+    fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return ERR_READ_FILE;
+    }
+    ws.rootDev = (fstat(fd, &st) == 0) ? (unsigned long long)st.st_dev : 0;
+    ws.buf = (char*)malloc(ws.bufferSize);
+    if (!ws.buf) {
+        close(fd);
+        return ERR_MEMALLOC;
+    }
+    walkDir(&ws, fd, path);
+    free(ws.buf);
+    close(fd);
+    return ws.found;
+}
+
+/**
+ * walkPhotoTrees()
+ *
+ * Walk several roots in parallel
+ */
+int walkPhotoTrees(const std::vector<std::string>& roots, const WalkOptions *opt,
+                   int threads, std::vector<WalkEntry>& out)
+{
+    std::vector<std::vector<WalkEntry> > perRoot(roots.size());
+    std::vector<int> result(roots.size(), 0);
+    int total = 0;
+
+    runParallel(threads, roots.size(), [&](size_t i) {
+        result[i] = walkPhotoTree(roots[i].c_str(), opt, perRoot[i]);
+    });
+    for (size_t i = 0; i < roots.size(); i++) {
+        if (result[i] < 0) {
+            return result[i];
+        }
+        total += result[i];
+    }
+    out.reserve(out.size() + total);
+    for (size_t i = 0; i < roots.size(); i++) {
+        out.insert(out.end(), perRoot[i].begin(), perRoot[i].end());
+    }
+    return total;
+}
+
+/**
+ * walkEntriesToPictures()
+ *
+ * Convert walker output into pictures with an empty date
+ */
+void walkEntriesToPictures(const std::vector<WalkEntry>& entries,
+                           std::vector<picture>& pics)
+{
+    pics.reserve(pics.size() + entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        picture pic;
+        pic.date.fill(0);
+        pic.filepath = entries[i].filepath;
+        pic.filename = entries[i].filename;
+        pic.orien = NOT_AVAILABLE;
+        pics.push_back(pic);
+    }
+}
@@ -0,0 +1,105 @@
+/*
+ * Fast directory walker
+ *
+ * Enumerates the photos below one or more roots with getdents64() into
+ * a large buffer, decides file vs. directory from d_type (a stat is only
+ * made when the file system reports DT_UNKNOWN), opens sub-directories
+ * with openat() relative to their parent and filters by extension before
+ * a path string is even built.  Several roots are walked in parallel.
+ *
+ *   Typical Usage:
+ *
+ *   std::vector<std::string> roots = { "/photos/2015", "/photos/2016" };
+ *   std::vector<WalkEntry> found;
+ *   walkPhotoTrees(roots, NULL, 0, found);
+ *   std::vector<picture> pics;
+ *   walkEntriesToPictures(found, pics);
+ */
+#if !defined(_DIRWALK_H_)
+#define _DIRWALK_H_
+
+#include <string>
+#include <vector>
+#include "fastCluster.h"
+
+// walk flags
+#define WALK_ONE_FILESYSTEM  0x01   // don't descend into other mounts
+#define WALK_HIDDEN          0x02   // include dot files and dot directories
+
+#define WALK_DEFAULT_BUFFER  (256 * 1024)
+
+typedef struct {
+    const char **extensions; // NULL-terminated, case-insensitive; NULL = .jpg/.jpeg
+    int flags;               // WALK_*
+    size_t bufferSize;       // getdents64 buffer, 0 = WALK_DEFAULT_BUFFER
+} WalkOptions;
+
+// a file found by the walker
+typedef struct {
+    std::string filepath;
+    std::string filename;
+    unsigned long long ino;  // d_ino, no stat needed
+    unsigned long long dev;  // st_dev of the containing directory
+} WalkEntry;
+
+/**
+ * hasPhotoExtension()
+ *
+ * Check a file name against the extension list
+ *
+ * parameters
+ *  [in] name : file name
+ *  [in] extensions : NULL-terminated list, NULL = .jpg/.jpeg
+ *
+ * return
+ *  1: match
+ *  0: no match
+ */
+int hasPhotoExtension(const char *name, const char **extensions);
+
+/**
+ * walkPhotoTree()
+ *
+ * Walk a single root
+ *
+ * parameters
+ *  [in] root : top directory
+ *  [in] opt : options (NULL = defaults)
+ *  [out] out : found files are appended
+ *
+ * return
+ *   n: number of files appended
+ *  -n: error
+ *      ERR_READ_FILE (root can't be opened; unreadable sub-directories
+ *                     are skipped)
+ *      ERR_MEMALLOC
+ */
+int walkPhotoTree(const char *root, const WalkOptions *opt, std::vector<WalkEntry>& out);
+
+/**
+ * walkPhotoTrees()
+ *
+ * Walk several roots in parallel
+ *
+ * parameters
+ *  [in] roots : top directories
+ *  [in] opt : options (NULL = defaults)
+ *  [in] threads : worker threads, 0 = hardware concurrency
+ *  [out] out : found files, in the order of the roots
+ *
+ * return
+ *   n: number of files found
+ *  -n: the first error seen
+ */
+int walkPhotoTrees(const std::vector<std::string>& roots, const WalkOptions *opt,
+                   int threads, std::vector<WalkEntry>& out);
+
+/**
+ * walkEntriesToPictures()
+ *
+ * Convert walker output into pictures with an empty date
+ */
+void walkEntriesToPictures(const std::vector<WalkEntry>& entries,
+                           std::vector<picture>& pics);
+
+#endif // _DIRWALK_H_
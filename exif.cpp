@@ -16,7 +16,9 @@
 
 #ifdef _MSC_VER
 #include <windows.h>
+#include <io.h>
 #define vsnprintf _vsnprintf
+#define write _write
 #endif
 #include <stdio.h>
 #include <stddef.h>
@@ -25,7 +27,21 @@
 #include <string.h>
 #include <memory.h>
 #include <ctype.h>
+#include <atomic>
+#include <mutex>
+#if !defined(_MSC_VER)
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define USE_READ_HINTS
+#endif
 #include "exif.hpp"
+#include "exiftags.h"
+#include "stagestats.h"
+#include "trace.h"
 
 #pragma pack(2)
 
@@ -79,6 +95,26 @@ struct _ifdTable {
     unsigned char *p;
 };
 
+// a JPEG file open for reading; on Linux the FILE reads through a cookie
+// that keeps its own window, so that seeking back into data already read
+// costs nothing and every byte fetched from the kernel is counted.  The
+// FILE's own buffer is small: each seek throws it away, and an unbuffered
+// FILE would call the cookie once per byte
+#define READER_WINDOW       4096
+#define READER_FILE_BUFFER  256
+typedef struct {
+    FILE *fp;
+    int fd;
+    long long pos;       // offset of the next read
+    long long readEnd;   // highest offset read so far
+    long long winStart;  // file offset of win[0]
+    size_t winLen;
+    unsigned char *win;  // window, or an aligned buffer for O_DIRECT
+    int direct;
+    unsigned char window[READER_WINDOW];
+    char fileBuf[READER_FILE_BUFFER];
+} JPEG_READER;
+
 static int init(FILE*);
 static int systemIsLittleEndian();
 static int dataIsLittleEndian();
@@ -87,7 +123,6 @@ static void *parseIFD(FILE*, unsigned int, IFD_TYPE);
 static TagNode *getTagNodePtrFromIfd(IfdTable*, unsigned short);
 static TagNode *duplicateTagNode(TagNode*);
 static void freeTagNode(void*);
-static char *getTagName(int, unsigned short);
 static int countIfdTableOnIfdTableArray(void **ifdTableArray);
 static IfdTable *getIfdTableFromIfdTableArray(void **ifdTableArray, IFD_TYPE ifdType);
 static void *createIfdTable(IFD_TYPE IfdType, unsigned short tagCount, unsigned int nextOfs);
@@ -100,13 +135,53 @@ static int setSingleNumDataToTag(TagNode *tag, unsigned int value);
 static int getApp1StartOffset(FILE *fp, const char *App1IDString,
                               size_t App1IDStringLength, int *pDQTOffset);
 static unsigned short swab16(unsigned short us);
-static void PRINTF(char **ms, const char *fmt, ...);
-static int _dumpIfdTable(void *pIfd, char **p);
-
+static void *exifAlloc(size_t size, ALLOC_SITE site);
+static void exifFree(void *p, ALLOC_SITE site);
+static void *exifAllocOwned(size_t size, ALLOC_SITE site);
+static void exifFreeOwned(void *p, ALLOC_SITE site);
+static FILE *openJpegReader(const char *path, JPEG_READER *r);
+static void adviseSequential(JPEG_READER *r);
+static void closeJpegReader(JPEG_READER *r);
+
+// the state of the file being parsed is per thread, so that
+// independent files can be parsed concurrently
 static int Verbose = 0;
-static int App1StartOffset = -1;
-static int JpegDQTOffset = -1;
-static APP1_HEADER App1Header;
+static thread_local int App1StartOffset = -1;
+static thread_local int JpegDQTOffset = -1;
+static thread_local APP1_HEADER App1Header;
+static thread_local int WriteByteOrder = EXIF_BYTE_ORDER_KEEP;
+
+// page cache hints and I/O counters of the file based entry points
+static int ReadHints = 0;
+static unsigned int ReadHintHeaderBytes = READ_HINT_DEFAULT_HEADER_BYTES;
+static std::atomic<unsigned long long> ReadFiles(0);
+static std::atomic<unsigned long long> ReadBytes(0);
+static std::atomic<unsigned long long> ResidentBytes(0);
+static std::atomic<unsigned long long> RetainedBytes(0);
+static std::atomic<unsigned long long> DirectFiles(0);
+static thread_local unsigned long long ThreadReadBytes = 0;
+
+// allocator hooks and per site counters (setExifAllocator)
+static ExifAllocator Allocator = { NULL, NULL, NULL };
+static int AllocCounting = 0;
+static thread_local ExifAllocStats ThreadAllocStats;
+static const char *AllocSiteNames[ALLOC_SITE_COUNT] = {
+    "ifd_array", "ifd_table", "tag_node", "tag_data",
+    "parse_temp", "thumbnail", "copy_buffer", "dump"
+};
+
+// error counters per kind with a reservoir of example paths (recordExifError)
+static std::atomic<unsigned long long> ErrorCounts[ERR_KIND_COUNT];
+static std::mutex ErrorSampleLock;
+static int ErrorSamples[ERR_KIND_COUNT];
+static char ErrorPaths[ERR_KIND_COUNT][ERR_SAMPLE_COUNT][ERR_SAMPLE_PATH_MAX];
+static thread_local unsigned int ErrorRandom = 0;
+static const char *ErrorNames[ERR_KIND_COUNT] = {
+    "no_exif", "read_file", "write_file", "invalid_jpeg", "invalid_app1header",
+    "invalid_ifd", "invalid_id", "invalid_type", "invalid_count",
+    "invalid_pointer", "not_exist", "already_exist", "unknown", "memalloc",
+    "timed_out"
+};
 
 // public funtions
 
@@ -123,6 +198,204 @@ void setVerbose(int v)
     Verbose = v;
 }
 
+/**
+ * setReadHints()
+ *
+ * Set the page cache hints used by createIfdTableArray() and
+ * removeExifSegmentFromJPEGFile()
+ *
+ * parameters
+ *  [in] hints : READ_HINT_xxx flags (0 = let the kernel decide)
+ *  [in] headerBytes : size of the range WILLNEED is applied to,
+ *                     0 for READ_HINT_DEFAULT_HEADER_BYTES
+ */
+void setReadHints(int hints, unsigned int headerBytes)
+{
+    ReadHints = hints;
+    ReadHintHeaderBytes = (headerBytes > 0) ? headerBytes : READ_HINT_DEFAULT_HEADER_BYTES;
+}
+
+/**
+ * getReadStats()
+ *
+ * Get the I/O counters since the last resetReadStats()
+ *
+ * parameters
+ *  [out] stats : the counters
+ */
+void getReadStats(ReadStats *stats)
+{
+    if (!stats) {
+        return;
+    }
+    stats->files = ReadFiles;
+    stats->bytesRead = ReadBytes;
+    stats->residentBytes = ResidentBytes;
+    stats->retainedBytes = RetainedBytes;
+    stats->directFiles = DirectFiles;
+}
+
+/**
+ * resetReadStats()
+ *
+ * Clear the I/O counters
+ */
+void resetReadStats()
+{
+    ReadFiles = 0;
+    ReadBytes = 0;
+    ResidentBytes = 0;
+    RetainedBytes = 0;
+    DirectFiles = 0;
+}
+
+/**
+ * getThreadReadBytes()
+ *
+ * Bytes the calling thread has read through the file based entry points
+ */
+unsigned long long getThreadReadBytes()
+{
+    return ThreadReadBytes;
+}
+
+/**
+ * setExifAllocator()
+ *
+ * Route the parser's allocations through a pair of hooks
+ */
+int setExifAllocator(const ExifAllocator *allocator)
+{
+    if (!allocator) {
+        Allocator.alloc = NULL;
+        Allocator.release = NULL;
+        Allocator.ctx = NULL;
+        return 0;
+    }
+    if (!allocator->alloc != !allocator->release) {
+        return ERR_INVALID_POINTER;
+    }
+    Allocator = *allocator;
+    return 0;
+}
+
+/**
+ * setExifAllocCounting()
+ *
+ * Count the parser's allocations per site
+ */
+void setExifAllocCounting(int enabled)
+{
+    AllocCounting = enabled;
+}
+
+/**
+ * getThreadAllocStats()
+ *
+ * Allocations the calling thread has made through the parser
+ */
+void getThreadAllocStats(ExifAllocStats *stats)
+{
+    if (stats) {
+        *stats = ThreadAllocStats;
+    }
+}
+
+/**
+ * getAllocSiteName()
+ *
+ * Name of an allocation site
+ */
+const char *getAllocSiteName(ALLOC_SITE site)
+{
+    return (site >= 0 && site < ALLOC_SITE_COUNT) ? AllocSiteNames[site] : "unknown";
+}
+
+/**
+ * recordExifError()
+ *
+ * Count a file by the kind of its failure
+ */
+void recordExifError(int status, const char *path)
+{
+    unsigned long long n;
+    int kind = -status;
+    int slot = -1;
+
+    if (status > 0 || kind >= ERR_KIND_COUNT) {
+        return;
+    }
+    n = ++ErrorCounts[kind];
+    if (!path) {
+        return;
+    }
+    if (n <= ERR_SAMPLE_COUNT) {
+        slot = (int)(n - 1);
+    } else {
+        // keep the n-th file with probability ERR_SAMPLE_COUNT/n (xorshift32)
+        if (!ErrorRandom) {
+            ErrorRandom = (unsigned int)(size_t)&ErrorRandom | 1;
+        }
+        ErrorRandom ^= ErrorRandom << 13;
+        ErrorRandom ^= ErrorRandom >> 17;
+        ErrorRandom ^= ErrorRandom << 5;
+        if (ErrorRandom % n < ERR_SAMPLE_COUNT) {
+            slot = (int)(ErrorRandom % n);
+        }
+    }
+    if (slot < 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(ErrorSampleLock);
+    snprintf(ErrorPaths[kind][slot], ERR_SAMPLE_PATH_MAX, "%s", path);
+    if (ErrorSamples[kind] <= slot) {
+        ErrorSamples[kind] = slot + 1;
+    }
+}
+
+/**
+ * getExifErrorStats()
+ *
+ * Get the error counters since the last resetExifErrorStats()
+ */
+void getExifErrorStats(ExifErrorStats *stats)
+{
+    if (!stats) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(ErrorSampleLock);
+    for (int k = 0; k < ERR_KIND_COUNT; k++) {
+        stats->count[k] = ErrorCounts[k];
+        stats->samples[k] = ErrorSamples[k];
+    }
+    memcpy(stats->path, ErrorPaths, sizeof(ErrorPaths));
+}
+
+/**
+ * resetExifErrorStats()
+ *
+ * Clear the error counters and examples
+ */
+void resetExifErrorStats()
+{
+    std::lock_guard<std::mutex> guard(ErrorSampleLock);
+    for (int k = 0; k < ERR_KIND_COUNT; k++) {
+        ErrorCounts[k] = 0;
+        ErrorSamples[k] = 0;
+    }
+    memset(ErrorPaths, 0, sizeof(ErrorPaths));
+}
+
+/**
+ * getExifErrorName()
+ *
+ * Name of an error kind
+ */
+const char *getExifErrorName(int status)
+{
+    return (status <= 0 && -status < ERR_KIND_COUNT) ? ErrorNames[-status] : "unknown";
+}
+
 /**
  * removeExifSegmentFromJPEGFile()
  *
@@ -149,8 +422,9 @@ int removeExifSegmentFromJPEGFile(const char *inJPEGFileName,
     size_t readLen, writeLen;
     unsigned char buf[8192], *p;
     FILE *fpr = NULL, *fpw = NULL;
+    JPEG_READER reader;
 
-    fpr = fopen(inJPEGFileName, "rb");
+    fpr = openJpegReader(inJPEGFileName, &reader);
     if (!fpr) {
         sts = ERR_READ_FILE;
         goto DONE;
@@ -164,12 +438,14 @@ int removeExifSegmentFromJPEGFile(const char *inJPEGFileName,
         sts = ERR_WRITE_FILE;
         goto DONE;
     }
+    // everything but the Exif segment is copied, front to back
+    adviseSequential(&reader);
     // copy the data in front of the Exif segment
     rewind(fpr);
     p = buf;
     if (App1StartOffset > sizeof(buf)) {
         // allocate new buffer if needed
-        p = (unsigned char*)malloc(App1StartOffset);
+        p = (unsigned char*)exifAlloc(App1StartOffset, ALLOC_SITE_COPY_BUFFER);
     }
     if (!p) {
         for (i = 0; i < App1StartOffset; i++) {
@@ -186,7 +462,7 @@ int removeExifSegmentFromJPEGFile(const char *inJPEGFileName,
             goto DONE;
         }
         if (p != &buf[0]) {
-            free(p);
+            exifFree(p, ALLOC_SITE_COPY_BUFFER);
         }
     }
     // seek to the end of the Exif segment
@@ -211,9 +487,7 @@ DONE:
     if (fpw) {
         fclose(fpw);
     }
-    if (fpr) {
-        fclose(fpr);
-    }
+    closeJpegReader(&reader);
     return sts;
 }
 
@@ -243,7 +517,10 @@ void **createIfdTableArray(const char *JPEGFileName, int *result)
 
     int i, sts = 1, ifdCount = 0;
     unsigned int ifdOffset;
+    STAGE_DECL(ifdStart);
+    TRACE_DECL(ifdSpan);
     FILE *fp = NULL;
+    JPEG_READER reader;
     TagNode *tag;
     void **ppIfdArray = NULL;
     void *ifdArray[32];
@@ -251,8 +528,9 @@ void **createIfdTableArray(const char *JPEGFileName, int *result)
 
     ifd_0th = ifd_exif = ifd_gps = ifd_io = ifd_1st = NULL;
     memset(ifdArray, 0, sizeof(ifdArray));
+    TRACE_SCOPE_ARG("file", JPEGFileName);
 
-    fp = fopen(JPEGFileName, "rb");
+    fp = openJpegReader(JPEGFileName, &reader);
     if (!fp) {
         sts = ERR_READ_FILE;
         goto DONE;
@@ -261,6 +539,8 @@ void **createIfdTableArray(const char *JPEGFileName, int *result)
     if (sts <= 0) {
         goto DONE;
     }
+    STAGE_BEGIN(ifdStart);
+    TRACE_BEGIN(ifdSpan);
     if (Verbose) {
         printf("system: %s-endian\n  data: %s-endian\n", 
             systemIsLittleEndian() ? "little" : "big",
@@ -343,18 +623,18 @@ void **createIfdTableArray(const char *JPEGFileName, int *result)
     }
 
 DONE:
+    STAGE_END(ifdStart, STAGE_PARSE_IFD, (unsigned long long)ifdCount);
+    TRACE_END(ifdSpan, "parse_ifd");
     *result = (sts <= 0) ? sts : ifdCount;
     if (ifdCount > 0) {
         // +1 extra NULL element to the array 
-        ppIfdArray = (void**)malloc(sizeof(void*)*(ifdCount+1));
+        ppIfdArray = (void**)exifAlloc(sizeof(void*)*(ifdCount+1), ALLOC_SITE_IFD_ARRAY);
         memset(ppIfdArray, 0, sizeof(void*)*(ifdCount+1));
         for (i = 0; ifdArray[i] != NULL; i++) {
             ppIfdArray[i] = ifdArray[i];
         }
     }
-    if (fp) {
-        fclose(fp);
-    }
+    closeJpegReader(&reader);
     return ppIfdArray;
 }
 
@@ -372,7 +652,7 @@ void freeIfdTableArray(void **ifdArray)
     for (i = 0; ifdArray[i] != NULL; i++) {
         freeIfdTable(ifdArray[i]);
     }
-    free(ifdArray);
+    exifFree(ifdArray, ALLOC_SITE_IFD_ARRAY);
 }
 
 /**
@@ -395,92 +675,478 @@ IFD_TYPE getIfdType(void *pIfd)
     return ifd->ifdType;
 }
 
-/**
- * dumpIfdTable()
- *
- * Dump the IFD table
- *
- * parameters
- *  [in] ifd: target IFD
+/*
+ * Dump writer
  */
 
-int dumpIfdTable(void *pIfd)
+// empty the stage into the FILE or descriptor
+static int drainDumpStage(DumpWriter *w)
 {
-    return _dumpIfdTable(pIfd, NULL);
+    size_t done = 0;
+    if (w->len == 0 || (!w->fp && w->fd < 0)) {
+        return w->error;
+    }
+    if (w->fp) {
+        done = fwrite(w->buf, 1, w->len, w->fp);
+    } else {
+        while (done < w->len) {
+            long n = (long)write(w->fd, w->buf + done, w->len - done);
+            if (n <= 0) {
+                break;
+            }
+            done += (size_t)n;
+        }
+    }
+    if (done < w->len && !w->error) {
+        w->error = ERR_WRITE_FILE;
+    }
+    w->len = 0;
+    return w->error;
 }
 
-void getIfdTableDump(void *pIfd, char **pp)
+// make room for n more bytes and the terminating NUL
+static int reserveDump(DumpWriter *w, size_t n)
 {
-    if (pp) {
-        *pp = NULL;
+    if (w->error) {
+        return 0;
+    }
+    if (w->len + n + 1 <= w->cap) {
+        return 1;
+    }
+    if (w->fp || w->fd >= 0) {
+        drainDumpStage(w);
+        return !w->error && n + 1 <= w->cap;
+    }
+    size_t cap = (w->cap) ? w->cap : 256;
+    while (cap < w->len + n + 1) {
+        cap *= 2;
+    }
+    char *p = (char*)exifAllocOwned(cap, ALLOC_SITE_DUMP);
+    if (!p) {
+        w->error = ERR_MEMALLOC;
+        return 0;
+    }
+    if (w->buf) {
+        memcpy(p, w->buf, w->len + 1);
+        exifFreeOwned(w->buf, ALLOC_SITE_DUMP);
     }
-    _dumpIfdTable(pIfd, pp);
+    w->buf = p;
+    w->cap = cap;
+    return 1;
 }
 
-static int _dumpIfdTable(void *pIfd, char **p)
+static void dumpPut(DumpWriter *w, const char *s, size_t n)
 {
-    int i;
-    IfdTable *ifd;
-    TagNode *tag;
-    char tagName[512];
-    int cnt = 0;
-    unsigned int count;
+    while (n > 0 && !w->error) {
+        size_t chunk = n;
+        if ((w->fp || w->fd >= 0) && chunk >= w->cap) {
+            chunk = w->cap - 1; // larger than the stage: pass it through in pieces
+        }
+        if (!reserveDump(w, chunk)) {
+            return;
+        }
+        memcpy(w->buf + w->len, s, chunk);
+        w->len += chunk;
+        w->buf[w->len] = '\0';
+        s += chunk;
+        n -= chunk;
+    }
+}
 
-    if (!pIfd) {
-        return 0;
+static void dumpPuts(DumpWriter *w, const char *s)
+{
+    dumpPut(w, s, strlen(s));
+}
+
+static void dumpPrintf(DumpWriter *w, const char *fmt, ...)
+{
+    char tmp[256];
+    va_list args;
+    int n;
+    va_start(args, fmt);
+    n = vsnprintf(tmp, sizeof(tmp), fmt, args);
+    va_end(args);
+    if (n > 0) {
+        dumpPut(w, tmp, ((size_t)n < sizeof(tmp)) ? (size_t)n : sizeof(tmp) - 1);
     }
-    ifd = (IfdTable*)pIfd;
+}
 
-    PRINTF(p, "\n{%s IFD}",
-        (ifd->ifdType == IFD_0TH)  ? "0TH" :
-        (ifd->ifdType == IFD_1ST)  ? "1ST" :
-        (ifd->ifdType == IFD_EXIF) ? "EXIF" :
-        (ifd->ifdType == IFD_GPS)  ? "GPS" :
-        (ifd->ifdType == IFD_IO)   ? "Interoperability" : "");
+// write a string escaped for the format; stops at NUL or after n bytes
+static void dumpString(DumpWriter *w, const unsigned char *s, size_t n, DUMP_FORMAT format)
+{
+    size_t run = 0, i;
+    for (i = 0; i < n && s[i]; i++) {
+        unsigned char c = s[i];
+        const char *esc = NULL;
+        char hex[8];
+        if (format == DUMP_JSON && (c == '"' || c == '\\')) {
+            esc = (c == '"') ? "\\\"" : "\\\\";
+        } else if (format == DUMP_TSV && c == '\\') {
+            esc = "\\\\";
+        } else if (format != DUMP_TEXT && c < 0x20) {
+            if (c == '\t') {
+                esc = "\\t";
+            } else if (c == '\n') {
+                esc = "\\n";
+            } else if (c == '\r') {
+                esc = "\\r";
+            } else {
+                snprintf(hex, sizeof(hex), (format == DUMP_JSON) ? "\\u%04x" : "\\x%02x", c);
+                esc = hex;
+            }
+        }
+        if (esc) {
+            dumpPut(w, (const char*)s + i - run, run);
+            dumpPuts(w, esc);
+            run = 0;
+        } else {
+            run++;
+        }
+    }
+    dumpPut(w, (const char*)s + i - run, run);
+}
+
+static const char *dumpIfdName(IFD_TYPE ifdType, DUMP_FORMAT format)
+{
+    static const char *text[] = { "", "0TH", "1ST", "EXIF", "GPS", "Interoperability" };
+    static const char *keys[] = { "unknown", "0th", "1st", "exif", "gps", "interop" };
+    int i = (ifdType >= IFD_0TH && ifdType <= IFD_IO) ? (int)ifdType : 0;
+    return (format == DUMP_TEXT) ? text[i] : keys[i];
+}
+
+static int isSignedType(unsigned short type)
+{
+    return type == TYPE_SBYTE || type == TYPE_SSHORT ||
+           type == TYPE_SLONG || type == TYPE_SRATIONAL;
+}
+
+// the value of a tag: a JSON scalar or array, or space separated text
+static void dumpTagValue(DumpWriter *w, const TagNode *tag, DUMP_FORMAT format)
+{
+    unsigned int i, n = (tag->count < DUMP_MAX_VALUES) ? tag->count : DUMP_MAX_VALUES;
+    int json = (format == DUMP_JSON);
+    int array = json && tag->count > 1;
+    const char *more = (n < tag->count) ? (json ? ",\"...\"" : " ...") : "";
+
+    if (tag->error) {
+        dumpPuts(w, json ? "null" : "(error)");
+        return;
+    }
+    if (tag->type == TYPE_ASCII && tag->byteData) {
+        dumpPuts(w, json ? "\"" : (format == DUMP_TEXT) ? "[" : "");
+        dumpString(w, tag->byteData, tag->count, format);
+        dumpPuts(w, json ? "\"" : (format == DUMP_TEXT) ? "]" : "");
+        return;
+    }
+    if (tag->type == TYPE_UNDEFINED && tag->byteData) {
+        // hex; a JSON string of up to DUMP_MAX_VALUES bytes
+        dumpPuts(w, json ? "\"" : "");
+        for (i = 0; i < n; i++) {
+            dumpPrintf(w, (json || i == 0) ? "%02X" : " %02X", tag->byteData[i]);
+        }
+        dumpPuts(w, (n < tag->count) ? (json ? "...\"" : " ...") : (json ? "\"" : ""));
+        return;
+    }
+    if (!tag->numData) {
+        dumpPuts(w, json ? "null" : "");
+        return;
+    }
+    dumpPuts(w, array ? "[" : "");
+    for (i = 0; i < n; i++) {
+        const char *sep = (i == 0) ? "" : json ? "," : " ";
+        if (tag->type == TYPE_RATIONAL || tag->type == TYPE_SRATIONAL) {
+            if (isSignedType(tag->type)) {
+                dumpPrintf(w, json ? "%s[%d,%d]" : "%s%d/%d", sep,
+                           (int)tag->numData[i*2], (int)tag->numData[i*2+1]);
+            } else {
+                dumpPrintf(w, json ? "%s[%u,%u]" : "%s%u/%u", sep,
+                           tag->numData[i*2], tag->numData[i*2+1]);
+            }
+        } else if (isSignedType(tag->type)) {
+            int v = (int)tag->numData[i];
+            if (tag->type == TYPE_SBYTE) {
+                v = (signed char)v;
+            } else if (tag->type == TYPE_SSHORT) {
+                v = (short)v;
+            }
+            dumpPrintf(w, "%s%d", sep, v);
+        } else {
+            dumpPrintf(w, "%s%u", sep, tag->numData[i]);
+        }
+    }
+    dumpPuts(w, more);
+    dumpPuts(w, array ? "]" : "");
+}
 
+static void dumpIfdText(DumpWriter *w, const IfdTable *ifd)
+{
+    const TagNode *tag;
+    int cnt = 0;
+
+    dumpPrintf(w, "\n{%s IFD}", dumpIfdName(ifd->ifdType, DUMP_TEXT));
     if (Verbose) {
-        PRINTF(p, " tags=%u\n", ifd->tagCount);
+        dumpPrintf(w, " tags=%u\n", ifd->tagCount);
     } else {
-        PRINTF(p, "\n");
+        dumpPuts(w, "\n");
     }
-
-    tag = ifd->tags;
-    while (tag) {
+    for (tag = ifd->tags; tag; tag = tag->next) {
+        const ExifTagDef *def = getExifTagDef(ifd->ifdType, tag->tagId);
+        std::string_view name = (def) ? def->name : std::string_view("(unknown)");
         if (Verbose) {
-            PRINTF(p, "tag[%02d] 0x%04X %s\n",
-                cnt++, tag->tagId, getTagName(ifd->ifdType, tag->tagId));
-            PRINTF(p, "\ttype=%u count=%u ", tag->type, tag->count);
-            PRINTF(p, "val=");
+            dumpPrintf(w, "tag[%02d] 0x%04X ", cnt++, tag->tagId);
+            dumpPut(w, name.data(), name.size());
+            if (def && !exifTagMatches(def, tag->type, tag->count)) {
+                dumpPuts(w, " (unexpected type or count)");
+            }
+            dumpPrintf(w, "\n\ttype=%u count=%u val=", tag->type, tag->count);
         } else {
-            strcpy(tagName, getTagName(ifd->ifdType, tag->tagId));
-            PRINTF(p, " - %s: ", (strlen(tagName) > 0) ? tagName : "(unknown)");
-			if (!strcmp(tagName, "Orientation"))
-			{
-				return (unsigned short)(tag->numData[0]);
-			}
-			
+            dumpPuts(w, " - ");
+            dumpPut(w, name.data(), name.size());
+            dumpPuts(w, ": ");
         }
-		tag = tag->next;
+        dumpTagValue(w, tag, DUMP_TEXT);
+        dumpPuts(w, "\n");
     }
+}
 
+static void dumpIfdJson(DumpWriter *w, const IfdTable *ifd)
+{
+    const TagNode *tag;
+    dumpPrintf(w, "{\"ifd\":\"%s\",\"tags\":[", dumpIfdName(ifd->ifdType, DUMP_JSON));
+    for (tag = ifd->tags; tag; tag = tag->next) {
+        std::string_view name = getExifTagName(ifd->ifdType, tag->tagId);
+        dumpPrintf(w, "%s{\"id\":%u,\"name\":\"", (tag == ifd->tags) ? "" : ",", tag->tagId);
+        dumpPut(w, name.data(), name.size());
+        dumpPrintf(w, "\",\"type\":%u,\"count\":%u,\"value\":", tag->type, tag->count);
+        dumpTagValue(w, tag, DUMP_JSON);
+        dumpPuts(w, "}");
+    }
+    dumpPuts(w, "]}");
+}
+
+static void dumpIfdTsv(DumpWriter *w, const IfdTable *ifd, const char *path)
+{
+    const TagNode *tag;
+    for (tag = ifd->tags; tag; tag = tag->next) {
+        if (path) {
+            dumpString(w, (const unsigned char*)path, (size_t)-1, DUMP_TSV);
+        }
+        std::string_view name = getExifTagName(ifd->ifdType, tag->tagId);
+        dumpPrintf(w, "\t%s\t0x%04X\t", dumpIfdName(ifd->ifdType, DUMP_TSV), tag->tagId);
+        dumpPut(w, name.data(), name.size());
+        dumpPrintf(w, "\t%u\t%u\t", tag->type, tag->count);
+        dumpTagValue(w, tag, DUMP_TSV);
+        dumpPuts(w, "\n");
+    }
+}
+
+// Orientation of an IFD, 0 if it has none
+static int getIfdOrientation(const IfdTable *ifd)
+{
+    const TagNode *tag;
+    if (ifd->ifdType != IFD_0TH) {
+        return 0;
+    }
+    for (tag = ifd->tags; tag; tag = tag->next) {
+        if (tag->tagId == TAG_Orientation) {
+            return (!tag->error && tag->numData) ? (unsigned short)tag->numData[0] : 0;
+        }
+    }
+    return 0;
 }
 
 /**
- * dumpIfdTableArray()
+ * initDumpWriter()
+ *
+ * Set up a dump writer
+ */
+void initDumpWriter(DumpWriter *w, FILE *fp, int fd)
+{
+    w->fp = fp;
+    w->fd = (fp) ? -1 : fd;
+    w->len = 0;
+    w->error = 0;
+    if (w->fp || w->fd >= 0) {
+        w->buf = w->stage;
+        w->cap = sizeof(w->stage);
+        w->buf[0] = '\0';
+    } else {
+        w->buf = NULL;
+        w->cap = 0;
+    }
+}
+
+/**
+ * flushDumpWriter()
  *
- * Dump the array of the IFD tables
+ * Write what is staged to the FILE or descriptor
+ */
+int flushDumpWriter(DumpWriter *w)
+{
+    drainDumpStage(w);
+    if (w->fp && fflush(w->fp) != 0 && !w->error) {
+        w->error = ERR_WRITE_FILE;
+    }
+    return w->error;
+}
+
+/**
+ * takeDumpBuffer()
  *
- * parameters
- *  [in] ifdArray : address of the IFD array
+ * Take the buffer of a buffer writer and reset the writer
  */
-void dumpIfdTableArray(void **ifdArray)
+char *takeDumpBuffer(DumpWriter *w)
+{
+    char *p = NULL;
+    if (w->fp || w->fd >= 0) {
+        return NULL;
+    }
+    if (!w->error) {
+        p = w->buf;
+    } else if (w->buf) {
+        exifFreeOwned(w->buf, ALLOC_SITE_DUMP);
+    }
+    initDumpWriter(w, NULL, -1);
+    return p;
+}
+
+/**
+ * freeDumpWriter()
+ *
+ * Flush a FILE or descriptor writer, or free the buffer of a buffer writer
+ */
+int freeDumpWriter(DumpWriter *w)
+{
+    int sts;
+    if (w->fp || w->fd >= 0) {
+        return flushDumpWriter(w);
+    }
+    sts = w->error;
+    if (w->buf) {
+        exifFreeOwned(w->buf, ALLOC_SITE_DUMP);
+    }
+    initDumpWriter(w, NULL, -1);
+    return sts;
+}
+
+/**
+ * writeDumpHeader()
+ *
+ * Write the header row of a TSV export
+ */
+int writeDumpHeader(DumpWriter *w, DUMP_FORMAT format)
+{
+    if (format == DUMP_TSV) {
+        dumpPuts(w, "file\tifd\ttag\tname\ttype\tcount\tvalue\n");
+    }
+    return w->error;
+}
+
+/**
+ * writeIfdTableArrayDump()
+ *
+ * Dump the IFD tables of one file
+ */
+int writeIfdTableArrayDump(DumpWriter *w, void **ifdArray, const char *path,
+                           int status, DUMP_FORMAT format)
 {
     int i;
-    if (ifdArray) {
-        for (i = 0; ifdArray[i] != NULL; i++) {
-            dumpIfdTable(ifdArray[i]);
+    if (format == DUMP_JSON) {
+        dumpPuts(w, "{\"file\":");
+        if (path) {
+            dumpPuts(w, "\"");
+            dumpString(w, (const unsigned char*)path, (size_t)-1, DUMP_JSON);
+            dumpPuts(w, "\"");
+        } else {
+            dumpPuts(w, "null");
         }
+        dumpPrintf(w, ",\"status\":%d,\"ifds\":[", status);
+    }
+    for (i = 0; ifdArray && ifdArray[i] != NULL; i++) {
+        const IfdTable *ifd = (const IfdTable*)ifdArray[i];
+        if (format == DUMP_JSON) {
+            dumpPuts(w, (i > 0) ? "," : "");
+            dumpIfdJson(w, ifd);
+        } else if (format == DUMP_TSV) {
+            dumpIfdTsv(w, ifd, path);
+        } else {
+            dumpIfdText(w, ifd);
+        }
+    }
+    if (format == DUMP_JSON) {
+        dumpPuts(w, "]}\n");
+    }
+    return w->error;
+}
+
+/**
+ * writeJPEGFileDump()
+ *
+ * Parse a JPEG file and dump its IFD tables
+ */
+int writeJPEGFileDump(DumpWriter *w, const char *JPEGFileName, DUMP_FORMAT format,
+                      int *result)
+{
+    int sts;
+    void **ifdArray = createIfdTableArray(JPEGFileName, &sts);
+    writeIfdTableArrayDump(w, ifdArray, JPEGFileName, sts, format);
+    if (ifdArray) {
+        freeIfdTableArray(ifdArray);
+    }
+    if (result) {
+        *result = sts;
+    }
+    return w->error;
+}
+
+/**
+ * dumpIfdTable()
+ *
+ * Dump the IFD table to stdout
+ */
+int dumpIfdTable(void *pIfd)
+{
+    DumpWriter w;
+    if (!pIfd) {
+        return 0;
+    }
+    initDumpWriter(&w, stdout, -1);
+    dumpIfdText(&w, (IfdTable*)pIfd);
+    drainDumpStage(&w);
+    return getIfdOrientation((IfdTable*)pIfd);
+}
+
+/**
+ * getIfdTableDump()
+ *
+ * Get the dump of the IFD table as text
+ */
+void getIfdTableDump(void *pIfd, char **pp)
+{
+    DumpWriter w;
+    if (!pp) {
+        return;
+    }
+    *pp = NULL;
+    if (!pIfd) {
+        return;
     }
+    initDumpWriter(&w, NULL, -1);
+    dumpIfdText(&w, (IfdTable*)pIfd);
+    *pp = takeDumpBuffer(&w);
+}
+
+/**
+ * dumpIfdTableArray()
+ *
+ * Dump the array of the IFD tables to stdout
+ */
+void dumpIfdTableArray(void **ifdArray)
+{
+    DumpWriter w;
+    initDumpWriter(&w, stdout, -1);
+    writeIfdTableArrayDump(&w, ifdArray, NULL, 0, DUMP_TEXT);
+    drainDumpStage(&w);
 }
 
 /**
@@ -517,6 +1183,27 @@ TagNodeInfo *getTagInfo(void **ifdArray,
     return NULL;
 }
 
+/**
+ * findTagInfo()
+ *
+ * Find the TagNodeInfo that matches the IFD_TYPE & TagId without copying it
+ */
+const TagNodeInfo *findTagInfo(void **ifdArray,
+                               IFD_TYPE ifdType,
+                               unsigned short tagId)
+{
+    int i;
+    if (!ifdArray) {
+        return NULL;
+    }
+    for (i = 0; ifdArray[i] != NULL; i++) {
+        if (getIfdType(ifdArray[i]) == ifdType) {
+            return (const TagNodeInfo*)getTagNodePtrFromIfd((IfdTable*)ifdArray[i], tagId);
+        }
+    }
+    return NULL;
+}
+
 /**
  * getTagInfoFromIfd()
  *
@@ -624,7 +1311,7 @@ TagNodeInfo *createTagInfo(unsigned short tagId,
         }
         return NULL;
     }
-    tag = (TagNode*)malloc(sizeof(TagNode));
+    tag = (TagNode*)exifAlloc(sizeof(TagNode), ALLOC_SITE_TAG_NODE);
     if (!tag) {
         if (pResult) {
             *pResult = ERR_MEMALLOC;
@@ -637,7 +1324,7 @@ TagNodeInfo *createTagInfo(unsigned short tagId,
     tag->count = count;
 
     if (type == TYPE_ASCII || type == TYPE_UNDEFINED) {
-        tag->byteData = (unsigned char*)malloc(count*sizeof(char));
+        tag->byteData = (unsigned char*)exifAlloc(count*sizeof(char), ALLOC_SITE_TAG_DATA);
     }
     else if (type == TYPE_BYTE   ||
              type == TYPE_SBYTE  ||
@@ -645,11 +1332,11 @@ TagNodeInfo *createTagInfo(unsigned short tagId,
              type == TYPE_LONG   ||
              type == TYPE_SSHORT ||
              type == TYPE_SLONG) {
-        tag->numData = (unsigned int*)malloc(count*sizeof(int));
+        tag->numData = (unsigned int*)exifAlloc(count*sizeof(int), ALLOC_SITE_TAG_DATA);
     }
     else if (type == TYPE_RATIONAL ||
              type == TYPE_SRATIONAL) {
-        tag->numData = (unsigned int*)malloc(count*sizeof(int)*2);
+        tag->numData = (unsigned int*)exifAlloc(count*sizeof(int)*2, ALLOC_SITE_TAG_DATA);
     }
     if (pResult) {
         *pResult = 0;
@@ -745,12 +1432,12 @@ void **insertIfdTableToIfdTableArray(void **ifdTableArray,
         return NULL;
     }
     // copy existing IFD tables to the new array
-    newIfdTableArray = (void**)malloc(sizeof(void*)*(num+2));
+    newIfdTableArray = (void**)exifAlloc(sizeof(void*)*(num+2), ALLOC_SITE_IFD_ARRAY);
     if (!newIfdTableArray) {
         if (pResult) {
             *pResult = ERR_MEMALLOC;
         }
-        free(newIfd);
+        exifFree(newIfd, ALLOC_SITE_IFD_TABLE);
         return NULL;
     }
     memset(newIfdTableArray, 0, sizeof(void*)*(num+2));
@@ -760,7 +1447,7 @@ void **insertIfdTableToIfdTableArray(void **ifdTableArray,
     // add the new IFD table
     newIfdTableArray[num] = newIfd;
     if (ifdTableArray) {
-        free(ifdTableArray); // free the old array
+        exifFree(ifdTableArray, ALLOC_SITE_IFD_ARRAY); // free the old array
     }
     if (pResult) {
         *pResult = 0;
@@ -903,7 +1590,7 @@ unsigned char *getThumbnailDataOnIfdTableArray(void **ifdTableArray,
         }
         return NULL;
     }
-    retp= (unsigned char*)malloc(len);
+    retp= (unsigned char*)exifAllocOwned(len, ALLOC_SITE_THUMBNAIL);
     if (!retp) {
         if (pResult) {
             *pResult = ERR_MEMALLOC;
@@ -954,7 +1641,7 @@ int setThumbnailDataOnIfdTableArray(void **ifdTableArray,
         return ERR_NOT_EXIST;
     }
     if (ifd->p) {
-        free(ifd->p);
+        exifFree(ifd->p, ALLOC_SITE_THUMBNAIL);
     }
     // set thumbnail length;
     tag = getTagNodePtrFromIfd(ifd, TAG_JPEGInterchangeFormatLength);
@@ -974,7 +1661,7 @@ int setThumbnailDataOnIfdTableArray(void **ifdTableArray,
         addTagNodeToIfd(ifd, TAG_JPEGInterchangeFormat,
                             TYPE_LONG, 1, &zero, NULL);
     }
-    ifd->p = (unsigned char*)malloc(length);
+    ifd->p = (unsigned char*)exifAlloc(length, ALLOC_SITE_THUMBNAIL);
     if (!ifd->p) {
         return ERR_MEMALLOC;
     }
@@ -982,6 +1669,19 @@ int setThumbnailDataOnIfdTableArray(void **ifdTableArray,
     return 0;
 }
 
+/**
+ * setWriteByteOrder()
+ *
+ * Set the byte order updateExifSegmentInJPEGFile() writes in
+ *
+ * parameters
+ *  [in] order : EXIF_BYTE_ORDER_xxx
+ */
+void setWriteByteOrder(int order)
+{
+    WriteByteOrder = order;
+}
+
 /**
  * updateExifSegmentInJPEGFile()
  *
@@ -1026,6 +1726,11 @@ int updateExifSegmentInJPEGFile(const char *inJPEGFileName,
     if (sts < 0) {
         goto DONE;
     }
+    if (WriteByteOrder != EXIF_BYTE_ORDER_KEEP) {
+        // the tables are in host order; fix_short()/fix_int() convert
+        // them to this while writing
+        App1Header.tiff.byteOrder = (unsigned short)WriteByteOrder;
+    }
     if (sts == 0) {
         hasExifSegment = 0;
         ofs = JpegDQTOffset;
@@ -1043,7 +1748,7 @@ int updateExifSegmentInJPEGFile(const char *inJPEGFileName,
     p = buf;
     if (ofs > sizeof(buf)) {
         // allocate new buffer if needed
-        p = (unsigned char*)malloc(ofs);
+        p = (unsigned char*)exifAlloc(ofs, ALLOC_SITE_COPY_BUFFER);
     }
     if (!p) {
         for (i = 0; i < ofs; i++) {
@@ -1060,7 +1765,7 @@ int updateExifSegmentInJPEGFile(const char *inJPEGFileName,
             goto DONE;
         }
         if (p != &buf[0]) {
-            free(p);
+            exifFree(p, ALLOC_SITE_COPY_BUFFER);
         }
     }
     // write new Exif segment
@@ -1156,7 +1861,7 @@ int removeAdobeMetadataSegmentFromJPEGFile(const char *inJPEGFileName,
     p = buf;
     if (ofs > sizeof(buf)) {
         // allocate new buffer if needed
-        p = (unsigned char*)malloc(ofs);
+        p = (unsigned char*)exifAlloc(ofs, ALLOC_SITE_COPY_BUFFER);
     }
     if (!p) {
         for (i = 0; i < (int)ofs; i++) {
@@ -1173,7 +1878,7 @@ int removeAdobeMetadataSegmentFromJPEGFile(const char *inJPEGFileName,
             goto DONE;
         }
         if (p != &buf[0]) {
-            free(p);
+            exifFree(p, ALLOC_SITE_COPY_BUFFER);
         }
     }
     if (fread(&hdr, 1, sizeof(SEGMENT_HEADER), fpr) != sizeof(SEGMENT_HEADER)) {
@@ -1254,177 +1959,10 @@ static int seekToRelativeOffset(FILE *fp, unsigned int ofs)
     return fseek(fp, (App1StartOffset + start) + ofs, SEEK_SET);
 }
 
-static char *getTagName(int ifdType, unsigned short tagId)
-{
-    static char tagName[128];
-    if (ifdType == IFD_0TH || ifdType == IFD_1ST || ifdType == IFD_EXIF) {
-        strcpy(tagName,
-            (tagId == 0x0100) ? "ImageWidth" :
-            (tagId == 0x0101) ? "ImageLength" :
-            (tagId == 0x0102) ? "BitsPerSample" :
-            (tagId == 0x0103) ? "Compression" :
-            (tagId == 0x0106) ? "PhotometricInterpretation" :
-            (tagId == 0x0112) ? "Orientation" :
-            (tagId == 0x0115) ? "SamplesPerPixel" :
-            (tagId == 0x011C) ? "PlanarConfiguration" :
-            (tagId == 0x0212) ? "YCbCrSubSampling" :
-            (tagId == 0x0213) ? "YCbCrPositioning" :
-            (tagId == 0x011A) ? "XResolution" :
-            (tagId == 0x011B) ? "YResolution" :
-            (tagId == 0x0128) ? "ResolutionUnit" :
-
-            (tagId == 0x0111) ? "StripOffsets" :
-            (tagId == 0x0116) ? "RowsPerStrip" :
-            (tagId == 0x0117) ? "StripByteCounts" :
-            (tagId == 0x0201) ? "JPEGInterchangeFormat" :
-            (tagId == 0x0202) ? "JPEGInterchangeFormatLength" :
-
-            (tagId == 0x012D) ? "TransferFunction" :
-            (tagId == 0x013E) ? "WhitePoint" :
-            (tagId == 0x013F) ? "PrimaryChromaticities" :
-            (tagId == 0x0211) ? "YCbCrCoefficients" :
-            (tagId == 0x0214) ? "ReferenceBlackWhite" :
-
-            (tagId == 0x0132) ? "DateTime" :
-            (tagId == 0x010E) ? "ImageDescription" :
-            (tagId == 0x010F) ? "Make" :
-            (tagId == 0x0110) ? "Model" :
-            (tagId == 0x0131) ? "Software" :
-            (tagId == 0x013B) ? "Artist" :
-            (tagId == 0x8298) ? "Copyright" :
-            (tagId == 0x8769) ? "ExifIFDPointer" :
-            (tagId == 0x8825) ? "GPSInfoIFDPointer":
-            (tagId == 0xA005) ? "InteroperabilityIFDPointer" :
-
-            (tagId == 0x4746) ? "Rating" :
-
-            (tagId == 0x9000) ? "ExifVersion" :
-            (tagId == 0xA000) ? "FlashPixVersion" :
-
-            (tagId == 0xA001) ? "ColorSpace" :
-
-            (tagId == 0x9101) ? "ComponentsConfiguration" :
-            (tagId == 0x9102) ? "CompressedBitsPerPixel" :
-            (tagId == 0xA002) ? "PixelXDimension" :
-            (tagId == 0xA003) ? "PixelYDimension" :
-
-            (tagId == 0x927C) ? "MakerNote" :
-            (tagId == 0x9286) ? "UserComment" :
-
-            (tagId == 0xA004) ? "RelatedSoundFile" :
-
-            (tagId == 0x9003) ? "DateTimeOriginal" :
-            (tagId == 0x9004) ? "DateTimeDigitized" :
-            (tagId == 0x9290) ? "SubSecTime" :
-            (tagId == 0x9291) ? "SubSecTimeOriginal" :
-            (tagId == 0x9292) ? "SubSecTimeDigitized" :
-
-            (tagId == 0x829A) ? "ExposureTime" :
-            (tagId == 0x829D) ? "FNumber" :
-            (tagId == 0x8822) ? "ExposureProgram" :
-            (tagId == 0x8824) ? "SpectralSensitivity" :
-            (tagId == 0x8827) ? "PhotographicSensitivity" :
-            (tagId == 0x8828) ? "OECF" :
-            (tagId == 0x8830) ? "SensitivityType" :
-            (tagId == 0x8831) ? "StandardOutputSensitivity" :
-            (tagId == 0x8832) ? "RecommendedExposureIndex" :
-            (tagId == 0x8833) ? "ISOSpeed" :
-            (tagId == 0x8834) ? "ISOSpeedLatitudeyyy" :
-            (tagId == 0x8835) ? "ISOSpeedLatitudezzz" :
-
-            (tagId == 0x9201) ? "ShutterSpeedValue" :
-            (tagId == 0x9202) ? "ApertureValue" :
-            (tagId == 0x9203) ? "BrightnessValue" :
-            (tagId == 0x9204) ? "ExposureBiasValue" :
-            (tagId == 0x9205) ? "MaxApertureValue" :
-            (tagId == 0x9206) ? "SubjectDistance" :
-            (tagId == 0x9207) ? "MeteringMode" :
-            (tagId == 0x9208) ? "LightSource" :
-            (tagId == 0x9209) ? "Flash" :
-            (tagId == 0x920A) ? "FocalLength" :
-            (tagId == 0x9214) ? "SubjectArea" :
-            (tagId == 0xA20B) ? "FlashEnergy" :
-            (tagId == 0xA20C) ? "SpatialFrequencyResponse" :
-            (tagId == 0xA20E) ? "FocalPlaneXResolution" :
-            (tagId == 0xA20F) ? "FocalPlaneYResolution" :
-            (tagId == 0xA210) ? "FocalPlaneResolutionUnit" :
-            (tagId == 0xA214) ? "SubjectLocation" :
-            (tagId == 0xA215) ? "ExposureIndex" :
-            (tagId == 0xA217) ? "SensingMethod" :
-            (tagId == 0xA300) ? "FileSource" :
-            (tagId == 0xA301) ? "SceneType" :
-            (tagId == 0xA302) ? "CFAPattern" :
-
-            (tagId == 0xA401) ? "CustomRendered" :
-            (tagId == 0xA402) ? "ExposureMode" :
-            (tagId == 0xA403) ? "WhiteBalance" :
-            (tagId == 0xA404) ? "DigitalZoomRatio" :
-            (tagId == 0xA405) ? "FocalLengthIn35mmFormat" :
-            (tagId == 0xA406) ? "SceneCaptureType" :
-            (tagId == 0xA407) ? "GainControl" :
-            (tagId == 0xA408) ? "Contrast" :
-            (tagId == 0xA409) ? "Saturation" :
-            (tagId == 0xA40A) ? "Sharpness" :
-            (tagId == 0xA40B) ? "DeviceSettingDescription" :
-            (tagId == 0xA40C) ? "SubjectDistanceRange" :
-
-            (tagId == 0xA420) ? "ImageUniqueID" :
-            (tagId == 0xA430) ? "CameraOwnerName" :
-            (tagId == 0xA431) ? "BodySerialNumber" :
-            (tagId == 0xA432) ? "LensSpecification" :
-            (tagId == 0xA433) ? "LensMake" :
-            (tagId == 0xA434) ? "LensModel" :
-            (tagId == 0xA435) ? "LensSerialNumber" :
-            (tagId == 0xA500) ? "Gamma" : 
-            "(unknown)");
-    } else if (ifdType == IFD_GPS) {
-        strcpy(tagName,
-            (tagId == 0x0000) ? "GPSVersionID" :
-            (tagId == 0x0001) ? "GPSLatitudeRef" :
-            (tagId == 0x0002) ? "GPSLatitude" :
-            (tagId == 0x0003) ? "GPSLongitudeRef" :
-            (tagId == 0x0004) ? "GPSLongitude" :
-            (tagId == 0x0005) ? "GPSAltitudeRef" :
-            (tagId == 0x0006) ? "GPSAltitude" :
-            (tagId == 0x0007) ? "GPSTimeStamp" :
-            (tagId == 0x0008) ? "GPSSatellites" :
-            (tagId == 0x0009) ? "GPSStatus" :
-            (tagId == 0x000A) ? "GPSMeasureMode" :
-            (tagId == 0x000B) ? "GPSDOP" :
-            (tagId == 0x000C) ? "GPSSpeedRef" :
-            (tagId == 0x000D) ? "GPSSpeed" :
-            (tagId == 0x000E) ? "GPSTrackRef" :
-            (tagId == 0x000F) ? "GPSTrack" :
-            (tagId == 0x0010) ? "GPSImgDirectionRef" :
-            (tagId == 0x0011) ? "GPSImgDirection" :
-            (tagId == 0x0012) ? "GPSMapDatum" :
-            (tagId == 0x0013) ? "GPSDestLatitudeRef" :
-            (tagId == 0x0014) ? "GPSDestLatitude" :
-            (tagId == 0x0015) ? "GPSDestLongitudeRef" :
-            (tagId == 0x0016) ? "GPSDestLongitude" :
-            (tagId == 0x0017) ? "GPSBearingRef" :
-            (tagId == 0x0018) ? "GPSBearing" :
-            (tagId == 0x0019) ? "GPSDestDistanceRef" :
-            (tagId == 0x001A) ? "GPSDestDistance" :
-            (tagId == 0x001B) ? "GPSProcessingMethod" :
-            (tagId == 0x001C) ? "GPSAreaInformation" :
-            (tagId == 0x001D) ? "GPSDateStamp" :
-            (tagId == 0x001E) ? "GPSDifferential" :
-            (tagId == 0x001F) ? "GPSHPositioningError" :
-            "(unknown)");
-    } else if (ifdType == IFD_IO) {
-        strcpy(tagName, 
-            (tagId == 0x0001) ? "InteroperabilityIndex" :
-            (tagId == 0x0002) ? "InteroperabilityVersion" :
-            "(unknown)");
-    }
-    return tagName;
-}
-
 // create the IFD table
 static void *createIfdTable(IFD_TYPE IfdType, unsigned short tagCount, unsigned int nextOfs)
 {
-    IfdTable *ifd = (IfdTable*)malloc(sizeof(IfdTable));
+    IfdTable *ifd = (IfdTable*)exifAlloc(sizeof(IfdTable), ALLOC_SITE_IFD_TABLE);
     if (!ifd) {
         return NULL;
     }
@@ -1449,7 +1987,7 @@ static void *addTagNodeToIfd(void *pIfd,
     if (!ifd) {
         return NULL;
     }
-    tag = (TagNode*)malloc(sizeof(TagNode));
+    tag = (TagNode*)exifAlloc(sizeof(TagNode), ALLOC_SITE_TAG_NODE);
     memset(tag, 0, sizeof(TagNode));
     tag->tagId = tagId;
     tag->type = type;
@@ -1462,12 +2000,12 @@ static void *addTagNodeToIfd(void *pIfd,
                 type == TYPE_SRATIONAL) {
                 num *= 2;
             }
-            tag->numData = (unsigned int*)malloc(sizeof(int)*num);
+            tag->numData = (unsigned int*)exifAlloc(sizeof(int)*num, ALLOC_SITE_TAG_DATA);
             for (i = 0; i < num; i++) {
                 tag->numData[i] = numData[i];
             }
         } else if (byteData != NULL) {
-            tag->byteData = (unsigned char*)malloc(count);
+            tag->byteData = (unsigned char*)exifAlloc(count, ALLOC_SITE_TAG_DATA);
             memcpy(tag->byteData, byteData, count);
         } else {
             tag->error = 1;
@@ -1499,7 +2037,7 @@ static TagNode *duplicateTagNode(TagNode *src)
     if (!src || src->count <= 0) {
         return NULL;
     }
-    dup = (TagNode*)malloc(sizeof(TagNode));
+    dup = (TagNode*)exifAlloc(sizeof(TagNode), ALLOC_SITE_TAG_NODE);
     memset(dup, 0, sizeof(TagNode));
     dup->tagId = src->tagId;
     dup->type = src->type;
@@ -1511,11 +2049,11 @@ static TagNode *duplicateTagNode(TagNode *src)
             src->type == TYPE_SRATIONAL) {
             len *= 2;
         }
-        dup->numData = (unsigned int*)malloc(len);
+        dup->numData = (unsigned int*)exifAlloc(len, ALLOC_SITE_TAG_DATA);
         memcpy(dup->numData, src->numData, len);
     } else if (src->byteData) {
         len = sizeof(char) * src->count;
-        dup->byteData = (unsigned char*)malloc(len);
+        dup->byteData = (unsigned char*)exifAlloc(len, ALLOC_SITE_TAG_DATA);
         memcpy(dup->byteData, src->byteData, len);
     }
     return dup;
@@ -1529,12 +2067,12 @@ static void freeTagNode(void *pTag)
         return;
     }
     if (tag->numData) {
-        free(tag->numData);
+        exifFree(tag->numData, ALLOC_SITE_TAG_DATA);
     }
     if (tag->byteData) {
-        free(tag->byteData);
+        exifFree(tag->byteData, ALLOC_SITE_TAG_DATA);
     }
-    free(tag);
+    exifFree(tag, ALLOC_SITE_TAG_NODE);
 }
 
 // free entire IFD table
@@ -1547,9 +2085,9 @@ static void freeIfdTable(void *pIfd)
     }
     tag = ifd->tags;
     if (ifd->p) {
-        free(ifd->p);
+        exifFree(ifd->p, ALLOC_SITE_THUMBNAIL);
     }
-    free(ifd);
+    exifFree(ifd, ALLOC_SITE_IFD_TABLE);
 
     if (tag) {
         while (tag->next) {
@@ -1651,7 +2189,7 @@ static int setSingleNumDataToTag(TagNode *tag, unsigned int value)
         return 0;
     }
     if (!tag->numData) {
-        tag->numData = (unsigned int*)malloc(sizeof(int));
+        tag->numData = (unsigned int*)exifAlloc(sizeof(int), ALLOC_SITE_TAG_DATA);
     }
     tag->count = 1;
     tag->numData[0] = value;
@@ -2225,7 +2763,7 @@ static void *parseIFD(FILE *fp,
         pos = ftell(fp);
 
         //printf("tag=0x%04X type=%u count=%u offset=%u name=[%s]\n",
-        //  tag.tag, tag.type, tag.count, tag.offset, getTagName(ifdType, tag.tag));
+        //  tag.tag, tag.type, tag.count, tag.offset, getExifTagName(ifdType, tag.tag).data());
 
         if (tag.type == TYPE_ASCII ||     // ascii = the null-terminated string
             tag.type == TYPE_UNDEFINED) { // undefined = the chunk data bytes
@@ -2240,7 +2778,7 @@ static void *parseIFD(FILE *fp,
                     if (tag.count >= App1Header.length) { // illegal
                         p = NULL;
                     } else {
-                        p = (unsigned char*)malloc(tag.count);
+                        p = (unsigned char*)exifAlloc(tag.count, ALLOC_SITE_PARSE_TEMP);
                     }
                     if (!p) {
                         // treat as an error
@@ -2252,14 +2790,14 @@ static void *parseIFD(FILE *fp,
                 if (seekToRelativeOffset(fp, tag.offset) != 0 ||
                     fread(p, 1, tag.count, fp) < tag.count) {
                     if (p != &buf[0]) {
-                        free(p);
+                        exifFree(p, ALLOC_SITE_PARSE_TEMP);
                     }
                     addTagNodeToIfd(ifd, tag.tag, tag.type, tag.count, NULL, NULL);
                     continue;
                 }
                 addTagNodeToIfd(ifd, tag.tag, tag.type, tag.count, NULL, p);
                 if (p != &buf[0]) {
-                    free(p);
+                    exifFree(p, ALLOC_SITE_PARSE_TEMP);
                 }
             }
         }
@@ -2269,11 +2807,11 @@ static void *parseIFD(FILE *fp,
             if (len >= App1Header.length) { // illegal
                 array = NULL;
             } else {
-                array = (unsigned int*)malloc(len);
+                array = (unsigned int*)exifAlloc(len, ALLOC_SITE_PARSE_TEMP);
                 if (array) {
                     if (seekToRelativeOffset(fp, tag.offset) != 0 ||
                         fread(array, 1, len , fp) < len) {
-                        free(array);
+                        exifFree(array, ALLOC_SITE_PARSE_TEMP);
                         array = NULL;
                     } else {
                         for (i = 0; i < (int)realCount; i++) {
@@ -2284,7 +2822,7 @@ static void *parseIFD(FILE *fp,
             }
             addTagNodeToIfd(ifd, tag.tag, tag.type, tag.count, array, NULL);
             if (array) {
-                free(array);
+                exifFree(array, ALLOC_SITE_PARSE_TEMP);
             }
         }
         else if (tag.type == TYPE_BYTE   ||
@@ -2322,7 +2860,7 @@ static void *parseIFD(FILE *fp,
                 if (allocSize >= App1Header.length) { // illegal
                     array = NULL;
                 } else {
-                    array = (unsigned int*)malloc(allocSize);
+                    array = (unsigned int*)exifAlloc(allocSize, ALLOC_SITE_PARSE_TEMP);
                 }
                 if (!array) {
                     addTagNodeToIfd(ifd, tag.tag, tag.type, tag.count, NULL, NULL);
@@ -2360,7 +2898,7 @@ static void *parseIFD(FILE *fp,
                     }
                 }
                 addTagNodeToIfd(ifd, tag.tag, tag.type, tag.count, array, NULL);
-                free(array);
+                exifFree(array, ALLOC_SITE_PARSE_TEMP);
              }
          }
     }
@@ -2377,12 +2915,12 @@ static void *parseIFD(FILE *fp,
             if (tag) {
                 thumbnail_len = tag->numData[0];
                 if (thumbnail_len > 0) {
-                    ifdTable->p = (unsigned char*)malloc(thumbnail_len);
+                    ifdTable->p = (unsigned char*)exifAlloc(thumbnail_len, ALLOC_SITE_THUMBNAIL);
                     if (ifdTable->p) {
                         if (seekToRelativeOffset(fp, thumbnail_ofs) == 0) {
                             if (fread(ifdTable->p, 1, thumbnail_len, fp)
                                                         != thumbnail_len) {
-                                free(ifdTable->p);
+                                exifFree(ifdTable->p, ALLOC_SITE_THUMBNAIL);
                                 ifdTable->p = NULL;
                             } else {
                                 // for test
@@ -2391,7 +2929,7 @@ static void *parseIFD(FILE *fp,
                                 //fclose(fpw);
                             }
                         } else {
-                            free(ifdTable->p);
+                            exifFree(ifdTable->p, ALLOC_SITE_THUMBNAIL);
                             ifdTable->p = NULL;
                         }
                     }
@@ -2563,9 +3101,15 @@ static int getApp1StartOffset(FILE *fp,
 static int init(FILE *fp)
 {
     int sts, dqtOffset = -1;;
+    STAGE_DECL(t0);
+    STAGE_BEGIN(t0);
+    TRACE_DECL(span);
+    TRACE_BEGIN(span);
     setDefaultApp1SegmentHader();
     // get the offset of the Exif segment
     sts = getApp1StartOffset(fp, EXIF_ID_STR, EXIF_ID_STR_LEN, &dqtOffset);
+    STAGE_END(t0, STAGE_MARKER_SCAN, 1);
+    TRACE_END(span, "marker_scan");
     if (sts < 0) { // error
         return sts;
     }
@@ -2581,92 +3125,343 @@ static int init(FILE *fp)
     return 1;
 }
 
-static void PRINTF(char **ms, const char *fmt, ...) {
-    char buf[4096];
-    char *p = NULL;
-    int len, cnt;
-    va_list args;
-    va_start(args, fmt);
-    cnt = vsnprintf(buf, sizeof(buf)-1, fmt, args);
-    if (!ms) {
-        printf("%s", buf);
+#if defined(USE_READ_HINTS)
+// fetch from the kernel and count it
+static ssize_t readerFetch(JPEG_READER *r, void *buf, size_t size, long long ofs)
+{
+    ssize_t n = pread(r->fd, buf, size, (off_t)ofs);
+    if (n > 0) {
+        if (ofs + n > r->readEnd) {
+            r->readEnd = ofs + n;
+        }
+        ReadBytes += (unsigned long long)n;
+        ThreadReadBytes += (unsigned long long)n;
+    }
+    return n;
+}
+
+static ssize_t readerRead(void *cookie, char *buf, size_t size)
+{
+    JPEG_READER *r = (JPEG_READER*)cookie;
+    size_t done = 0;
+    ssize_t n;
+    while (done < size) {
+        if (r->pos >= r->winStart && r->pos < r->winStart + (long long)r->winLen) {
+            // served from the window
+            size_t ofs = (size_t)(r->pos - r->winStart);
+            size_t len = r->winLen - ofs;
+            if (len > size - done) {
+                len = size - done;
+            }
+            memcpy(buf + done, r->win + ofs, len);
+            r->pos += len;
+            done += len;
+            continue;
+        }
+        if (r->direct) {
+            // O_DIRECT wants aligned offsets, lengths and buffers
+            long long start = r->pos & ~(long long)(READER_WINDOW - 1);
+            n = readerFetch(r, r->win, READER_WINDOW, start);
+            if (n > 0 && start + n > r->pos) {
+                r->winStart = start;
+                r->winLen = (size_t)n;
+                continue;
+            }
+            if (n > 0) {
+                n = 0; // past the end
+            }
+        } else if (size - done >= sizeof(r->window)) {
+            // large reads (the copy loops) bypass the window
+            n = readerFetch(r, buf + done, size - done, r->pos);
+        } else {
+            n = readerFetch(r, r->win, sizeof(r->window), r->pos);
+            if (n > 0) {
+                r->winStart = r->pos;
+                r->winLen = (size_t)n;
+                continue;
+            }
+        }
+        if (n <= 0) {
+            if (n < 0 && done == 0) {
+                return -1;
+            }
+            break;
+        }
+        r->pos += n;
+        done += n;
+    }
+    return (ssize_t)done;
+}
+
+static int readerSeek(void *cookie, off64_t *offset, int whence)
+{
+    JPEG_READER *r = (JPEG_READER*)cookie;
+    struct stat st;
+    long long base = 0;
+    if (whence == SEEK_CUR) {
+        base = r->pos;
+    } else if (whence == SEEK_END) {
+        if (fstat(r->fd, &st) != 0) {
+            return -1;
+        }
+        base = (long long)st.st_size;
+    }
+    if (base + *offset < 0) {
+        return -1;
+    }
+    r->pos = base + *offset;
+    *offset = r->pos;
+    return 0;
+}
+
+static int readerClose(void *cookie)
+{
+    // the descriptor outlives the FILE for the closing hints
+    (void)cookie;
+    return 0;
+}
+
+// bytes of the file present in the page cache
+static unsigned long long residentBytesOf(int fd)
+{
+    struct stat st;
+    unsigned long long resident = 0;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || pageSize <= 0) {
+        return 0;
+    }
+    size_t pages = ((size_t)st.st_size + pageSize - 1) / pageSize;
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        return 0;
+    }
+    unsigned char *vec = (unsigned char*)malloc(pages);
+    if (vec && mincore(p, (size_t)st.st_size, vec) == 0) {
+        for (size_t i = 0; i < pages; i++) {
+            if (vec[i] & 1) {
+                resident += pageSize;
+            }
+        }
+    }
+    free(vec);
+    munmap(p, (size_t)st.st_size);
+    return resident;
+}
+#endif
+
+static FILE *openJpegReader(const char *path, JPEG_READER *r)
+{
+    STAGE_DECL(t0);
+    STAGE_BEGIN(t0);
+    TRACE_SCOPE("open");
+    r->fp = NULL;
+    r->fd = -1;
+    r->pos = 0;
+    r->readEnd = 0;
+    r->winStart = 0;
+    r->winLen = 0;
+    r->win = r->window;
+    r->direct = 0;
+#if defined(USE_READ_HINTS)
+    cookie_io_functions_t io = { readerRead, NULL, readerSeek, readerClose };
+    if (ReadHints & READ_HINT_DIRECT) {
+        void *buf = NULL;
+        r->fd = open(path, O_RDONLY | O_CLOEXEC | O_DIRECT);
+        if (r->fd >= 0 && posix_memalign(&buf, READER_WINDOW, READER_WINDOW) == 0) {
+            r->win = (unsigned char*)buf;
+            r->direct = 1;
+            DirectFiles++;
+        } else if (r->fd >= 0) {
+            close(r->fd);
+            r->fd = -1;
+        }
+    }
+    if (r->fd < 0) {
+        // also when the file system has no O_DIRECT (tmpfs)
+        r->fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (r->fd < 0) {
+        return NULL;
+    }
+    if (ReadHints & READ_HINT_RANDOM) {
+        posix_fadvise(r->fd, 0, 0, POSIX_FADV_RANDOM);
+    }
+    if (ReadHints & READ_HINT_WILLNEED) {
+        posix_fadvise(r->fd, 0, ReadHintHeaderBytes, POSIX_FADV_WILLNEED);
+    }
+    r->fp = fopencookie(r, "rb", io);
+    if (!r->fp) {
+        close(r->fd);
+        r->fd = -1;
+        if (r->direct) {
+            free(r->win);
+            r->win = r->window;
+            r->direct = 0;
+        }
+        return NULL;
+    }
+    setvbuf(r->fp, r->fileBuf, _IOFBF, sizeof(r->fileBuf));
+#else
+    r->fp = fopen(path, "rb");
+    if (!r->fp) {
+        return NULL;
+    }
+#endif
+    ReadFiles++;
+    STAGE_END(t0, STAGE_OPEN, 1);
+    return r->fp;
+}
+
+// the caller is about to read the rest of the file in order
+static void adviseSequential(JPEG_READER *r)
+{
+#if defined(USE_READ_HINTS)
+    if (r->fd >= 0 && (ReadHints & READ_HINT_RANDOM)) {
+        posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#else
+    (void)r;
+#endif
+}
+
+static void closeJpegReader(JPEG_READER *r)
+{
+    if (!r->fp) {
         return;
     }
-    else if (*ms) {
-        len = (int)(strlen(*ms) + cnt + 1);
-        p = (char*)malloc(len);
-        strcpy(p, *ms);
-        strcat(p, buf);
-        free(*ms);
+    TRACE_SCOPE("close");
+    fclose(r->fp);
+    r->fp = NULL;
+#if defined(USE_READ_HINTS)
+    if (ReadHints & READ_HINT_MEASURE) {
+        ResidentBytes += residentBytesOf(r->fd);
+    }
+    if (ReadHints & READ_HINT_DONTNEED) {
+        // drop what was read and what WILLNEED asked for, nothing more
+        long long len = r->readEnd;
+        if ((ReadHints & READ_HINT_WILLNEED) && len < (long long)ReadHintHeaderBytes) {
+            len = ReadHintHeaderBytes;
+        }
+        posix_fadvise(r->fd, 0, (off_t)len, POSIX_FADV_DONTNEED);
+    }
+    if (ReadHints & READ_HINT_MEASURE) {
+        RetainedBytes += residentBytesOf(r->fd);
+    }
+    close(r->fd);
+    r->fd = -1;
+    if (r->direct) {
+        free(r->win);
+        r->win = r->window;
+        r->direct = 0;
+    }
+#endif
+}
+
+// allocate for the parser itself
+static void *exifAlloc(size_t size, ALLOC_SITE site)
+{
+    void *p = (Allocator.alloc) ? Allocator.alloc(Allocator.ctx, size, site) : malloc(size);
+    if (p && AllocCounting) {
+        ThreadAllocStats.allocs[site]++;
+        ThreadAllocStats.bytes[site] += size;
+    }
+    return p;
+}
+
+static void exifFree(void *p, ALLOC_SITE site)
+{
+    if (!p) {
+        return;
+    }
+    if (AllocCounting) {
+        ThreadAllocStats.frees[site]++;
+    }
+    if (Allocator.release) {
+        Allocator.release(Allocator.ctx, p, site);
     } else {
-        len = cnt + 1;
-        p = (char*)malloc(len);
-        strcpy(p, buf);
+        free(p);
     }
-    *ms = p;
-    va_end(args);
 }
+
+// allocate what is handed over to the caller, who frees it with free()
+static void *exifAllocOwned(size_t size, ALLOC_SITE site)
+{
+    void *p = malloc(size);
+    if (p && AllocCounting) {
+        ThreadAllocStats.allocs[site]++;
+        ThreadAllocStats.bytes[site] += size;
+    }
+    return p;
+}
+
+static void exifFreeOwned(void *p, ALLOC_SITE site)
+{
+    if (p && AllocCounting) {
+        ThreadAllocStats.frees[site]++;
+    }
+    free(p);
+}
+
 //get the shooting angle of picture
 int getImgOrientation(const char* path)
 {
-	void **ifdArray;
-	int i, result;
+	ImgResult res;
 
-	ifdArray = createIfdTableArray(path, &result);
+	readImgInfo(path, &res);
+	return res.orientation;
+}
 
-	switch (result) {
-	case 0: // no IFDs
-		printf("[%s] does not seem to contain the Exif segment.\n", path);
-		break;
-	case ERR_READ_FILE:
-		printf("failed to open or read [%s].\n", path);
-		break;
-	case ERR_INVALID_JPEG:
-		printf("[%s] is not a valid JPEG file.\n", path);
-		break;
-	case ERR_INVALID_APP1HEADER:
-		printf("[%s] does not have valid Exif segment header.\n", path);
-		break;
-	case ERR_INVALID_IFD:
-		printf("[%s] contains one or more IFD errors. use -v for details.\n", path);
-		break;
-	default:
-		//printf("[%s] createIfdTableArray: result=%d\n", path, result);
-		break;
-	}
+/**
+ * readImgInfo()
+ *
+ * Get the Orientation and shooting date of a JPEG file and the status
+ * of its Exif data
+ */
+int readImgInfo(const char *path, ImgResult *res)
+{
+	void **ifdArray;
+	const TagNodeInfo *tag;
 
+	res->orientation = 0;
+	res->date[0] = '\0';
+	ifdArray = createIfdTableArray(path, &res->status);
 	if (!ifdArray) {
-		return 0;
+		return res->status;
 	}
 
-	int Ori = dumpIfdTable(ifdArray[0]);
-
-	// free IFD table array
-	if (ifdArray != NULL)
-	{
-		freeIfdTableArray(ifdArray);
+	tag = findTagInfo(ifdArray, IFD_0TH, TAG_Orientation);
+	if (tag && !tag->error && tag->numData) {
+		res->orientation = (unsigned short)tag->numData[0];
+	}
+	tag = findTagInfo(ifdArray, IFD_EXIF, TAG_DateTimeOriginal);
+	if (tag && !tag->error && tag->byteData) {
+		size_t len = strnlen((const char*)tag->byteData, tag->count);
+		if (len >= sizeof(res->date)) {
+			len = sizeof(res->date) - 1;
+		}
+		memcpy(res->date, tag->byteData, len);
+		res->date[len] = '\0';
 	}
 
-	return Ori;
+	freeIfdTableArray(ifdArray);
+
+	return res->status;
 }
 //get picture shooting date ,then parse by ordered type.
 std::string getImgData(const char* path)
 {
 	// get [DateTimeOriginal] tag value from Exif IFD
 	void **ifdArray;
-	TagNodeInfo *tag;
+	const TagNodeInfo *tag;
 	int result;
 	std::string str_result="";
 	// parse the JPEG header and create the pointer array of the IFD tables
 	ifdArray = createIfdTableArray(path, &result);
-	tag = getTagInfo(ifdArray, IFD_EXIF, TAG_DateTimeOriginal);
-	if (tag) {
-		if (!tag->error) {
-			//printf("Exif IFD : DateTimeOriginal = [%s]\n", tag->byteData);
-			char *date = (char*)(tag->byteData);
-			str_result = std::string(date);
-		}
-		freeTagInfo(tag);
+	tag = findTagInfo(ifdArray, IFD_EXIF, TAG_DateTimeOriginal);
+	if (tag && !tag->error && tag->byteData) {
+		//printf("Exif IFD : DateTimeOriginal = [%s]\n", tag->byteData);
+		char *date = (char*)(tag->byteData);
+		str_result = std::string(date, strnlen(date, tag->count));
 	}
 	if (ifdArray != NULL)
 	{
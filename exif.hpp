@@ -150,6 +150,27 @@ struct _tagNodeInfo {
 #define ERR_ALREADY_EXIST       -11
 #define ERR_UNKNOWN             -12
 #define ERR_MEMALLOC            -13
+#define ERR_TIMED_OUT           -14
+
+// kinds of failed files (ExifErrorStats): indexed by -status, so
+// [0] = no Exif segment, [1] = ERR_READ_FILE ... [14] = ERR_TIMED_OUT
+#define ERR_KIND_COUNT       15
+#define ERR_SAMPLE_COUNT     4    // example paths kept per kind
+#define ERR_SAMPLE_PATH_MAX  512  // longer paths are truncated
+
+// per kind error counters (getExifErrorStats)
+typedef struct {
+    unsigned long long count[ERR_KIND_COUNT];
+    int samples[ERR_KIND_COUNT];  // paths held in path[kind]
+    char path[ERR_KIND_COUNT][ERR_SAMPLE_COUNT][ERR_SAMPLE_PATH_MAX];
+} ExifErrorStats;
+
+// result of readImgInfo()
+typedef struct {
+    int status;       // of createIfdTableArray(): n = IFDs, 0 = no Exif segment, -n = ERR_xxx
+    int orientation;  // 0 = not available
+    char date[20];    // DateTimeOriginal "YYYY:MM:DD hh:mm:ss", "" = not available
+} ImgResult;
 
 // public funtions
 
@@ -158,6 +179,70 @@ int getImgOrientation(const char* path);
 //get image data
 std::string getImgData(const char* path);
 
+/**
+ * readImgInfo()
+ *
+ * Get the Orientation and shooting date of a JPEG file and the status
+ * of its Exif data, parsing the file once
+ *
+ * parameters
+ *  [in] path : JPEG file
+ *  [out] res : status, Orientation and date
+ *
+ * return
+ *   the status, as in res->status
+ *
+ * note
+ * Nothing is printed or counted: pass the status to recordExifError()
+ * once per file.  ERR_INVALID_IFD comes with the values of the IFDs that
+ * were read.  getImgOrientation() and getImgData() don't count either.
+ */
+int readImgInfo(const char *path, ImgResult *res);
+
+/**
+ * recordExifError()
+ *
+ * Count a file by the kind of its failure
+ *
+ * parameters
+ *  [in] status : result of createIfdTableArray() or similar; > 0 is ignored
+ *  [in] path : the file, may be kept as an example (NULL = none)
+ *
+ * note
+ * Call it once per file; ingestPhotos() does so for every entry.  Safe
+ * to call from any thread; only a failure that is picked as an example
+ * takes a lock.  The examples are a uniform sample of the files
+ * of each kind since the last resetExifErrorStats().
+ */
+void recordExifError(int status, const char *path);
+
+/**
+ * getExifErrorStats()
+ *
+ * Get the error counters since the last resetExifErrorStats()
+ *
+ * parameters
+ *  [out] stats : the counters and example paths
+ */
+void getExifErrorStats(ExifErrorStats *stats);
+
+/**
+ * resetExifErrorStats()
+ *
+ * Clear the error counters and examples
+ */
+void resetExifErrorStats();
+
+/**
+ * getExifErrorName()
+ *
+ * Name of an error kind, e.g. "invalid_jpeg"
+ *
+ * parameters
+ *  [in] status : 0 or ERR_xxx
+ */
+const char *getExifErrorName(int status);
+
 /**
  * setVerbose()
  *
@@ -168,6 +253,156 @@ std::string getImgData(const char* path);
  */
 void setVerbose(int v);
 
+// page cache hints of the file based entry points (setReadHints)
+#define READ_HINT_RANDOM      0x01 // POSIX_FADV_RANDOM: no readahead
+#define READ_HINT_WILLNEED    0x02 // POSIX_FADV_WILLNEED on the header range
+#define READ_HINT_DONTNEED    0x04 // POSIX_FADV_DONTNEED on what was read
+#define READ_HINT_MEASURE     0x08 // count resident pages with mincore()
+#define READ_HINT_DIRECT      0x10 // O_DIRECT: bypass the page cache entirely
+#define READ_HINT_HEADER      (READ_HINT_RANDOM | READ_HINT_WILLNEED | READ_HINT_DONTNEED)
+
+#define READ_HINT_DEFAULT_HEADER_BYTES  (64 * 1024)
+
+// I/O counters of the file based entry points (getReadStats)
+typedef struct {
+    unsigned long long files;         // files opened
+    unsigned long long bytesRead;     // bytes read from the kernel
+    unsigned long long residentBytes; // page cache held by the files when
+                                      // parsing ended (READ_HINT_MEASURE)
+    unsigned long long retainedBytes; // page cache still held after the
+                                      // files were closed (READ_HINT_MEASURE)
+    unsigned long long directFiles;   // files read with O_DIRECT; the others
+                                      // are on a file system without it
+                                      // (READ_HINT_DIRECT)
+} ReadStats;
+
+/**
+ * setReadHints()
+ *
+ * Set the page cache hints used by createIfdTableArray() and
+ * removeExifSegmentFromJPEGFile()
+ *
+ * parameters
+ *  [in] hints : READ_HINT_xxx flags (0 = let the kernel decide)
+ *  [in] headerBytes : size of the range WILLNEED is applied to,
+ *                     0 for READ_HINT_DEFAULT_HEADER_BYTES
+ *
+ * note
+ * The hints apply to the whole process, so set them once per run before
+ * starting the workers.  DONTNEED also drops pages another process had
+ * cached from the same range, so it suits archives rather than files
+ * that are being served.  Hints are ignored where posix_fadvise() is
+ * not available.  DIRECT reads every header from the device in aligned
+ * 4KB blocks, which is what a cold scan costs without having to drop
+ * the cache first.
+ */
+void setReadHints(int hints, unsigned int headerBytes);
+
+/**
+ * getReadStats()
+ *
+ * Get the I/O counters since the last resetReadStats()
+ *
+ * parameters
+ *  [out] stats : the counters
+ */
+void getReadStats(ReadStats *stats);
+
+/**
+ * resetReadStats()
+ *
+ * Clear the I/O counters
+ */
+void resetReadStats();
+
+/**
+ * getThreadReadBytes()
+ *
+ * Bytes the calling thread has read through the file based entry points
+ * (never reset; take the difference around a call)
+ */
+unsigned long long getThreadReadBytes();
+
+// where the parser allocates (ExifAllocator, ExifAllocStats)
+typedef enum {
+    ALLOC_SITE_IFD_ARRAY = 0, // createIfdTableArray(), insertIfdTableToIfdTableArray()
+    ALLOC_SITE_IFD_TABLE,     // createIfdTable(): one per IFD
+    ALLOC_SITE_TAG_NODE,      // addTagNodeToIfd(), duplicateTagNode(), createTagInfo()
+    ALLOC_SITE_TAG_DATA,      // the numData/byteData of those tags
+    ALLOC_SITE_PARSE_TEMP,    // parseIFD(): values read before they are copied
+    ALLOC_SITE_THUMBNAIL,     // thumbnail data of the 1st IFD
+    ALLOC_SITE_COPY_BUFFER,   // file writers: the data ahead of the Exif segment
+    ALLOC_SITE_DUMP,          // buffers of the dump writer, getIfdTableDump()
+    ALLOC_SITE_COUNT
+} ALLOC_SITE;
+
+// allocator hooks (setExifAllocator)
+typedef struct {
+    void *(*alloc)(void *ctx, size_t size, ALLOC_SITE site);
+    void (*release)(void *ctx, void *p, ALLOC_SITE site);
+    void *ctx;
+} ExifAllocator;
+
+// allocation counters per site (getThreadAllocStats)
+typedef struct {
+    unsigned long long allocs[ALLOC_SITE_COUNT];
+    unsigned long long bytes[ALLOC_SITE_COUNT];
+    unsigned long long frees[ALLOC_SITE_COUNT];
+} ExifAllocStats;
+
+/**
+ * setExifAllocator()
+ *
+ * Route the parser's allocations through a pair of hooks
+ *
+ * parameters
+ *  [in] allocator : the hooks, copied (NULL = malloc() and free())
+ *
+ * return
+ *   0: OK
+ *  -n: error
+ *      ERR_INVALID_POINTER : only one of alloc and release is set
+ *
+ * note
+ * Set it once before anything is parsed: memory has to go back to the
+ * allocator it came from, and the hooks are called from every thread
+ * that parses.  release may do nothing (an arena that is reset between
+ * files).  The thumbnail copy of getThumbnailDataOnIfdTableArray() and
+ * the dump buffers (getIfdTableDump(), takeDumpBuffer()) are handed to
+ * the caller, who frees them with free(), so those always come from
+ * malloc() (and are still counted).
+ */
+int setExifAllocator(const ExifAllocator *allocator);
+
+/**
+ * setExifAllocCounting()
+ *
+ * Count the parser's allocations per site (off by default)
+ *
+ * parameters
+ *  [in] enabled : 1=on  0=off
+ */
+void setExifAllocCounting(int enabled);
+
+/**
+ * getThreadAllocStats()
+ *
+ * Allocations the calling thread has made through the parser while
+ * counting was on (never reset; take the difference around a call to
+ * get the figures of one file)
+ *
+ * parameters
+ *  [out] stats : the counters
+ */
+void getThreadAllocStats(ExifAllocStats *stats);
+
+/**
+ * getAllocSiteName()
+ *
+ * Name of an allocation site (e.g. "tag_node")
+ */
+const char *getAllocSiteName(ALLOC_SITE site);
+
 /**
  * removeExifSegmentFromJPEGFile()
  *
@@ -237,23 +472,166 @@ IFD_TYPE getIfdType(void *ifd);
 /**
  * dumpIfdTable()
  *
- * Dump the IFD table
+ * Dump the IFD table to stdout
  *
  * parameters
  *  [in] ifd: target IFD
+ *
+ * return
+ *  the Orientation of the IFD, 0 if it has none
  */
 int dumpIfdTable(void *ifd);
 
 /**
  * dumpIfdTableArray()
  *
- * Dump the array of the IFD tables
+ * Dump the array of the IFD tables to stdout
  *
  * parameters
  *  [in] ifdArray : address of the IFD array
  */
 void dumpIfdTableArray(void **ifdArray);
 
+/**
+ * getIfdTableDump()
+ *
+ * Get the dump of the IFD table as text
+ *
+ * parameters
+ *  [in] pIfd : target IFD
+ *  [out] pp : the text, NULL on error; the caller must free it
+ */
+void getIfdTableDump(void *pIfd, char **pp);
+
+// output formats of the dump writer
+typedef enum {
+    DUMP_TEXT = 0,   // what dumpIfdTable() prints
+    DUMP_JSON,       // one object per file and line (JSON Lines)
+    DUMP_TSV         // one row per tag: file ifd tag name type count value
+} DUMP_FORMAT;
+
+#define DUMP_STAGE_SIZE  8192   // output staged before it goes to a file
+#define DUMP_MAX_VALUES  64     // values of a tag written; the rest is "..."
+
+/*
+ * Dump writer
+ *
+ * Appends to a growable buffer or stages the output for a FILE or a file
+ * descriptor; either way an append is amortised O(1), and writing to a
+ * FILE or descriptor allocates nothing.  Errors are sticky: once a write
+ * fails every later call returns the error.
+ */
+typedef struct {
+    char *buf;        // the buffer, or stage when writing to fp/fd
+    size_t len;
+    size_t cap;
+    FILE *fp;         // NULL unless writing to a FILE
+    int fd;           // -1 unless writing to a descriptor
+    int error;        // 0, ERR_WRITE_FILE or ERR_MEMALLOC
+    char stage[DUMP_STAGE_SIZE];
+} DumpWriter;
+
+/**
+ * initDumpWriter()
+ *
+ * Set up a dump writer
+ *
+ * parameters
+ *  [out] w : the writer
+ *  [in] fp : FILE to write to, NULL for a buffer or a descriptor
+ *  [in] fd : descriptor to write to when fp is NULL, -1 for a buffer
+ *
+ * note
+ * The buffer is NUL terminated and stays valid until freeDumpWriter() or
+ * takeDumpBuffer().
+ */
+void initDumpWriter(DumpWriter *w, FILE *fp, int fd);
+
+/**
+ * flushDumpWriter()
+ *
+ * Write what is staged to the FILE or descriptor (nothing for a buffer)
+ *
+ * return
+ *   0: OK
+ *  -n: error
+ *      ERR_WRITE_FILE
+ */
+int flushDumpWriter(DumpWriter *w);
+
+/**
+ * takeDumpBuffer()
+ *
+ * Take the buffer of a buffer writer and reset the writer
+ *
+ * return
+ *  the text (the caller must free it), NULL if nothing was written or
+ *  an allocation failed
+ */
+char *takeDumpBuffer(DumpWriter *w);
+
+/**
+ * freeDumpWriter()
+ *
+ * Flush a FILE or descriptor writer, or free the buffer of a buffer writer
+ *
+ * return
+ *   0: OK
+ *  -n: error
+ *      ERR_WRITE_FILE
+ *      ERR_MEMALLOC
+ */
+int freeDumpWriter(DumpWriter *w);
+
+/**
+ * writeDumpHeader()
+ *
+ * Write the header row of a TSV export (nothing for the other formats)
+ *
+ * return
+ *   0: OK
+ *  -n: the writer's error
+ */
+int writeDumpHeader(DumpWriter *w, DUMP_FORMAT format);
+
+/**
+ * writeIfdTableArrayDump()
+ *
+ * Dump the IFD tables of one file
+ *
+ * parameters
+ *  [in] w : the writer
+ *  [in] ifdArray : address of the IFD array (NULL = the file has none)
+ *  [in] path : name of the file for JSON and TSV, may be NULL
+ *  [in] status : createIfdTableArray() result, written to JSON
+ *  [in] format : DUMP_xxx
+ *
+ * return
+ *   0: OK
+ *  -n: the writer's error
+ */
+int writeIfdTableArrayDump(DumpWriter *w, void **ifdArray, const char *path,
+                           int status, DUMP_FORMAT format);
+
+/**
+ * writeJPEGFileDump()
+ *
+ * Parse a JPEG file and dump its IFD tables
+ *
+ * parameters
+ *  [in] w : the writer
+ *  [in] JPEGFileName : target JPEG file
+ *  [in] format : DUMP_xxx
+ *  [out] result : createIfdTableArray() result, may be NULL; a file
+ *                 that fails to parse is still dumped with its status
+ *
+ * return
+ *   0: OK
+ *  -n: the writer's error
+ */
+int writeJPEGFileDump(DumpWriter *w, const char *JPEGFileName, DUMP_FORMAT format,
+                      int *result);
+
 /**
  * getTagInfo()
  *
@@ -272,6 +650,29 @@ TagNodeInfo *getTagInfo(void **ifdArray,
                        IFD_TYPE ifdType,
                        unsigned short tagId);
 
+/**
+ * findTagInfo()
+ *
+ * Find the TagNodeInfo that matches the IFD_TYPE & TagId without copying it
+ *
+ * parameters
+ *  [in] ifdArray : address of the IFD array
+ *  [in] ifdType : target IFD TYPE
+ *  [in] tagId : target tag ID
+ *
+ * return
+ *   NULL: tag is not found
+ *  !NULL: the tag inside the IFD tables
+ *
+ * note
+ * The tag belongs to the tables: it stays valid until they are freed or
+ * the tag is removed, and must not be passed to freeTagInfo().  Use
+ * getTagInfo() for a copy that outlives the tables.
+ */
+const TagNodeInfo *findTagInfo(void **ifdArray,
+                               IFD_TYPE ifdType,
+                               unsigned short tagId);
+
 /**
  * getTagInfoFromIfd()
  *
@@ -474,8 +875,24 @@ int setThumbnailDataOnIfdTableArray(void **ifdTableArray,
                                     unsigned char *pData,
                                     unsigned int length);
 
-void getIfdTableDump(void *pIfd, char **pp);
 
+// byte order of the Exif segment written (setWriteByteOrder)
+#define EXIF_BYTE_ORDER_KEEP      0        // the input's; little-endian if it has none
+#define EXIF_BYTE_ORDER_INTEL     0x4949   // "II", little-endian
+#define EXIF_BYTE_ORDER_MOTOROLA  0x4D4D   // "MM", big-endian
+
+/**
+ * setWriteByteOrder()
+ *
+ * Set the byte order updateExifSegmentInJPEGFile() writes in
+ *
+ * parameters
+ *  [in] order : EXIF_BYTE_ORDER_xxx
+ *
+ * note
+ * The setting is per thread, like the state of the file being parsed.
+ */
+void setWriteByteOrder(int order);
 
 /**
  * updateExifSegmentInJPEGFile()
@@ -501,8 +918,6 @@ int updateExifSegmentInJPEGFile(const char *inJPEGFileName,
                                 const char *outJPGEFileName,
                                 void **ifdTableArray);
 
-void getIfdTableDump(void *pIfd, char **pp);
-
 /**
  * removeAdobeMetadataSegmentFromJPEGFile()
  *
@@ -582,6 +997,9 @@ int removeAdobeMetadataSegmentFromJPEGFile(const char *inJPEGFileName,
 
 #define TAG_DateTimeOriginal             0x9003
 #define TAG_DateTimeDigitized            0x9004
+#define TAG_OffsetTime                   0x9010
+#define TAG_OffsetTimeOriginal           0x9011
+#define TAG_OffsetTimeDigitized          0x9012
 #define TAG_SubSecTime                   0x9290
 #define TAG_SubSecTimeOriginal           0x9291
 #define TAG_SubSecTimeDigitized          0x9292
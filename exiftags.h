@@ -0,0 +1,353 @@
+/*
+ * Exif tag table
+ *
+ * What the Exif 2.32 specification expects of every tag the parser knows
+ * (name, allowed types and count), looked up by IFD and tag ID through a
+ * perfect hash that is built by the compiler: a lookup is two hashes, one
+ * table read and one compare, whatever the tag, and the names are
+ * std::string_views into the literals, so nothing is copied.
+ *
+ * The hash is "hash and displace": a first hash puts every key into one
+ * of TAG_HASH_BUCKETS buckets, and each bucket gets the seed of a second
+ * hash that sends its keys to free slots.  The seeds are searched for at
+ * compile time, fullest bucket first; a table that can't be placed fails
+ * the build (static_assert below).
+ *
+ *   Typical Usage:
+ *
+ *   std::string_view name = getExifTagName(IFD_0TH, TAG_Orientation);
+ *
+ *   const ExifTagDef *def = getExifTagDef(IFD_EXIF, tag->tagId);
+ *   if (def && !exifTagMatches(def, tag->type, tag->count)) {
+ *       ...
+ *   }
+ */
+#if !defined(_EXIFTAGS_H_)
+#define _EXIFTAGS_H_
+
+#include <string_view>
+#include "exif.hpp"
+
+// tag namespaces: 0th, 1st and Exif IFD tags share the TIFF numbering
+#define TAG_GROUP_TIFF   0
+#define TAG_GROUP_GPS    1
+#define TAG_GROUP_IO     2
+#define TAG_GROUP_NONE   0xFF
+
+// allowed types as a mask of 1 << TYPE_xxx
+#define TAG_T(type)      (1 << (type))
+#define TAG_BYTE         TAG_T(TYPE_BYTE)
+#define TAG_ASCII        TAG_T(TYPE_ASCII)
+#define TAG_SHORT        TAG_T(TYPE_SHORT)
+#define TAG_LONG         TAG_T(TYPE_LONG)
+#define TAG_RATIONAL     TAG_T(TYPE_RATIONAL)
+#define TAG_UNDEFINED    TAG_T(TYPE_UNDEFINED)
+#define TAG_SRATIONAL    TAG_T(TYPE_SRATIONAL)
+#define TAG_ANY_COUNT    0
+
+typedef struct {
+    unsigned char group;     // TAG_GROUP_xxx
+    unsigned short tagId;
+    std::string_view name;
+    unsigned short types;    // TAG_xxx mask
+    unsigned short count;    // values expected, TAG_ANY_COUNT if it varies
+} ExifTagDef;
+
+static constexpr ExifTagDef ExifTagDefs[] = {
+    // TIFF structure
+    { TAG_GROUP_TIFF, 0x0100, "ImageWidth",                  TAG_SHORT | TAG_LONG, 1 },
+    { TAG_GROUP_TIFF, 0x0101, "ImageLength",                 TAG_SHORT | TAG_LONG, 1 },
+    { TAG_GROUP_TIFF, 0x0102, "BitsPerSample",               TAG_SHORT, 3 },
+    { TAG_GROUP_TIFF, 0x0103, "Compression",                 TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0x0106, "PhotometricInterpretation",   TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0x0112, "Orientation",                 TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0x0115, "SamplesPerPixel",             TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0x011C, "PlanarConfiguration",         TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0x0212, "YCbCrSubSampling",            TAG_SHORT, 2 },
+    { TAG_GROUP_TIFF, 0x0213, "YCbCrPositioning",            TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0x011A, "XResolution",                 TAG_RATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0x011B, "YResolution",                 TAG_RATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0x0128, "ResolutionUnit",              TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0x0111, "StripOffsets",                TAG_SHORT | TAG_LONG, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0x0116, "RowsPerStrip",                TAG_SHORT | TAG_LONG, 1 },
+    { TAG_GROUP_TIFF, 0x0117, "StripByteCounts",             TAG_SHORT | TAG_LONG, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0x0201, "JPEGInterchangeFormat",       TAG_LONG, 1 },
+    { TAG_GROUP_TIFF, 0x0202, "JPEGInterchangeFormatLength", TAG_LONG, 1 },
+    { TAG_GROUP_TIFF, 0x012D, "TransferFunction",            TAG_SHORT, 768 },
+    { TAG_GROUP_TIFF, 0x013E, "WhitePoint",                  TAG_RATIONAL, 2 },
+    { TAG_GROUP_TIFF, 0x013F, "PrimaryChromaticities",       TAG_RATIONAL, 6 },
+    { TAG_GROUP_TIFF, 0x0211, "YCbCrCoefficients",           TAG_RATIONAL, 3 },
+    { TAG_GROUP_TIFF, 0x0214, "ReferenceBlackWhite",         TAG_RATIONAL, 6 },
+    { TAG_GROUP_TIFF, 0x0132, "DateTime",                    TAG_ASCII, 20 },
+    { TAG_GROUP_TIFF, 0x010E, "ImageDescription",            TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0x010F, "Make",                        TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0x0110, "Model",                       TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0x0131, "Software",                    TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0x013B, "Artist",                      TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0x8298, "Copyright",                   TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0x8769, "ExifIFDPointer",              TAG_LONG, 1 },
+    { TAG_GROUP_TIFF, 0x8825, "GPSInfoIFDPointer",           TAG_LONG, 1 },
+    { TAG_GROUP_TIFF, 0xA005, "InteroperabilityIFDPointer",  TAG_LONG, 1 },
+    { TAG_GROUP_TIFF, 0x4746, "Rating",                      TAG_SHORT, 1 },
+    // Exif IFD
+    { TAG_GROUP_TIFF, 0x9000, "ExifVersion",                 TAG_UNDEFINED, 4 },
+    { TAG_GROUP_TIFF, 0xA000, "FlashPixVersion",             TAG_UNDEFINED, 4 },
+    { TAG_GROUP_TIFF, 0xA001, "ColorSpace",                  TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0x9101, "ComponentsConfiguration",     TAG_UNDEFINED, 4 },
+    { TAG_GROUP_TIFF, 0x9102, "CompressedBitsPerPixel",      TAG_RATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0xA002, "PixelXDimension",             TAG_SHORT | TAG_LONG, 1 },
+    { TAG_GROUP_TIFF, 0xA003, "PixelYDimension",             TAG_SHORT | TAG_LONG, 1 },
+    { TAG_GROUP_TIFF, 0x927C, "MakerNote",                   TAG_UNDEFINED, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0x9286, "UserComment",                 TAG_UNDEFINED, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0xA004, "RelatedSoundFile",            TAG_ASCII, 13 },
+    { TAG_GROUP_TIFF, 0x9003, "DateTimeOriginal",            TAG_ASCII, 20 },
+    { TAG_GROUP_TIFF, 0x9004, "DateTimeDigitized",           TAG_ASCII, 20 },
+    { TAG_GROUP_TIFF, 0x9010, "OffsetTime",                  TAG_ASCII, 7 },
+    { TAG_GROUP_TIFF, 0x9011, "OffsetTimeOriginal",          TAG_ASCII, 7 },
+    { TAG_GROUP_TIFF, 0x9012, "OffsetTimeDigitized",         TAG_ASCII, 7 },
+    { TAG_GROUP_TIFF, 0x9290, "SubSecTime",                  TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0x9291, "SubSecTimeOriginal",          TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0x9292, "SubSecTimeDigitized",         TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0x829A, "ExposureTime",                TAG_RATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0x829D, "FNumber",                     TAG_RATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0x8822, "ExposureProgram",             TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0x8824, "SpectralSensitivity",         TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0x8827, "PhotographicSensitivity",     TAG_SHORT, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0x8828, "OECF",                        TAG_UNDEFINED, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0x8830, "SensitivityType",             TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0x8831, "StandardOutputSensitivity",   TAG_LONG, 1 },
+    { TAG_GROUP_TIFF, 0x8832, "RecommendedExposureIndex",    TAG_LONG, 1 },
+    { TAG_GROUP_TIFF, 0x8833, "ISOSpeed",                    TAG_LONG, 1 },
+    { TAG_GROUP_TIFF, 0x8834, "ISOSpeedLatitudeyyy",         TAG_LONG, 1 },
+    { TAG_GROUP_TIFF, 0x8835, "ISOSpeedLatitudezzz",         TAG_LONG, 1 },
+    { TAG_GROUP_TIFF, 0x9201, "ShutterSpeedValue",           TAG_SRATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0x9202, "ApertureValue",               TAG_RATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0x9203, "BrightnessValue",             TAG_SRATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0x9204, "ExposureBiasValue",           TAG_SRATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0x9205, "MaxApertureValue",            TAG_RATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0x9206, "SubjectDistance",             TAG_RATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0x9207, "MeteringMode",                TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0x9208, "LightSource",                 TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0x9209, "Flash",                       TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0x920A, "FocalLength",                 TAG_RATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0x9214, "SubjectArea",                 TAG_SHORT, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0xA20B, "FlashEnergy",                 TAG_RATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0xA20C, "SpatialFrequencyResponse",    TAG_UNDEFINED, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0xA20E, "FocalPlaneXResolution",       TAG_RATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0xA20F, "FocalPlaneYResolution",       TAG_RATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0xA210, "FocalPlaneResolutionUnit",    TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0xA214, "SubjectLocation",             TAG_SHORT, 2 },
+    { TAG_GROUP_TIFF, 0xA215, "ExposureIndex",               TAG_RATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0xA217, "SensingMethod",               TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0xA300, "FileSource",                  TAG_UNDEFINED, 1 },
+    { TAG_GROUP_TIFF, 0xA301, "SceneType",                   TAG_UNDEFINED, 1 },
+    { TAG_GROUP_TIFF, 0xA302, "CFAPattern",                  TAG_UNDEFINED, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0xA401, "CustomRendered",              TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0xA402, "ExposureMode",                TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0xA403, "WhiteBalance",                TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0xA404, "DigitalZoomRatio",            TAG_RATIONAL, 1 },
+    { TAG_GROUP_TIFF, 0xA405, "FocalLengthIn35mmFormat",     TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0xA406, "SceneCaptureType",            TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0xA407, "GainControl",                 TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0xA408, "Contrast",                    TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0xA409, "Saturation",                  TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0xA40A, "Sharpness",                   TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0xA40B, "DeviceSettingDescription",    TAG_UNDEFINED, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0xA40C, "SubjectDistanceRange",        TAG_SHORT, 1 },
+    { TAG_GROUP_TIFF, 0xA420, "ImageUniqueID",               TAG_ASCII, 33 },
+    { TAG_GROUP_TIFF, 0xA430, "CameraOwnerName",             TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0xA431, "BodySerialNumber",            TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0xA432, "LensSpecification",           TAG_RATIONAL, 4 },
+    { TAG_GROUP_TIFF, 0xA433, "LensMake",                    TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0xA434, "LensModel",                   TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0xA435, "LensSerialNumber",            TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_TIFF, 0xA500, "Gamma",                       TAG_RATIONAL, 1 },
+    // GPS IFD
+    { TAG_GROUP_GPS,  0x0000, "GPSVersionID",                TAG_BYTE, 4 },
+    { TAG_GROUP_GPS,  0x0001, "GPSLatitudeRef",              TAG_ASCII, 2 },
+    { TAG_GROUP_GPS,  0x0002, "GPSLatitude",                 TAG_RATIONAL, 3 },
+    { TAG_GROUP_GPS,  0x0003, "GPSLongitudeRef",             TAG_ASCII, 2 },
+    { TAG_GROUP_GPS,  0x0004, "GPSLongitude",                TAG_RATIONAL, 3 },
+    { TAG_GROUP_GPS,  0x0005, "GPSAltitudeRef",              TAG_BYTE, 1 },
+    { TAG_GROUP_GPS,  0x0006, "GPSAltitude",                 TAG_RATIONAL, 1 },
+    { TAG_GROUP_GPS,  0x0007, "GPSTimeStamp",                TAG_RATIONAL, 3 },
+    { TAG_GROUP_GPS,  0x0008, "GPSSatellites",               TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_GPS,  0x0009, "GPSStatus",                   TAG_ASCII, 2 },
+    { TAG_GROUP_GPS,  0x000A, "GPSMeasureMode",              TAG_ASCII, 2 },
+    { TAG_GROUP_GPS,  0x000B, "GPSDOP",                      TAG_RATIONAL, 1 },
+    { TAG_GROUP_GPS,  0x000C, "GPSSpeedRef",                 TAG_ASCII, 2 },
+    { TAG_GROUP_GPS,  0x000D, "GPSSpeed",                    TAG_RATIONAL, 1 },
+    { TAG_GROUP_GPS,  0x000E, "GPSTrackRef",                 TAG_ASCII, 2 },
+    { TAG_GROUP_GPS,  0x000F, "GPSTrack",                    TAG_RATIONAL, 1 },
+    { TAG_GROUP_GPS,  0x0010, "GPSImgDirectionRef",          TAG_ASCII, 2 },
+    { TAG_GROUP_GPS,  0x0011, "GPSImgDirection",             TAG_RATIONAL, 1 },
+    { TAG_GROUP_GPS,  0x0012, "GPSMapDatum",                 TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_GPS,  0x0013, "GPSDestLatitudeRef",          TAG_ASCII, 2 },
+    { TAG_GROUP_GPS,  0x0014, "GPSDestLatitude",             TAG_RATIONAL, 3 },
+    { TAG_GROUP_GPS,  0x0015, "GPSDestLongitudeRef",         TAG_ASCII, 2 },
+    { TAG_GROUP_GPS,  0x0016, "GPSDestLongitude",            TAG_RATIONAL, 3 },
+    { TAG_GROUP_GPS,  0x0017, "GPSBearingRef",               TAG_ASCII, 2 },
+    { TAG_GROUP_GPS,  0x0018, "GPSBearing",                  TAG_RATIONAL, 1 },
+    { TAG_GROUP_GPS,  0x0019, "GPSDestDistanceRef",          TAG_ASCII, 2 },
+    { TAG_GROUP_GPS,  0x001A, "GPSDestDistance",             TAG_RATIONAL, 1 },
+    { TAG_GROUP_GPS,  0x001B, "GPSProcessingMethod",         TAG_UNDEFINED, TAG_ANY_COUNT },
+    { TAG_GROUP_GPS,  0x001C, "GPSAreaInformation",          TAG_UNDEFINED, TAG_ANY_COUNT },
+    { TAG_GROUP_GPS,  0x001D, "GPSDateStamp",                TAG_ASCII, 11 },
+    { TAG_GROUP_GPS,  0x001E, "GPSDifferential",             TAG_SHORT, 1 },
+    { TAG_GROUP_GPS,  0x001F, "GPSHPositioningError",        TAG_RATIONAL, 1 },
+    // Interoperability IFD
+    { TAG_GROUP_IO,   0x0001, "InteroperabilityIndex",       TAG_ASCII, TAG_ANY_COUNT },
+    { TAG_GROUP_IO,   0x0002, "InteroperabilityVersion",     TAG_UNDEFINED, 4 },
+};
+
+#define TAG_DEF_COUNT     (sizeof(ExifTagDefs) / sizeof(ExifTagDefs[0]))
+#define TAG_HASH_SLOTS    256   // power of two above TAG_DEF_COUNT
+#define TAG_HASH_BUCKETS  64
+#define TAG_HASH_TRIES    4096  // seeds tried per bucket
+
+typedef struct {
+    int ok;                                  // every key got a slot
+    unsigned short seed[TAG_HASH_BUCKETS];   // second hash of each bucket
+    short slot[TAG_HASH_SLOTS];              // index into ExifTagDefs, -1 = free
+} TagHashTable;
+
+constexpr unsigned int exifTagKey(unsigned int group, unsigned int tagId)
+{
+    return (group << 16) | tagId;
+}
+
+// 32-bit finaliser of MurmurHash3, keyed by seed
+constexpr unsigned int exifTagHash(unsigned int key, unsigned int seed)
+{
+    unsigned int h = key ^ (seed * 0x9E3779B9u);
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
+
+constexpr TagHashTable buildTagHashTable()
+{
+    TagHashTable t = {};
+    unsigned char bucketOf[TAG_DEF_COUNT] = {};
+    unsigned int size[TAG_HASH_BUCKETS] = {};
+    unsigned int largest = 0;
+
+    for (unsigned int i = 0; i < TAG_HASH_SLOTS; i++) {
+        t.slot[i] = -1;
+    }
+    for (unsigned int i = 0; i < TAG_DEF_COUNT; i++) {
+        unsigned int key = exifTagKey(ExifTagDefs[i].group, ExifTagDefs[i].tagId);
+        bucketOf[i] = (unsigned char)(exifTagHash(key, 0) % TAG_HASH_BUCKETS);
+        if (++size[bucketOf[i]] > largest) {
+            largest = size[bucketOf[i]];
+        }
+    }
+    // place the fullest buckets first, while most slots are free
+    for (unsigned int want = largest; want > 0; want--) {
+        for (unsigned int b = 0; b < TAG_HASH_BUCKETS; b++) {
+            if (size[b] != want) {
+                continue;
+            }
+            unsigned int seed = 1;
+            for (; seed <= TAG_HASH_TRIES; seed++) {
+                short taken[TAG_HASH_SLOTS] = {};
+                int fits = 1;
+                for (unsigned int i = 0; i < TAG_DEF_COUNT && fits; i++) {
+                    if (bucketOf[i] != b) {
+                        continue;
+                    }
+                    unsigned int key = exifTagKey(ExifTagDefs[i].group, ExifTagDefs[i].tagId);
+                    unsigned int s = exifTagHash(key, seed) & (TAG_HASH_SLOTS - 1);
+                    fits = (t.slot[s] < 0 && !taken[s]);
+                    taken[s] = 1;
+                }
+                if (fits) {
+                    break;
+                }
+            }
+            if (seed > TAG_HASH_TRIES) {
+                return t; // ok stays 0
+            }
+            t.seed[b] = (unsigned short)seed;
+            for (unsigned int i = 0; i < TAG_DEF_COUNT; i++) {
+                if (bucketOf[i] == b) {
+                    unsigned int key = exifTagKey(ExifTagDefs[i].group, ExifTagDefs[i].tagId);
+                    t.slot[exifTagHash(key, seed) & (TAG_HASH_SLOTS - 1)] = (short)i;
+                }
+            }
+        }
+    }
+    t.ok = 1;
+    return t;
+}
+
+static constexpr TagHashTable TagHash = buildTagHashTable();
+static_assert(TagHash.ok, "no perfect hash for the Exif tag table; raise TAG_HASH_SLOTS");
+
+/**
+ * getExifTagGroup()
+ *
+ * Tag namespace of an IFD
+ */
+constexpr unsigned int getExifTagGroup(IFD_TYPE ifdType)
+{
+    return (ifdType == IFD_0TH || ifdType == IFD_1ST || ifdType == IFD_EXIF) ? TAG_GROUP_TIFF :
+           (ifdType == IFD_GPS) ? TAG_GROUP_GPS :
+           (ifdType == IFD_IO)  ? TAG_GROUP_IO : TAG_GROUP_NONE;
+}
+
+/**
+ * getExifTagDef()
+ *
+ * What the specification expects of a tag
+ *
+ * parameters
+ *  [in] ifdType : IFD the tag is in
+ *  [in] tagId : tag ID
+ *
+ * return
+ *  NULL: the tag is unknown
+ * !NULL: the definition
+ */
+constexpr const ExifTagDef *getExifTagDef(IFD_TYPE ifdType, unsigned short tagId)
+{
+    unsigned int key = exifTagKey(getExifTagGroup(ifdType), tagId);
+    unsigned int seed = TagHash.seed[exifTagHash(key, 0) % TAG_HASH_BUCKETS];
+    int i = TagHash.slot[exifTagHash(key, seed) & (TAG_HASH_SLOTS - 1)];
+    // an empty bucket has seed 0 and no key of it is in the table
+    return (i >= 0 && exifTagKey(ExifTagDefs[i].group, ExifTagDefs[i].tagId) == key) ?
+           &ExifTagDefs[i] : nullptr;
+}
+
+/**
+ * getExifTagName()
+ *
+ * Name of a tag (e.g. "Orientation"), empty if the tag is unknown
+ */
+constexpr std::string_view getExifTagName(IFD_TYPE ifdType, unsigned short tagId)
+{
+    const ExifTagDef *def = getExifTagDef(ifdType, tagId);
+    return (def) ? def->name : std::string_view();
+}
+
+/**
+ * exifTagMatches()
+ *
+ * Whether a tag has a type and count the specification allows
+ */
+constexpr bool exifTagMatches(const ExifTagDef *def, unsigned short type, unsigned int count)
+{
+    return type < 16 && (def->types & (1 << type)) &&
+           (def->count == TAG_ANY_COUNT || def->count == count);
+}
+
+static_assert(getExifTagName(IFD_0TH, 0x0112) == "Orientation", "tag table");
+static_assert(getExifTagName(IFD_EXIF, 0x9003) == "DateTimeOriginal", "tag table");
+static_assert(getExifTagName(IFD_GPS, 0x0000) == "GPSVersionID", "tag table");
+static_assert(getExifTagName(IFD_IO, 0x0001) == "InteroperabilityIndex", "tag table");
+static_assert(getExifTagName(IFD_GPS, 0x0112).empty(), "tag table");
+
+#endif // _EXIFTAGS_H_
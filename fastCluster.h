@@ -4,9 +4,13 @@
 Authorzhao
 Date201614 20:34:56
 */
+#if !defined(_FASTCLUSTER_H_)
+#define _FASTCLUSTER_H_
+
 #include <iostream>
 #include <vector>
 #include <array>
+#include <string>
 
 struct picture
 {
@@ -21,8 +25,10 @@ struct picsInoneTime
 	std::vector<picture> pic;
 };
 
-bool comppics(picture x,picture y);
+bool comppics(const picture& x, const picture& y);
 
 void splitpicsOntime(std::vector<picture>& pics,int rule, std::vector<picsInoneTime>& picsOT);
 
 void regressionsplit(picture& pic1, picture& pic2,int& i, int s, picsInoneTime& tmp, std::vector<picsInoneTime> & picsOT);
+
+#endif // _FASTCLUSTER_H_
@@ -1,9 +1,17 @@
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cassert>
+#include "fastCluster.h"
+#include "stagestats.h"
+#include "trace.h"
 
 using namespace std;
 
-bool comppics(picture x, picture y)
+// more runs than 1 per RUN_MERGE_LIMIT photos: sorting beats merging
+#define RUN_MERGE_LIMIT 16
+
+bool comppics(const picture& x, const picture& y)
 {
 
 	for (int i = 0; i < x.date.size();)
@@ -46,20 +54,93 @@ void regressionsplit(picture& pic1,picture& pic2, int& i,int s, picsInoneTime& t
 	}
 
 }
+// cut pics into ascending runs (TimSort style), reversing the strictly
+// descending ones in place; returns the start of every run followed by
+// pics.size(), or nothing once there are too many runs to be worth it
+static std::vector<size_t> findSortedRuns(std::vector<picture>& pics)
+{
+	std::vector<size_t> runs;
+	size_t n = pics.size(), i = 0;
+	while (i < n)
+	{
+		size_t j = i + 1;
+		if (j < n && comppics(pics[j], pics[i]))
+		{
+			// strictly descending, so reversing keeps equal dates in order
+			while (j < n && comppics(pics[j], pics[j - 1]))
+			{
+				j++;
+			}
+			reverse(pics.begin() + i, pics.begin() + j);
+		}
+		else
+		{
+			while (j < n && !comppics(pics[j], pics[j - 1]))
+			{
+				j++;
+			}
+		}
+		runs.push_back(i);
+		if (runs.size() > n / RUN_MERGE_LIMIT + 1)
+		{
+			runs.clear();
+			return runs;
+		}
+		i = j;
+	}
+	runs.push_back(n);
+	return runs;
+}
+
+// sort pics, in linear time when it is already (nearly) in order
+static void sortpics(std::vector<picture>& pics)
+{
+	std::vector<size_t> runs = findSortedRuns(pics);
+	if (runs.empty())
+	{
+		sort(pics.begin(), pics.end(), comppics);
+		return;
+	}
+	// merge neighbouring runs pairwise until one is left
+	while (runs.size() > 2)
+	{
+		std::vector<size_t> merged;
+		size_t r = runs.size() - 1;
+		for (size_t k = 0; k + 1 < r; k += 2)
+		{
+			inplace_merge(pics.begin() + runs[k], pics.begin() + runs[k + 1],
+				pics.begin() + runs[k + 2], comppics);
+			merged.push_back(runs[k]);
+		}
+		if (r % 2)
+		{
+			merged.push_back(runs[r - 1]);
+		}
+		merged.push_back(pics.size());
+		runs.swap(merged);
+	}
+}
+
 void splitpicsOntime(std::vector<picture>& pics, int rule, 
 	std::vector<picsInoneTime> & picsOT)
 {
 	assert((rule == 0) || (rule == 1) || (rule == 2) 
 		|| (rule == 3) || (rule == 4) || (rule == 5));
 	picsOT.clear();
-	if (pics.size() < 2)
+	if (pics.empty())
 	{
-		picsInoneTime tmp;
-		tmp.pic.push_back(pics[0]);
-		picsOT.push_back(tmp);
+		return;
 	}
-	sort(pics.begin(), pics.end(), comppics);
+	STAGE_DECL(t0);
+	STAGE_BEGIN(t0);
+	TRACE_DECL(span);
+	TRACE_BEGIN(span);
+	sortpics(pics);
+	STAGE_END(t0, STAGE_SORT, pics.size());
+	TRACE_END(span, "sort");
 
+	STAGE_BEGIN(t0);
+	TRACE_BEGIN(span);
 	picsInoneTime tmp;
 	tmp.pic.push_back(pics[0]);
 	for (int i = 1; i < pics.size(); i++)
@@ -68,5 +149,7 @@ void splitpicsOntime(std::vector<picture>& pics, int rule,
 		regressionsplit(pics[i - 1], pics[i], ss, rule, tmp, picsOT);
 	}
 	picsOT.push_back(tmp);
+	STAGE_END(t0, STAGE_SPLIT, pics.size());
+	TRACE_END(span, "split");
 
 }
@@ -0,0 +1,615 @@
+/*
+ * Synthetic photo corpus generator
+ *
+ * Writes N JPEG files whose Exif segments look like a camera's, built
+ * with the library's own write path (createTagInfo(),
+ * insertTagNodeToIfdTableArray(), updateExifSegmentInJPEGFile()), so
+ * benchmarks can be run and shared without anyone's real photos.  The
+ * same seed always gives the same corpus, whatever the thread count.
+ *
+ *   Usage:
+ *
+ *   gencorpus -n 100000 -o /tmp/corpus [options]
+ *
+ *    -S seed          random seed (default 1)
+ *    -d dist          shooting dates: uniform, burst or sequential
+ *    -r from-to       years of the dates (default 2010-2020)
+ *    -B n             mean photos per burst session (default 20)
+ *    -u fraction      photos without DateTimeOriginal
+ *    -z fraction      photos with OffsetTimeOriginal
+ *    -g fraction      photos with a GPS IFD
+ *    -t n             tags besides the date and the orientation (default 12)
+ *    -m bytes         maker note size (default 0 = none)
+ *    -T bytes         thumbnail size (default 0 = none)
+ *    -P bytes         image data after the Exif segment (default 0)
+ *    -b order         le, be or mixed (default le)
+ *    -x fraction      malformed files
+ *    -f n             files per directory (default 1000)
+ *    -j n             threads (default: all cores)
+ *
+ * The dates follow one of three shapes: uniform over the year range,
+ * burst (sessions of photos a few seconds apart at random times, the
+ * way people shoot) or sequential (ascending in file order, like a
+ * single camera's card).  Malformed files are valid ones damaged
+ * afterwards in one of the ways found in the wild: a truncated Exif
+ * segment, an unknown byte order mark, an IFD offset past the segment,
+ * a tag count past the segment or a missing SOI marker.
+ *
+ * The image data is filler, not a decodable picture; only the structure
+ * the Exif parser looks at is real.  Every file is listed with its
+ * date, orientation, byte order and damage in <out>/manifest.tsv.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <array>
+#include <atomic>
+#include <random>
+#include <string>
+#include <vector>
+#include "exif.hpp"
+#include "datekey.h"
+#include "parallel.h"
+
+typedef enum {
+    DATES_UNIFORM = 0,
+    DATES_BURST,
+    DATES_SEQUENTIAL
+} DATE_DIST;
+
+typedef enum {
+    MALFORM_NONE = 0,
+    MALFORM_TRUNCATED,   // file ends inside the Exif segment
+    MALFORM_BYTE_ORDER,  // neither "II" nor "MM"
+    MALFORM_IFD_OFFSET,  // 0th IFD offset past the segment
+    MALFORM_TAG_COUNT,   // first tag of the 0th IFD claims 2G values
+    MALFORM_NO_SOI,      // not a JPEG at all
+    MALFORM_KINDS
+} MALFORM;
+
+static const char *malformNames[MALFORM_KINDS] = {
+    "-", "truncated", "byte-order", "ifd-offset", "tag-count", "no-soi"
+};
+
+typedef struct {
+    long long count;
+    const char *outDir;
+    unsigned long long seed;
+    DATE_DIST dates;
+    int fromYear;
+    int toYear;
+    int burstMean;
+    double undated;
+    double zoned;
+    double gps;
+    int tags;
+    unsigned int makerNoteBytes;
+    unsigned int thumbnailBytes;
+    unsigned int payloadBytes;
+    int byteOrder;       // EXIF_BYTE_ORDER_xxx, EXIF_BYTE_ORDER_KEEP = mixed
+    double malformed;
+    int filesPerDir;
+    int threads;
+} GenOptions;
+
+// what one file will contain, decided up front so that the parallel
+// writers don't depend on each other
+typedef struct {
+    long long when;       // seconds since 1970 in camera time, -1 = no date
+    int orientation;
+    int offsetMinutes;    // OffsetTimeOriginal when hasOffset
+    int hasOffset;
+    int hasGps;
+    int byteOrder;
+    int malform;
+    unsigned long long seed;
+} GenPlan;
+
+// tags a camera writes, in the order they are added
+typedef struct {
+    IFD_TYPE ifd;
+    unsigned short tag;
+    unsigned short type;
+    const char *text;       // TYPE_ASCII / TYPE_UNDEFINED
+    unsigned int num[2];    // TYPE_SHORT / TYPE_LONG / TYPE_RATIONAL
+} GEN_TAG;
+
+static const GEN_TAG cameraTags[] = {
+    { IFD_0TH,  TAG_Make,               TYPE_ASCII,     "Canon", { 0, 0 } },
+    { IFD_0TH,  TAG_Model,              TYPE_ASCII,     "Canon EOS 5D Mark IV", { 0, 0 } },
+    { IFD_0TH,  TAG_XResolution,        TYPE_RATIONAL,  NULL, { 72, 1 } },
+    { IFD_0TH,  TAG_YResolution,        TYPE_RATIONAL,  NULL, { 72, 1 } },
+    { IFD_0TH,  TAG_ResolutionUnit,     TYPE_SHORT,     NULL, { 2, 0 } },
+    { IFD_0TH,  TAG_Software,           TYPE_ASCII,     "Firmware Version 1.0.4", { 0, 0 } },
+    { IFD_EXIF, TAG_ExposureTime,       TYPE_RATIONAL,  NULL, { 1, 125 } },
+    { IFD_EXIF, TAG_FNumber,            TYPE_RATIONAL,  NULL, { 28, 10 } },
+    { IFD_EXIF, TAG_ExposureProgram,    TYPE_SHORT,     NULL, { 2, 0 } },
+    { IFD_EXIF, TAG_ExifVersion,        TYPE_UNDEFINED, "0231", { 0, 0 } },
+    { IFD_EXIF, TAG_MeteringMode,       TYPE_SHORT,     NULL, { 5, 0 } },
+    { IFD_EXIF, TAG_Flash,              TYPE_SHORT,     NULL, { 16, 0 } },
+    { IFD_EXIF, TAG_FocalLength,        TYPE_RATIONAL,  NULL, { 50, 1 } },
+    { IFD_EXIF, TAG_SubSecTimeOriginal, TYPE_ASCII,     "42", { 0, 0 } },
+    { IFD_EXIF, TAG_ColorSpace,         TYPE_SHORT,     NULL, { 1, 0 } },
+    { IFD_EXIF, TAG_PixelXDimension,    TYPE_LONG,      NULL, { 6720, 0 } },
+    { IFD_EXIF, TAG_PixelYDimension,    TYPE_LONG,      NULL, { 4480, 0 } },
+    { IFD_EXIF, TAG_WhiteBalance,       TYPE_SHORT,     NULL, { 0, 0 } },
+    { IFD_EXIF, TAG_LensModel,          TYPE_ASCII,     "EF24-105mm f/4L IS USM", { 0, 0 } },
+};
+
+#define CAMERA_TAG_COUNT   (int)(sizeof(cameraTags) / sizeof(cameraTags[0]))
+#define FILLER_TAG_BASE    0xC350  // private tags used past the camera tags
+
+static const int zoneOffsets[] = { 60, 120, 540, -300, -480, 330, 0 };
+
+static unsigned long long mixSeed(unsigned long long seed, unsigned long long i)
+{
+    // splitmix64, so neighbouring files get unrelated streams
+    unsigned long long x = seed + (i + 1) * 0x9E3779B97F4A7C15ULL;
+    x ^= x >> 30; x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27; x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static long long yearStart(int year)
+{
+    std::array<int, 6> d = { { year, 1, 1, 0, 0, 0 } };
+    return dateToSeconds(d);
+}
+
+static void makePlans(const GenOptions *opt, std::vector<GenPlan>& plans)
+{
+    std::mt19937_64 rng(opt->seed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    long long from = yearStart(opt->fromYear);
+    long long span = yearStart(opt->toYear + 1) - from;
+    long long t = from, left = 0;
+    std::geometric_distribution<long long> burst(1.0 / (opt->burstMean > 0 ? opt->burstMean : 1));
+
+    plans.resize((size_t)opt->count);
+    for (size_t i = 0; i < plans.size(); i++) {
+        GenPlan& p = plans[i];
+        switch (opt->dates) {
+        case DATES_UNIFORM:
+            t = from + (long long)(rng() % (unsigned long long)span);
+            break;
+        case DATES_BURST:
+            if (left-- <= 0) {
+                t = from + (long long)(rng() % (unsigned long long)span);
+                left = burst(rng);
+            } else {
+                t += 1 + (long long)(rng() % 30);
+            }
+            break;
+        case DATES_SEQUENTIAL:
+            t += 1 + (long long)(rng() % (unsigned long long)(2 * span / opt->count + 1));
+            break;
+        }
+        p.when = (unit(rng) < opt->undated) ? -1 : t;
+        // most photos are shot in landscape
+        double o = unit(rng);
+        p.orientation = (o < 0.80) ? 1 : (o < 0.92) ? 6 : (o < 0.97) ? 8 : 3;
+        p.hasOffset = unit(rng) < opt->zoned;
+        p.offsetMinutes = zoneOffsets[rng() % (sizeof(zoneOffsets) / sizeof(zoneOffsets[0]))];
+        p.hasGps = unit(rng) < opt->gps;
+        p.byteOrder = opt->byteOrder;
+        if (p.byteOrder == EXIF_BYTE_ORDER_KEEP) {
+            p.byteOrder = (rng() & 1) ? EXIF_BYTE_ORDER_MOTOROLA : EXIF_BYTE_ORDER_INTEL;
+        }
+        p.malform = MALFORM_NONE;
+        if (unit(rng) < opt->malformed) {
+            p.malform = 1 + (int)(rng() % (MALFORM_KINDS - 1));
+        }
+        p.seed = mixSeed(opt->seed, i);
+    }
+}
+
+static void formatDate(long long when, char *buf, size_t size)
+{
+    std::array<int, 6> d;
+    secondsToDate(when, d);
+    snprintf(buf, size, "%04d:%02d:%02d %02d:%02d:%02d", d[0], d[1], d[2], d[3], d[4], d[5]);
+}
+
+// add a tag with ASCII/UNDEFINED data; 0 = OK
+static int addBytesTag(void **ifdArray, IFD_TYPE ifd, unsigned short id,
+                       unsigned short type, const void *data, unsigned int count)
+{
+    int result;
+    TagNodeInfo *tag = createTagInfo(id, type, count, &result);
+    if (!tag) {
+        return result;
+    }
+    memcpy(tag->byteData, data, count);
+    result = insertTagNodeToIfdTableArray(ifdArray, ifd, tag);
+    freeTagInfo(tag);
+    return result;
+}
+
+// add a tag with numeric data (pairs for TYPE_RATIONAL); 0 = OK
+static int addNumTag(void **ifdArray, IFD_TYPE ifd, unsigned short id,
+                     unsigned short type, const unsigned int *num, unsigned int count)
+{
+    int result;
+    TagNodeInfo *tag = createTagInfo(id, type, count, &result);
+    if (!tag) {
+        return result;
+    }
+    unsigned int n = (type == TYPE_RATIONAL) ? count * 2 : count;
+    for (unsigned int i = 0; i < n; i++) {
+        tag->numData[i] = num[i];
+    }
+    result = insertTagNodeToIfdTableArray(ifdArray, ifd, tag);
+    freeTagInfo(tag);
+    return result;
+}
+
+static int addCameraTags(void **ifdArray, int tags)
+{
+    char text[32];
+    int sts = 0;
+    for (int k = 0; k < tags && sts == 0; k++) {
+        if (k >= CAMERA_TAG_COUNT) {
+            int len = snprintf(text, sizeof(text), "filler %d", k) + 1;
+            sts = addBytesTag(ifdArray, IFD_0TH, (unsigned short)(FILLER_TAG_BASE + k),
+                              TYPE_ASCII, text, (unsigned int)len);
+            continue;
+        }
+        const GEN_TAG& t = cameraTags[k];
+        if (t.type == TYPE_ASCII) {
+            sts = addBytesTag(ifdArray, t.ifd, t.tag, t.type, t.text,
+                              (unsigned int)strlen(t.text) + 1);
+        } else if (t.type == TYPE_UNDEFINED) {
+            sts = addBytesTag(ifdArray, t.ifd, t.tag, t.type, t.text,
+                              (unsigned int)strlen(t.text));
+        } else {
+            sts = addNumTag(ifdArray, t.ifd, t.tag, t.type, t.num, 1);
+        }
+    }
+    return sts;
+}
+
+static int addGps(void **ifdArray, std::mt19937_64& rng)
+{
+    static const unsigned int version[4] = { 2, 3, 0, 0 };
+    unsigned int lat[6] = { (unsigned int)(rng() % 80), 1, (unsigned int)(rng() % 60), 1,
+                            (unsigned int)(rng() % 6000), 100 };
+    unsigned int lon[6] = { (unsigned int)(rng() % 180), 1, (unsigned int)(rng() % 60), 1,
+                            (unsigned int)(rng() % 6000), 100 };
+    const char *latRef = (rng() & 1) ? "N" : "S";
+    const char *lonRef = (rng() & 1) ? "E" : "W";
+    int sts = addNumTag(ifdArray, IFD_GPS, TAG_GPSVersionID, TYPE_BYTE, version, 4);
+    if (sts == 0) {
+        sts = addBytesTag(ifdArray, IFD_GPS, TAG_GPSLatitudeRef, TYPE_ASCII, latRef, 2);
+    }
+    if (sts == 0) {
+        sts = addNumTag(ifdArray, IFD_GPS, TAG_GPSLatitude, TYPE_RATIONAL, lat, 3);
+    }
+    if (sts == 0) {
+        sts = addBytesTag(ifdArray, IFD_GPS, TAG_GPSLongitudeRef, TYPE_ASCII, lonRef, 2);
+    }
+    if (sts == 0) {
+        sts = addNumTag(ifdArray, IFD_GPS, TAG_GPSLongitude, TYPE_RATIONAL, lon, 3);
+    }
+    return sts;
+}
+
+// build the IFD tables of one file
+static void **buildTables(const GenOptions *opt, const GenPlan& p, std::mt19937_64& rng,
+                          int *pResult)
+{
+    void **ifdArray = NULL;
+    unsigned int orientation = (unsigned int)p.orientation;
+    char text[32];
+    int sts;
+
+    ifdArray = insertIfdTableToIfdTableArray(NULL, IFD_0TH, &sts);
+    if (ifdArray) {
+        ifdArray = insertIfdTableToIfdTableArray(ifdArray, IFD_EXIF, &sts);
+    }
+    if (ifdArray && p.hasGps) {
+        ifdArray = insertIfdTableToIfdTableArray(ifdArray, IFD_GPS, &sts);
+    }
+    if (ifdArray && opt->thumbnailBytes > 0) {
+        ifdArray = insertIfdTableToIfdTableArray(ifdArray, IFD_1ST, &sts);
+    }
+    if (!ifdArray) {
+        *pResult = sts;
+        return NULL;
+    }
+    sts = addNumTag(ifdArray, IFD_0TH, TAG_Orientation, TYPE_SHORT, &orientation, 1);
+    if (sts == 0 && p.when >= 0) {
+        formatDate(p.when, text, sizeof(text));
+        sts = addBytesTag(ifdArray, IFD_EXIF, TAG_DateTimeOriginal, TYPE_ASCII, text, 20);
+    }
+    if (sts == 0 && p.when >= 0 && p.hasOffset) {
+        int m = (p.offsetMinutes < 0) ? -p.offsetMinutes : p.offsetMinutes;
+        snprintf(text, sizeof(text), "%c%02d:%02d", (p.offsetMinutes < 0) ? '-' : '+',
+                 m / 60, m % 60);
+        sts = addBytesTag(ifdArray, IFD_EXIF, TAG_OffsetTimeOriginal, TYPE_ASCII, text, 7);
+    }
+    if (sts == 0) {
+        sts = addCameraTags(ifdArray, opt->tags);
+    }
+    if (sts == 0 && p.hasGps) {
+        sts = addGps(ifdArray, rng);
+    }
+    if (sts == 0 && opt->makerNoteBytes > 0) {
+        std::vector<unsigned char> note(opt->makerNoteBytes);
+        for (size_t i = 0; i < note.size(); i++) {
+            note[i] = (unsigned char)rng();
+        }
+        sts = addBytesTag(ifdArray, IFD_EXIF, TAG_MakerNote, TYPE_UNDEFINED,
+                          &note[0], (unsigned int)note.size());
+    }
+    if (sts == 0 && opt->thumbnailBytes > 0) {
+        // SOI, filler, EOI
+        std::vector<unsigned char> thumb(opt->thumbnailBytes < 4 ? 4 : opt->thumbnailBytes);
+        for (size_t i = 2; i + 2 < thumb.size(); i++) {
+            thumb[i] = (unsigned char)rng();
+        }
+        thumb[0] = 0xFF;
+        thumb[1] = 0xD8;
+        thumb[thumb.size() - 2] = 0xFF;
+        thumb[thumb.size() - 1] = 0xD9;
+        sts = setThumbnailDataOnIfdTableArray(ifdArray, &thumb[0], (unsigned int)thumb.size());
+    }
+    if (sts != 0) {
+        freeIfdTableArray(ifdArray);
+        ifdArray = NULL;
+    }
+    *pResult = sts;
+    return ifdArray;
+}
+
+// damage a written file; 0 = OK
+static int damageFile(const std::string& path, int kind, std::mt19937_64& rng)
+{
+    std::vector<unsigned char> buf;
+    unsigned char chunk[8192];
+    size_t n, tiff = 0, ifd0;
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return ERR_READ_FILE;
+    }
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        buf.insert(buf.end(), chunk, chunk + n);
+    }
+    fclose(fp);
+    // the TIFF header follows "Exif\0\0"
+    for (size_t i = 0; i + 6 < buf.size() && i < 65536; i++) {
+        if (memcmp(&buf[i], "Exif\0\0", 6) == 0) {
+            tiff = i + 6;
+            break;
+        }
+    }
+    if (tiff == 0 || tiff + 8 > buf.size()) {
+        return ERR_INVALID_APP1HEADER;
+    }
+    int big = buf[tiff] == 'M';
+    ifd0 = big ? (buf[tiff + 4] << 24 | buf[tiff + 5] << 16 | buf[tiff + 6] << 8 | buf[tiff + 7])
+               : (buf[tiff + 7] << 24 | buf[tiff + 6] << 16 | buf[tiff + 5] << 8 | buf[tiff + 4]);
+    switch (kind) {
+    case MALFORM_TRUNCATED:
+        buf.resize(tiff + 8 + (size_t)(rng() % (ifd0 + 16)));
+        break;
+    case MALFORM_BYTE_ORDER:
+        buf[tiff] = 'X';
+        buf[tiff + 1] = 'X';
+        break;
+    case MALFORM_IFD_OFFSET:
+        // huge in either byte order
+        memset(&buf[tiff + 4], 0xFF, 3);
+        buf[tiff + (big ? 7 : 4)] = 0xF0;
+        break;
+    case MALFORM_TAG_COUNT:
+        if (tiff + ifd0 + 10 <= buf.size()) {
+            memset(&buf[tiff + ifd0 + 6], 0x7F, 4);
+        }
+        break;
+    case MALFORM_NO_SOI:
+        buf[0] = 0x00;
+        break;
+    }
+    fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        return ERR_WRITE_FILE;
+    }
+    n = fwrite(&buf[0], 1, buf.size(), fp);
+    fclose(fp);
+    return (n == buf.size()) ? 0 : ERR_WRITE_FILE;
+}
+
+// a JPEG without an Exif segment for the writer to start from
+static int writeBaseJpeg(const std::string& path, unsigned int payloadBytes)
+{
+    static const unsigned char head[] = { 0xFF, 0xD8, 0xFF, 0xDB, 0x00, 0x43, 0x00 };
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        return ERR_WRITE_FILE;
+    }
+    fwrite(head, 1, sizeof(head), fp);
+    for (int i = 0; i < 64; i++) {
+        fputc(1, fp);
+    }
+    std::mt19937 rng(payloadBytes);
+    for (unsigned int i = 0; i < payloadBytes; i++) {
+        fputc((int)(rng() & 0x7F), fp);
+    }
+    fputc(0xFF, fp);
+    fputc(0xD9, fp);
+    return (fclose(fp) == 0) ? 0 : ERR_WRITE_FILE;
+}
+
+static std::string filePath(const GenOptions *opt, size_t i)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "/d%05zu/IMG_%07zu.JPG", i / opt->filesPerDir, i);
+    return std::string(opt->outDir) + buf;
+}
+
+static int writeManifest(const GenOptions *opt, const std::vector<GenPlan>& plans)
+{
+    std::string path = std::string(opt->outDir) + "/manifest.tsv";
+    char date[32];
+    FILE *fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        return ERR_WRITE_FILE;
+    }
+    fprintf(fp, "path\tdate\toffset\torientation\tbyteorder\tdamage\n");
+    for (size_t i = 0; i < plans.size(); i++) {
+        const GenPlan& p = plans[i];
+        if (p.when >= 0) {
+            formatDate(p.when, date, sizeof(date));
+        } else {
+            strcpy(date, "-");
+        }
+        fprintf(fp, "%s\t%s\t", filePath(opt, i).c_str() + strlen(opt->outDir) + 1, date);
+        if (p.when >= 0 && p.hasOffset) {
+            fprintf(fp, "%d", p.offsetMinutes);
+        } else {
+            fputc('-', fp);
+        }
+        fprintf(fp, "\t%d\t%s\t%s\n", p.orientation,
+                (p.byteOrder == EXIF_BYTE_ORDER_MOTOROLA) ? "MM" : "II",
+                malformNames[p.malform]);
+    }
+    return (fclose(fp) == 0) ? 0 : ERR_WRITE_FILE;
+}
+
+static int parseFraction(const char *arg, double *v)
+{
+    char *end;
+    *v = strtod(arg, &end);
+    return end != arg && *end == '\0' && *v >= 0.0 && *v <= 1.0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s -n count -o dir [-S seed] [-d uniform|burst|sequential]\n"
+            "       [-r from-to] [-B burst] [-u frac] [-z frac] [-g frac] [-t tags]\n"
+            "       [-m makernote] [-T thumbnail] [-P payload] [-b le|be|mixed]\n"
+            "       [-x frac] [-f perdir] [-j threads]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    GenOptions opt;
+    std::vector<GenPlan> plans;
+    std::string base;
+    std::atomic<long long> failed(0);
+    int c, ok = 1;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.seed = 1;
+    opt.fromYear = 2010;
+    opt.toYear = 2020;
+    opt.burstMean = 20;
+    opt.tags = 12;
+    opt.byteOrder = EXIF_BYTE_ORDER_INTEL;
+    opt.filesPerDir = 1000;
+
+    while ((c = getopt(argc, argv, "n:o:S:d:r:B:u:z:g:t:m:T:P:b:x:f:j:")) != -1) {
+        switch (c) {
+        case 'n': opt.count = atoll(optarg); break;
+        case 'o': opt.outDir = optarg; break;
+        case 'S': opt.seed = strtoull(optarg, NULL, 0); break;
+        case 'd':
+            if (strcmp(optarg, "uniform") == 0) {
+                opt.dates = DATES_UNIFORM;
+            } else if (strcmp(optarg, "burst") == 0) {
+                opt.dates = DATES_BURST;
+            } else if (strcmp(optarg, "sequential") == 0) {
+                opt.dates = DATES_SEQUENTIAL;
+            } else {
+                ok = 0;
+            }
+            break;
+        case 'r':
+            ok = sscanf(optarg, "%d-%d", &opt.fromYear, &opt.toYear) == 2 &&
+                 opt.fromYear >= 1970 && opt.fromYear <= opt.toYear && opt.toYear <= 9999;
+            break;
+        case 'B': opt.burstMean = atoi(optarg); break;
+        case 'u': ok = parseFraction(optarg, &opt.undated); break;
+        case 'z': ok = parseFraction(optarg, &opt.zoned); break;
+        case 'g': ok = parseFraction(optarg, &opt.gps); break;
+        case 't': opt.tags = atoi(optarg); break;
+        case 'm': opt.makerNoteBytes = (unsigned int)strtoul(optarg, NULL, 0); break;
+        case 'T': opt.thumbnailBytes = (unsigned int)strtoul(optarg, NULL, 0); break;
+        case 'P': opt.payloadBytes = (unsigned int)strtoul(optarg, NULL, 0); break;
+        case 'b':
+            if (strcmp(optarg, "le") == 0) {
+                opt.byteOrder = EXIF_BYTE_ORDER_INTEL;
+            } else if (strcmp(optarg, "be") == 0) {
+                opt.byteOrder = EXIF_BYTE_ORDER_MOTOROLA;
+            } else if (strcmp(optarg, "mixed") == 0) {
+                opt.byteOrder = EXIF_BYTE_ORDER_KEEP;
+            } else {
+                ok = 0;
+            }
+            break;
+        case 'x': ok = parseFraction(optarg, &opt.malformed); break;
+        case 'f': opt.filesPerDir = atoi(optarg); break;
+        case 'j': opt.threads = atoi(optarg); break;
+        default: ok = 0; break;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opt.count <= 0 || !opt.outDir || opt.filesPerDir <= 0 || opt.tags < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (mkdir(opt.outDir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "can't create %s\n", opt.outDir);
+        return 1;
+    }
+    for (long long d = 0; d <= (opt.count - 1) / opt.filesPerDir; d++) {
+        std::string dir = filePath(&opt, (size_t)(d * opt.filesPerDir));
+        dir.resize(dir.rfind('/'));
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "can't create %s\n", dir.c_str());
+            return 1;
+        }
+    }
+    base = std::string(opt.outDir) + "/.base.jpg";
+    if (writeBaseJpeg(base, opt.payloadBytes) != 0) {
+        fprintf(stderr, "can't write %s\n", base.c_str());
+        return 1;
+    }
+
+    makePlans(&opt, plans);
+    runParallel(opt.threads, plans.size(), [&](size_t i) {
+        const GenPlan& p = plans[i];
+        std::mt19937_64 rng(p.seed);
+        std::string path = filePath(&opt, i);
+        int sts;
+        void **ifdArray = buildTables(&opt, p, rng, &sts);
+        if (ifdArray) {
+            setWriteByteOrder(p.byteOrder);
+            sts = updateExifSegmentInJPEGFile(base.c_str(), path.c_str(), ifdArray);
+            freeIfdTableArray(ifdArray);
+            sts = (sts == 1) ? 0 : sts;
+        }
+        if (sts == 0 && p.malform != MALFORM_NONE) {
+            sts = damageFile(path, p.malform, rng);
+        }
+        if (sts != 0) {
+            fprintf(stderr, "%s: error %d\n", path.c_str(), sts);
+            failed++;
+        }
+    });
+    unlink(base.c_str());
+
+    if (writeManifest(&opt, plans) != 0) {
+        fprintf(stderr, "can't write the manifest\n");
+        return 1;
+    }
+    return (failed > 0) ? 1 : 0;
+}
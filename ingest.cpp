@@ -0,0 +1,583 @@
+/*
+ * Ingest stage
+ */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include "exif.hpp"
+#include "ingest.h"
+#include "parallel.h"
+#include "trace.h"
+
+typedef std::pair<unsigned long long, unsigned long long> SortKey;
+
+// physical byte offset of the first extent; 0 if it can't be mapped
+static unsigned long long firstExtentOf(const char *path)
+{
+    union {
+        struct fiemap fm;
+        char raw[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } u;
+    unsigned long long phys = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    memset(&u, 0, sizeof(u));
+    u.fm.fm_start = 0;
+    u.fm.fm_length = ~0ULL;
+    u.fm.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &u.fm) == 0 && u.fm.fm_mapped_extents > 0 &&
+        !(u.fm.fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN)) {
+        phys = u.fm.fm_extents[0].fe_physical;
+    }
+    close(fd);
+    return phys;
+}
+
+// read a 0/1 flag from sysfs; -1 if it isn't there
+static int readSysFlag(const char *path)
+{
+    char c = 0;
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    if (fread(&c, 1, 1, fp) != 1) {
+        c = 0;
+    }
+    fclose(fp);
+    return (c == '0') ? 0 : (c == '1') ? 1 : -1;
+}
+
+// rotational flag of a block device; -1 if unknown
+static int readRotational(unsigned int maj, unsigned int min)
+{
+    char path[128];
+    int rotational;
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", maj, min);
+    rotational = readSysFlag(path);
+    if (rotational < 0) {
+        // a partition; the queue belongs to the whole disk
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational", maj, min);
+        rotational = readSysFlag(path);
+    }
+    return rotational;
+}
+
+// file systems whose data is behind a network or a user space daemon
+static int isNetworkFsType(const char *type)
+{
+    static const char *const types[] = {
+        "nfs", "nfs4", "cifs", "smb3", "smbfs", "9p", "ceph", "glusterfs",
+        "afs", "lustre", "gpfs", "sshfs"
+    };
+    if (strncmp(type, "fuse", 4) == 0) {
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strcmp(type, types[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// file systems with an anonymous st_dev: find the mount in mountinfo and
+// follow its source to the block device behind it (btrfs, for one, reports
+// an anonymous device for a file system on a real disk).  Network types
+// get the network depth; anything else unresolved (tmpfs, overlayfs, ...)
+// gets the rotational default
+static int anonymousDeviceDepth(unsigned int maj, unsigned int min)
+{
+    char line[4096], type[64], source[1024];
+    unsigned int m1, m2;
+    int depth = INGEST_DEPTH_ROTATIONAL;
+    FILE *fp = fopen("/proc/self/mountinfo", "r");
+    if (!fp) {
+        return depth;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        const char *sep;
+        struct stat st;
+        if (sscanf(line, "%*u %*u %u:%u", &m1, &m2) != 2 || m1 != maj || m2 != min ||
+            (sep = strstr(line, " - ")) == NULL ||
+            sscanf(sep + 3, "%63s %1023s", type, source) != 2) {
+            continue;
+        }
+        if (isNetworkFsType(type)) {
+            depth = INGEST_DEPTH_NETWORK;
+        } else if (stat(source, &st) == 0 && S_ISBLK(st.st_mode) &&
+                   readRotational(major(st.st_rdev), minor(st.st_rdev)) == 0) {
+            depth = INGEST_DEPTH_SOLID_STATE;
+        }
+        break;
+    }
+    fclose(fp);
+    return depth;
+}
+
+/**
+ * getDeviceQueueDepth()
+ *
+ * Default number of outstanding reads for a device
+ */
+int getDeviceQueueDepth(unsigned long long dev)
+{
+    unsigned int maj = major((dev_t)dev), min = minor((dev_t)dev);
+    if (maj == 0) {
+        return anonymousDeviceDepth(maj, min);
+    }
+    // unknown devices are treated as disks, the safe choice for seeks
+    return (readRotational(maj, min) == 0) ? INGEST_DEPTH_SOLID_STATE : INGEST_DEPTH_ROTATIONAL;
+}
+
+// queue depth of a device, honouring the caller's overrides
+static int depthOf(const IngestOptions *opt, unsigned long long dev)
+{
+    if (opt && opt->depths) {
+        for (size_t i = 0; i < opt->depthCount; i++) {
+            if (opt->depths[i].dev == dev && opt->depths[i].depth > 0) {
+                return opt->depths[i].depth;
+            }
+        }
+    }
+    return getDeviceQueueDepth(dev);
+}
+
+/**
+ * makeWalkEntries()
+ *
+ * Build walker entries for paths that did not come from the walker
+ */
+void makeWalkEntries(const std::vector<picture>& pics, std::vector<WalkEntry>& entries)
+{
+    entries.resize(pics.size());
+    for (size_t i = 0; i < pics.size(); i++) {
+        struct stat st;
+        WalkEntry& e = entries[i];
+        e.filepath = pics[i].filepath;
+        e.filename = pics[i].filename;
+        e.ino = 0;
+        e.dev = 0;
+        if (stat(pics[i].filepath.c_str(), &st) == 0) {
+            e.ino = (unsigned long long)st.st_ino;
+            e.dev = (unsigned long long)st.st_dev;
+        }
+    }
+}
+
+/**
+ * orderForSpindles()
+ *
+ * Split the entries into one queue per device and order each queue
+ */
+void orderForSpindles(const std::vector<WalkEntry>& entries, IO_ORDER order,
+                      std::vector<std::vector<size_t> >& queues)
+{
+    std::map<unsigned long long, size_t> queueOfDev;
+    queues.clear();
+    for (size_t i = 0; i < entries.size(); i++) {
+        std::map<unsigned long long, size_t>::iterator it = queueOfDev.find(entries[i].dev);
+        if (it == queueOfDev.end()) {
+            it = queueOfDev.insert(std::make_pair(entries[i].dev, queues.size())).first;
+            queues.push_back(std::vector<size_t>());
+        }
+        queues[it->second].push_back(i);
+    }
+    if (order == ORDER_NONE) {
+        return;
+    }
+    // FIEMAP costs an open per file, so map the devices in parallel
+    runParallel((int)queues.size(), queues.size(), [&](size_t q) {
+        std::vector<size_t>& queue = queues[q];
+        std::vector<std::pair<SortKey, size_t> > keyed(queue.size());
+        for (size_t k = 0; k < queue.size(); k++) {
+            const WalkEntry& e = entries[queue[k]];
+            unsigned long long phys = 0;
+            if (order == ORDER_EXTENT) {
+                phys = firstExtentOf(e.filepath.c_str());
+            }
+            // unmappable files go last, in inode order
+            keyed[k].first = (phys != 0) ? SortKey(0, phys) : SortKey(1, e.ino);
+            keyed[k].second = queue[k];
+        }
+        std::sort(keyed.begin(), keyed.end());
+        for (size_t k = 0; k < queue.size(); k++) {
+            queue[k] = keyed[k].second;
+        }
+    });
+}
+
+// the outputs of one ingestPhotos() call
+typedef struct {
+    const std::vector<WalkEntry> *entries;
+    std::vector<picture> *pics;
+    std::vector<int> *status;
+    MetaCache *cache;
+    RateLimiter *limiter;
+    const TimeZone *zone;
+    std::atomic<int> dated;
+} IngestOutput;
+
+static void storeResult(IngestOutput *out, size_t i, const MetaCacheRecord& rec, int sts)
+{
+    picture& pic = (*out->pics)[i];
+    unpackDateKey(dateKeyToZone(out->zone, rec.dateKey, rec.utcOffset), pic.date);
+    pic.filepath = (*out->entries)[i].filepath;
+    pic.filename = (*out->entries)[i].filename;
+    pic.orien = rec.orientation;
+    recordExifError(sts, pic.filepath.c_str());
+    if (out->status) {
+        (*out->status)[i] = sts;
+    }
+    if (rec.dateKey != DATEKEY_NONE) {
+        out->dated++;
+    }
+}
+
+// read the items of one device queue without a deadline
+static void runQueue(IngestOutput *out, const std::vector<size_t>& items, int depth,
+                     std::atomic<unsigned long long> *failed,
+                     std::atomic<unsigned long long> *bytesRead)
+{
+    runParallel(depth, items.size(), [&](size_t k) {
+        size_t i = items[k];
+        MetaCacheRecord rec;
+        unsigned long long readBefore = getThreadReadBytes();
+        int sts = getImgMetaCached(out->cache, (*out->entries)[i].filepath.c_str(), &rec);
+        unsigned long long bytes = getThreadReadBytes() - readBefore;
+        *bytesRead += bytes;
+        if (out->limiter) {
+            // cache hits read nothing and cost only a stat()
+            chargeRateLimit(out->limiter, bytes, (bytes > 0) ? 1 : 0);
+        }
+        if (sts < 0) {
+            (*failed)++;
+        }
+        storeResult(out, i, rec, sts);
+    });
+}
+
+/*
+ * Deadline mode
+ *
+ * A blocked read can't be cancelled, so a worker stuck past the deadline
+ * is abandoned instead: its file goes on the timed-out list, a new worker
+ * takes its place in the queue, and the old one exits when the read
+ * finally returns.  Abandoned workers may outlive ingestPhotos(), so they
+ * only hold the run state and may touch the caller's data (outputs,
+ * cache, limiter) only between enterRun() and leaveRun(); the run waits
+ * for that section to empty before it is closed.
+ */
+typedef std::chrono::steady_clock Clock;
+
+typedef struct {
+    Clock::time_point start;
+    size_t item;     // index into entries
+    int busy;        // reading item
+    int inside;      // between enterRun() and leaveRun()
+    int abandoned;
+} WORKER_SLOT;
+
+typedef struct {
+    std::mutex lock;
+    std::condition_variable changed;
+    IngestOutput *out;
+    const std::vector<size_t> *items;
+    size_t next;         // next item to hand out
+    size_t finished;     // items read or abandoned
+    int closed;          // the caller's data must not be touched
+    int inside;          // workers between enterRun() and leaveRun()
+    unsigned long long failed;
+    unsigned long long bytesRead;
+    std::vector<size_t> timedOut;
+    std::deque<WORKER_SLOT> slots;
+} DeadlineRun;
+
+static int enterRun(DeadlineRun *run, size_t slot)
+{
+    std::lock_guard<std::mutex> guard(run->lock);
+    if (run->closed || run->slots[slot].abandoned) {
+        return 0;
+    }
+    run->slots[slot].inside = 1;
+    run->inside++;
+    return 1;
+}
+
+static void leaveRun(DeadlineRun *run, size_t slot, int done)
+{
+    std::lock_guard<std::mutex> guard(run->lock);
+    run->slots[slot].inside = 0;
+    run->inside--;
+    if (done) {
+        run->slots[slot].busy = 0;
+        run->finished++;
+    }
+    run->changed.notify_all();
+}
+
+static void deadlineWorker(std::shared_ptr<DeadlineRun> run, size_t slot)
+{
+    for (;;) {
+        std::string path;
+        struct stat st;
+        MetaCacheRecord rec;
+        size_t i;
+        int sts, hit = 0;
+        {
+            std::lock_guard<std::mutex> guard(run->lock);
+            WORKER_SLOT& ws = run->slots[slot];
+            if (run->closed || ws.abandoned || run->next >= run->items->size()) {
+                return;
+            }
+            i = (*run->items)[run->next++];
+            ws.item = i;
+            ws.busy = 1;
+            ws.start = Clock::now();
+            path = (*run->out->entries)[i].filepath;
+        }
+        unsigned long long readBefore = getThreadReadBytes();
+        int statOk = (stat(path.c_str(), &st) == 0);
+        if (statOk && run->out->cache) {
+            if (!enterRun(run.get(), slot)) {
+                return;
+            }
+            hit = lookupMetaCache(run->out->cache, &st, &rec);
+            leaveRun(run.get(), slot, 0);
+        }
+        if (!statOk) {
+            rec.dateKey = DATEKEY_NONE;
+            rec.orientation = NOT_AVAILABLE;
+            rec.utcOffset = UTC_OFFSET_UNKNOWN;
+            sts = ERR_READ_FILE;
+        } else if (hit) {
+            sts = rec.status;
+        } else {
+            sts = readImgMeta(path.c_str(), &rec);
+        }
+        // too late if the file was given up on meanwhile
+        if (!enterRun(run.get(), slot)) {
+            return;
+        }
+        IngestOutput *out = run->out;
+        if (statOk && !hit && out->cache && sts != ERR_READ_FILE) {
+            storeMetaCache(out->cache, &st, &rec);
+        }
+        unsigned long long bytes = getThreadReadBytes() - readBefore;
+        if (out->limiter) {
+            chargeRateLimit(out->limiter, bytes, (bytes > 0) ? 1 : 0);
+        }
+        {
+            std::lock_guard<std::mutex> guard(run->lock);
+            run->bytesRead += bytes;
+            if (sts < 0) {
+                run->failed++;
+            }
+        }
+        storeResult(out, i, rec, sts);
+        leaveRun(run.get(), slot, 1);
+    }
+}
+
+// start a worker on a new slot; run->lock must be held
+static int startWorker(const std::shared_ptr<DeadlineRun>& run)
+{
+    size_t slot = run->slots.size();
+    WORKER_SLOT ws;
+    ws.item = 0;
+    ws.busy = 0;
+    ws.inside = 0;
+    ws.abandoned = 0;
+    run->slots.push_back(ws);
+    try {
+        std::thread(deadlineWorker, run, slot).detach();
+    } catch (...) {
+        run->slots.pop_back();
+        return 0;
+    }
+    return 1;
+}
+
+// read the items of one device queue, giving up on files that take
+// longer than deadlineMs; returns the items given up on
+static std::vector<size_t> runQueueWithDeadline(IngestOutput *out,
+                                                const std::vector<size_t>& items,
+                                                int depth, unsigned int deadlineMs,
+                                                std::atomic<unsigned long long> *failed,
+                                                std::atomic<unsigned long long> *bytesRead)
+{
+    std::shared_ptr<DeadlineRun> run = std::make_shared<DeadlineRun>();
+    Clock::duration deadline = std::chrono::milliseconds(deadlineMs);
+    // check often enough to overshoot the deadline by a quarter at most
+    Clock::duration tick = std::chrono::milliseconds(deadlineMs / 4 + 1);
+    std::vector<size_t> timedOut;
+    int running = 0;
+
+    run->out = out;
+    run->items = &items;
+    run->next = 0;
+    run->finished = 0;
+    run->closed = 0;
+    run->inside = 0;
+    run->failed = 0;
+    run->bytesRead = 0;
+
+    std::unique_lock<std::mutex> lk(run->lock);
+    for (int t = 0; t < depth && (size_t)t < items.size(); t++) {
+        running += startWorker(run);
+    }
+    if (running == 0) {
+        // no threads to be had: read in this thread without a deadline
+        lk.unlock();
+        runQueue(out, items, 1, failed, bytesRead);
+        return timedOut;
+    }
+    while (run->finished < items.size()) {
+        run->changed.wait_for(lk, tick);
+        Clock::time_point now = Clock::now();
+        for (size_t w = 0; w < run->slots.size(); w++) {
+            WORKER_SLOT& ws = run->slots[w];
+            if (!ws.busy || ws.inside || ws.abandoned || now - ws.start <= deadline) {
+                continue;
+            }
+            ws.abandoned = 1;
+            ws.busy = 0;
+            run->finished++;
+            run->timedOut.push_back(ws.item);
+            if (run->next < items.size()) {
+                startWorker(run);
+            }
+        }
+    }
+    // the caller's data is handed back once nobody is using it
+    run->closed = 1;
+    while (run->inside > 0) {
+        run->changed.wait(lk);
+    }
+    *failed += run->failed;
+    *bytesRead += run->bytesRead;
+    timedOut.swap(run->timedOut);
+    return timedOut;
+}
+
+/**
+ * ingestPhotos()
+ *
+ * Read the metadata of all entries
+ */
+int ingestPhotos(const std::vector<WalkEntry>& entries, const IngestOptions *opt,
+                 std::vector<picture>& pics, std::vector<int> *status)
+{
+    std::vector<std::vector<size_t> > queues;
+    std::vector<std::vector<size_t> > slow;
+    IngestOutput out;
+    IO_ORDER order = (opt) ? opt->order : ORDER_NONE;
+    unsigned int deadlineMs = (opt) ? opt->deadlineMs : 0;
+    TRACE_SCOPE("ingest");
+
+    out.entries = &entries;
+    out.pics = &pics;
+    out.status = status;
+    out.cache = (opt) ? opt->cache : NULL;
+    out.limiter = (opt) ? opt->limiter : NULL;
+    out.zone = (opt) ? opt->zone : NULL;
+    out.dated = 0;
+
+    pics.assign(entries.size(), picture());
+    if (status) {
+        status->assign(entries.size(), 0);
+    }
+    if (opt && opt->timedOut) {
+        opt->timedOut->clear();
+    }
+    orderForSpindles(entries, order, queues);
+    slow.resize(queues.size());
+
+    if (opt && opt->deviceStats) {
+        opt->deviceStats->assign(queues.size(), IngestDeviceStats());
+    }
+
+    // every device queue gets its own workers, as many as its depth; they
+    // take the files in queue order so the physical order is kept
+    runParallel((int)queues.size(), queues.size(), [&](size_t q) {
+        const std::vector<size_t>& queue = queues[q];
+        unsigned long long dev = entries[queue[0]].dev;
+        int depth = depthOf(opt, dev);
+        std::atomic<unsigned long long> failed(0), bytesRead(0);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        TRACE_SCOPE("ingest_queue");
+
+        if (deadlineMs > 0) {
+            slow[q] = runQueueWithDeadline(&out, queue, depth, deadlineMs, &failed, &bytesRead);
+        } else {
+            runQueue(&out, queue, depth, &failed, &bytesRead);
+        }
+        if (opt && opt->deviceStats) {
+            IngestDeviceStats& ds = (*opt->deviceStats)[q];
+            ds.dev = dev;
+            ds.depth = depth;
+            ds.files = queue.size();
+            ds.failed = failed;
+            ds.bytesRead = bytesRead;
+            ds.quarantined = slow[q].size();
+            ds.elapsedUs = (unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        }
+    });
+
+    // the slow files get a second chance once everything else is done,
+    // one at a time per device so they don't compete with each other
+    runParallel((int)queues.size(), queues.size(), [&](size_t q) {
+        std::atomic<unsigned long long> failed(0), bytesRead(0);
+        std::vector<size_t> lost;
+        if (slow[q].empty()) {
+            return;
+        }
+        TRACE_SCOPE("ingest_retry");
+        if (opt->retryDeadlineMs > 0) {
+            lost = runQueueWithDeadline(&out, slow[q], 1, opt->retryDeadlineMs,
+                                        &failed, &bytesRead);
+        } else {
+            runQueue(&out, slow[q], 1, &failed, &bytesRead);
+        }
+        for (size_t k = 0; k < lost.size(); k++) {
+            MetaCacheRecord rec;
+            rec.dateKey = DATEKEY_NONE;
+            rec.orientation = NOT_AVAILABLE;
+            rec.utcOffset = UTC_OFFSET_UNKNOWN;
+            storeResult(&out, lost[k], rec, ERR_TIMED_OUT);
+        }
+        slow[q].swap(lost);
+        if (opt->deviceStats) {
+            IngestDeviceStats& ds = (*opt->deviceStats)[q];
+            ds.failed += failed + slow[q].size();
+            ds.bytesRead += bytesRead;
+            ds.timedOut = slow[q].size();
+        }
+    });
+    if (opt && opt->timedOut) {
+        for (size_t q = 0; q < slow.size(); q++) {
+            opt->timedOut->insert(opt->timedOut->end(), slow[q].begin(), slow[q].end());
+        }
+    }
+    return out.dated;
+}
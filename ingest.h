@@ -0,0 +1,149 @@
+/*
+ * Ingest stage
+ *
+ * Reads the date and orientation of every file found by the walker.
+ * Files are split into one queue per device (per spindle set) and each
+ * queue can be put into physical order before createIfdTableArray()
+ * touches the files, so a spinning disk sweeps across the platter
+ * instead of seeking between randomly placed APP1 headers:
+ *
+ *   ORDER_NONE   : walk order
+ *   ORDER_INODE  : by inode number; inode tables roughly follow the data
+ *                  on ext4/XFS and it costs no system call at all
+ *   ORDER_EXTENT : by the physical offset of the first extent from
+ *                  FIEMAP, falling back to the inode number for files
+ *                  the file system can't map
+ *
+ * Every queue is served by its own set of workers, so devices don't wait
+ * for each other.  The number of reads kept outstanding on a device is
+ * its queue depth: a spinning disk wants one (anything more turns the
+ * sweep back into seeks), flash and network mounts need several to hide
+ * their latency.  Unless the caller overrides it, the depth is chosen
+ * from /sys/dev/block/<major>:<minor>/queue/rotational.
+ *
+ * A file that takes longer than deadlineMs (a stalled NFS or FUSE read)
+ * is quarantined: its worker is abandoned and replaced, so the rest of
+ * the queue moves on, and the file is retried with retryDeadlineMs once
+ * all queues are drained.  Files that miss that deadline as well get
+ * ERR_TIMED_OUT.  An abandoned worker keeps its thread until the kernel
+ * returns its read, but never touches the caller's data again.
+ *
+ * With a zone set, the shooting date of every photo that records its
+ * offset from UTC (OffsetTimeOriginal, or GPS time) is moved to that
+ * zone's local time before it lands in pics, so splitpicsOntime() puts
+ * photos taken while travelling on the day they belong to at home.
+ * Photos without an offset keep their camera time.
+ */
+#if !defined(_INGEST_H_)
+#define _INGEST_H_
+
+#include <vector>
+#include "dirwalk.h"
+#include "metacache.h"
+#include "ratelimit.h"
+#include "tzone.h"
+
+typedef enum {
+    ORDER_NONE = 0,
+    ORDER_INODE,
+    ORDER_EXTENT
+} IO_ORDER;
+
+#define INGEST_DEPTH_ROTATIONAL    1
+#define INGEST_DEPTH_SOLID_STATE   8
+#define INGEST_DEPTH_NETWORK       4   // network and FUSE file systems
+
+// queue depth override for one device
+typedef struct {
+    unsigned long long dev;
+    int depth;
+} IngestDeviceDepth;
+
+// throughput of one device during ingestPhotos()
+typedef struct {
+    unsigned long long dev;
+    int depth;                      // outstanding reads used
+    unsigned long long files;
+    unsigned long long failed;      // createIfdTableArray() < 0
+    unsigned long long bytesRead;   // read from the device (cache hits read none)
+    unsigned long long elapsedUs;   // wall time until the queue drained
+    unsigned long long quarantined; // missed the deadline, retried at the end
+    unsigned long long timedOut;    // missed the retry deadline as well
+} IngestDeviceStats;
+
+typedef struct {
+    IO_ORDER order;
+    MetaCache *cache;                 // optional
+    const IngestDeviceDepth *depths;  // optional overrides
+    size_t depthCount;
+    std::vector<IngestDeviceStats> *deviceStats; // optional, one per device
+    RateLimiter *limiter;             // optional, charged per file parsed
+    unsigned int deadlineMs;          // per file, 0 = none
+    unsigned int retryDeadlineMs;     // for the retry pass, 0 = none
+    std::vector<size_t> *timedOut;    // optional, entries given up on
+    const TimeZone *zone;             // optional, see below
+} IngestOptions;
+
+/**
+ * getDeviceQueueDepth()
+ *
+ * Default number of outstanding reads for a device: from the rotational
+ * flag of the block device behind it, the network depth for network and
+ * FUSE file systems, and the rotational depth when neither is known
+ *
+ * parameters
+ *  [in] dev : st_dev of a file on the device
+ *
+ * return
+ *  INGEST_DEPTH_ROTATIONAL, INGEST_DEPTH_SOLID_STATE or INGEST_DEPTH_NETWORK
+ */
+int getDeviceQueueDepth(unsigned long long dev);
+
+/**
+ * makeWalkEntries()
+ *
+ * Build walker entries for paths that did not come from the walker
+ * (one stat per file)
+ *
+ * parameters
+ *  [in] pics : pictures with filepath set
+ *  [out] entries : one entry per picture, same order
+ */
+void makeWalkEntries(const std::vector<picture>& pics, std::vector<WalkEntry>& entries);
+
+/**
+ * orderForSpindles()
+ *
+ * Split the entries into one queue per device and order each queue
+ *
+ * parameters
+ *  [in] entries : files to read
+ *  [in] order : ordering of each queue
+ *  [out] queues : indices into entries, one vector per device
+ */
+void orderForSpindles(const std::vector<WalkEntry>& entries, IO_ORDER order,
+                      std::vector<std::vector<size_t> >& queues);
+
+/**
+ * ingestPhotos()
+ *
+ * Read the metadata of all entries
+ *
+ * parameters
+ *  [in] entries : files to read
+ *  [in] opt : options (NULL = walk order, no cache)
+ *  [out] pics : one picture per entry, in the order of entries
+ *  [out] status : result of createIfdTableArray() per entry, or
+ *                 ERR_TIMED_OUT (may be NULL)
+ *
+ * return
+ *  number of pictures with a shooting date
+ *
+ * note
+ * Each entry's status also goes to recordExifError(), so a run's
+ * failures can be read by kind with getExifErrorStats().
+ */
+int ingestPhotos(const std::vector<WalkEntry>& entries, const IngestOptions *opt,
+                 std::vector<picture>& pics, std::vector<int> *status);
+
+#endif // _INGEST_H_
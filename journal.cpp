@@ -0,0 +1,590 @@
+/*
+ * Crash-safe move journal
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include "exif.hpp"
+#include "journal.h"
+
+#define REC_BEGIN     0x4E474542 // "BEGN": mode, destRoot
+#define REC_PLAN      0x4E414C50 // "PLAN": src, dir, name
+#define REC_PLAN_END  0x444E4550 // "PEND": all PLAN records are written
+#define REC_DONE      0x454E4F44 // "DONE": result, final name
+#define REC_NAME      0x454D414E // "NAME": name, replacing the planned one
+
+typedef struct {
+    unsigned int type;
+    unsigned int length;
+    unsigned long long index;
+} REC_HEADER;
+
+// state of an open journal during execution
+typedef struct {
+    int fd;
+    int rootFd;
+    std::vector<int> srcFds;   // one per source file system
+    std::mutex lock;           // batch, batched, error
+    std::mutex flushLock;      // one flushBatch() at a time
+    std::string batch;
+    int batched;
+    int error;
+    const std::vector<unsigned long long> *indexMap; // op -> plan index, NULL = same
+} JournalWriter;
+
+static int SyncEvery = JOURNAL_DEFAULT_SYNC_EVERY;
+
+/**
+ * setJournalSyncEvery()
+ *
+ * Number of completions per durable batch
+ */
+void setJournalSyncEvery(int n)
+{
+    SyncEvery = (n > 0) ? n : 1;
+}
+
+static unsigned int crc32(const void *data, size_t len, unsigned int crc)
+{
+    static unsigned int table[256];
+    static int tableReady = 0;
+    const unsigned char *p = (const unsigned char*)data;
+    if (!tableReady) {
+        for (unsigned int i = 0; i < 256; i++) {
+            unsigned int c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        tableReady = 1;
+    }
+    crc = ~crc;
+    while (len--) {
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void appendString(std::string& out, const std::string& s)
+{
+    unsigned int len = (unsigned int)s.size();
+    out.append((const char*)&len, sizeof(len));
+    out.append(s);
+}
+
+static int takeString(const char **p, const char *end, std::string& s)
+{
+    unsigned int len;
+    if (end - *p < (ptrdiff_t)sizeof(len)) {
+        return 0;
+    }
+    memcpy(&len, *p, sizeof(len));
+    *p += sizeof(len);
+    if ((size_t)(end - *p) < len) {
+        return 0;
+    }
+    s.assign(*p, len);
+    *p += len;
+    return 1;
+}
+
+static void appendRecord(std::string& out, unsigned int type,
+                         unsigned long long index, const std::string& payload)
+{
+    REC_HEADER hdr;
+    unsigned int crc;
+    hdr.type = type;
+    hdr.length = (unsigned int)payload.size();
+    hdr.index = index;
+    crc = crc32(&hdr, sizeof(hdr), 0);
+    crc = crc32(payload.data(), payload.size(), crc);
+    out.append((const char*)&hdr, sizeof(hdr));
+    out.append(payload);
+    out.append((const char*)&crc, sizeof(crc));
+}
+
+static int writeAll(int fd, const std::string& data)
+{
+    const char *p = data.data();
+    size_t left = data.size();
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return ERR_WRITE_FILE;
+        }
+        p += n;
+        left -= n;
+    }
+    return 0;
+}
+
+// make the placements durable; a move touches the source file system
+// as well (the unlink)
+static int syncPlacements(JournalWriter *jw)
+{
+    int sts = 0;
+#if defined(__linux__)
+    if (syncfs(jw->rootFd) != 0) {
+        sts = ERR_WRITE_FILE;
+    }
+    for (size_t i = 0; i < jw->srcFds.size(); i++) {
+        if (syncfs(jw->srcFds[i]) != 0) {
+            sts = ERR_WRITE_FILE;
+        }
+    }
+#else
+    sync();
+#endif
+    return sts;
+}
+
+// make the placements durable, then the completions that record them.
+// The batch is taken out under the lock and synced outside it, so the
+// workers keep placing; wait = 0 returns at once if another thread is
+// already flushing (its successor picks the records up).  On failure
+// the records go back to the batch: nothing unsynced is written
+static int flushBatch(JournalWriter *jw, int wait)
+{
+    std::unique_lock<std::mutex> flushing(jw->flushLock, std::defer_lock);
+    std::string batch;
+    int batched, sts;
+    if (wait) {
+        flushing.lock();
+    } else if (!flushing.try_lock()) {
+        return 0;
+    }
+    {
+        std::lock_guard<std::mutex> guard(jw->lock);
+        if (jw->batched == 0) {
+            return 0;
+        }
+        batch.swap(jw->batch);
+        batched = jw->batched;
+        jw->batched = 0;
+    }
+    sts = syncPlacements(jw);
+    if (sts == 0 && (writeAll(jw->fd, batch) != 0 || fdatasync(jw->fd) != 0)) {
+        sts = ERR_WRITE_FILE;
+    }
+    if (sts != 0) {
+        std::lock_guard<std::mutex> guard(jw->lock);
+        jw->batch.insert(0, batch);
+        jw->batched += batched;
+        if (jw->error == 0) {
+            jw->error = sts;
+        }
+    }
+    return sts;
+}
+
+static void onPlaced(size_t index, int result, const char *name, void *userData)
+{
+    JournalWriter *jw = (JournalWriter*)userData;
+    std::string payload;
+    if (result <= 0) {
+        return; // not done; a resume will retry it
+    }
+    payload.append((const char*)&result, sizeof(result));
+    appendString(payload, name);
+    if (jw->indexMap) {
+        index = (size_t)(*jw->indexMap)[index];
+    }
+    int full;
+    {
+        std::lock_guard<std::mutex> guard(jw->lock);
+        appendRecord(jw->batch, REC_DONE, index, payload);
+        // after a failed flush only the final one retries
+        full = (++jw->batched >= SyncEvery && jw->error == 0);
+    }
+    if (full) {
+        flushBatch(jw, 0);
+    }
+}
+
+static std::string dirNameOf(const std::string& path)
+{
+    size_t slash = path.rfind('/');
+    if (slash == std::string::npos) {
+        return ".";
+    }
+    return (slash == 0) ? "/" : path.substr(0, slash);
+}
+
+// one directory fd per file system the sources live on, other than the
+// output's, for flushBatch() to syncfs()
+static void openSourceFileSystems(const std::vector<MaterialiseOp>& ops, int rootFd,
+                                  std::vector<int>& fds)
+{
+    std::set<std::string> dirs;
+    std::set<dev_t> devs;
+    struct stat st;
+    if (fstat(rootFd, &st) == 0) {
+        devs.insert(st.st_dev);
+    }
+    for (size_t k = 0; k < ops.size(); k++) {
+        std::string dir = dirNameOf(ops[k].src);
+        if (!dirs.insert(dir).second || stat(dir.c_str(), &st) != 0 ||
+            !devs.insert(st.st_dev).second) {
+            continue;
+        }
+        int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            fds.push_back(fd);
+        }
+    }
+}
+
+// execute ops under the journal; journal fd is open for appending
+static int runJournaled(int fd, const char *destRoot, const std::vector<MaterialiseOp>& ops,
+                        const std::vector<unsigned long long> *indexMap,
+                        PLACE_MODE mode, int threads, RateLimiter *limiter,
+                        MaterialiseStats *stats)
+{
+    JournalWriter jw;
+    int sts;
+    jw.fd = fd;
+    jw.batched = 0;
+    jw.error = 0;
+    jw.indexMap = indexMap;
+    jw.rootFd = open(destRoot, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (jw.rootFd < 0) {
+        return ERR_WRITE_FILE;
+    }
+    if (mode == PLACE_MOVE) {
+        openSourceFileSystems(ops, jw.rootFd, jw.srcFds);
+    }
+    // names were made unique against the output tree when planning, so a
+    // clash now means someone else wrote there: report, don't rename
+    sts = executeMaterialise(destRoot, ops, mode, threads, 0, limiter, onPlaced, &jw, stats);
+    if (flushBatch(&jw, 1) != 0) {
+        jw.error = ERR_WRITE_FILE;
+    }
+    close(jw.rootFd);
+    for (size_t i = 0; i < jw.srcFds.size(); i++) {
+        close(jw.srcFds[i]);
+    }
+    return (sts != 0) ? sts : jw.error;
+}
+
+// give every op a name that is free in the output tree right now
+static void reserveNames(const char *destRoot, std::vector<MaterialiseOp>& ops)
+{
+    std::set<std::string> taken;
+    int rootFd = open(destRoot, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd < 0) {
+        return;
+    }
+    for (size_t k = 0; k < ops.size(); k++) {
+        if (k == 0 || ops[k].dir != ops[k - 1].dir) {
+            taken.clear();
+            for (size_t j = k; j < ops.size() && ops[j].dir == ops[k].dir; j++) {
+                taken.insert(ops[j].name);
+            }
+        }
+        struct stat st;
+        std::string name = ops[k].name;
+        int n = 1;
+        while (fstatat(rootFd, (ops[k].dir + "/" + name).c_str(), &st,
+                       AT_SYMLINK_NOFOLLOW) == 0) {
+            do {
+                name = getSuffixedName(ops[k].name, n++);
+            } while (taken.count(name));
+        }
+        if (name != ops[k].name) {
+            taken.insert(name);
+            ops[k].name = name;
+        }
+    }
+    close(rootFd);
+}
+
+/**
+ * materialiseGroupsJournaled()
+ *
+ * materialiseGroups() with a move journal
+ */
+int materialiseGroupsJournaled(const std::vector<picsInoneTime>& picsOT, int rule,
+                               const char *destRoot, PLACE_MODE mode, int threads,
+                               RateLimiter *limiter, const char *journalPath,
+                               MaterialiseStats *stats)
+{
+    std::vector<MaterialiseOp> ops;
+    std::string log, payload;
+    unsigned long long dirs = 0;
+    unsigned int m = (unsigned int)mode;
+    int fd, sts;
+
+    if (stats) {
+        memset(stats, 0, sizeof(MaterialiseStats));
+    }
+    fd = open(journalPath, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return (errno == EEXIST) ? ERR_ALREADY_EXIST : ERR_WRITE_FILE;
+    }
+    planMaterialise(picsOT, rule, ops);
+    sts = makeOutputDirs(destRoot, ops, threads, &dirs);
+    if (stats) {
+        stats->dirsCreated = dirs;
+    }
+    if (sts != 0) {
+        close(fd);
+        unlink(journalPath);
+        return sts;
+    }
+    reserveNames(destRoot, ops);
+
+    // the whole plan is durable before the first file moves
+    payload.append((const char*)&m, sizeof(m));
+    appendString(payload, destRoot);
+    appendRecord(log, REC_BEGIN, 0, payload);
+    for (size_t k = 0; k < ops.size(); k++) {
+        payload.clear();
+        appendString(payload, ops[k].src);
+        appendString(payload, ops[k].dir);
+        appendString(payload, ops[k].name);
+        appendRecord(log, REC_PLAN, k, payload);
+    }
+    appendRecord(log, REC_PLAN_END, ops.size(), std::string());
+    if (writeAll(fd, log) != 0 || fsync(fd) != 0) {
+        close(fd);
+        unlink(journalPath);
+        return ERR_WRITE_FILE;
+    }
+    log.clear();
+
+    sts = runJournaled(fd, destRoot, ops, NULL, mode, threads, limiter, stats);
+    close(fd);
+    if (sts == 0) {
+        unlink(journalPath);
+    }
+    return sts;
+}
+
+// whether an existing target is the placement of src: 1 = yes and src
+// is still there, 0 = src is gone (moved, nothing left to lose), -1 = an
+// unrelated file.  Links share the inode; copies keep size and mtime and
+// in PLACE_MOVE only get their name once their data is on disk
+static int isOwnPlacement(const std::string& src, const struct stat& target)
+{
+    struct stat st;
+    if (lstat(src.c_str(), &st) != 0) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    if (st.st_dev == target.st_dev && st.st_ino == target.st_ino) {
+        return 1;
+    }
+    if (S_ISREG(st.st_mode) && S_ISREG(target.st_mode) &&
+        st.st_size == target.st_size &&
+        st.st_mtim.tv_sec == target.st_mtim.tv_sec &&
+        st.st_mtim.tv_nsec == target.st_mtim.tv_nsec) {
+        return 1;
+    }
+    return -1;
+}
+
+/**
+ * resumeMoveJournal()
+ *
+ * Finish the run recorded in a journal
+ */
+int resumeMoveJournal(const char *journalPath, int threads, RateLimiter *limiter,
+                      MaterialiseStats *stats)
+{
+    std::vector<MaterialiseOp> ops, pending;
+    std::vector<unsigned long long> pendingIndex;
+    std::vector<size_t> clashed;
+    std::map<std::string, std::set<std::string> > namesByDir;
+    std::vector<char> done;
+    std::string data, destRoot, log;
+    PLACE_MODE mode = PLACE_MOVE;
+    int fd, rootFd, sts, planned = 0, unsynced = 0;
+    off_t good = 0;
+    char buf[64 * 1024];
+    ssize_t n;
+
+    if (stats) {
+        memset(stats, 0, sizeof(MaterialiseStats));
+    }
+    fd = open(journalPath, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd < 0) {
+        return (errno == ENOENT) ? ERR_NOT_EXIST : ERR_READ_FILE;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        data.append(buf, n);
+    }
+    if (n < 0) {
+        close(fd);
+        return ERR_READ_FILE;
+    }
+
+    // replay
+    const char *p = data.data(), *end = data.data() + data.size();
+    while ((size_t)(end - p) >= sizeof(REC_HEADER) + sizeof(unsigned int)) {
+        REC_HEADER hdr;
+        unsigned int crc;
+        memcpy(&hdr, p, sizeof(hdr));
+        if ((size_t)(end - p) < sizeof(hdr) + hdr.length + sizeof(crc)) {
+            break;
+        }
+        memcpy(&crc, p + sizeof(hdr) + hdr.length, sizeof(crc));
+        if (crc != crc32(p + sizeof(hdr), hdr.length, crc32(&hdr, sizeof(hdr), 0))) {
+            break;
+        }
+        const char *q = p + sizeof(hdr), *qend = q + hdr.length;
+        if (hdr.type == REC_BEGIN && hdr.length >= sizeof(unsigned int)) {
+            unsigned int m;
+            memcpy(&m, q, sizeof(m));
+            q += sizeof(m);
+            mode = (PLACE_MODE)m;
+            takeString(&q, qend, destRoot);
+        } else if (hdr.type == REC_PLAN && hdr.index == ops.size()) {
+            MaterialiseOp op;
+            if (!takeString(&q, qend, op.src) || !takeString(&q, qend, op.dir) ||
+                !takeString(&q, qend, op.name)) {
+                break;
+            }
+            ops.push_back(op);
+        } else if (hdr.type == REC_PLAN_END && hdr.index == ops.size()) {
+            planned = 1;
+            done.assign(ops.size(), 0);
+        } else if (hdr.type == REC_DONE && planned && hdr.index < ops.size()) {
+            std::string name;
+            q += sizeof(int);
+            if (takeString(&q, qend, name)) {
+                ops[hdr.index].name = name;
+            }
+            done[hdr.index] = 1;
+        } else if (hdr.type == REC_NAME && planned && hdr.index < ops.size()) {
+            std::string name;
+            if (takeString(&q, qend, name)) {
+                ops[hdr.index].name = name;
+            }
+        }
+        p += sizeof(hdr) + hdr.length + sizeof(crc);
+        good = p - data.data();
+    }
+    if (!planned || destRoot.empty()) {
+        // nothing was touched before the plan became durable
+        close(fd);
+        unlink(journalPath);
+        return ERR_NOT_EXIST;
+    }
+    // drop a torn tail so new records follow valid ones
+    if ((size_t)good < data.size() && ftruncate(fd, good) != 0) {
+        close(fd);
+        return ERR_WRITE_FILE;
+    }
+    data.clear();
+
+    rootFd = open(destRoot.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd < 0) {
+        close(fd);
+        return ERR_WRITE_FILE;
+    }
+    removeStalePartFiles(destRoot.c_str(), ops);
+    // an op whose target exists may have completed with its DONE record
+    // lost, or the name may have been taken by an unrelated file since
+    // the plan was made; only the first lets the source go
+    for (size_t k = 0; k < ops.size(); k++) {
+        std::string target = ops[k].dir + "/" + ops[k].name;
+        struct stat st;
+        int own;
+        if (done[k]) {
+            continue;
+        }
+        if (fstatat(rootFd, target.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            pending.push_back(ops[k]);
+            pendingIndex.push_back(k);
+            continue;
+        }
+        own = isOwnPlacement(ops[k].src, st);
+        if (own < 0) {
+            clashed.push_back(k);
+            continue;
+        }
+        if (own == 1 && mode == PLACE_MOVE) {
+            // placed, source not yet unlinked: the target's name has to
+            // be durable first, as in placeFile()
+            int dirFd = openat(rootFd, ops[k].dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dirFd < 0 || fsync(dirFd) != 0) {
+                if (dirFd >= 0) {
+                    close(dirFd);
+                }
+                unsynced = 1; // neither done nor retried; the journal is kept
+                continue;
+            }
+            close(dirFd);
+            unlink(ops[k].src.c_str());
+        }
+        std::string payload;
+        int result = PLACED_NONE;
+        payload.append((const char*)&result, sizeof(result));
+        appendString(payload, ops[k].name);
+        appendRecord(log, REC_DONE, k, payload);
+    }
+    // a clashing op gets a free suffixed name, journaled before it is used
+    for (size_t c = 0; c < clashed.size(); c++) {
+        size_t k = clashed[c];
+        std::set<std::string>& taken = namesByDir[ops[k].dir];
+        if (taken.empty()) {
+            for (size_t j = 0; j < ops.size(); j++) {
+                if (ops[j].dir == ops[k].dir) {
+                    taken.insert(ops[j].name);
+                }
+            }
+        }
+        std::string base = ops[k].name, name;
+        struct stat st;
+        int n = 1;
+        do {
+            name = getSuffixedName(base, n++);
+        } while (taken.count(name) ||
+                 fstatat(rootFd, (ops[k].dir + "/" + name).c_str(), &st,
+                         AT_SYMLINK_NOFOLLOW) == 0);
+        taken.insert(name);
+        ops[k].name = name;
+        std::string payload;
+        appendString(payload, name);
+        appendRecord(log, REC_NAME, k, payload);
+        pending.push_back(ops[k]);
+        pendingIndex.push_back(k);
+    }
+    close(rootFd);
+    if (!log.empty() && (writeAll(fd, log) != 0 || fdatasync(fd) != 0)) {
+        close(fd);
+        return ERR_WRITE_FILE;
+    }
+
+    sts = 0;
+    if (!pending.empty()) {
+        unsigned long long dirs = 0;
+        sts = makeOutputDirs(destRoot.c_str(), pending, threads, &dirs);
+        if (stats) {
+            stats->dirsCreated = dirs;
+        }
+        if (sts == 0) {
+            sts = runJournaled(fd, destRoot.c_str(), pending, &pendingIndex,
+                               mode, threads, limiter, stats);
+        }
+    }
+    if (sts == 0 && unsynced) {
+        sts = ERR_WRITE_FILE;
+    }
+    close(fd);
+    if (sts == 0) {
+        unlink(journalPath);
+    }
+    return sts;
+}
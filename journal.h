@@ -0,0 +1,95 @@
+/*
+ * Crash-safe move journal
+ *
+ * An append-only log of the materialisation of one run.  All planned
+ * operations are written and fsync'ed before the first file is touched;
+ * completions are appended in batches, each batch made durable only
+ * after the placements it records (syncfs of the output and source file
+ * systems); a batch whose sync fails is never written.
+ *
+ * If the run dies, resumeMoveJournal() re-reads the log, skips every
+ * completed operation and carries out the rest.  The plan holds the full
+ * source and target paths, so no photo has to be parsed again, and the
+ * cost is proportional to the remaining work.  An operation whose target
+ * exists without a completion counts as done only if the target is the
+ * source's own placement (same inode, or a copy of the same size and
+ * mtime, which is fsync'ed before it gets its name); otherwise it is redone under a free "_n" name, which is
+ * journaled before it is used.
+ *
+ * Record format (host byte order):
+ *   u32 type | u32 payload length | u64 op index | payload | u32 crc32
+ * A torn or corrupt tail is cut off when the journal is reopened.
+ *
+ *   Typical Usage:
+ *
+ *   int sts = resumeMoveJournal("run.journal", 0, NULL, &stats); // after a crash
+ *   if (sts == ERR_NOT_EXIST) {                               // fresh run
+ *       sts = materialiseGroupsJournaled(picsOT, 2, "/out", PLACE_MOVE, 0, NULL,
+ *                                        "run.journal", &stats);
+ *   }
+ */
+#if !defined(_JOURNAL_H_)
+#define _JOURNAL_H_
+
+#include <vector>
+#include "materialise.h"
+
+#define JOURNAL_DEFAULT_SYNC_EVERY 1024
+
+/**
+ * materialiseGroupsJournaled()
+ *
+ * materialiseGroups() with a move journal
+ *
+ * parameters
+ *  [in] picsOT : groups from splitpicsOntime()
+ *  [in] rule : the rule the groups were split with
+ *  [in] destRoot : output directory (created if needed)
+ *  [in] mode : PLACE_MOVE or PLACE_LINK
+ *  [in] threads : worker threads, 0 = hardware concurrency
+ *  [in] limiter : as for executeMaterialise() (NULL = no limit)
+ *  [in] journalPath : journal file, must not exist
+ *  [out] stats : counters per placement method (may be NULL)
+ *
+ * return
+ *   0: OK (the journal is removed)
+ *  -n: error (the journal is kept for resumeMoveJournal())
+ *      ERR_ALREADY_EXIST (a journal of an unfinished run is in the way)
+ *      ERR_WRITE_FILE
+ *      ERR_READ_FILE
+ */
+int materialiseGroupsJournaled(const std::vector<picsInoneTime>& picsOT, int rule,
+                               const char *destRoot, PLACE_MODE mode, int threads,
+                               RateLimiter *limiter, const char *journalPath,
+                               MaterialiseStats *stats);
+
+/**
+ * resumeMoveJournal()
+ *
+ * Finish the run recorded in a journal
+ *
+ * parameters
+ *  [in] journalPath : journal file
+ *  [in] threads : worker threads, 0 = hardware concurrency
+ *  [in] limiter : as for executeMaterialise() (NULL = no limit)
+ *  [out] stats : counters of the operations carried out now (may be NULL)
+ *
+ * return
+ *   0: OK (the journal is removed)
+ *  -n: error
+ *      ERR_NOT_EXIST (no journal, or one whose plan never became
+ *                     durable; nothing was moved and it is removed)
+ *      ERR_WRITE_FILE
+ *      ERR_READ_FILE
+ */
+int resumeMoveJournal(const char *journalPath, int threads, RateLimiter *limiter,
+                      MaterialiseStats *stats);
+
+/**
+ * setJournalSyncEvery()
+ *
+ * Number of completions per durable batch (default JOURNAL_DEFAULT_SYNC_EVERY)
+ */
+void setJournalSyncEvery(int n);
+
+#endif // _JOURNAL_H_
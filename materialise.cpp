@@ -0,0 +1,507 @@
+/*
+ * Output materialisation
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <atomic>
+#include <map>
+#include <set>
+#include "exif.hpp"
+#include "materialise.h"
+#include "parallel.h"
+#include "stagestats.h"
+#include "trace.h"
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+typedef struct {
+    std::atomic<unsigned long long> byMethod[PLACED_COPY + 1];
+    std::atomic<unsigned long long> failed;
+    std::atomic<int> firstError;
+} SharedStats;
+
+static void recordError(SharedStats *ss, int sts)
+{
+    int expected = 0;
+    ss->firstError.compare_exchange_strong(expected, sts);
+}
+
+/**
+ * getGroupDirName()
+ *
+ * Relative directory of a group, e.g. "2016/01" for rule 1
+ */
+std::string getGroupDirName(const std::array<int, 6>& date, int rule)
+{
+    char buf[64];
+    int len;
+    if (rule < 0) {
+        rule = 0;
+    } else if (rule > 5) {
+        rule = 5;
+    }
+    len = snprintf(buf, sizeof(buf), "%04d", date[0]);
+    for (int i = 1; i <= rule; i++) {
+        len += snprintf(buf + len, sizeof(buf) - len, "/%02d", date[i]);
+    }
+    return std::string(buf, len);
+}
+
+// reflink or copy the data of srcFd into dstFd
+static int copyData(int srcFd, int dstFd)
+{
+    char buf[64 * 1024];
+    ssize_t n;
+#ifdef FICLONE
+    if (ioctl(dstFd, FICLONE, srcFd) == 0) {
+        return PLACED_REFLINK;
+    }
+#endif
+#ifdef SYS_copy_file_range
+    // in-kernel copy, may still share extents on NFS / CIFS servers
+    for (;;) {
+        n = syscall(SYS_copy_file_range, srcFd, NULL, dstFd, NULL, 1 << 30, 0);
+        if (n == 0) {
+            return PLACED_COPY;
+        }
+        if (n < 0) {
+            break;
+        }
+    }
+    if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) {
+        return ERR_WRITE_FILE;
+    }
+    if (lseek(srcFd, 0, SEEK_SET) != 0 || lseek(dstFd, 0, SEEK_SET) != 0 ||
+        ftruncate(dstFd, 0) != 0) {
+        return ERR_WRITE_FILE;
+    }
+#endif
+    while ((n = read(srcFd, buf, sizeof(buf))) > 0) {
+        char *p = buf;
+        while (n > 0) {
+            ssize_t w = write(dstFd, p, n);
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return ERR_WRITE_FILE;
+            }
+            p += w;
+            n -= w;
+        }
+    }
+    return (n < 0) ? ERR_READ_FILE : PLACED_COPY;
+}
+
+// create dirFd/name as a reflink or copy of src; the data goes to a
+// ".name.part" file and is on disk before the name appears, so a crash
+// never leaves a truncated photo under its final name
+static int cloneInto(const char *src, int dirFd, const char *name)
+{
+    struct stat st;
+    int srcFd, dstFd, sts;
+    std::string part = std::string(".") + name + ".part";
+    srcFd = open(src, O_RDONLY | O_CLOEXEC);
+    if (srcFd < 0 || fstat(srcFd, &st) != 0) {
+        if (srcFd >= 0) {
+            close(srcFd);
+        }
+        return ERR_READ_FILE;
+    }
+    dstFd = openat(dirFd, part.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   st.st_mode & 07777);
+    if (dstFd < 0) {
+        close(srcFd);
+        return ERR_WRITE_FILE;
+    }
+    sts = copyData(srcFd, dstFd);
+    if (sts > 0) {
+        // keep the time stamps, which also lets a journal resume tell
+        // its own copy from an unrelated file (resumeMoveJournal)
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        futimens(dstFd, times);
+    }
+    if (sts > 0 && fsync(dstFd) != 0) {
+        sts = ERR_WRITE_FILE;
+    }
+    if (close(dstFd) != 0 && sts > 0) {
+        sts = ERR_WRITE_FILE;
+    }
+    close(srcFd);
+    if (sts > 0 && linkat(dirFd, part.c_str(), dirFd, name, 0) != 0) {
+        sts = (errno == EEXIST) ? ERR_ALREADY_EXIST : ERR_WRITE_FILE;
+    }
+    unlinkat(dirFd, part.c_str(), 0);
+    return sts;
+}
+
+// second half of a move that had to create the new name first: the name
+// must survive a crash that the unlink of src does.  If either step fails
+// the new name is taken back, so an error always leaves src where it was
+static int dropSource(const char *src, int dirFd, const char *name, int placed)
+{
+    if (fsync(dirFd) == 0 && (unlink(src) == 0 || errno == ENOENT)) {
+        return placed;
+    }
+    unlinkat(dirFd, name, 0);
+    return ERR_WRITE_FILE;
+}
+
+/**
+ * placeFile()
+ *
+ * Place a single file into a directory
+ */
+int placeFile(const char *src, int dirFd, const char *name, PLACE_MODE mode)
+{
+    int sts;
+    if (mode == PLACE_MOVE) {
+#ifdef SYS_renameat2
+        if (syscall(SYS_renameat2, AT_FDCWD, src, dirFd, name, RENAME_NOREPLACE) == 0) {
+            return PLACED_RENAME;
+        }
+#else
+        errno = ENOSYS;
+#endif
+        if (errno == EEXIST) {
+            return ERR_ALREADY_EXIST;
+        }
+        if (errno == EINVAL || errno == ENOSYS) {
+            // the file system can't do RENAME_NOREPLACE: link + unlink is
+            // the same operation without the risk of replacing a file
+            if (linkat(AT_FDCWD, src, dirFd, name, 0) == 0) {
+                return dropSource(src, dirFd, name, PLACED_RENAME);
+            }
+            if (errno == EEXIST) {
+                return ERR_ALREADY_EXIST;
+            }
+        }
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+            errno != EPERM && errno != EMLINK) {
+            return (errno == ENOENT) ? ERR_READ_FILE : ERR_WRITE_FILE;
+        }
+        sts = cloneInto(src, dirFd, name);
+        return (sts > 0) ? dropSource(src, dirFd, name, sts) : sts;
+    }
+    if (linkat(AT_FDCWD, src, dirFd, name, 0) == 0) {
+        return PLACED_HARDLINK;
+    }
+    if (errno == EEXIST) {
+        return ERR_ALREADY_EXIST;
+    }
+    if (errno == ENOENT) {
+        return ERR_READ_FILE;
+    }
+    // EXDEV, EPERM (no hardlinks on this fs), EMLINK ...
+    return cloneInto(src, dirFd, name);
+}
+
+/**
+ * getSuffixedName()
+ *
+ * "IMG.JPG" -> "IMG_n.JPG"
+ */
+std::string getSuffixedName(const std::string& name, int n)
+{
+    char num[16];
+    size_t dot = name.rfind('.');
+    snprintf(num, sizeof(num), "_%d", n);
+    if (dot == std::string::npos || dot == 0) {
+        return name + num;
+    }
+    return name.substr(0, dot) + num + name.substr(dot);
+}
+
+static std::string baseNameOf(const picture& pic)
+{
+    if (!pic.filename.empty()) {
+        return pic.filename;
+    }
+    size_t slash = pic.filepath.rfind('/');
+    return (slash == std::string::npos) ? pic.filepath : pic.filepath.substr(slash + 1);
+}
+
+// mkdir -p for the output root
+static int makeRoot(const char *destRoot)
+{
+    std::string path(destRoot);
+    for (size_t i = 1; i <= path.size(); i++) {
+        if (i == path.size() || path[i] == '/') {
+            std::string part = path.substr(0, i);
+            if (mkdir(part.c_str(), 0755) != 0 && errno != EEXIST) {
+                return ERR_WRITE_FILE;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * planMaterialise()
+ *
+ * Turn the groups into a list of placement operations
+ */
+void planMaterialise(const std::vector<picsInoneTime>& picsOT, int rule,
+                     std::vector<MaterialiseOp>& ops)
+{
+    ops.clear();
+    for (size_t g = 0; g < picsOT.size(); g++) {
+        const std::vector<picture>& pics = picsOT[g].pic;
+        std::map<std::string, int> used;
+        if (pics.empty()) {
+            continue;
+        }
+        std::string dir = getGroupDirName(pics[0].date, rule);
+        for (size_t i = 0; i < pics.size(); i++) {
+            MaterialiseOp op;
+            std::string name = baseNameOf(pics[i]);
+            int n = used[name]++;
+            op.src = pics[i].filepath;
+            op.dir = dir;
+            op.name = (n == 0) ? name : getSuffixedName(name, n);
+            ops.push_back(op);
+        }
+    }
+}
+
+/**
+ * makeOutputDirs()
+ *
+ * Create the output root and every directory the operations need
+ */
+int makeOutputDirs(const char *destRoot, const std::vector<MaterialiseOp>& ops,
+                   int threads, unsigned long long *dirsCreated)
+{
+    std::map<int, std::vector<std::string> > byDepth;
+    std::set<std::string> seen;
+    std::atomic<unsigned long long> created(0);
+    std::atomic<int> firstError(0);
+    int rootFd, sts;
+
+    sts = makeRoot(destRoot);
+    if (sts != 0) {
+        return sts;
+    }
+    // every directory and parent once, bucketed by depth
+    for (size_t k = 0; k < ops.size(); k++) {
+        const std::string& dir = ops[k].dir;
+        if (k > 0 && dir == ops[k - 1].dir) {
+            continue;
+        }
+        int depth = 0;
+        for (size_t i = 0; i <= dir.size(); i++) {
+            if (i == dir.size() || dir[i] == '/') {
+                std::string part = dir.substr(0, i);
+                if (seen.insert(part).second) {
+                    byDepth[depth].push_back(part);
+                }
+                depth++;
+            }
+        }
+    }
+    rootFd = open(destRoot, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd < 0) {
+        return ERR_WRITE_FILE;
+    }
+    // parents before children; siblings in parallel
+    std::map<int, std::vector<std::string> >::iterator it;
+    for (it = byDepth.begin(); it != byDepth.end() && firstError == 0; ++it) {
+        const std::vector<std::string>& level = it->second;
+        runParallel(threads, level.size(), [&](size_t i) {
+            if (mkdirat(rootFd, level[i].c_str(), 0755) == 0) {
+                created++;
+            } else if (errno != EEXIST) {
+                firstError = ERR_WRITE_FILE;
+            }
+        });
+    }
+    close(rootFd);
+    if (dirsCreated) {
+        *dirsCreated = created;
+    }
+    return firstError;
+}
+
+// remove the ".name.part" files a crash left behind in dirFd for the
+// names of ops[begin, end), which all go to that directory.  Only names
+// of these ops: a ".part" of a run into the same directory with other
+// names may still be in use
+static void sweepPartFiles(int dirFd, const std::vector<MaterialiseOp>& ops,
+                           size_t begin, size_t end)
+{
+    std::set<std::string> names;
+    struct dirent *dent;
+    int fd = dup(dirFd);
+    DIR *dp = (fd >= 0) ? fdopendir(fd) : NULL;
+    if (dp == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    for (size_t k = begin; k < end; k++) {
+        names.insert(ops[k].name);
+    }
+    while ((dent = readdir(dp)) != NULL) {
+        size_t len = strlen(dent->d_name);
+        if (len > 6 && dent->d_name[0] == '.' &&
+            strcmp(dent->d_name + len - 5, ".part") == 0 &&
+            names.count(std::string(dent->d_name + 1, len - 6))) {
+            unlinkat(dirFd, dent->d_name, 0);
+        }
+    }
+    closedir(dp);
+}
+
+/**
+ * removeStalePartFiles()
+ *
+ * Remove the temporaries of the operations a crash left behind
+ */
+int removeStalePartFiles(const char *destRoot, const std::vector<MaterialiseOp>& ops)
+{
+    int rootFd = open(destRoot, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd < 0) {
+        return ERR_WRITE_FILE;
+    }
+    for (size_t begin = 0, end; begin < ops.size(); begin = end) {
+        for (end = begin + 1; end < ops.size() && ops[end].dir == ops[begin].dir; end++) {
+        }
+        int dirFd = openat(rootFd, ops[begin].dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirFd >= 0) {
+            sweepPartFiles(dirFd, ops, begin, end);
+            close(dirFd);
+        }
+    }
+    close(rootFd);
+    return 0;
+}
+
+/**
+ * executeMaterialise()
+ *
+ * Carry out placement operations
+ */
+int executeMaterialise(const char *destRoot, const std::vector<MaterialiseOp>& ops,
+                       PLACE_MODE mode, int threads, int suffixOnClash,
+                       RateLimiter *limiter, PlacedCallback callback, void *userData,
+                       MaterialiseStats *stats)
+{
+    SharedStats ss;
+    std::vector<size_t> runs; // start index of each run of ops sharing a directory
+    int rootFd;
+
+    for (int i = 0; i <= PLACED_COPY; i++) {
+        ss.byMethod[i] = 0;
+    }
+    ss.failed = 0;
+    ss.firstError = 0;
+
+    for (size_t k = 0; k < ops.size(); k++) {
+        if (k == 0 || ops[k].dir != ops[k - 1].dir) {
+            runs.push_back(k);
+        }
+    }
+    runs.push_back(ops.size());
+    TRACE_SCOPE("materialise");
+
+    rootFd = open(destRoot, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd < 0) {
+        return ERR_WRITE_FILE;
+    }
+    runParallel(threads, runs.size() - 1, [&](size_t r) {
+        size_t begin = runs[r], end = runs[r + 1];
+        int dirFd = openat(rootFd, ops[begin].dir.c_str(),
+                           O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirFd < 0) {
+            ss.failed += end - begin;
+            recordError(&ss, ERR_WRITE_FILE);
+            for (size_t k = begin; k < end && callback; k++) {
+                callback(k, ERR_WRITE_FILE, NULL, userData);
+            }
+            return;
+        }
+        sweepPartFiles(dirFd, ops, begin, end);
+        for (size_t k = begin; k < end; k++) {
+            const MaterialiseOp& op = ops[k];
+            std::string name = op.name;
+            STAGE_DECL(t0);
+            STAGE_BEGIN(t0);
+            TRACE_DECL(span);
+            TRACE_BEGIN(span);
+            int sts = placeFile(op.src.c_str(), dirFd, name.c_str(), mode);
+            // never replace: a file left by an earlier run gets a suffix
+            for (int n = 1; suffixOnClash && sts == ERR_ALREADY_EXIST && n < 1000; n++) {
+                name = getSuffixedName(op.name, n);
+                sts = placeFile(op.src.c_str(), dirFd, name.c_str(), mode);
+            }
+            STAGE_END(t0, STAGE_MATERIALISE, 1);
+            TRACE_END_ARG(span, "place", op.src.c_str());
+            if (limiter) {
+                struct stat st;
+                unsigned long long bytes = 0;
+                if (sts == PLACED_COPY && fstatat(dirFd, name.c_str(), &st, 0) == 0) {
+                    bytes = (unsigned long long)st.st_size;
+                }
+                chargeRateLimit(limiter, bytes, 1);
+            }
+            if (sts > 0) {
+                ss.byMethod[sts]++;
+            } else {
+                ss.failed++;
+                recordError(&ss, sts);
+            }
+            if (callback) {
+                callback(k, sts, name.c_str(), userData);
+            }
+        }
+        close(dirFd);
+    });
+    close(rootFd);
+
+    if (stats) {
+        stats->renamed += ss.byMethod[PLACED_RENAME];
+        stats->hardlinked += ss.byMethod[PLACED_HARDLINK];
+        stats->reflinked += ss.byMethod[PLACED_REFLINK];
+        stats->copied += ss.byMethod[PLACED_COPY];
+        stats->failed += ss.failed;
+    }
+    return ss.firstError.load();
+}
+
+/**
+ * materialiseGroups()
+ *
+ * Write the groups to disk below destRoot
+ */
+int materialiseGroups(const std::vector<picsInoneTime>& picsOT, int rule,
+                      const char *destRoot, PLACE_MODE mode, int threads,
+                      RateLimiter *limiter, MaterialiseStats *stats)
+{
+    std::vector<MaterialiseOp> ops;
+    unsigned long long dirs = 0;
+    int sts;
+
+    if (stats) {
+        memset(stats, 0, sizeof(MaterialiseStats));
+    }
+    planMaterialise(picsOT, rule, ops);
+    sts = makeOutputDirs(destRoot, ops, threads, &dirs);
+    if (stats) {
+        stats->dirsCreated = dirs;
+    }
+    if (sts != 0) {
+        return sts;
+    }
+    return executeMaterialise(destRoot, ops, mode, threads, 1, limiter, NULL, NULL, stats);
+}
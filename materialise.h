@@ -0,0 +1,202 @@
+/*
+ * Output materialisation
+ *
+ * Writes the groups produced by splitpicsOntime() to disk as
+ *   destRoot/YYYY[/MM[/DD[/hh[/mm[/ss]]]]]/filename
+ * placing each file with the cheapest operation the file systems allow:
+ *
+ *   PLACE_MOVE : renameat2(RENAME_NOREPLACE) on the same file system,
+ *                otherwise reflink / copy into place and unlink the source
+ *                once the copy and its directory entry are fsync'ed
+ *   PLACE_LINK : the source stays; hardlink, otherwise FICLONE reflink,
+ *                otherwise a byte copy as the last resort
+ *
+ * Group directories (and their parents) are created once each, one
+ * directory level at a time with the directories of a level created in
+ * parallel.  Name clashes inside a group get a "_n" suffix, existing
+ * files are never replaced.
+ */
+#if !defined(_MATERIALISE_H_)
+#define _MATERIALISE_H_
+
+#include <string>
+#include <vector>
+#include "fastCluster.h"
+#include "ratelimit.h"
+
+typedef enum {
+    PLACE_MOVE = 0,
+    PLACE_LINK
+} PLACE_MODE;
+
+// how a file ended up in its group directory
+typedef enum {
+    PLACED_NONE = 0,
+    PLACED_RENAME,
+    PLACED_HARDLINK,
+    PLACED_REFLINK,
+    PLACED_COPY
+} PLACE_METHOD;
+
+// one file to place: destRoot/dir/name <- src
+typedef struct {
+    std::string src;
+    std::string dir;   // group directory relative to destRoot
+    std::string name;
+} MaterialiseOp;
+
+// called after each operation with its index in the op list, the result
+// of placeFile() and the name the file was finally placed under
+typedef void (*PlacedCallback)(size_t index, int result, const char *name,
+                               void *userData);
+
+typedef struct {
+    unsigned long long renamed;
+    unsigned long long hardlinked;
+    unsigned long long reflinked;
+    unsigned long long copied;
+    unsigned long long failed;
+    unsigned long long dirsCreated;
+} MaterialiseStats;
+
+/**
+ * getGroupDirName()
+ *
+ * Relative directory of a group, e.g. "2016/01" for rule 1
+ *
+ * parameters
+ *  [in] date : date of any photo in the group
+ *  [in] rule : split rule as for splitpicsOntime()
+ */
+std::string getGroupDirName(const std::array<int, 6>& date, int rule);
+
+/**
+ * getSuffixedName()
+ *
+ * Name used when a file name is taken: "IMG.JPG" -> "IMG_n.JPG"
+ */
+std::string getSuffixedName(const std::string& name, int n);
+
+/**
+ * placeFile()
+ *
+ * Place a single file into a directory
+ *
+ * parameters
+ *  [in] src : source path
+ *  [in] dirFd : target directory
+ *  [in] name : target file name, must not exist
+ *  [in] mode : PLACE_MOVE or PLACE_LINK
+ *
+ * return
+ *   n: PLACE_METHOD used
+ *  -n: error, nothing was placed and src is where it was
+ *      ERR_ALREADY_EXIST
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ */
+int placeFile(const char *src, int dirFd, const char *name, PLACE_MODE mode);
+
+/**
+ * planMaterialise()
+ *
+ * Turn the groups into a list of placement operations; operations of
+ * one group are adjacent and names are unique within each group
+ *
+ * parameters
+ *  [in] picsOT : groups from splitpicsOntime()
+ *  [in] rule : the rule the groups were split with
+ *  [out] ops : the operations
+ */
+void planMaterialise(const std::vector<picsInoneTime>& picsOT, int rule,
+                     std::vector<MaterialiseOp>& ops);
+
+/**
+ * makeOutputDirs()
+ *
+ * Create destRoot and every directory the operations need, each once
+ *
+ * parameters
+ *  [in] destRoot : output directory
+ *  [in] ops : planned operations
+ *  [in] threads : worker threads, 0 = hardware concurrency
+ *  [out] dirsCreated : number of directories that did not exist (may be NULL)
+ *
+ * return
+ *   0: OK
+ *  ERR_WRITE_FILE
+ */
+int makeOutputDirs(const char *destRoot, const std::vector<MaterialiseOp>& ops,
+                   int threads, unsigned long long *dirsCreated);
+
+/**
+ * removeStalePartFiles()
+ *
+ * Remove the ".name.part" temporaries a crash left behind for the names
+ * of the operations.  executeMaterialise() does this for every directory
+ * it places into; a resume also needs it for operations it won't redo
+ *
+ * parameters
+ *  [in] destRoot : output directory
+ *  [in] ops : operations, as ordered by planMaterialise()
+ *
+ * return
+ *   0: OK
+ *  ERR_WRITE_FILE : destRoot can't be opened
+ */
+int removeStalePartFiles(const char *destRoot, const std::vector<MaterialiseOp>& ops);
+
+/**
+ * executeMaterialise()
+ *
+ * Carry out placement operations; the directories must exist
+ *
+ * parameters
+ *  [in] destRoot : output directory
+ *  [in] ops : operations, as ordered by planMaterialise()
+ *  [in] mode : PLACE_MOVE or PLACE_LINK
+ *  [in] threads : worker threads, 0 = hardware concurrency
+ *  [in] suffixOnClash : 1 = retry with a "_n" name if the target exists,
+ *                       0 = report ERR_ALREADY_EXIST
+ *  [in] limiter : charged one file per operation and the file size for
+ *                 byte copies; renames, links and reflinks move no data
+ *                 (NULL = no limit)
+ *  [in] callback : called after every operation (may be NULL)
+ *  [in] userData : passed through to the callback
+ *  [in,out] stats : counters are added to (may be NULL)
+ *
+ * return
+ *   0: OK
+ *  -n: the first error seen
+ */
+int executeMaterialise(const char *destRoot, const std::vector<MaterialiseOp>& ops,
+                       PLACE_MODE mode, int threads, int suffixOnClash,
+                       RateLimiter *limiter, PlacedCallback callback, void *userData,
+                       MaterialiseStats *stats);
+
+/**
+ * materialiseGroups()
+ *
+ * Write the groups to disk below destRoot
+ *
+ * parameters
+ *  [in] picsOT : groups from splitpicsOntime()
+ *  [in] rule : the rule the groups were split with
+ *  [in] destRoot : output directory (created if needed)
+ *  [in] mode : PLACE_MOVE or PLACE_LINK
+ *  [in] threads : worker threads, 0 = hardware concurrency
+ *  [in] limiter : as for executeMaterialise() (NULL = no limit)
+ *  [out] stats : counters per placement method (may be NULL)
+ *
+ * return
+ *   0: OK
+ *  -n: error (the first one seen; the remaining files are still placed)
+ *      ERR_WRITE_FILE
+ *      ERR_READ_FILE
+ *      ERR_ALREADY_EXIST
+ */
+int materialiseGroups(const std::vector<picsInoneTime>& picsOT, int rule,
+                      const char *destRoot, PLACE_MODE mode, int threads,
+                      RateLimiter *limiter, MaterialiseStats *stats);
+
+#endif // _MATERIALISE_H_
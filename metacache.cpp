@@ -0,0 +1,418 @@
+/*
+ * Persistent metadata cache
+ *
+ * File layout:
+ *   CACHE_HEADER
+ *   CACHE_SLOT[slotCount]   (slotCount is a power of 2)
+ *
+ * Slots are addressed by a hash of (dev, ino) with linear probing.
+ * A slot whose (dev, ino) matches but whose size or mtime differ is
+ * a stale entry of a modified file and is overwritten in place.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mutex>
+#include <new>
+#include <vector>
+#include "exif.hpp"
+#include "metacache.h"
+#include "tzone.h"
+#include "stagestats.h"
+
+#define CACHE_MAGIC          "EXMCACHE"
+#define CACHE_VERSION        2
+#define CACHE_DEFAULT_SLOTS  (1 << 16)
+#define CACHE_MAX_LOAD_PCT   70
+
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int slotCount;
+    unsigned int used;
+    unsigned int reserved;
+} CACHE_HEADER;
+
+typedef struct {
+    unsigned long long dev;
+    unsigned long long ino;
+    unsigned long long size;
+    unsigned long long mtimeNs;
+    unsigned long long dateKey;
+    short orientation;
+    short status;
+    short utcOffset;
+    unsigned short reserved;
+    unsigned int inUse;
+} CACHE_SLOT;
+
+struct _metaCache {
+    int fd;
+    void *map;
+    size_t mapLen;
+    CACHE_HEADER *hdr;
+    CACHE_SLOT *slots;
+    unsigned long long hits;
+    unsigned long long misses;
+    std::mutex lock; // lookups and stores may come from parser threads
+};
+
+static unsigned long long mtimeNsOf(const struct stat *st)
+{
+#if defined(__APPLE__)
+    return (unsigned long long)st->st_mtimespec.tv_sec * 1000000000ULL +
+           st->st_mtimespec.tv_nsec;
+#else
+    return (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL +
+           st->st_mtim.tv_nsec;
+#endif
+}
+
+static unsigned long long hashKey(unsigned long long dev, unsigned long long ino)
+{
+    // splitmix64 finaliser over the combined key
+    unsigned long long x = ino ^ (dev * 0x9E3779B97F4A7C15ULL);
+    x ^= x >> 30; x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27; x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static size_t mapLengthOf(unsigned int slotCount)
+{
+    return sizeof(CACHE_HEADER) + sizeof(CACHE_SLOT) * (size_t)slotCount;
+}
+
+// map the file with the given slot count, initialising it if requested;
+// on failure the cache is left as it was
+static int mapCache(MetaCache *cache, unsigned int slotCount, int initialise)
+{
+    size_t len = mapLengthOf(slotCount);
+    if (initialise) {
+        // allocate the blocks now: a full disk is an error here rather
+        // than a SIGBUS on the first store into a hole of the mapping.
+        // Only a file system without fallocate support is let through
+        int err;
+        if (ftruncate(cache->fd, (off_t)len) != 0) {
+            return ERR_WRITE_FILE;
+        }
+        err = posix_fallocate(cache->fd, 0, (off_t)len);
+        if (err != 0 && err != EOPNOTSUPP && err != EINVAL) {
+            return ERR_WRITE_FILE;
+        }
+    }
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+    if (p == MAP_FAILED) {
+        return ERR_MEMALLOC;
+    }
+    cache->map = p;
+    cache->mapLen = len;
+    cache->hdr = (CACHE_HEADER*)p;
+    cache->slots = (CACHE_SLOT*)((char*)p + sizeof(CACHE_HEADER));
+    if (initialise) {
+        memset(p, 0, len);
+        memcpy(cache->hdr->magic, CACHE_MAGIC, sizeof(cache->hdr->magic));
+        cache->hdr->version = CACHE_VERSION;
+        cache->hdr->slotCount = slotCount;
+        cache->hdr->used = 0;
+    }
+    return 0;
+}
+
+static void unmapCache(MetaCache *cache)
+{
+    if (cache->map) {
+        munmap(cache->map, cache->mapLen);
+        cache->map = NULL;
+        cache->hdr = NULL;
+        cache->slots = NULL;
+    }
+}
+
+// find the slot of (dev, ino), or the empty slot where it belongs
+static CACHE_SLOT *probe(CACHE_SLOT *slots, unsigned int slotCount,
+                         unsigned long long dev, unsigned long long ino)
+{
+    unsigned int mask = slotCount - 1;
+    unsigned int i = (unsigned int)hashKey(dev, ino) & mask;
+    for (;;) {
+        CACHE_SLOT *s = &slots[i];
+        if (!s->inUse || (s->dev == dev && s->ino == ino)) {
+            return s;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+// double the slot array and rehash all entries; on failure the cache
+// keeps its old mapping and contents
+static int growCache(MetaCache *cache)
+{
+    unsigned int oldCount = cache->hdr->slotCount;
+    unsigned int newCount = oldCount * 2;
+    void *oldMap = cache->map;
+    size_t oldLen = cache->mapLen;
+    std::vector<CACHE_SLOT> live;
+    live.reserve(cache->hdr->used);
+    for (unsigned int i = 0; i < oldCount; i++) {
+        if (cache->slots[i].inUse) {
+            live.push_back(cache->slots[i]);
+        }
+    }
+    int sts = mapCache(cache, newCount, 1);
+    if (sts != 0) {
+        // the old slots are untouched; shrink the file back to match them.
+        // If that fails the file no longer matches its header, and the
+        // next openMetaCache() would start it afresh: say so
+        if (ftruncate(cache->fd, (off_t)oldLen) != 0) {
+            sts = ERR_WRITE_FILE;
+        }
+        return sts;
+    }
+    munmap(oldMap, oldLen);
+    for (size_t i = 0; i < live.size(); i++) {
+        *probe(cache->slots, newCount, live[i].dev, live[i].ino) = live[i];
+    }
+    cache->hdr->used = (unsigned int)live.size();
+    return 0;
+}
+
+/**
+ * openMetaCache()
+ *
+ * Open (or create) the cache file and map it into memory
+ */
+MetaCache *openMetaCache(const char *path, unsigned int initialSlots, int *pResult)
+{
+    struct stat st;
+    CACHE_HEADER hdr;
+    unsigned int slots = CACHE_DEFAULT_SLOTS;
+    int sts, valid = 0;
+    MetaCache *cache = new (std::nothrow) MetaCache();
+    if (!cache) {
+        if (pResult) {
+            *pResult = ERR_MEMALLOC;
+        }
+        return NULL;
+    }
+    // round the requested slot count up to a power of 2
+    if (initialSlots > 0) {
+        slots = 1;
+        while (slots < initialSlots) {
+            slots <<= 1;
+        }
+    }
+    cache->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (cache->fd < 0) {
+        sts = ERR_READ_FILE;
+        goto ERR;
+    }
+    // check whether the existing file is usable as is
+    if (fstat(cache->fd, &st) == 0 && (size_t)st.st_size >= sizeof(hdr) &&
+        pread(cache->fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr) &&
+        memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) == 0 &&
+        hdr.version == CACHE_VERSION &&
+        hdr.slotCount > 0 && (hdr.slotCount & (hdr.slotCount - 1)) == 0 &&
+        (size_t)st.st_size == mapLengthOf(hdr.slotCount)) {
+        valid = 1;
+        slots = hdr.slotCount;
+    }
+    sts = mapCache(cache, slots, !valid);
+    if (sts != 0) {
+        goto ERR;
+    }
+    if (pResult) {
+        *pResult = 0;
+    }
+    return cache;
+ERR:
+    if (cache->fd >= 0) {
+        close(cache->fd);
+    }
+    delete cache;
+    if (pResult) {
+        *pResult = sts;
+    }
+    return NULL;
+}
+
+/**
+ * closeMetaCache()
+ *
+ * Flush and unmap the cache
+ */
+void closeMetaCache(MetaCache *cache)
+{
+    if (!cache) {
+        return;
+    }
+    if (cache->map) {
+        msync(cache->map, cache->mapLen, MS_SYNC);
+    }
+    unmapCache(cache);
+    close(cache->fd);
+    delete cache;
+}
+
+/**
+ * lookupMetaCache()
+ *
+ * Look up the record of a file
+ */
+int lookupMetaCache(MetaCache *cache, const struct stat *st, MetaCacheRecord *rec)
+{
+    CACHE_SLOT *s;
+    if (!cache || !st || !rec) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> guard(cache->lock);
+    s = probe(cache->slots, cache->hdr->slotCount,
+              (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+    if (!s->inUse ||
+        s->size != (unsigned long long)st->st_size ||
+        s->mtimeNs != mtimeNsOf(st)) {
+        cache->misses++;
+        return 0;
+    }
+    rec->dateKey = s->dateKey;
+    rec->orientation = s->orientation;
+    rec->status = s->status;
+    rec->utcOffset = s->utcOffset;
+    cache->hits++;
+    return 1;
+}
+
+/**
+ * storeMetaCache()
+ *
+ * Insert or update the record of a file
+ */
+int storeMetaCache(MetaCache *cache, const struct stat *st, const MetaCacheRecord *rec)
+{
+    CACHE_SLOT *s;
+    unsigned long long dev, ino;
+    if (!cache || !st || !rec) {
+        return ERR_INVALID_POINTER;
+    }
+    dev = (unsigned long long)st->st_dev;
+    ino = (unsigned long long)st->st_ino;
+    std::lock_guard<std::mutex> guard(cache->lock);
+    s = probe(cache->slots, cache->hdr->slotCount, dev, ino);
+    if (!s->inUse) {
+        // keep the load factor bounded before taking a new slot
+        if ((unsigned long long)(cache->hdr->used + 1) * 100 >
+            (unsigned long long)cache->hdr->slotCount * CACHE_MAX_LOAD_PCT) {
+            int sts = growCache(cache);
+            if (sts != 0) {
+                return sts;
+            }
+            s = probe(cache->slots, cache->hdr->slotCount, dev, ino);
+        }
+        cache->hdr->used++;
+    }
+    s->dev = dev;
+    s->ino = ino;
+    s->size = (unsigned long long)st->st_size;
+    s->mtimeNs = mtimeNsOf(st);
+    s->dateKey = rec->dateKey;
+    s->orientation = rec->orientation;
+    s->status = rec->status;
+    s->utcOffset = rec->utcOffset;
+    s->inUse = 1;
+    return 0;
+}
+
+/**
+ * readImgMeta()
+ *
+ * Parse the date and the orientation of a photo in a single pass
+ */
+int readImgMeta(const char *path, MetaCacheRecord *rec)
+{
+    void **ifdArray;
+    const TagNodeInfo *tag;
+    int result;
+    STAGE_DECL(t0);
+    std::array<int, 6> date;
+
+    rec->dateKey = DATEKEY_NONE;
+    rec->orientation = NOT_AVAILABLE;
+    rec->utcOffset = UTC_OFFSET_UNKNOWN;
+    ifdArray = createIfdTableArray(path, &result);
+    rec->status = (short)result;
+    if (!ifdArray) {
+        return result;
+    }
+    STAGE_BEGIN(t0);
+    tag = findTagInfo(ifdArray, IFD_EXIF, TAG_DateTimeOriginal);
+    if (tag && !tag->error && parseExifDate((const char*)tag->byteData, tag->count, date)) {
+        rec->dateKey = packDateKey(date);
+    }
+    STAGE_END(t0, STAGE_DATE_PARSE, 1);
+    tag = findTagInfo(ifdArray, IFD_0TH, TAG_Orientation);
+    if (tag && !tag->error && tag->numData) {
+        rec->orientation = (short)tag->numData[0];
+    }
+    rec->utcOffset = (short)readUtcOffset(ifdArray);
+    freeIfdTableArray(ifdArray);
+    return result;
+}
+
+/**
+ * getImgMetaCached()
+ *
+ * Get the metadata of a photo, from the cache when the file is unchanged,
+ * otherwise by parsing it and storing the result
+ */
+int getImgMetaCached(MetaCache *cache, const char *path, MetaCacheRecord *rec)
+{
+    struct stat st;
+    int result;
+    if (!cache) {
+        return readImgMeta(path, rec);
+    }
+    if (stat(path, &st) != 0) {
+        rec->dateKey = DATEKEY_NONE;
+        rec->orientation = NOT_AVAILABLE;
+        rec->status = ERR_READ_FILE;
+        rec->utcOffset = UTC_OFFSET_UNKNOWN;
+        return ERR_READ_FILE;
+    }
+    if (lookupMetaCache(cache, &st, rec)) {
+        return rec->status;
+    }
+    result = readImgMeta(path, rec);
+    // transient read errors are not remembered
+    if (result != ERR_READ_FILE) {
+        storeMetaCache(cache, &st, rec);
+    }
+    return result;
+}
+
+/**
+ * getMetaCacheStats()
+ *
+ * Get the hit/miss counters since openMetaCache()
+ */
+void getMetaCacheStats(MetaCache *cache, unsigned long long *hits,
+                       unsigned long long *misses, unsigned int *entries)
+{
+    if (!cache) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(cache->lock);
+    if (hits) {
+        *hits = cache->hits;
+    }
+    if (misses) {
+        *misses = cache->misses;
+    }
+    if (entries) {
+        *entries = cache->hdr->used;
+    }
+}
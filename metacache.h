@@ -0,0 +1,153 @@
+/*
+ * Persistent metadata cache
+ *
+ * An on-disk table of the metadata the splitter needs from each photo
+ * (packed shooting date, its offset from UTC, orientation and parse
+ * status), keyed by the
+ * identity of the file: (st_dev, st_ino) with st_size and st_mtime in
+ * nanoseconds as the validity check.  A file whose key and validity
+ * fields match is served from the cache without being opened.
+ *
+ * The file is a fixed header followed by an open-addressing (linear
+ * probing) slot array and is used through mmap(), so opening a cache of
+ * millions of entries costs no parse step.
+ *
+ *   Typical Usage:
+ *
+ *   int result;
+ *   MetaCache *cache = openMetaCache("photos.cache", 0, &result);
+ *   MetaCacheRecord rec;
+ *   if (getImgMetaCached(cache, "IMG_0001.JPG", &rec) > 0) {
+ *       unpackDateKey(rec.dateKey, pic.date);
+ *       pic.orien = rec.orientation;
+ *   }
+ *   closeMetaCache(cache);
+ */
+#if !defined(_METACACHE_H_)
+#define _METACACHE_H_
+
+#include <sys/stat.h>
+#include "datekey.h"
+
+// metadata of a photo as stored in the cache
+typedef struct {
+    unsigned long long dateKey; // packDateKey() of DateTimeOriginal, 0 if none
+    short orientation;          // Orientation_TYPE, NOT_AVAILABLE if none
+    short status;               // result of createIfdTableArray()
+    short utcOffset;            // readUtcOffset() in minutes, UTC_OFFSET_UNKNOWN if none
+} MetaCacheRecord;
+
+typedef struct _metaCache MetaCache;
+
+/**
+ * openMetaCache()
+ *
+ * Open (or create) the cache file and map it into memory
+ *
+ * parameters
+ *  [in] path : cache file
+ *  [in] initialSlots : slot count of a newly created cache, 0 for default
+ *  [out] pResult : result status
+ *   0: OK
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_MEMALLOC
+ *
+ * return
+ *  NULL: error
+ * !NULL: the cache handle
+ *
+ * note
+ * A file with a wrong magic or version is discarded and recreated.
+ * One handle may be shared by threads; the file must not be opened
+ * by two processes at once.
+ */
+MetaCache *openMetaCache(const char *path, unsigned int initialSlots, int *pResult);
+
+/**
+ * closeMetaCache()
+ *
+ * Flush and unmap the cache
+ *
+ * parameters
+ *  [in] cache : the cache handle
+ */
+void closeMetaCache(MetaCache *cache);
+
+/**
+ * lookupMetaCache()
+ *
+ * Look up the record of a file
+ *
+ * parameters
+ *  [in] cache : the cache handle
+ *  [in] st : stat of the file
+ *  [out] rec : the cached record
+ *
+ * return
+ *  1: hit
+ *  0: miss, or the file has changed since it was cached
+ */
+int lookupMetaCache(MetaCache *cache, const struct stat *st, MetaCacheRecord *rec);
+
+/**
+ * storeMetaCache()
+ *
+ * Insert or update the record of a file
+ *
+ * parameters
+ *  [in] cache : the cache handle
+ *  [in] st : stat of the file
+ *  [in] rec : the record
+ *
+ * return
+ *   0: OK
+ *  -n: error
+ *      ERR_INVALID_POINTER
+ *      ERR_MEMALLOC : the grown cache could not be mapped
+ *      ERR_WRITE_FILE : the cache could not grow, or its file could not
+ *                       be shrunk back afterwards (then the next
+ *                       openMetaCache() starts it afresh)
+ */
+int storeMetaCache(MetaCache *cache, const struct stat *st, const MetaCacheRecord *rec);
+
+/**
+ * readImgMeta()
+ *
+ * Parse the date and the orientation of a photo in a single pass
+ *
+ * parameters
+ *  [in] path : target JPEG file
+ *  [out] rec : the parsed record
+ *
+ * return
+ *  the result status of createIfdTableArray()
+ */
+int readImgMeta(const char *path, MetaCacheRecord *rec);
+
+/**
+ * getImgMetaCached()
+ *
+ * Get the metadata of a photo, from the cache when the file is unchanged,
+ * otherwise by parsing it and storing the result
+ *
+ * parameters
+ *  [in] cache : the cache handle (NULL parses without caching)
+ *  [in] path : target JPEG file
+ *  [out] rec : the record
+ *
+ * return
+ *  the result status of createIfdTableArray(), ERR_READ_FILE if stat() fails
+ */
+int getImgMetaCached(MetaCache *cache, const char *path, MetaCacheRecord *rec);
+
+/**
+ * getMetaCacheStats()
+ *
+ * Get the hit/miss counters since openMetaCache()
+ */
+void getMetaCacheStats(MetaCache *cache, unsigned long long *hits,
+                       unsigned long long *misses, unsigned int *entries);
+
+#endif // _METACACHE_H_
@@ -0,0 +1,62 @@
+/*
+ * Minimal fork/join helper shared by the pipeline stages
+ */
+#if !defined(_PARALLEL_H_)
+#define _PARALLEL_H_
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/**
+ * defaultThreadCount()
+ *
+ * Number of worker threads to use when the caller passes 0
+ */
+inline int defaultThreadCount(int threads)
+{
+    if (threads <= 0) {
+        threads = (int)std::thread::hardware_concurrency();
+        if (threads <= 0) {
+            threads = 4;
+        }
+    }
+    return threads;
+}
+
+/**
+ * runParallel()
+ *
+ * Run fn(i) for every i in [0, count) on up to `threads` threads
+ * (0 = hardware concurrency).  Items are handed out one at a time, so
+ * uneven items balance themselves.
+ */
+template <typename F>
+void runParallel(int threads, size_t count, F fn)
+{
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> pool;
+    threads = defaultThreadCount(threads);
+    if ((size_t)threads > count) {
+        threads = (int)count;
+    }
+    if (threads <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            fn(i);
+        }
+        return;
+    }
+    for (int t = 0; t < threads; t++) {
+        pool.push_back(std::thread([&]() {
+            size_t i;
+            while ((i = next.fetch_add(1)) < count) {
+                fn(i);
+            }
+        }));
+    }
+    for (size_t t = 0; t < pool.size(); t++) {
+        pool[t].join();
+    }
+}
+
+#endif // _PARALLEL_H_
@@ -0,0 +1,169 @@
+/*
+ * I/O rate limiting
+ */
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <chrono>
+#include <mutex>
+#include <new>
+#include <thread>
+#include "exif.hpp"
+#include "ratelimit.h"
+
+// from linux/ioprio.h, which isn't exported by every libc
+#define IOPRIO_CLASS_SHIFT   13
+#define IOPRIO_CLASS_BE      2
+#define IOPRIO_CLASS_IDLE    3
+#define IOPRIO_WHO_PROCESS   1
+#define IOPRIO_BE_NORM       4
+
+typedef std::chrono::steady_clock Clock;
+
+typedef struct {
+    double rate;    // tokens per second, 0 = unlimited
+    double tokens;  // may go negative (debt)
+} BUCKET;
+
+struct _rateLimiter {
+    std::mutex lock;
+    BUCKET bytes;
+    BUCKET files;
+    Clock::time_point last;
+};
+
+// add the tokens earned since the last refill, up to one second worth
+static void refill(BUCKET *b, double elapsed)
+{
+    if (b->rate <= 0) {
+        b->tokens = 0;
+        return;
+    }
+    b->tokens += b->rate * elapsed;
+    if (b->tokens > b->rate) {
+        b->tokens = b->rate;
+    }
+}
+
+// seconds until the bucket is out of debt
+static double debtOf(const BUCKET *b)
+{
+    if (b->rate <= 0 || b->tokens >= 0) {
+        return 0;
+    }
+    return -b->tokens / b->rate;
+}
+
+/**
+ * createRateLimiter()
+ *
+ * Create a limiter
+ */
+RateLimiter *createRateLimiter(double bytesPerSec, double filesPerSec, int *pResult)
+{
+    RateLimiter *rl = new (std::nothrow) RateLimiter();
+    if (!rl) {
+        if (pResult) {
+            *pResult = ERR_MEMALLOC;
+        }
+        return NULL;
+    }
+    rl->last = Clock::now();
+    setRateLimit(rl, bytesPerSec, filesPerSec);
+    if (pResult) {
+        *pResult = 0;
+    }
+    return rl;
+}
+
+/**
+ * destroyRateLimiter()
+ *
+ * Free a limiter
+ */
+void destroyRateLimiter(RateLimiter *rl)
+{
+    delete rl;
+}
+
+/**
+ * setRateLimit()
+ *
+ * Change the limits at runtime
+ */
+void setRateLimit(RateLimiter *rl, double bytesPerSec, double filesPerSec)
+{
+    if (!rl) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(rl->lock);
+    rl->bytes.rate = (bytesPerSec > 0) ? bytesPerSec : 0;
+    rl->files.rate = (filesPerSec > 0) ? filesPerSec : 0;
+    // start from a full bucket; a lowered limit forgives the old debt
+    rl->bytes.tokens = rl->bytes.rate;
+    rl->files.tokens = rl->files.rate;
+    rl->last = Clock::now();
+}
+
+/**
+ * chargeRateLimit()
+ *
+ * Charge work done and wait while the limiter is in debt
+ */
+void chargeRateLimit(RateLimiter *rl, unsigned long long bytes, unsigned int files)
+{
+    int charged = 0;
+    if (!rl) {
+        return;
+    }
+    for (;;) {
+        double wait;
+        {
+            std::lock_guard<std::mutex> guard(rl->lock);
+            Clock::time_point now = Clock::now();
+            double elapsed = std::chrono::duration<double>(now - rl->last).count();
+            rl->last = now;
+            refill(&rl->bytes, elapsed);
+            refill(&rl->files, elapsed);
+            if (!charged) {
+                if (rl->bytes.rate > 0) {
+                    rl->bytes.tokens -= (double)bytes;
+                }
+                if (rl->files.rate > 0) {
+                    rl->files.tokens -= (double)files;
+                }
+                charged = 1;
+            }
+            wait = debtOf(&rl->bytes);
+            if (debtOf(&rl->files) > wait) {
+                wait = debtOf(&rl->files);
+            }
+        }
+        if (wait <= 0) {
+            return;
+        }
+        // sleep in slices so that a changed limit is picked up
+        if (wait > RATELIMIT_MAX_SLEEP_MS / 1000.0) {
+            wait = RATELIMIT_MAX_SLEEP_MS / 1000.0;
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+    }
+}
+
+/**
+ * setBackgroundIoPriority()
+ *
+ * Move the calling thread to the idle I/O class (or back to best effort)
+ */
+int setBackgroundIoPriority(int idle)
+{
+#ifdef SYS_ioprio_set
+    int prio = idle ? (IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT)
+                    : ((IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | IOPRIO_BE_NORM);
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio) == 0) {
+        return 0;
+    }
+#else
+    (void)idle;
+#endif
+    return ERR_UNKNOWN;
+}
@@ -0,0 +1,104 @@
+/*
+ * I/O rate limiting
+ *
+ * A token bucket per resource (bytes and files) shared by all workers of
+ * a stage.  Each bucket refills at its rate and holds at most one second
+ * worth of tokens, so short bursts pass while the average stays at the
+ * limit.  Work is charged after it is done, with the amounts actually
+ * used; a worker that drives a bucket into debt sleeps until the debt is
+ * paid back.  Limits can be changed while workers are running, e.g. from
+ * a signal-driven control thread, and take effect within
+ * RATELIMIT_MAX_SLEEP_MS.
+ *
+ *   Typical Usage:
+ *
+ *   RateLimiter *rl = createRateLimiter(20.0 * 1024 * 1024, 500, &result);
+ *   setBackgroundIoPriority(1);      // before starting the workers
+ *   ...
+ *   chargeRateLimit(rl, bytesRead, 1); // in each worker, per file
+ *   ...
+ *   setRateLimit(rl, 0, 0);          // off hours: unlimited
+ *   destroyRateLimiter(rl);
+ */
+#if !defined(_RATELIMIT_H_)
+#define _RATELIMIT_H_
+
+#define RATELIMIT_MAX_SLEEP_MS  100
+
+typedef struct _rateLimiter RateLimiter;
+
+/**
+ * createRateLimiter()
+ *
+ * Create a limiter
+ *
+ * parameters
+ *  [in] bytesPerSec : byte limit, 0 = unlimited
+ *  [in] filesPerSec : file limit, 0 = unlimited
+ *  [out] pResult : result status
+ *   0: OK
+ *  -n: error
+ *      ERR_MEMALLOC
+ *
+ * return
+ *  NULL: error
+ * !NULL: the limiter
+ */
+RateLimiter *createRateLimiter(double bytesPerSec, double filesPerSec, int *pResult);
+
+/**
+ * destroyRateLimiter()
+ *
+ * Free a limiter; no worker may be charging it any more
+ *
+ * parameters
+ *  [in] rl : the limiter
+ */
+void destroyRateLimiter(RateLimiter *rl);
+
+/**
+ * setRateLimit()
+ *
+ * Change the limits at runtime
+ *
+ * parameters
+ *  [in] rl : the limiter
+ *  [in] bytesPerSec : byte limit, 0 = unlimited
+ *  [in] filesPerSec : file limit, 0 = unlimited
+ */
+void setRateLimit(RateLimiter *rl, double bytesPerSec, double filesPerSec);
+
+/**
+ * chargeRateLimit()
+ *
+ * Charge work done and wait while the limiter is in debt
+ *
+ * parameters
+ *  [in] rl : the limiter (NULL = no limit)
+ *  [in] bytes : bytes read or written
+ *  [in] files : files opened or placed
+ */
+void chargeRateLimit(RateLimiter *rl, unsigned long long bytes, unsigned int files);
+
+/**
+ * setBackgroundIoPriority()
+ *
+ * Move the calling thread to the idle I/O class (or back to best effort)
+ *
+ * parameters
+ *  [in] idle : 1 = idle class, 0 = best effort (the default)
+ *
+ * return
+ *   0: OK
+ *  -n: error
+ *      ERR_UNKNOWN (ioprio_set failed or isn't available)
+ *
+ * note
+ * Threads created afterwards inherit the class, so call it before the
+ * workers are started.  The idle class only has an effect with an I/O
+ * scheduler that implements classes (BFQ, CFQ); the rate limits work
+ * everywhere.
+ */
+int setBackgroundIoPriority(int idle);
+
+#endif // _RATELIMIT_H_
@@ -0,0 +1,356 @@
+/*
+ * Sharded splitting
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <queue>
+#include "exif.hpp"
+#include "datekey.h"
+#include "shard.h"
+
+#define SHARD_RUN_MAGIC    "EXMSHARD"
+#define SHARD_RUN_VERSION  2
+
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int shard;
+    unsigned int shardCount;
+    unsigned int reserved;
+    unsigned long long jobId;
+    unsigned long long count;
+} SHARD_RUN_HEADER;
+
+typedef struct {
+    unsigned long long dateKey;
+    short orientation;
+    std::string path;
+} RUN_RECORD;
+
+static bool recordLess(const RUN_RECORD& a, const RUN_RECORD& b)
+{
+    if (a.dateKey != b.dateKey) {
+        return a.dateKey < b.dateKey;
+    }
+    return a.path < b.path;
+}
+
+static unsigned long long fnv1a(const std::string& s, unsigned long long h)
+{
+    for (size_t i = 0; i < s.size(); i++) {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+/**
+ * shardOfPath()
+ *
+ * Shard a path belongs to
+ */
+int shardOfPath(const std::string& path, int shardCount)
+{
+    unsigned long long h = fnv1a(path, 0xCBF29CE484222325ULL);
+    return (shardCount > 0) ? (int)(h % (unsigned long long)shardCount) : 0;
+}
+
+/**
+ * newShardJobId()
+ *
+ * Id of a new sharded job
+ */
+unsigned long long newShardJobId(const std::vector<std::string>& roots)
+{
+    struct timespec ts;
+    unsigned long long h = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < roots.size(); i++) {
+        h = fnv1a(roots[i], h);
+        h = fnv1a(std::string(1, '\0'), h);
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    h ^= (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    h ^= (unsigned long long)getpid() << 32;
+    return h;
+}
+
+/**
+ * getShardRunPath()
+ *
+ * Path of the run file of a shard
+ */
+std::string getShardRunPath(const char *runDir, int shard, int shardCount)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/shard-%04d-of-%04d.run", shard, shardCount);
+    return std::string(runDir) + name;
+}
+
+// write the sorted records as a run and publish it
+static int writeRun(const char *runDir, int shard, int shardCount,
+                    unsigned long long jobId, const std::vector<RUN_RECORD>& recs)
+{
+    std::string path = getShardRunPath(runDir, shard, shardCount);
+    std::string part = path + ".part";
+    SHARD_RUN_HEADER hdr;
+    FILE *fp;
+    int sts = 0;
+
+    fp = fopen(part.c_str(), "wb");
+    if (!fp) {
+        return ERR_WRITE_FILE;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SHARD_RUN_MAGIC, sizeof(hdr.magic));
+    hdr.version = SHARD_RUN_VERSION;
+    hdr.shard = shard;
+    hdr.shardCount = shardCount;
+    hdr.jobId = jobId;
+    hdr.count = recs.size();
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+        sts = ERR_WRITE_FILE;
+    }
+    for (size_t i = 0; i < recs.size() && sts == 0; i++) {
+        unsigned short len = (unsigned short)recs[i].path.size();
+        if (fwrite(&recs[i].dateKey, sizeof(recs[i].dateKey), 1, fp) != 1 ||
+            fwrite(&recs[i].orientation, sizeof(recs[i].orientation), 1, fp) != 1 ||
+            fwrite(&len, sizeof(len), 1, fp) != 1 ||
+            fwrite(recs[i].path.data(), 1, len, fp) != len) {
+            sts = ERR_WRITE_FILE;
+        }
+    }
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        sts = ERR_WRITE_FILE;
+    }
+    fclose(fp);
+    if (sts == 0 && rename(part.c_str(), path.c_str()) != 0) {
+        sts = ERR_WRITE_FILE;
+    }
+    if (sts != 0) {
+        unlink(part.c_str());
+    }
+    return sts;
+}
+
+/**
+ * runShardWorker()
+ *
+ * Walk the roots, parse the files of one shard and write its sorted run
+ */
+int runShardWorker(const std::vector<std::string>& roots, int shard, int shardCount,
+                   unsigned long long jobId, const char *runDir, const IngestOptions *opt)
+{
+    std::vector<WalkEntry> all, mine;
+    std::vector<picture> pics;
+    std::vector<RUN_RECORD> recs;
+    int sts;
+
+    if (shardCount <= 0 || shard < 0 || shard >= shardCount) {
+        return ERR_INVALID_ID;
+    }
+    sts = walkPhotoTrees(roots, NULL, 0, all);
+    if (sts < 0) {
+        return sts;
+    }
+    for (size_t i = 0; i < all.size(); i++) {
+        if (shardOfPath(all[i].filepath, shardCount) == shard) {
+            mine.push_back(all[i]);
+        }
+    }
+    all.clear();
+    ingestPhotos(mine, opt, pics, NULL);
+
+    recs.reserve(pics.size());
+    for (size_t i = 0; i < pics.size(); i++) {
+        RUN_RECORD r;
+        if (pics[i].filepath.size() > 0xFFFF) {
+            continue; // longer than any PATH_MAX
+        }
+        r.dateKey = packDateKey(pics[i].date);
+        r.orientation = (short)pics[i].orien;
+        r.path = pics[i].filepath;
+        recs.push_back(r);
+    }
+    std::sort(recs.begin(), recs.end(), recordLess);
+    sts = writeRun(runDir, shard, shardCount, jobId, recs);
+    return (sts < 0) ? sts : (int)recs.size();
+}
+
+// sequential reader of one run
+typedef struct {
+    FILE *fp;
+    unsigned long long remaining;
+    RUN_RECORD rec;
+} RUN_READER;
+
+// read the next record into r->rec; 1 = read, 0 = end, <0 = error
+static int readRecord(RUN_READER *r)
+{
+    unsigned short len;
+    if (r->remaining == 0) {
+        return 0;
+    }
+    if (fread(&r->rec.dateKey, sizeof(r->rec.dateKey), 1, r->fp) != 1 ||
+        fread(&r->rec.orientation, sizeof(r->rec.orientation), 1, r->fp) != 1 ||
+        fread(&len, sizeof(len), 1, r->fp) != 1) {
+        return ERR_READ_FILE;
+    }
+    r->rec.path.resize(len);
+    if (len > 0 && fread(&r->rec.path[0], 1, len, r->fp) != len) {
+        return ERR_READ_FILE;
+    }
+    r->remaining--;
+    return 1;
+}
+
+static int openRun(RUN_READER *r, const std::string& path, int shard, int shardCount,
+                   unsigned long long jobId)
+{
+    SHARD_RUN_HEADER hdr;
+    r->fp = fopen(path.c_str(), "rb");
+    if (!r->fp) {
+        return (errno == ENOENT) ? ERR_NOT_EXIST : ERR_READ_FILE;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, r->fp) != 1 ||
+        memcmp(hdr.magic, SHARD_RUN_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != SHARD_RUN_VERSION ||
+        hdr.shard != (unsigned int)shard || hdr.shardCount != (unsigned int)shardCount) {
+        return ERR_READ_FILE;
+    }
+    if (hdr.jobId != jobId) {
+        return ERR_INVALID_ID; // left over from another job
+    }
+    r->remaining = hdr.count;
+    return 0;
+}
+
+// min-heap order of the readers by their current record
+struct RunAfter {
+    const std::vector<RUN_READER> *runs;
+    bool operator()(size_t a, size_t b) const {
+        return recordLess((*runs)[b].rec, (*runs)[a].rec);
+    }
+};
+
+/**
+ * mergeShardRuns()
+ *
+ * Merge the runs of all shards into groups
+ */
+int mergeShardRuns(const char *runDir, int shardCount, unsigned long long jobId, int rule,
+                   std::vector<picsInoneTime>& picsOT)
+{
+    std::vector<RUN_READER> runs(shardCount);
+    RunAfter after = { &runs };
+    std::priority_queue<size_t, std::vector<size_t>, RunAfter> heap(after);
+    unsigned long long groupKey = 0;
+    int sts = 0, total = 0;
+
+    picsOT.clear();
+    for (int s = 0; s < shardCount; s++) {
+        runs[s].fp = NULL;
+    }
+    for (int s = 0; s < shardCount && sts == 0; s++) {
+        sts = openRun(&runs[s], getShardRunPath(runDir, s, shardCount), s, shardCount, jobId);
+        if (sts == 0) {
+            sts = readRecord(&runs[s]);
+            if (sts > 0) {
+                heap.push(s);
+                sts = 0;
+            }
+        }
+    }
+    while (sts == 0 && !heap.empty()) {
+        size_t s = heap.top();
+        const RUN_RECORD& rec = runs[s].rec;
+        unsigned long long key = truncateDateKey(rec.dateKey, rule);
+        picture pic;
+        size_t slash = rec.path.rfind('/');
+
+        heap.pop();
+        unpackDateKey(rec.dateKey, pic.date);
+        pic.filepath = rec.path;
+        pic.filename = (slash == std::string::npos) ? rec.path : rec.path.substr(slash + 1);
+        pic.orien = rec.orientation;
+        if (picsOT.empty() || key != groupKey) {
+            picsOT.push_back(picsInoneTime());
+            groupKey = key;
+        }
+        picsOT.back().pic.push_back(pic);
+        total++;
+
+        sts = readRecord(&runs[s]);
+        if (sts > 0) {
+            heap.push(s);
+            sts = 0;
+        }
+    }
+    for (int s = 0; s < shardCount; s++) {
+        if (runs[s].fp) {
+            fclose(runs[s].fp);
+        }
+    }
+    if (sts < 0) {
+        picsOT.clear();
+        return sts;
+    }
+    return total;
+}
+
+/**
+ * runShardedSplit()
+ *
+ * Fork one worker process per shard on this host and merge their runs
+ */
+int runShardedSplit(const std::vector<std::string>& roots, int shardCount,
+                    const char *runDir, int rule, const IngestOptions *opt,
+                    std::vector<picsInoneTime>& picsOT)
+{
+    std::vector<pid_t> pids;
+    unsigned long long jobId;
+    int sts = 0;
+
+    if (shardCount <= 0) {
+        return ERR_INVALID_ID;
+    }
+    jobId = newShardJobId(roots);
+    for (int s = 0; s < shardCount; s++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            sts = ERR_UNKNOWN;
+            break;
+        }
+        if (pid == 0) {
+            IngestOptions local;
+            int result;
+            if (opt) {
+                // a cache file must not be mapped by two processes
+                local = *opt;
+                local.cache = NULL;
+            }
+            result = runShardWorker(roots, s, shardCount, jobId, runDir, opt ? &local : NULL);
+            _exit((result < 0) ? -result : 0);
+        }
+        pids.push_back(pid);
+    }
+    for (size_t i = 0; i < pids.size(); i++) {
+        int wstatus;
+        if (waitpid(pids[i], &wstatus, 0) < 0) {
+            sts = (sts != 0) ? sts : ERR_UNKNOWN;
+        } else if (!WIFEXITED(wstatus)) {
+            sts = (sts != 0) ? sts : ERR_UNKNOWN;
+        } else if (WEXITSTATUS(wstatus) != 0) {
+            sts = (sts != 0) ? sts : -WEXITSTATUS(wstatus);
+        }
+    }
+    if (sts != 0) {
+        return sts;
+    }
+    return mergeShardRuns(runDir, shardCount, jobId, rule, picsOT);
+}
@@ -0,0 +1,156 @@
+/*
+ * Sharded splitting
+ *
+ * Splits a corpus too large for one machine over N worker processes,
+ * on one host or many, that share a run directory:
+ *
+ *   1. every worker walks the roots and keeps the files whose path hashes
+ *      to its shard, parses them and writes one sorted run file
+ *   2. one process k-way merges the N runs into the groups
+ *      splitpicsOntime() would have produced for the whole corpus
+ *
+ * A run is published with rename() only once it is complete and synced,
+ * so the merge never sees a half written run.  Every run carries the id
+ * of the job it was written for, and the merge rejects a run of another
+ * job, so a worker that never ran can't leave an earlier job's run to be
+ * merged in silently.
+ *
+ * Every worker walks all of the roots and keeps 1/N of the files, so the
+ * directory metadata traffic on a shared store grows with N: fine for
+ * local disks and a handful of nodes, but with many workers on one NFS
+ * export, give each worker a disjoint set of roots instead (with
+ * shardCount = 1 each) and merge the resulting groups.
+ *
+ * Run file format (host byte order):
+ *   SHARD_RUN_HEADER
+ *   record * count, ordered by (dateKey, path):
+ *     u64 dateKey | i16 orientation | u16 path length | path bytes
+ *
+ *   Typical Usage:
+ *
+ *   // once, by whoever launches the job; handed to every node
+ *   unsigned long long job = newShardJobId(roots);
+ *   // on each of 8 nodes, n = 0..7
+ *   runShardWorker(roots, n, 8, job, "/shared/runs", NULL);
+ *   // on one of them, after all workers are done
+ *   mergeShardRuns("/shared/runs", 8, job, 2, picsOT);
+ *
+ *   // or all on this host
+ *   runShardedSplit(roots, 8, "/tmp/runs", 2, NULL, picsOT);
+ */
+#if !defined(_SHARD_H_)
+#define _SHARD_H_
+
+#include <string>
+#include <vector>
+#include "fastCluster.h"
+#include "ingest.h"
+
+/**
+ * shardOfPath()
+ *
+ * Shard a path belongs to (FNV-1a of the path)
+ *
+ * parameters
+ *  [in] path : file path as produced by the walker
+ *  [in] shardCount : number of shards
+ */
+int shardOfPath(const std::string& path, int shardCount);
+
+/**
+ * getShardRunPath()
+ *
+ * Path of the run file of a shard: runDir/shard-nnnn-of-NNNN.run
+ */
+std::string getShardRunPath(const char *runDir, int shard, int shardCount);
+
+/**
+ * newShardJobId()
+ *
+ * Id of a new sharded job: a hash of the roots and the current time
+ *
+ * parameters
+ *  [in] roots : source directories of the job
+ *
+ * note
+ * Make it once per job and pass the same value to every worker and to
+ * the merge.
+ */
+unsigned long long newShardJobId(const std::vector<std::string>& roots);
+
+/**
+ * runShardWorker()
+ *
+ * Walk the roots, parse the files of one shard and write its sorted run
+ *
+ * parameters
+ *  [in] roots : source directories, the same list for every worker
+ *  [in] shard : shard of this worker, 0 .. shardCount-1
+ *  [in] shardCount : number of shards
+ *  [in] jobId : id of the job, see newShardJobId()
+ *  [in] runDir : shared run directory (must exist)
+ *  [in] opt : ingest options (may be NULL)
+ *
+ * return
+ *   n: number of photos in the run
+ *  -n: error
+ *      ERR_INVALID_ID (bad shard numbers)
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_MEMALLOC
+ */
+int runShardWorker(const std::vector<std::string>& roots, int shard, int shardCount,
+                   unsigned long long jobId, const char *runDir, const IngestOptions *opt);
+
+/**
+ * mergeShardRuns()
+ *
+ * Merge the runs of all shards into groups
+ *
+ * parameters
+ *  [in] runDir : shared run directory
+ *  [in] shardCount : number of shards
+ *  [in] jobId : id the workers were given
+ *  [in] rule : split rule as for splitpicsOntime()
+ *  [out] picsOT : the groups, in date order
+ *
+ * return
+ *   n: number of photos
+ *  -n: error
+ *      ERR_NOT_EXIST (a run is missing)
+ *      ERR_INVALID_ID (a run belongs to another job)
+ *      ERR_READ_FILE (a run is truncated or not a run file)
+ */
+int mergeShardRuns(const char *runDir, int shardCount, unsigned long long jobId, int rule,
+                   std::vector<picsInoneTime>& picsOT);
+
+/**
+ * runShardedSplit()
+ *
+ * Fork one worker process per shard on this host, wait for them and
+ * merge their runs (under a new job id)
+ *
+ * parameters
+ *  [in] roots : source directories
+ *  [in] shardCount : number of worker processes
+ *  [in] runDir : run directory (must exist)
+ *  [in] rule : split rule as for splitpicsOntime()
+ *  [in] opt : ingest options of every worker (may be NULL)
+ *  [out] picsOT : the groups, in date order
+ *
+ * return
+ *   n: number of photos
+ *  -n: error of the first worker that failed, or of the merge
+ *      ERR_UNKNOWN (fork failed or a worker died)
+ *
+ * note
+ * Call it before the process starts other threads: only the calling
+ * thread survives in the forked workers.  The workers don't use
+ * opt->cache (a cache file can't be shared by processes), and the
+ * limits of opt->limiter apply to each worker separately.
+ */
+int runShardedSplit(const std::vector<std::string>& roots, int shardCount,
+                    const char *runDir, int rule, const IngestOptions *opt,
+                    std::vector<picsInoneTime>& picsOT);
+
+#endif // _SHARD_H_
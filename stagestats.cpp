@@ -0,0 +1,303 @@
+/*
+ * Per-stage latency histograms and counters
+ *
+ * Each thread owns a shard that only it writes.  The values are atomics
+ * updated with relaxed loads and stores (no read-modify-write, the owner
+ * is the only writer), so recording costs no locked instruction and a
+ * snapshot may read them at any time.  The shard list is only locked
+ * when a thread records for the first time, when it ends (its figures
+ * are folded into the retired totals) and when a snapshot is taken.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "exif.hpp"
+#include "stagestats.h"
+
+typedef struct {
+    std::atomic<unsigned long long> count;
+    std::atomic<unsigned long long> items;
+    std::atomic<unsigned long long> totalNs;
+    std::atomic<unsigned long long> maxNs;
+    std::atomic<unsigned long long> buckets[STAGE_HIST_BUCKETS];
+} STAGE_CELL;
+
+struct StageShard {
+    STAGE_CELL cell[STAGE_COUNT];
+    StageShard()
+    {
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            cell[s].count = 0;
+            cell[s].items = 0;
+            cell[s].totalNs = 0;
+            cell[s].maxNs = 0;
+            for (int b = 0; b < STAGE_HIST_BUCKETS; b++) {
+                cell[s].buckets[b] = 0;
+            }
+        }
+    }
+};
+
+static const char *stageNames[STAGE_COUNT] = {
+    "open", "marker_scan", "parse_ifd", "date_parse", "sort", "split", "materialise"
+};
+
+static std::atomic<int> Enabled(1);
+static std::mutex ShardLock;
+static std::vector<StageShard*> Shards;   // of the running threads
+static StageSnapshot Retired;             // of the threads that have ended
+
+static void addShard(StageSnapshot *snap, const StageShard *shard)
+{
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        const STAGE_CELL& c = shard->cell[s];
+        StageStats& st = snap->stage[s];
+        st.count += c.count.load(std::memory_order_relaxed);
+        st.items += c.items.load(std::memory_order_relaxed);
+        st.totalNs += c.totalNs.load(std::memory_order_relaxed);
+        unsigned long long m = c.maxNs.load(std::memory_order_relaxed);
+        if (m > st.maxNs) {
+            st.maxNs = m;
+        }
+        for (int b = 0; b < STAGE_HIST_BUCKETS; b++) {
+            st.buckets[b] += c.buckets[b].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// registers the thread's shard on first use and retires it at thread exit
+struct ShardOwner {
+    StageShard *shard;
+    ~ShardOwner()
+    {
+        if (!shard) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(ShardLock);
+        addShard(&Retired, shard);
+        for (size_t i = 0; i < Shards.size(); i++) {
+            if (Shards[i] == shard) {
+                Shards[i] = Shards.back();
+                Shards.pop_back();
+                break;
+            }
+        }
+        delete shard;
+    }
+};
+
+static thread_local ShardOwner Owner;
+
+static StageShard *myShard()
+{
+    if (!Owner.shard) {
+        StageShard *shard = new StageShard();
+        std::lock_guard<std::mutex> guard(ShardLock);
+        Shards.push_back(shard);
+        Owner.shard = shard;
+    }
+    return Owner.shard;
+}
+
+static unsigned long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucketOf(unsigned long long ns)
+{
+    if (ns < (1ULL << STAGE_HIST_SUB_BITS)) {
+        return (int)ns;
+    }
+    int e = 63 - __builtin_clzll(ns);
+    if (e >= STAGE_HIST_MAX_BITS) {
+        return STAGE_HIST_BUCKETS - 1;
+    }
+    return ((e - STAGE_HIST_SUB_BITS + 1) << STAGE_HIST_SUB_BITS) +
+           (int)((ns >> (e - STAGE_HIST_SUB_BITS)) & ((1 << STAGE_HIST_SUB_BITS) - 1));
+}
+
+// first value past the bucket
+static unsigned long long bucketEnd(int b)
+{
+    if (b < (1 << STAGE_HIST_SUB_BITS)) {
+        return (unsigned long long)b + 1;
+    }
+    int shift = (b >> STAGE_HIST_SUB_BITS) - 1;
+    unsigned long long first = (unsigned long long)((1 << STAGE_HIST_SUB_BITS) +
+                                (b & ((1 << STAGE_HIST_SUB_BITS) - 1))) << shift;
+    return first + (1ULL << shift);
+}
+
+static void bump(std::atomic<unsigned long long>& v, unsigned long long n)
+{
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/**
+ * setStageStatsEnabled()
+ *
+ * Turn recording on or off (on by default)
+ */
+void setStageStatsEnabled(int enabled)
+{
+    Enabled = enabled;
+}
+
+/**
+ * stageStart()
+ *
+ * Start timing a stage
+ */
+unsigned long long stageStart()
+{
+    return Enabled.load(std::memory_order_relaxed) ? nowNs() : 0;
+}
+
+/**
+ * stageEnd()
+ *
+ * Record a stage call into the calling thread's histogram
+ */
+void stageEnd(STAGE_ID stage, unsigned long long start, unsigned long long items)
+{
+    if (!start || stage < 0 || stage >= STAGE_COUNT) {
+        return;
+    }
+    unsigned long long ns = nowNs() - start;
+    STAGE_CELL& c = myShard()->cell[stage];
+    bump(c.count, 1);
+    bump(c.items, items);
+    bump(c.totalNs, ns);
+    if (ns > c.maxNs.load(std::memory_order_relaxed)) {
+        c.maxNs.store(ns, std::memory_order_relaxed);
+    }
+    bump(c.buckets[bucketOf(ns)], 1);
+}
+
+/**
+ * getStageSnapshot()
+ *
+ * Merge the figures of all threads
+ */
+void getStageSnapshot(StageSnapshot *snap)
+{
+    if (!snap) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(ShardLock);
+    *snap = Retired;
+    for (size_t i = 0; i < Shards.size(); i++) {
+        addShard(snap, Shards[i]);
+    }
+}
+
+/**
+ * getStagePercentile()
+ *
+ * Latency below which p percent of the calls of a stage finished
+ */
+unsigned long long getStagePercentile(const StageStats *stats, double p)
+{
+    if (!stats || stats->count == 0) {
+        return 0;
+    }
+    unsigned long long rank = (unsigned long long)(p / 100.0 * stats->count + 0.5);
+    unsigned long long seen = 0;
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (int b = 0; b < STAGE_HIST_BUCKETS; b++) {
+        seen += stats->buckets[b];
+        if (seen >= rank) {
+            unsigned long long end = bucketEnd(b);
+            return (end < stats->maxNs) ? end : stats->maxNs;
+        }
+    }
+    return stats->maxNs;
+}
+
+/**
+ * getStageName()
+ *
+ * Name of a stage as used in the Prometheus labels
+ */
+const char *getStageName(STAGE_ID stage)
+{
+    return (stage >= 0 && stage < STAGE_COUNT) ? stageNames[stage] : "unknown";
+}
+
+/**
+ * writeStagePrometheus()
+ *
+ * Write a snapshot in the Prometheus text exposition format
+ */
+int writeStagePrometheus(const char *path)
+{
+    // exposed bucket bounds in ns; a fine bucket counts toward a bound
+    // once all of it is below the bound
+    static const unsigned long long bounds[] = {
+        1000ULL, 2500ULL, 5000ULL, 10000ULL, 25000ULL, 50000ULL,
+        100000ULL, 250000ULL, 500000ULL, 1000000ULL, 2500000ULL, 5000000ULL,
+        10000000ULL, 25000000ULL, 50000000ULL, 100000000ULL, 250000000ULL,
+        500000000ULL, 1000000000ULL, 2500000000ULL, 5000000000ULL, 10000000000ULL
+    };
+    const int nBounds = (int)(sizeof(bounds) / sizeof(bounds[0]));
+    StageSnapshot *snap = new StageSnapshot;
+    std::string tmp = std::string(path) + ".tmp";
+    FILE *fp;
+    int ok;
+
+    getStageSnapshot(snap);
+    fp = fopen(tmp.c_str(), "w");
+    if (!fp) {
+        delete snap;
+        return ERR_WRITE_FILE;
+    }
+    fprintf(fp, "# HELP exif_stage_duration_seconds Time per call of a pipeline stage.\n"
+                "# TYPE exif_stage_duration_seconds histogram\n");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        const StageStats& st = snap->stage[s];
+        unsigned long long cumulative = 0;
+        int b = 0;
+        for (int k = 0; k < nBounds; k++) {
+            while (b < STAGE_HIST_BUCKETS && bucketEnd(b) <= bounds[k]) {
+                cumulative += st.buckets[b++];
+            }
+            fprintf(fp, "exif_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                    stageNames[s], bounds[k] / 1e9, cumulative);
+        }
+        fprintf(fp, "exif_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                stageNames[s], st.count);
+        fprintf(fp, "exif_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n",
+                stageNames[s], st.totalNs / 1e9);
+        fprintf(fp, "exif_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+                stageNames[s], st.count);
+    }
+    fprintf(fp, "# HELP exif_stage_items_total Items processed by a pipeline stage.\n"
+                "# TYPE exif_stage_items_total counter\n");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        fprintf(fp, "exif_stage_items_total{stage=\"%s\"} %llu\n",
+                stageNames[s], snap->stage[s].items);
+    }
+    fprintf(fp, "# HELP exif_stage_duration_max_seconds Longest call of a pipeline stage.\n"
+                "# TYPE exif_stage_duration_max_seconds gauge\n");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        fprintf(fp, "exif_stage_duration_max_seconds{stage=\"%s\"} %.9f\n",
+                stageNames[s], snap->stage[s].maxNs / 1e9);
+    }
+    delete snap;
+    ok = (fflush(fp) == 0);
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path) != 0) {
+        remove(tmp.c_str());
+        return ERR_WRITE_FILE;
+    }
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * Per-stage latency histograms and counters
+ *
+ * Every pipeline stage records how long each call took into a histogram
+ * owned by the calling thread, so recording is a clock read and a few
+ * uncontended stores; nothing is shared until someone asks.  A snapshot
+ * merges the histograms of all threads (and of threads that have ended)
+ * on demand.
+ *
+ * The histograms are log-linear in the style of HdrHistogram: 16
+ * sub-buckets per power of two, so any recorded value is known to within
+ * 6.25%, from 1ns up to 2^36ns (about 69s); longer calls land in the
+ * last bucket.
+ *
+ * The hooks in the pipeline are compiled in only when EXIF_STAGESTATS
+ * is defined, the way EXIF_TRACE works for trace.h: without it the
+ * STAGE_* macros expand to nothing, so the parser and the splitter can
+ * be linked without stagestats.cpp (e.g. bench.cpp + exif.cpp +
+ * fastcluster.cpp + dirwalk.cpp) and the snapshot stays empty.
+ *
+ *   Typical Usage:
+ *
+ *   STAGE_DECL(t0);                      // before any goto
+ *   STAGE_BEGIN(t0);
+ *   ...
+ *   STAGE_END(t0, STAGE_SORT, pics.size());
+ *
+ *   StageSnapshot snap;
+ *   getStageSnapshot(&snap);
+ *   printf("p99 parse: %llu ns\n",
+ *          getStagePercentile(&snap.stage[STAGE_PARSE_IFD], 99.0));
+ *   writeStagePrometheus("/var/lib/node_exporter/exif.prom");
+ */
+#if !defined(_STAGESTATS_H_)
+#define _STAGESTATS_H_
+
+#if defined(EXIF_STAGESTATS)
+#define STAGE_DECL(var)               unsigned long long var = 0
+#define STAGE_BEGIN(var)              (var) = stageStart()
+#define STAGE_END(var, stage, items)  stageEnd((stage), (var), (items))
+#else
+#define STAGE_DECL(var)
+#define STAGE_BEGIN(var)
+#define STAGE_END(var, stage, items)
+#endif
+
+typedef enum {
+    STAGE_OPEN = 0,      // opening a file for the parser
+    STAGE_MARKER_SCAN,   // getApp1StartOffset(): finding the Exif segment
+    STAGE_PARSE_IFD,     // decoding all IFDs of a file (items = IFDs)
+    STAGE_DATE_PARSE,    // DateTimeOriginal to a date key
+    STAGE_SORT,          // sorting the pictures (items = pictures)
+    STAGE_SPLIT,         // grouping sorted pictures (items = pictures)
+    STAGE_MATERIALISE,   // placing one file in its group directory
+    STAGE_COUNT
+} STAGE_ID;
+
+#define STAGE_HIST_SUB_BITS  4
+#define STAGE_HIST_MAX_BITS  36
+#define STAGE_HIST_BUCKETS   ((STAGE_HIST_MAX_BITS - STAGE_HIST_SUB_BITS + 1) << STAGE_HIST_SUB_BITS)
+
+// merged figures of one stage
+typedef struct {
+    unsigned long long count;     // calls
+    unsigned long long items;     // what the calls processed, see STAGE_ID
+    unsigned long long totalNs;
+    unsigned long long maxNs;
+    unsigned long long buckets[STAGE_HIST_BUCKETS];
+} StageStats;
+
+typedef struct {
+    StageStats stage[STAGE_COUNT];
+} StageSnapshot;
+
+/**
+ * setStageStatsEnabled()
+ *
+ * Turn recording on or off (on by default)
+ *
+ * parameters
+ *  [in] enabled : 1=on  0=off
+ */
+void setStageStatsEnabled(int enabled);
+
+/**
+ * stageStart()
+ *
+ * Start timing a stage
+ *
+ * return
+ *  start time to pass to stageEnd(), 0 when recording is off
+ */
+unsigned long long stageStart();
+
+/**
+ * stageEnd()
+ *
+ * Record a stage call into the calling thread's histogram
+ *
+ * parameters
+ *  [in] stage : the stage
+ *  [in] start : stageStart() of the call (0 = not recorded)
+ *  [in] items : what the call processed
+ */
+void stageEnd(STAGE_ID stage, unsigned long long start, unsigned long long items);
+
+/**
+ * getStageSnapshot()
+ *
+ * Merge the figures of all threads
+ *
+ * parameters
+ *  [out] snap : the merged figures
+ *
+ * note
+ * Threads keep recording while the snapshot is taken, so two stages of
+ * one snapshot may be a few calls apart.
+ */
+void getStageSnapshot(StageSnapshot *snap);
+
+/**
+ * getStagePercentile()
+ *
+ * Latency below which p percent of the calls of a stage finished
+ *
+ * parameters
+ *  [in] stats : figures of the stage
+ *  [in] p : percentile, 0 to 100
+ *
+ * return
+ *  the upper edge of the bucket holding the percentile in ns, 0 if the
+ *  stage has no calls
+ */
+unsigned long long getStagePercentile(const StageStats *stats, double p);
+
+/**
+ * getStageName()
+ *
+ * Name of a stage as used in the Prometheus labels (e.g. "parse_ifd")
+ */
+const char *getStageName(STAGE_ID stage);
+
+/**
+ * writeStagePrometheus()
+ *
+ * Write a snapshot in the Prometheus text exposition format
+ *
+ * parameters
+ *  [in] path : output file; written as path.tmp and renamed, so a
+ *              collector never reads half a file
+ *
+ * return
+ *   0: OK
+ *  -n: error
+ *      ERR_WRITE_FILE
+ */
+int writeStagePrometheus(const char *path);
+
+#endif // _STAGESTATS_H_
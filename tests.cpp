@@ -0,0 +1,655 @@
+/*
+ * Behaviour checks of the library
+ *
+ * One executable that exercises the deterministic parts of every module
+ * against a plain reference implementation, and, given a corpus made by
+ * gencorpus, the parser against the corpus manifest:
+ *
+ *   datekey     : packDateKey() order and round trip, truncateDateKey(),
+ *                 parseExifDate() bounds
+ *   dateindex   : lowerBoundDateKey(), queryDateRange() and the galloping
+ *                 queryDateRanges() against std::lower_bound
+ *   tzone       : POSIX TZ rule expansion (a TZif file written here) and
+ *                 the system zone database against localtime_r()
+ *   fastcluster : presorted, descending and shuffled input to
+ *                 splitpicsOntime() against std::stable_sort
+ *   catalogue   : writeCatalogue() / openCatalogue() round trip
+ *   journal     : resumeMoveJournal() after a run died half way
+ *   shard       : runShardWorker() + mergeShardRuns() against one
+ *                 ingestPhotos() and splitpicsOntime() (corpus only)
+ *   manifest    : readImgInfo() / readImgMeta() of every corpus file
+ *                 against <corpus>/manifest.tsv (corpus only)
+ *
+ *   Usage:
+ *
+ *   gencorpus -n 2000 -o /tmp/corpus -x 0.2 -z 0.3 -g 0.3 -u 0.05 -b mixed
+ *   tests [/tmp/corpus]
+ *
+ * Prints every failed check and a summary; the exit status is 0 only if
+ * all checks passed.  Scratch files go to a directory below $TMPDIR (or
+ * /tmp) that is removed afterwards.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "exif.hpp"
+#include "fastCluster.h"
+#include "datekey.h"
+#include "dateindex.h"
+#include "tzone.h"
+#include "catalogue.h"
+#include "journal.h"
+#include "materialise.h"
+#include "metacache.h"
+#include "dirwalk.h"
+#include "ingest.h"
+#include "shard.h"
+
+static int Checks = 0;
+static int Failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+static int check(int ok, const char *what, const char *file, int line)
+{
+    Checks++;
+    if (!ok) {
+        Failures++;
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+    }
+    return ok;
+}
+
+static std::string ScratchDir;
+
+static int removeEntry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+static void writeFile(const std::string& path, const std::string& data)
+{
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (fp) {
+        fwrite(data.data(), 1, data.size(), fp);
+        fclose(fp);
+    }
+}
+
+static std::string readFile(const std::string& path)
+{
+    std::string data;
+    char buf[4096];
+    size_t n;
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return "<missing>";
+    }
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data.append(buf, n);
+    }
+    fclose(fp);
+    return data;
+}
+
+static int exists(const std::string& path)
+{
+    struct stat st;
+    return lstat(path.c_str(), &st) == 0;
+}
+
+static std::array<int, 6> randomDate(std::mt19937_64& rng)
+{
+    std::array<int, 6> d;
+    d[0] = 2000 + (int)(rng() % 20);
+    d[1] = 1 + (int)(rng() % 12);
+    d[2] = 1 + (int)(rng() % 28);
+    d[3] = (int)(rng() % 24);
+    d[4] = (int)(rng() % 60);
+    d[5] = (int)(rng() % 60);
+    return d;
+}
+
+static std::vector<picture> randomPictures(size_t n, unsigned long long seed)
+{
+    std::mt19937_64 rng(seed);
+    std::vector<picture> pics(n);
+    for (size_t i = 0; i < n; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "IMG_%07zu.JPG", i);
+        pics[i].date = randomDate(rng);
+        // few distinct dates per group, so groups hold ties
+        if (i % 3 == 1) {
+            pics[i].date = pics[i - 1].date;
+        }
+        pics[i].filename = name;
+        pics[i].filepath = std::string("/photos/") + name;
+        pics[i].orien = 1 + (int)(rng() % 8);
+    }
+    return pics;
+}
+
+// groups as (truncated key, sorted paths), for comparisons that don't
+// depend on the order inside a group
+typedef std::vector<std::pair<unsigned long long, std::vector<std::string> > > GroupList;
+
+static GroupList groupList(const std::vector<picsInoneTime>& picsOT, int rule)
+{
+    GroupList list;
+    for (size_t g = 0; g < picsOT.size(); g++) {
+        std::vector<std::string> paths;
+        unsigned long long key = 0;
+        for (size_t i = 0; i < picsOT[g].pic.size(); i++) {
+            paths.push_back(picsOT[g].pic[i].filepath);
+            key = truncateDateKey(packDateKey(picsOT[g].pic[i].date), rule);
+        }
+        std::sort(paths.begin(), paths.end());
+        list.push_back(std::make_pair(key, paths));
+    }
+    return list;
+}
+
+// splitpicsOntime() as the plain definition: stable sort, cut where the
+// truncated key changes
+static void referenceSplit(std::vector<picture> pics, int rule, std::vector<picsInoneTime>& picsOT)
+{
+    picsOT.clear();
+    std::stable_sort(pics.begin(), pics.end(), comppics);
+    for (size_t i = 0; i < pics.size(); i++) {
+        if (i == 0 || truncateDateKey(packDateKey(pics[i].date), rule) !=
+                      truncateDateKey(packDateKey(pics[i - 1].date), rule)) {
+            picsOT.push_back(picsInoneTime());
+        }
+        picsOT.back().pic.push_back(pics[i]);
+    }
+}
+
+static void testDateKey()
+{
+    std::mt19937_64 rng(1);
+    std::array<int, 6> d, back;
+    for (int i = 0; i < 10000; i++) {
+        std::array<int, 6> a = randomDate(rng), b = randomDate(rng);
+        unpackDateKey(packDateKey(a), back);
+        CHECK(back == a);
+        CHECK((packDateKey(a) < packDateKey(b)) == (a < b));
+        for (int rule = 0; rule < 6; rule++) {
+            int same = std::equal(a.begin(), a.begin() + rule + 1, b.begin());
+            CHECK((truncateDateKey(packDateKey(a), rule) ==
+                   truncateDateKey(packDateKey(b), rule)) == same);
+        }
+    }
+    CHECK(truncateDateKey(packDateKey(d = {{ 2016, 5, 6, 7, 8, 9 }}), 5) == packDateKey(d));
+    CHECK(parseExifDate("2016:05:06 07:08:09", 20, d) &&
+          d == (std::array<int, 6>{{ 2016, 5, 6, 7, 8, 9 }}));
+    CHECK(parseExifDate("2016:05:06 07:08:09", 19, d));
+    CHECK(!parseExifDate("2016:05:06 07:08:09", 18, d));
+    CHECK(!parseExifDate("2016:05:06 07:08:0x", 20, d));
+    CHECK(!parseExifDate("    :  :     :  :  ", 20, d));
+    CHECK(!parseExifDate(NULL, 20, d));
+}
+
+static void checkIndex(const std::vector<unsigned long long>& keys, std::mt19937_64& rng)
+{
+    int sts;
+    DateIndex *idx = createDateIndex(keys.data(), keys.size(), &sts);
+    if (!CHECK(idx != NULL && sts == 0)) {
+        return;
+    }
+    unsigned long long top = keys.empty() ? 100 : keys.back() + 2;
+    std::vector<DateRangeQuery> queries;
+    for (int q = 0; q < 2000; q++) {
+        // probe present keys, the gaps between them and both ends
+        unsigned long long key = (keys.empty() || (q & 1)) ? rng() % (top + 1)
+                                                           : keys[rng() % keys.size()];
+        size_t want = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+        CHECK(lowerBoundDateKey(idx, key) == want);
+
+        unsigned long long to = key + rng() % 50;
+        size_t begin, end;
+        queryDateRange(idx, key, to, &begin, &end);
+        CHECK(begin == want);
+        CHECK(end == (size_t)(std::lower_bound(keys.begin(), keys.end(), to) - keys.begin()));
+        DateRangeQuery dq = { key, to, 0, 0 };
+        queries.push_back(dq);
+    }
+    CHECK(queryDateRanges(idx, queries.data(), queries.size()) == 0);
+    for (size_t q = 0; q < queries.size(); q++) {
+        size_t begin, end;
+        queryDateRange(idx, queries[q].from, queries[q].to, &begin, &end);
+        CHECK(queries[q].begin == begin && queries[q].end == end);
+    }
+    destroyDateIndex(idx);
+}
+
+static void testDateIndex()
+{
+    static const size_t sizes[] = { 0, 1, 7, 8, 9, 63, 64, 65, 1000, 100003 };
+    std::mt19937_64 rng(2);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        std::vector<unsigned long long> keys(sizes[s]);
+        unsigned long long k = 10;
+        for (size_t i = 0; i < keys.size(); i++) {
+            k += rng() % 4;  // runs of equal keys and gaps
+            keys[i] = k;
+        }
+        checkIndex(keys, rng);
+    }
+}
+
+static void appendBE(std::string& s, unsigned long long v, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; i--) {
+        s += (char)((v >> (8 * i)) & 0xFF);
+    }
+}
+
+// a TZif v2 file without transitions: every offset after 1970 comes from
+// expanding the POSIX rule of the footer
+static std::string makeTzif(int stdOffset, const char *abbr, const char *rule)
+{
+    std::string block, file;
+    appendBE(block, 0, 4);                  // isutcnt
+    appendBE(block, 0, 4);                  // isstdcnt
+    appendBE(block, 0, 4);                  // leapcnt
+    appendBE(block, 0, 4);                  // timecnt
+    appendBE(block, 1, 4);                  // typecnt
+    appendBE(block, strlen(abbr) + 1, 4);   // charcnt
+    std::string data;
+    appendBE(data, (unsigned int)stdOffset, 4);
+    data += '\0';                           // isdst
+    data += '\0';                           // abbreviation index
+    data.append(abbr, strlen(abbr) + 1);
+    for (int v = 0; v < 2; v++) {
+        file += "TZif2";
+        file.append(15, '\0');
+        file += block;
+        file += data;
+    }
+    file += '\n';
+    file += rule;
+    file += '\n';
+    return file;
+}
+
+static long long utcOf(int y, int mo, int d, int h, int mi, int s)
+{
+    std::array<int, 6> date = {{ y, mo, d, h, mi, s }};
+    return daysFromCivil(date[0], date[1], date[2]) * 86400LL +
+           date[3] * 3600 + date[4] * 60 + date[5];
+}
+
+static void testTimeZone()
+{
+    int sts;
+    std::string cet = ScratchDir + "/cet.tzif", syd = ScratchDir + "/syd.tzif";
+    writeFile(cet, makeTzif(3600, "CET", "CET-1CEST,M3.5.0,M10.5.0/3"));
+    writeFile(syd, makeTzif(36000, "AEST", "AEST-10AEDT,M10.1.0,M4.1.0/3"));
+
+    TimeZone *tz = loadTimeZone(cet.c_str(), &sts);
+    if (CHECK(tz != NULL && sts == 0)) {
+        // 2021: last Sunday of March 01:00 UTC, last Sunday of October 01:00 UTC
+        CHECK(getZoneOffset(tz, utcOf(2021, 3, 28, 0, 59, 59)) == 3600);
+        CHECK(getZoneOffset(tz, utcOf(2021, 3, 28, 1, 0, 0)) == 7200);
+        CHECK(getZoneOffset(tz, utcOf(2021, 10, 31, 0, 59, 59)) == 7200);
+        CHECK(getZoneOffset(tz, utcOf(2021, 10, 31, 1, 0, 0)) == 3600);
+        // 2024 has five Sundays in March; the 31st is the last
+        CHECK(getZoneOffset(tz, utcOf(2024, 3, 31, 0, 59, 59)) == 3600);
+        CHECK(getZoneOffset(tz, utcOf(2024, 3, 31, 1, 0, 0)) == 7200);
+        CHECK(getZoneOffset(tz, utcOf(1975, 7, 1, 0, 0, 0)) == 7200);
+        CHECK(getZoneOffset(tz, utcOf(2090, 7, 1, 0, 0, 0)) == 7200);
+        CHECK(getZoneOffset(tz, utcOf(2090, 12, 1, 0, 0, 0)) == 3600);
+        freeTimeZone(tz);
+    }
+    tz = loadTimeZone(syd.c_str(), &sts);
+    if (CHECK(tz != NULL && sts == 0)) {
+        // southern hemisphere: DST spans the turn of the year
+        CHECK(getZoneOffset(tz, utcOf(2021, 1, 15, 0, 0, 0)) == 39600);
+        CHECK(getZoneOffset(tz, utcOf(2021, 4, 3, 15, 59, 59)) == 39600);
+        CHECK(getZoneOffset(tz, utcOf(2021, 4, 3, 16, 0, 0)) == 36000);
+        CHECK(getZoneOffset(tz, utcOf(2021, 10, 2, 15, 59, 59)) == 36000);
+        CHECK(getZoneOffset(tz, utcOf(2021, 10, 2, 16, 0, 0)) == 39600);
+        freeTimeZone(tz);
+    }
+    tz = loadTimeZone("+05:45", &sts);
+    if (CHECK(tz != NULL)) {
+        CHECK(getZoneOffset(tz, utcOf(2021, 6, 1, 0, 0, 0)) == 5 * 3600 + 45 * 60);
+        freeTimeZone(tz);
+    }
+    CHECK(loadTimeZone("No/Such_Zone", &sts) == NULL && sts == ERR_READ_FILE);
+
+    // the system database, where there is one, against the C library
+    static const char *zones[] = { "Europe/Berlin", "America/New_York", "Australia/Sydney" };
+    for (size_t z = 0; z < sizeof(zones) / sizeof(zones[0]); z++) {
+        tz = loadTimeZone(zones[z], &sts);
+        if (!tz) {
+            continue;
+        }
+        setenv("TZ", zones[z], 1);
+        tzset();
+        std::mt19937_64 rng(3);
+        for (int i = 0; i < 2000; i++) {
+            // 1980 .. 2037: time_t and the C library agree there
+            time_t t = (time_t)(315532800LL + (long long)(rng() % 1814400000ULL));
+            struct tm tm;
+            localtime_r(&t, &tm);
+            CHECK(getZoneOffset(tz, (long long)t) == (int)tm.tm_gmtoff);
+        }
+        freeTimeZone(tz);
+    }
+    unsetenv("TZ");
+    tzset();
+}
+
+static void checkSplit(const std::vector<picture>& input, const char *what)
+{
+    for (int rule = 0; rule < 6; rule++) {
+        std::vector<picture> pics = input;
+        std::vector<picsInoneTime> got, want;
+        splitpicsOntime(pics, rule, got);
+        referenceSplit(input, rule, want);
+        if (!CHECK(groupList(got, rule) == groupList(want, rule))) {
+            fprintf(stderr, "  %s, rule %d\n", what, rule);
+        }
+    }
+}
+
+static void testSplit()
+{
+    std::vector<picture> pics = randomPictures(20000, 4), sorted = pics;
+    std::stable_sort(sorted.begin(), sorted.end(), comppics);
+    checkSplit(pics, "shuffled");
+    checkSplit(sorted, "sorted");
+
+    // a handful of presorted runs (cards of several cameras), one of
+    // them descending: merged, and stable for equal dates
+    std::vector<picture> runs;
+    for (int r = 0; r < 5; r++) {
+        std::vector<picture> run = randomPictures(3000, 10 + r);
+        for (size_t i = 0; i < run.size(); i++) {
+            run[i].filepath += (char)('a' + r);
+        }
+        std::stable_sort(run.begin(), run.end(), comppics);
+        if (r == 2) {
+            std::reverse(run.begin(), run.end());
+        }
+        runs.insert(runs.end(), run.begin(), run.end());
+    }
+    checkSplit(runs, "presorted runs");
+
+    std::vector<picture> merged = sorted, want = sorted;
+    std::vector<picsInoneTime> groups;
+    splitpicsOntime(merged, 5, groups);
+    size_t k = 0;
+    for (size_t g = 0; g < groups.size(); g++) {
+        for (size_t i = 0; i < groups[g].pic.size(); i++, k++) {
+            // sorted input keeps its order exactly
+            CHECK(groups[g].pic[i].filepath == want[k].filepath);
+        }
+    }
+    std::vector<picture> none;
+    splitpicsOntime(none, 2, groups);
+    CHECK(groups.empty());
+}
+
+static void testCatalogue()
+{
+    std::string path = ScratchDir + "/photos.cat";
+    std::vector<picture> pics = randomPictures(5000, 5);
+    int sts;
+    CHECK(writeCatalogue(path.c_str(), pics, CATALOGUE_ALL_RULES & ~CATALOGUE_RULE(4)) == 0);
+    Catalogue *cat = openCatalogue(path.c_str(), &sts);
+    if (!CHECK(cat != NULL && sts == 0)) {
+        return;
+    }
+    CHECK(getCatalogueSize(cat) == pics.size());
+    const unsigned long long *keys = getCatalogueDateKeys(cat);
+    for (size_t r = 1; r < getCatalogueSize(cat); r++) {
+        CHECK(keys[r - 1] < keys[r] ||
+              (keys[r - 1] == keys[r] &&
+               strcmp(getCataloguePath(cat, r - 1), getCataloguePath(cat, r)) < 0));
+    }
+    std::map<std::string, const picture*> byPath;
+    for (size_t i = 0; i < pics.size(); i++) {
+        byPath[pics[i].filepath] = &pics[i];
+    }
+    for (size_t r = 0; r < getCatalogueSize(cat); r++) {
+        picture pic;
+        getCataloguePicture(cat, r, pic);
+        const picture *orig = byPath.count(pic.filepath) ? byPath[pic.filepath] : NULL;
+        CHECK(orig && orig->date == pic.date && orig->orien == pic.orien &&
+              orig->filename == pic.filename);
+    }
+    CHECK(getCataloguePath(cat, pics.size())[0] == '\0');
+    for (int rule = 0; rule < 6; rule++) {
+        std::vector<picsInoneTime> got, want;
+        sts = catalogueToGroups(cat, rule, got);
+        if (rule == 4) {
+            CHECK(sts == ERR_NOT_EXIST && got.empty());
+            continue;
+        }
+        referenceSplit(pics, rule, want);
+        CHECK(sts == 0 && groupList(got, rule) == groupList(want, rule));
+    }
+    closeCatalogue(cat);
+
+    writeFile(path, "not a catalogue at all, but long enough to have a header........"
+                    "................................................................");
+    CHECK(openCatalogue(path.c_str(), &sts) == NULL && sts == ERR_INVALID_ID);
+}
+
+// a move run that died half way, finished by resumeMoveJournal()
+static void testJournal()
+{
+    static const char *names[] = { "A.JPG", "B.JPG", "C.JPG", "E.JPG", "F.JPG" };
+    std::string src = ScratchDir + "/src", out = ScratchDir + "/out";
+    std::string dir = out + "/2016/01", journal = ScratchDir + "/run.journal";
+    std::vector<picsInoneTime> groups(1);
+    MaterialiseStats stats;
+    int sts;
+
+    mkdir(src.c_str(), 0755);
+    for (int i = 0; i < 5; i++) {
+        picture pic;
+        pic.date = {{ 2016, 1, 2, 3, 4, 5 }};
+        pic.filepath = src + "/" + names[i];
+        pic.filename = names[i];
+        pic.orien = 1;
+        groups[0].pic.push_back(pic);
+    }
+    setJournalSyncEvery(1);
+    // no source exists yet: every operation fails after the plan is
+    // durable, so the journal stays for a resume
+    sts = materialiseGroupsJournaled(groups, 1, out.c_str(), PLACE_MOVE, 2, NULL,
+                                     journal.c_str(), &stats);
+    CHECK(sts < 0 && exists(journal) && exists(dir));
+
+    // A: moved, its completion lost
+    writeFile(dir + "/A.JPG", "a");
+    // B: the name was taken by an unrelated file since the plan was made
+    writeFile(src + "/B.JPG", "bb-photo");
+    writeFile(dir + "/B.JPG", "unrelated");
+    // C: linked into place, the unlink of the source lost
+    writeFile(src + "/C.JPG", "c");
+    CHECK(link((src + "/C.JPG").c_str(), (dir + "/C.JPG").c_str()) == 0);
+    // E: copied across file systems with its time stamps, unlink lost
+    writeFile(src + "/E.JPG", "eee");
+    writeFile(dir + "/E.JPG", "eee");
+    {
+        struct stat st;
+        stat((src + "/E.JPG").c_str(), &st);
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        utimensat(AT_FDCWD, (dir + "/E.JPG").c_str(), times, 0);
+    }
+    // F: never started, but its copy left a temporary behind
+    writeFile(src + "/F.JPG", "f");
+    writeFile(dir + "/.F.JPG.part", "f-partial");
+    // and the last record was torn
+    {
+        FILE *fp = fopen(journal.c_str(), "ab");
+        fwrite("TORN", 1, 4, fp);
+        fclose(fp);
+    }
+
+    sts = resumeMoveJournal(journal.c_str(), 2, NULL, &stats);
+    CHECK(sts == 0);
+    CHECK(!exists(journal));
+    CHECK(readFile(dir + "/A.JPG") == "a");
+    CHECK(readFile(dir + "/B.JPG") == "unrelated");
+    CHECK(readFile(dir + "/B_1.JPG") == "bb-photo");
+    CHECK(readFile(dir + "/C.JPG") == "c");
+    CHECK(readFile(dir + "/E.JPG") == "eee");
+    CHECK(readFile(dir + "/F.JPG") == "f");
+    CHECK(!exists(dir + "/.F.JPG.part"));
+    for (int i = 0; i < 5; i++) {
+        CHECK(!exists(src + "/" + names[i]));
+    }
+    CHECK(resumeMoveJournal(journal.c_str(), 2, NULL, &stats) == ERR_NOT_EXIST);
+}
+
+static void testShard(const char *corpus)
+{
+    std::vector<std::string> roots(1, corpus);
+    std::string runDir = ScratchDir + "/runs";
+    std::vector<picture> pics;
+    std::vector<picsInoneTime> got, want;
+    const int shards = 3;
+    int total = 0, sts;
+
+    mkdir(runDir.c_str(), 0755);
+    unsigned long long job = newShardJobId(roots);
+    for (int s = 0; s < shards; s++) {
+        sts = runShardWorker(roots, s, shards, job, runDir.c_str(), NULL);
+        CHECK(sts >= 0);
+        total += (sts > 0) ? sts : 0;
+    }
+    // the same photos read by one process
+    std::vector<WalkEntry> found;
+    walkPhotoTrees(roots, NULL, 0, found);
+    ingestPhotos(found, NULL, pics, NULL);
+    CHECK(total == (int)pics.size());
+    for (int rule = 0; rule < 6; rule += 2) {
+        sts = mergeShardRuns(runDir.c_str(), shards, job, rule, got);
+        referenceSplit(pics, rule, want);
+        CHECK(sts == (int)pics.size());
+        CHECK(groupList(got, rule) == groupList(want, rule));
+        for (size_t g = 0; g < got.size(); g++) {
+            for (size_t i = 1; i < got[g].pic.size(); i++) {
+                CHECK(!comppics(got[g].pic[i], got[g].pic[i - 1]));
+            }
+        }
+    }
+    CHECK(mergeShardRuns(runDir.c_str(), shards, job + 1, 2, got) == ERR_INVALID_ID);
+    CHECK(mergeShardRuns(runDir.c_str(), shards + 1, job, 2, got) < 0);
+}
+
+// every file of the corpus parses to what the generator wrote
+static void testManifest(const char *corpus)
+{
+    std::string path = std::string(corpus) + "/manifest.tsv";
+    char line[1024];
+    int files = 0;
+    FILE *fp = fopen(path.c_str(), "r");
+    if (!CHECK(fp != NULL)) {
+        return;
+    }
+    if (!fgets(line, sizeof(line), fp)) {
+        line[0] = '\0';
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char file[512], date[32], offset[16], damage[32];
+        int orientation;
+        ImgResult res;
+        MetaCacheRecord rec;
+        if (sscanf(line, "%511[^\t]\t%31[^\t]\t%15[^\t]\t%d\t%*[^\t]\t%31[^\n]",
+                   file, date, offset, &orientation, damage) != 5) {
+            CHECK(!"manifest line");
+            continue;
+        }
+        std::string full = std::string(corpus) + "/" + file;
+        int sts = readImgInfo(full.c_str(), &res);
+        readImgMeta(full.c_str(), &rec);
+        files++;
+        if (strcmp(date, "-") == 0) {
+            date[0] = '\0';
+        }
+        if (strcmp(damage, "-") == 0) {
+            if (!CHECK(sts > 0 && strcmp(res.date, date) == 0 &&
+                       res.orientation == orientation)) {
+                fprintf(stderr, "  %s: status %d date [%s] orientation %d\n",
+                        file, sts, res.date, res.orientation);
+            }
+            if (strcmp(offset, "-") != 0) {
+                CHECK(rec.utcOffset == atoi(offset));
+            }
+        } else if (strcmp(damage, "tag-count") == 0) {
+            // only the damaged tag is lost
+            CHECK(sts > 0 && strcmp(res.date, date) == 0);
+        } else {
+            // the Exif segment can't be trusted: nothing is taken from it
+            if (!CHECK(sts < 0 && res.date[0] == '\0' && rec.dateKey == DATEKEY_NONE)) {
+                fprintf(stderr, "  %s (%s): status %d date [%s]\n", file, damage, sts, res.date);
+            }
+        }
+    }
+    fclose(fp);
+    CHECK(files > 0);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *corpus = (argc > 1) ? argv[1] : NULL;
+    const char *tmp = getenv("TMPDIR");
+    char dir[512];
+
+    snprintf(dir, sizeof(dir), "%s/exiftests.XXXXXX", tmp ? tmp : "/tmp");
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "can't create a scratch directory below %s\n", tmp ? tmp : "/tmp");
+        return 1;
+    }
+    ScratchDir = dir;
+
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        { "datekey", testDateKey },
+        { "dateindex", testDateIndex },
+        { "tzone", testTimeZone },
+        { "fastcluster", testSplit },
+        { "catalogue", testCatalogue },
+        { "journal", testJournal },
+    };
+    for (size_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+        int before = Failures;
+        tests[t].run();
+        printf("%-12s %s\n", tests[t].name, (Failures == before) ? "ok" : "FAILED");
+    }
+    if (corpus) {
+        int before = Failures;
+        testShard(corpus);
+        printf("%-12s %s\n", "shard", (Failures == before) ? "ok" : "FAILED");
+        before = Failures;
+        testManifest(corpus);
+        printf("%-12s %s\n", "manifest", (Failures == before) ? "ok" : "FAILED");
+    } else {
+        printf("shard        skipped (no corpus)\nmanifest     skipped (no corpus)\n");
+    }
+
+    nftw(dir, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+    printf("%d checks, %d failed\n", Checks, Failures);
+    return (Failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,264 @@
+/*
+ * Span tracing in the Chrome trace event format
+ *
+ * Each thread appends its spans to its own buffer.  The buffer has a
+ * lock, but only writeChromeTrace() and startTrace() ever take it from
+ * another thread, so recording a span never waits.  Buffers of threads
+ * that have ended are kept until the next startTrace(), since the
+ * pipeline's workers usually end before the trace is written.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#include "exif.hpp"
+#include "trace.h"
+
+static const char *TraceHeader = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+#if defined(EXIF_TRACE)
+
+typedef struct {
+    const char *name;
+    unsigned long long start;   // ns since the trace started
+    unsigned long long dur;     // ns
+    size_t arg;                 // offset into args + 1, 0 = none
+} TRACE_EVENT;
+
+struct TraceBuffer {
+    std::mutex lock;
+    long tid;
+    unsigned long long dropped;
+    std::vector<TRACE_EVENT> events;
+    std::string args;
+};
+
+static std::atomic<int> Enabled(0);
+static std::atomic<unsigned long long> Epoch(0);
+static std::mutex BufferLock;
+static std::vector<TraceBuffer*> Buffers;   // of the running threads
+static std::vector<TraceBuffer*> Retired;   // of the threads that have ended
+
+static void clearBuffer(TraceBuffer *b)
+{
+    b->events.clear();
+    b->args.clear();
+    b->dropped = 0;
+}
+
+// registers the thread's buffer on first use and retires it at thread exit
+struct BufferOwner {
+    TraceBuffer *buffer;
+    ~BufferOwner()
+    {
+        if (!buffer) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(BufferLock);
+        for (size_t i = 0; i < Buffers.size(); i++) {
+            if (Buffers[i] == buffer) {
+                Buffers[i] = Buffers.back();
+                Buffers.pop_back();
+                break;
+            }
+        }
+        if (buffer->events.empty() && !buffer->dropped) {
+            delete buffer;
+        } else {
+            Retired.push_back(buffer);
+        }
+    }
+};
+
+static thread_local BufferOwner Owner;
+
+static long threadId()
+{
+#if defined(__linux__)
+    return (long)syscall(SYS_gettid);
+#else
+    static std::atomic<long> next(1);
+    return next++;
+#endif
+}
+
+static TraceBuffer *myBuffer()
+{
+    if (!Owner.buffer) {
+        TraceBuffer *buffer = new TraceBuffer();
+        buffer->tid = threadId();
+        buffer->dropped = 0;
+        std::lock_guard<std::mutex> guard(BufferLock);
+        Buffers.push_back(buffer);
+        Owner.buffer = buffer;
+    }
+    return Owner.buffer;
+}
+
+static unsigned long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * traceNow()
+ *
+ * Start time of a span
+ */
+unsigned long long traceNow()
+{
+    return Enabled.load(std::memory_order_relaxed) ? nowNs() : 0;
+}
+
+/**
+ * traceSpan()
+ *
+ * Record a span that started at `start` and ends now
+ */
+void traceSpan(const char *name, unsigned long long start, const char *arg)
+{
+    unsigned long long epoch = Epoch.load(std::memory_order_relaxed);
+    if (!start || start < epoch) {
+        return; // not recorded, or begun before the trace was restarted
+    }
+    unsigned long long end = nowNs();
+    TraceBuffer *b = myBuffer();
+    std::lock_guard<std::mutex> guard(b->lock);
+    if (b->events.size() >= TRACE_MAX_EVENTS) {
+        b->dropped++;
+        return;
+    }
+    TRACE_EVENT ev = { name, start - epoch, end - start, 0 };
+    if (arg) {
+        ev.arg = b->args.size() + 1;
+        b->args.append(arg);
+        b->args.push_back('\0');
+    }
+    b->events.push_back(ev);
+}
+
+static void writeString(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', fp);
+            fputc(c, fp);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+// write the spans of a buffer; returns the number written
+static int writeBuffer(FILE *fp, TraceBuffer *b, int pid, int written,
+                       unsigned long long *dropped)
+{
+    std::lock_guard<std::mutex> guard(b->lock);
+    for (size_t i = 0; i < b->events.size(); i++) {
+        const TRACE_EVENT& ev = b->events[i];
+        fprintf(fp, "%s\n{\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,\"ts\":%llu.%03llu,"
+                    "\"dur\":%llu.%03llu,\"name\":",
+                (written > 0) ? "," : "", pid, b->tid,
+                ev.start / 1000, ev.start % 1000, ev.dur / 1000, ev.dur % 1000);
+        writeString(fp, ev.name);
+        if (ev.arg) {
+            fputs(",\"args\":{\"file\":", fp);
+            writeString(fp, b->args.c_str() + ev.arg - 1);
+            fputc('}', fp);
+        }
+        fputc('}', fp);
+        written++;
+    }
+    *dropped += b->dropped;
+    return written;
+}
+
+#endif // EXIF_TRACE
+
+/**
+ * startTrace()
+ *
+ * Discard what was recorded so far and start recording
+ */
+void startTrace()
+{
+#if defined(EXIF_TRACE)
+    std::lock_guard<std::mutex> guard(BufferLock);
+    for (size_t i = 0; i < Retired.size(); i++) {
+        delete Retired[i];
+    }
+    Retired.clear();
+    for (size_t i = 0; i < Buffers.size(); i++) {
+        std::lock_guard<std::mutex> bufferGuard(Buffers[i]->lock);
+        clearBuffer(Buffers[i]);
+    }
+    Epoch = nowNs();
+    Enabled = 1;
+#endif
+}
+
+/**
+ * stopTrace()
+ *
+ * Stop recording
+ */
+void stopTrace()
+{
+#if defined(EXIF_TRACE)
+    Enabled = 0;
+#endif
+}
+
+/**
+ * writeChromeTrace()
+ *
+ * Write the recorded spans of all threads as Chrome trace JSON
+ */
+int writeChromeTrace(const char *path)
+{
+    std::string tmp = std::string(path) + ".tmp";
+    unsigned long long dropped = 0;
+    int written = 0;
+    FILE *fp;
+    int ok;
+
+    fp = fopen(tmp.c_str(), "w");
+    if (!fp) {
+        return ERR_WRITE_FILE;
+    }
+    fputs(TraceHeader, fp);
+#if defined(EXIF_TRACE)
+    {
+        int pid = (int)getpid();
+        std::lock_guard<std::mutex> guard(BufferLock);
+        for (size_t i = 0; i < Retired.size(); i++) {
+            written = writeBuffer(fp, Retired[i], pid, written, &dropped);
+        }
+        for (size_t i = 0; i < Buffers.size(); i++) {
+            written = writeBuffer(fp, Buffers[i], pid, written, &dropped);
+        }
+    }
+#endif
+    fprintf(fp, "\n],\"otherData\":{\"dropped\":%llu}}\n", dropped);
+    ok = (fflush(fp) == 0);
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path) != 0) {
+        remove(tmp.c_str());
+        return ERR_WRITE_FILE;
+    }
+    return written;
+}
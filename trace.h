@@ -0,0 +1,121 @@
+/*
+ * Span tracing in the Chrome trace event format
+ *
+ * Spans are recorded into a buffer owned by the calling thread and
+ * written out on demand as Chrome trace JSON, which Perfetto
+ * (ui.perfetto.dev) and chrome://tracing open directly; every thread
+ * gets its own track, so a slow batch shows at a glance whether the
+ * walker, the parser pool or the materialiser held it up.
+ *
+ * Tracing is compiled in only when EXIF_TRACE is defined.  Without it
+ * the TRACE_* macros expand to nothing, so the instrumented code is
+ * exactly what it would be without them; the functions below still
+ * exist and write an empty trace.  With it, recording still only starts
+ * with startTrace(); until then a span costs one relaxed load.
+ *
+ *   Typical Usage:
+ *
+ *   TRACE_SCOPE("sort");                 // until the end of the block
+ *
+ *   TRACE_DECL(span);                    // before any goto
+ *   TRACE_BEGIN(span);
+ *   ...
+ *   TRACE_END(span, "parse_ifd");        // records nothing if not begun
+ *
+ *   startTrace();
+ *   ...
+ *   writeChromeTrace("ingest.trace.json");
+ */
+#if !defined(_TRACE_H_)
+#define _TRACE_H_
+
+#if defined(EXIF_TRACE)
+
+#define TRACE_CAT2(a, b)             a##b
+#define TRACE_CAT(a, b)              TRACE_CAT2(a, b)
+#define TRACE_DECL(var)              unsigned long long var = 0
+#define TRACE_BEGIN(var)             (var) = traceNow()
+#define TRACE_END(var, name)         traceSpan((name), (var), NULL)
+#define TRACE_END_ARG(var, name, arg) traceSpan((name), (var), (arg))
+#define TRACE_SCOPE(name)            TraceScope TRACE_CAT(traceScope_, __LINE__)((name), NULL)
+#define TRACE_SCOPE_ARG(name, arg)   TraceScope TRACE_CAT(traceScope_, __LINE__)((name), (arg))
+
+/**
+ * traceNow()
+ *
+ * Start time of a span
+ *
+ * return
+ *  start time to pass to traceSpan(), 0 when not recording
+ */
+unsigned long long traceNow();
+
+/**
+ * traceSpan()
+ *
+ * Record a span that started at `start` and ends now
+ *
+ * parameters
+ *  [in] name : span name; must be a string literal (only the pointer is kept)
+ *  [in] start : traceNow() of the span (0 = not recorded)
+ *  [in] arg : shown as args.file of the span, copied (NULL = none)
+ */
+void traceSpan(const char *name, unsigned long long start, const char *arg);
+
+// records a span from its construction to the end of the enclosing block
+struct TraceScope {
+    const char *name;
+    const char *arg;
+    unsigned long long start;
+    TraceScope(const char *n, const char *a) : name(n), arg(a), start(traceNow()) {}
+    ~TraceScope() { traceSpan(name, start, arg); }
+};
+
+#else
+
+#define TRACE_DECL(var)
+#define TRACE_BEGIN(var)
+#define TRACE_END(var, name)
+#define TRACE_END_ARG(var, name, arg)
+#define TRACE_SCOPE(name)
+#define TRACE_SCOPE_ARG(name, arg)
+
+#endif // EXIF_TRACE
+
+#define TRACE_MAX_EVENTS  (1 << 20)   // per thread; later spans are dropped
+
+/**
+ * startTrace()
+ *
+ * Discard what was recorded so far and start recording
+ */
+void startTrace();
+
+/**
+ * stopTrace()
+ *
+ * Stop recording; what was recorded is kept for writeChromeTrace()
+ */
+void stopTrace();
+
+/**
+ * writeChromeTrace()
+ *
+ * Write the recorded spans of all threads as Chrome trace JSON
+ *
+ * parameters
+ *  [in] path : output file; written as path.tmp and renamed
+ *
+ * return
+ *   n: number of spans written
+ *  -n: error
+ *      ERR_WRITE_FILE
+ *
+ * note
+ * May be called while recording; spans still open are not included.
+ * Spans dropped because a thread's buffer was full are counted in
+ * otherData.dropped of the output.
+ */
+int writeChromeTrace(const char *path);
+
+#endif // _TRACE_H_
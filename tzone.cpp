@@ -0,0 +1,497 @@
+/*
+ * Time zone correction
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+#include "exif.hpp"
+#include "datekey.h"
+#include "tzone.h"
+
+struct _timeZone {
+    std::vector<long long> at;  // UTC instants of the transitions, ascending
+    std::vector<int> offset;    // offset[i] applies before at[i], the last
+                                // one after all of them (size at + 1)
+};
+
+// a transition date of a POSIX TZ rule
+typedef struct {
+    char kind;   // 'M' month.week.day, 'J' julian day 1..365, 'N' day 0..365
+    int month;
+    int week;
+    int wday;
+    int day;
+    int secs;    // local time of day of the change
+} TZ_RULE_DATE;
+
+// the POSIX TZ string at the end of a TZif file
+typedef struct {
+    int stdOffset;  // seconds east of UTC
+    int dstOffset;
+    int hasDst;
+    TZ_RULE_DATE start;
+    TZ_RULE_DATE end;
+} TZ_RULE;
+
+static long long readBE(const unsigned char *p, int bytes)
+{
+    unsigned long long v = 0;
+    for (int i = 0; i < bytes; i++) {
+        v = (v << 8) | p[i];
+    }
+    // sign extend
+    if (bytes < 8 && (v & (1ULL << (bytes * 8 - 1)))) {
+        v |= ~0ULL << (bytes * 8);
+    }
+    return (long long)v;
+}
+
+// [+-]hh[:mm[:ss]] -> seconds; NULL if malformed
+static const char *parseTime(const char *p, int *secs)
+{
+    int sign = 1, v[3] = { 0, 0, 0 };
+    if (*p == '+' || *p == '-') {
+        sign = (*p == '-') ? -1 : 1;
+        p++;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (!isdigit((unsigned char)*p)) {
+            if (i == 0) {
+                return NULL;
+            }
+            break;
+        }
+        while (isdigit((unsigned char)*p)) {
+            v[i] = v[i] * 10 + (*p++ - '0');
+        }
+        if (*p != ':') {
+            break;
+        }
+        p++;
+    }
+    *secs = sign * (v[0] * 3600 + v[1] * 60 + v[2]);
+    return p;
+}
+
+static const char *parseZoneName(const char *p)
+{
+    if (*p == '<') {
+        const char *q = strchr(p, '>');
+        return q ? q + 1 : NULL;
+    }
+    const char *start = p;
+    while (isalpha((unsigned char)*p)) {
+        p++;
+    }
+    return (p - start >= 3) ? p : NULL;
+}
+
+static const char *parseRuleDate(const char *p, TZ_RULE_DATE *d)
+{
+    memset(d, 0, sizeof(*d));
+    d->secs = 2 * 3600;
+    if (*p == 'M') {
+        d->kind = 'M';
+        if (sscanf(p + 1, "%d.%d.%d", &d->month, &d->week, &d->wday) != 3) {
+            return NULL;
+        }
+        p++;
+        while (isdigit((unsigned char)*p) || *p == '.') {
+            p++;
+        }
+    } else {
+        d->kind = 'N';
+        if (*p == 'J') {
+            d->kind = 'J';
+            p++;
+        }
+        if (!isdigit((unsigned char)*p)) {
+            return NULL;
+        }
+        d->day = (int)strtol(p, (char**)&p, 10);
+    }
+    if (*p == '/') {
+        p = parseTime(p + 1, &d->secs);
+    }
+    return p;
+}
+
+// parse e.g. "CET-1CEST,M3.5.0,M10.5.0/3"; 1 = OK
+static int parseRule(const char *p, TZ_RULE *rule)
+{
+    int secs;
+    memset(rule, 0, sizeof(*rule));
+    if (!(p = parseZoneName(p)) || !(p = parseTime(p, &secs))) {
+        return 0;
+    }
+    // POSIX offsets count west of UTC
+    rule->stdOffset = -secs;
+    if (*p == '\0' || *p == '\n') {
+        return 1;
+    }
+    if (!(p = parseZoneName(p))) {
+        return 0;
+    }
+    rule->hasDst = 1;
+    rule->dstOffset = rule->stdOffset + 3600;
+    if (*p != ',' && *p != '\0' && *p != '\n') {
+        if (!(p = parseTime(p, &secs))) {
+            return 0;
+        }
+        rule->dstOffset = -secs;
+    }
+    if (*p != ',' || !(p = parseRuleDate(p + 1, &rule->start)) ||
+        *p != ',' || !(p = parseRuleDate(p + 1, &rule->end))) {
+        // DST without rules: the US rules POSIX implies
+        return 0;
+    }
+    return 1;
+}
+
+// day (since 1970) a rule date falls on in a year
+static long long ruleDay(int year, const TZ_RULE_DATE *d)
+{
+    long long jan1 = daysFromCivil(year, 1, 1);
+    int leap = (daysFromCivil(year + 1, 1, 1) - jan1) == 366;
+    if (d->kind == 'J') {
+        return jan1 + d->day - 1 + (leap && d->day >= 60);
+    }
+    if (d->kind == 'N') {
+        return jan1 + d->day;
+    }
+    long long first = daysFromCivil(year, d->month, 1);
+    long long next = (d->month == 12) ? daysFromCivil(year + 1, 1, 1)
+                                      : daysFromCivil(year, d->month + 1, 1);
+    // 1970-01-01 was a Thursday
+    int dow = (int)(((first + 4) % 7 + 7) % 7);
+    long long day = first + (d->wday - dow + 7) % 7 + (d->week - 1) * 7;
+    while (day >= next) {
+        day -= 7;  // week 5 = the last one
+    }
+    return day;
+}
+
+// append the transitions of the rule after the table's last one
+static void expandRule(TimeZone *tz, const TZ_RULE *rule)
+{
+    int year = 1970;
+    if (!rule->hasDst) {
+        if (tz->at.empty()) {
+            tz->offset.back() = rule->stdOffset;
+        }
+        return;
+    }
+    if (!tz->at.empty()) {
+        int m, d;
+        civilFromDays(tz->at.back() / 86400, &year, &m, &d);
+    }
+    for (; year <= TZONE_LAST_YEAR; year++) {
+        std::pair<long long, int> t[2];
+        t[0].first = ruleDay(year, &rule->start) * 86400 + rule->start.secs - rule->stdOffset;
+        t[0].second = rule->dstOffset;
+        t[1].first = ruleDay(year, &rule->end) * 86400 + rule->end.secs - rule->dstOffset;
+        t[1].second = rule->stdOffset;
+        if (t[1].first < t[0].first) {
+            std::swap(t[0], t[1]); // southern hemisphere
+        }
+        for (int i = 0; i < 2; i++) {
+            if (tz->at.empty() || t[i].first > tz->at.back()) {
+                tz->at.push_back(t[i].first);
+                tz->offset.push_back(t[i].second);
+            }
+        }
+    }
+}
+
+// parse a TZif file (RFC 8536); 0 = OK
+static int parseTzif(TimeZone *tz, const std::string& data)
+{
+    const unsigned char *p = (const unsigned char*)data.data();
+    size_t len = data.size(), pos = 0;
+    int timeSize = 4;
+    long long counts[6];
+    TZ_RULE rule;
+
+    if (len < 44 || memcmp(p, "TZif", 4) != 0) {
+        return ERR_INVALID_ID;
+    }
+    for (;;) {
+        size_t body;
+        if (pos + 44 > len) {
+            return ERR_INVALID_ID;
+        }
+        // isutcnt, isstdcnt, leapcnt, timecnt, typecnt, charcnt
+        for (int i = 0; i < 6; i++) {
+            counts[i] = readBE(p + pos + 20 + 4 * i, 4);
+            if (counts[i] < 0) {
+                return ERR_INVALID_ID;
+            }
+        }
+        body = counts[3] * timeSize + counts[3] + counts[4] * 6 + counts[5] +
+               counts[2] * (timeSize + 4) + counts[1] + counts[0];
+        if (pos + 44 + body > len) {
+            return ERR_INVALID_ID;
+        }
+        // version 2+ repeats the data with 64-bit times; use that
+        if (timeSize == 4 && p[4] >= '2') {
+            pos += 44 + body;
+            timeSize = 8;
+            continue;
+        }
+        break;
+    }
+    const unsigned char *times = p + pos + 44;
+    const unsigned char *idx = times + counts[3] * timeSize;
+    const unsigned char *types = idx + counts[3];
+    if (counts[4] == 0) {
+        return ERR_INVALID_ID;
+    }
+    tz->offset.push_back((int)readBE(types, 4));
+    for (long long i = 0; i < counts[3]; i++) {
+        if (idx[i] >= counts[4]) {
+            return ERR_INVALID_ID;
+        }
+        tz->at.push_back(readBE(times + i * timeSize, timeSize));
+        tz->offset.push_back((int)readBE(types + idx[i] * 6, 4));
+    }
+    // the footer rule covers the time after the last transition
+    if (timeSize == 8) {
+        size_t foot = pos + 44 + counts[3] * 8 + counts[3] + counts[4] * 6 + counts[5] +
+                      counts[2] * 12 + counts[1] + counts[0];
+        if (foot < len && p[foot] == '\n') {
+            std::string tzstr = data.substr(foot + 1);
+            if (parseRule(tzstr.c_str(), &rule)) {
+                expandRule(tz, &rule);
+            }
+        }
+    }
+    return 0;
+}
+
+// "+09:00", "-0330", "+9" -> seconds east; 1 = it is one
+static int parseFixedOffset(const char *name, int *secs)
+{
+    int sign, h = 0, m = 0, digits = 0;
+    if (*name != '+' && *name != '-') {
+        return 0;
+    }
+    sign = (*name == '-') ? -1 : 1;
+    for (name++; isdigit((unsigned char)*name) && digits < 2; name++, digits++) {
+        h = h * 10 + (*name - '0');
+    }
+    if (*name == ':') {
+        name++;
+    }
+    if (isdigit((unsigned char)name[0]) && isdigit((unsigned char)name[1])) {
+        m = (name[0] - '0') * 10 + (name[1] - '0');
+        name += 2;
+    }
+    if (digits == 0 || *name != '\0' || h > 14 || m > 59) {
+        return 0;
+    }
+    *secs = sign * (h * 3600 + m * 60);
+    return 1;
+}
+
+/**
+ * loadTimeZone()
+ *
+ * Load a time zone
+ */
+TimeZone *loadTimeZone(const char *name, int *pResult)
+{
+    std::string path, data;
+    int secs, sts = 0;
+    FILE *fp;
+    TimeZone *tz = new (std::nothrow) TimeZone();
+    if (!tz) {
+        sts = ERR_MEMALLOC;
+        goto DONE;
+    }
+    if (strcmp(name, "UTC") == 0 || strcmp(name, "Z") == 0) {
+        tz->offset.push_back(0);
+        goto DONE;
+    }
+    if (parseFixedOffset(name, &secs)) {
+        tz->offset.push_back(secs);
+        goto DONE;
+    }
+    if (name[0] == '/') {
+        path = name;
+    } else {
+        const char *dir = getenv("TZDIR");
+        if (strstr(name, "..")) {
+            sts = ERR_READ_FILE;
+            goto DONE;
+        }
+        path = std::string(dir ? dir : "/usr/share/zoneinfo") + "/" + name;
+    }
+    fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+            data.append(buf, n);
+        }
+    }
+    fclose(fp);
+    sts = parseTzif(tz, data);
+DONE:
+    if (sts != 0) {
+        delete tz;
+        tz = NULL;
+    }
+    if (pResult) {
+        *pResult = sts;
+    }
+    return tz;
+}
+
+/**
+ * freeTimeZone()
+ *
+ * Free a zone
+ */
+void freeTimeZone(TimeZone *tz)
+{
+    delete tz;
+}
+
+/**
+ * getZoneOffset()
+ *
+ * Offset of the zone from UTC at an instant
+ */
+int getZoneOffset(const TimeZone *tz, long long utc)
+{
+    const long long *first = tz->at.data();
+    size_t len = tz->at.size();
+    // count the transitions at or before utc; the loop body compiles to
+    // conditional moves, so the only branch is the loop itself
+    while (len > 0) {
+        size_t half = len / 2;
+        int before = first[half] <= utc;
+        first = before ? first + half + 1 : first;
+        len = before ? len - half - 1 : half;
+    }
+    return tz->offset[first - tz->at.data()];
+}
+
+// "+hh:mm" / "-hh:mm" -> minutes; 1 = OK.  len: bytes readable at s,
+// which need not be NUL-terminated
+static int parseOffsetTime(const unsigned char *s, size_t len, int *minutes)
+{
+    int h, m;
+    if (!s || len < 6 || (s[0] != '+' && s[0] != '-') ||
+        !isdigit(s[1]) || !isdigit(s[2]) || s[3] != ':' || !isdigit(s[4]) || !isdigit(s[5])) {
+        return 0;
+    }
+    h = (s[1] - '0') * 10 + (s[2] - '0');
+    m = (s[4] - '0') * 10 + (s[5] - '0');
+    if (h > 14 || m > 59) {
+        return 0;
+    }
+    *minutes = ((s[0] == '-') ? -1 : 1) * (h * 60 + m);
+    return 1;
+}
+
+// UTC shooting time from GPSDateStamp + GPSTimeStamp; 1 = OK
+static int readGpsTime(void **ifdArray, long long *utc)
+{
+    const TagNodeInfo *date, *time;
+    std::array<int, 6> d;
+    char ymd[11];
+    int ok = 0;
+    date = findTagInfo(ifdArray, IFD_GPS, TAG_GPSDateStamp);
+    time = findTagInfo(ifdArray, IFD_GPS, TAG_GPSTimeStamp);
+    if (!date || !time || date->error || time->error || !date->byteData ||
+        date->count < 10) {
+        return 0;
+    }
+    // "YYYY:MM:DD", scanned from a terminated copy of the count bytes
+    memcpy(ymd, date->byteData, 10);
+    ymd[10] = '\0';
+    if (time->numData && time->count >= 3 &&
+        sscanf(ymd, "%d:%d:%d", &d[0], &d[1], &d[2]) == 3 &&
+        time->numData[1] && time->numData[3] && time->numData[5]) {
+        d[3] = 0;
+        d[4] = 0;
+        d[5] = 0;
+        *utc = dateToSeconds(d) +
+               (long long)(time->numData[0] / time->numData[1]) * 3600 +
+               (long long)(time->numData[2] / time->numData[3]) * 60 +
+               (long long)(time->numData[4] / time->numData[5]);
+        ok = 1;
+    }
+    return ok;
+}
+
+/**
+ * readUtcOffset()
+ *
+ * Offset of the shooting time from UTC as recorded in the Exif data
+ */
+int readUtcOffset(void **ifdArray)
+{
+    static const unsigned short offsetTags[] = { TAG_OffsetTimeOriginal, TAG_OffsetTime };
+    const TagNodeInfo *tag;
+    std::array<int, 6> local;
+    long long gps;
+    int minutes = UTC_OFFSET_UNKNOWN;
+
+    for (int i = 0; i < 2 && minutes == UTC_OFFSET_UNKNOWN; i++) {
+        tag = findTagInfo(ifdArray, IFD_EXIF, offsetTags[i]);
+        if (tag && !tag->error && !parseOffsetTime(tag->byteData, tag->count, &minutes)) {
+            minutes = UTC_OFFSET_UNKNOWN;
+        }
+    }
+    if (minutes != UTC_OFFSET_UNKNOWN) {
+        return minutes;
+    }
+    tag = findTagInfo(ifdArray, IFD_EXIF, TAG_DateTimeOriginal);
+    if (!tag) {
+        return UTC_OFFSET_UNKNOWN;
+    }
+    if (!tag->error && parseExifDate((const char*)tag->byteData, tag->count, local) &&
+        readGpsTime(ifdArray, &gps)) {
+        // zones are whole quarter hours; the rest is clock drift
+        long long diff = (dateToSeconds(local) - gps) / 60;
+        long long q = (diff >= 0) ? (diff + 7) / 15 : -((-diff + 7) / 15);
+        if (q * 15 >= -14 * 60 && q * 15 <= 14 * 60) {
+            minutes = (int)(q * 15);
+        }
+    }
+    return minutes;
+}
+
+/**
+ * dateKeyToZone()
+ *
+ * Move a date key from the zone it was shot in to the target zone
+ */
+unsigned long long dateKeyToZone(const TimeZone *tz, unsigned long long key,
+                                 int offsetMinutes)
+{
+    std::array<int, 6> date;
+    long long utc;
+    if (!tz || key == DATEKEY_NONE || offsetMinutes == UTC_OFFSET_UNKNOWN) {
+        return key;
+    }
+    unpackDateKey(key, date);
+    if (date[1] < 1 || date[1] > 12 || date[2] < 1) {
+        return key;
+    }
+    utc = dateToSeconds(date) - offsetMinutes * 60LL;
+    secondsToDate(utc + getZoneOffset(tz, utc), date);
+    return packDateKey(date);
+}
@@ -0,0 +1,110 @@
+/*
+ * Time zone correction
+ *
+ * DateTimeOriginal is wall clock time wherever the camera happened to be
+ * (or UTC on many phones), so a trip across time zones lands photos in
+ * the wrong day.  The offset of each photo is taken from Exif 2.31
+ * OffsetTimeOriginal / OffsetTime, or derived from the GPS time stamp,
+ * and the date is moved into one target zone before splitting.
+ *
+ * A zone is loaded once from its TZif file (/usr/share/zoneinfo or
+ * $TZDIR) into a sorted table of UTC transition instants.  The POSIX TZ
+ * rule at the end of the file is expanded into explicit transitions up
+ * to TZONE_LAST_YEAR, so every conversion is the same branch-free
+ * binary search over plain arrays, with no allocation and no libc
+ * localtime() state.
+ *
+ *   Typical Usage:
+ *
+ *   TimeZone *tz = loadTimeZone("Europe/Berlin", &result);
+ *   IngestOptions opt = { ORDER_INODE };
+ *   opt.zone = tz;
+ *   ingestPhotos(entries, &opt, pics, NULL); // dates are Berlin time
+ *   splitpicsOntime(pics, 2, picsOT);
+ *   freeTimeZone(tz);
+ */
+#if !defined(_TZONE_H_)
+#define _TZONE_H_
+
+#include <array>
+
+#define UTC_OFFSET_UNKNOWN  (-32768)
+#define TZONE_LAST_YEAR     2100
+
+typedef struct _timeZone TimeZone;
+
+/**
+ * loadTimeZone()
+ *
+ * Load a time zone
+ *
+ * parameters
+ *  [in] name : "UTC", a fixed offset such as "+09:00" or "-0330",
+ *              a zoneinfo name such as "Asia/Tokyo", or a TZif file path
+ *  [out] pResult : result status
+ *   0: OK
+ *  -n: error
+ *      ERR_READ_FILE (no such zone)
+ *      ERR_INVALID_ID (not a TZif file)
+ *      ERR_MEMALLOC
+ *
+ * return
+ *  NULL: error
+ * !NULL: the zone
+ */
+TimeZone *loadTimeZone(const char *name, int *pResult);
+
+/**
+ * freeTimeZone()
+ *
+ * Free a zone
+ */
+void freeTimeZone(TimeZone *tz);
+
+/**
+ * getZoneOffset()
+ *
+ * Offset of the zone from UTC at an instant
+ *
+ * parameters
+ *  [in] tz : the zone
+ *  [in] utc : seconds since 1970-01-01 00:00:00 UTC
+ *
+ * return
+ *  seconds east of UTC
+ */
+int getZoneOffset(const TimeZone *tz, long long utc);
+
+/**
+ * readUtcOffset()
+ *
+ * Offset of the shooting time from UTC as recorded in the Exif data:
+ * OffsetTimeOriginal, else OffsetTime, else the difference between
+ * DateTimeOriginal and the GPS date and time (rounded to 15 minutes)
+ *
+ * parameters
+ *  [in] ifdArray : from createIfdTableArray()
+ *
+ * return
+ *  minutes east of UTC, UTC_OFFSET_UNKNOWN if nothing tells
+ */
+int readUtcOffset(void **ifdArray);
+
+/**
+ * dateKeyToZone()
+ *
+ * Move a date key from the zone it was shot in to the target zone
+ *
+ * parameters
+ *  [in] tz : target zone (NULL = leave the key as is)
+ *  [in] key : packDateKey() of the local shooting time
+ *  [in] offsetMinutes : offset of the key from UTC, UTC_OFFSET_UNKNOWN
+ *                       leaves the key as is
+ *
+ * return
+ *  the date key in the target zone
+ */
+unsigned long long dateKeyToZone(const TimeZone *tz, unsigned long long key,
+                                 int offsetMinutes);
+
+#endif // _TZONE_H_
@@ -0,0 +1,441 @@
+/*
+ * Watch mode
+ *
+ * Each photo is parsed when its writer closes it (IN_CLOSE_WRITE) or when
+ * it is renamed into a watched directory (IN_MOVED_TO).  The grouping is
+ * a map from the truncated date key to the set of paths in the group, so
+ * an event touches only the group the photo leaves and the one it joins.
+ *
+ * When the kernel's event queue overflows (IN_Q_OVERFLOW) events were
+ * lost, so every root is walked again and the result diffed against the
+ * grouping.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <new>
+#include "exif.hpp"
+#include "dirwalk.h"
+#include "watcher.h"
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+                    IN_DELETE | IN_CREATE | IN_DELETE_SELF)
+
+typedef struct {
+    unsigned long long dateKey;
+    unsigned long long group;
+    int orientation;
+} WatchedPhoto;
+
+struct _photoWatcher {
+    int fd;
+    int rule;
+    WatchCallback callback;
+    void *userData;
+    MetaCache *cache;
+    std::vector<std::string> roots;
+    std::map<int, std::string> dirs;                 // watch descriptor -> directory
+    std::map<std::string, WatchedPhoto> photos;      // path -> photo
+    std::map<unsigned long long, std::set<std::string> > groups;
+};
+
+static void emit(PhotoWatcher *w, WATCH_EVENT_TYPE type, const std::string& path,
+                 unsigned long long oldGroup, unsigned long long newGroup, int orien)
+{
+    WatchEvent ev;
+    if (!w->callback) {
+        return;
+    }
+    ev.type = type;
+    ev.path = path.c_str();
+    ev.oldGroup = oldGroup;
+    ev.newGroup = newGroup;
+    ev.orientation = orien;
+    w->callback(&ev, w->userData);
+}
+
+// take a photo out of its group
+static void leaveGroup(PhotoWatcher *w, const std::string& path, unsigned long long group)
+{
+    std::map<unsigned long long, std::set<std::string> >::iterator it = w->groups.find(group);
+    if (it == w->groups.end()) {
+        return;
+    }
+    it->second.erase(path);
+    if (it->second.empty()) {
+        w->groups.erase(it);
+        emit(w, WATCH_GROUP_DELETED, path, group, 0, NOT_AVAILABLE);
+    }
+}
+
+// put a photo into its group
+static void joinGroup(PhotoWatcher *w, const std::string& path, unsigned long long group)
+{
+    std::set<std::string>& members = w->groups[group];
+    if (members.empty()) {
+        emit(w, WATCH_GROUP_CREATED, path, 0, group, NOT_AVAILABLE);
+    }
+    members.insert(path);
+}
+
+static void removePhoto(PhotoWatcher *w, const std::string& path)
+{
+    std::map<std::string, WatchedPhoto>::iterator it = w->photos.find(path);
+    if (it == w->photos.end()) {
+        return;
+    }
+    unsigned long long group = it->second.group;
+    w->photos.erase(it);
+    emit(w, WATCH_PHOTO_REMOVED, path, group, 0, NOT_AVAILABLE);
+    leaveGroup(w, path, group);
+}
+
+// parse a new or modified photo and update the grouping; 1 = the photo
+// is in a group, 0 = it is not (gone, no Exif, no shooting date)
+static int updatePhoto(PhotoWatcher *w, const std::string& path)
+{
+    MetaCacheRecord rec;
+    WatchedPhoto photo;
+    int sts = getImgMetaCached(w->cache, path.c_str(), &rec);
+    if (sts == ERR_READ_FILE) {
+        return 0; // vanished again before we got to it
+    }
+    if (sts <= 0 || rec.dateKey == DATEKEY_NONE) {
+        // screenshots and the like have no date to group by; a photo
+        // rewritten without one leaves its group
+        removePhoto(w, path);
+        return 0;
+    }
+    photo.dateKey = rec.dateKey;
+    photo.group = truncateDateKey(rec.dateKey, w->rule);
+    photo.orientation = rec.orientation;
+
+    std::map<std::string, WatchedPhoto>::iterator it = w->photos.find(path);
+    if (it == w->photos.end()) {
+        w->photos[path] = photo;
+        joinGroup(w, path, photo.group);
+        emit(w, WATCH_PHOTO_ADDED, path, 0, photo.group, photo.orientation);
+    } else {
+        unsigned long long oldGroup = it->second.group;
+        it->second = photo;
+        if (oldGroup != photo.group) {
+            leaveGroup(w, path, oldGroup);
+            joinGroup(w, path, photo.group);
+            emit(w, WATCH_PHOTO_MOVED, path, oldGroup, photo.group, photo.orientation);
+        }
+    }
+    return 1;
+}
+
+// remove every photo below a directory that was moved away
+static void removeTree(PhotoWatcher *w, const std::string& dir)
+{
+    std::string prefix = dir + "/";
+    std::vector<std::string> gone;
+    std::map<std::string, WatchedPhoto>::iterator it = w->photos.lower_bound(prefix);
+    for (; it != w->photos.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+        gone.push_back(it->first);
+    }
+    for (size_t i = 0; i < gone.size(); i++) {
+        removePhoto(w, gone[i]);
+    }
+}
+
+// stop watching a directory that was moved away and everything below it,
+// so its events don't keep arriving under the old paths
+static void unwatchTree(PhotoWatcher *w, const std::string& dir)
+{
+    std::string prefix = dir + "/";
+    std::map<int, std::string>::iterator it = w->dirs.begin();
+    while (it != w->dirs.end()) {
+        if (it->second == dir || it->second.compare(0, prefix.size(), prefix) == 0) {
+            inotify_rm_watch(w->fd, it->first);
+            w->dirs.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// add watches below dir; optionally index the photos already there and
+// collect their paths into seen (may be NULL)
+static int watchTree(PhotoWatcher *w, const std::string& dir, int scanExisting, int *parsed,
+                     std::set<std::string> *seen)
+{
+    int wd, n = 1;
+    DIR *dp;
+    struct dirent *de;
+
+    wd = inotify_add_watch(w->fd, dir.c_str(), WATCH_MASK | IN_ONLYDIR);
+    if (wd < 0) {
+        return ERR_READ_FILE;
+    }
+    w->dirs[wd] = dir;
+    dp = opendir(dir.c_str());
+    if (!dp) {
+        return n;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        std::string path;
+        int isDir;
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        path = dir + "/" + de->d_name;
+        isDir = (de->d_type == DT_DIR);
+        if (de->d_type == DT_UNKNOWN) {
+            struct stat st;
+            isDir = (lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode));
+        }
+        if (isDir) {
+            int sts = watchTree(w, path, scanExisting, parsed, seen);
+            if (sts > 0) {
+                n += sts;
+            }
+        } else if (scanExisting && hasPhotoExtension(de->d_name, NULL) &&
+                   updatePhoto(w, path)) {
+            (*parsed)++;
+            if (seen) {
+                seen->insert(path);
+            }
+        }
+    }
+    closedir(dp);
+    return n;
+}
+
+/**
+ * createPhotoWatcher()
+ *
+ * Create a watcher
+ */
+PhotoWatcher *createPhotoWatcher(int rule, WatchCallback callback, void *userData,
+                                 MetaCache *cache, int *pResult)
+{
+    PhotoWatcher *w = new (std::nothrow) PhotoWatcher;
+    if (!w) {
+        if (pResult) {
+            *pResult = ERR_MEMALLOC;
+        }
+        return NULL;
+    }
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->fd < 0) {
+        delete w;
+        if (pResult) {
+            *pResult = ERR_UNKNOWN;
+        }
+        return NULL;
+    }
+    w->rule = rule;
+    w->callback = callback;
+    w->userData = userData;
+    w->cache = cache;
+    if (pResult) {
+        *pResult = 0;
+    }
+    return w;
+}
+
+/**
+ * destroyPhotoWatcher()
+ *
+ * Stop watching and free the watcher
+ */
+void destroyPhotoWatcher(PhotoWatcher *watcher)
+{
+    if (!watcher) {
+        return;
+    }
+    close(watcher->fd);
+    delete watcher;
+}
+
+/**
+ * addWatchRoot()
+ *
+ * Watch a source tree recursively
+ */
+int addWatchRoot(PhotoWatcher *watcher, const char *root, int scanExisting)
+{
+    int parsed = 0;
+    std::string dir(root);
+    if (!watcher) {
+        return ERR_INVALID_POINTER;
+    }
+    while (dir.size() > 1 && dir[dir.size() - 1] == '/') {
+        dir.erase(dir.size() - 1);
+    }
+    watcher->roots.push_back(dir);
+    return watchTree(watcher, dir, scanExisting, &parsed, NULL);
+}
+
+// events were lost: watch and walk every root afresh, then drop the
+// photos that are no longer there; the walk reports what changed
+static void rescanRoots(PhotoWatcher *w, int *parsed)
+{
+    std::set<std::string> seen;
+    std::vector<std::string> gone;
+    std::map<int, std::string>::iterator d;
+    for (d = w->dirs.begin(); d != w->dirs.end(); ++d) {
+        inotify_rm_watch(w->fd, d->first);
+    }
+    w->dirs.clear();
+    for (size_t i = 0; i < w->roots.size(); i++) {
+        watchTree(w, w->roots[i], 1, parsed, &seen);
+    }
+    std::map<std::string, WatchedPhoto>::iterator it;
+    for (it = w->photos.begin(); it != w->photos.end(); ++it) {
+        if (!seen.count(it->first)) {
+            gone.push_back(it->first);
+        }
+    }
+    for (size_t i = 0; i < gone.size(); i++) {
+        removePhoto(w, gone[i]);
+    }
+}
+
+/**
+ * pollPhotoWatcher()
+ *
+ * Process the pending file system events
+ */
+int pollPhotoWatcher(PhotoWatcher *watcher, int timeoutMs)
+{
+    // aligned as required for struct inotify_event
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd;
+    int parsed = 0, overflow = 0;
+    ssize_t len;
+
+    if (!watcher) {
+        return ERR_INVALID_POINTER;
+    }
+    pfd.fd = watcher->fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeoutMs) <= 0) {
+        return 0;
+    }
+    for (;;) {
+        len = read(watcher->fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                break;
+            }
+            return ERR_READ_FILE;
+        }
+        if (len == 0) {
+            break;
+        }
+        for (char *p = buf; p < buf + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                overflow = 1; // comes with wd == -1
+                continue;
+            }
+            std::map<int, std::string>::iterator d = watcher->dirs.find(ev->wd);
+            if (d == watcher->dirs.end()) {
+                continue;
+            }
+            if (ev->mask & (IN_IGNORED | IN_DELETE_SELF)) {
+                watcher->dirs.erase(d);
+                continue;
+            }
+            if (ev->len == 0) {
+                continue;
+            }
+            std::string path = d->second + "/" + ev->name;
+            if (ev->mask & IN_ISDIR) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    // files may already have landed before the watch was added
+                    watchTree(watcher, path, 1, &parsed, NULL);
+                } else if (ev->mask & IN_MOVED_FROM) {
+                    removeTree(watcher, path);
+                    unwatchTree(watcher, path);
+                }
+                continue;
+            }
+            if (!hasPhotoExtension(ev->name, NULL)) {
+                continue;
+            }
+            if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                parsed += updatePhoto(watcher, path);
+            } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                removePhoto(watcher, path);
+            }
+        }
+    }
+    if (overflow) {
+        rescanRoots(watcher, &parsed);
+    }
+    return parsed;
+}
+
+/**
+ * runPhotoWatcher()
+ *
+ * Process events until *stop becomes non-zero
+ */
+int runPhotoWatcher(PhotoWatcher *watcher, volatile int *stop, int timeoutMs)
+{
+    while (!*stop) {
+        int sts = pollPhotoWatcher(watcher, timeoutMs);
+        if (sts < 0) {
+            return sts;
+        }
+    }
+    return 0;
+}
+
+static bool compWatched(const std::pair<unsigned long long, std::string>& x,
+                        const std::pair<unsigned long long, std::string>& y)
+{
+    return x < y;
+}
+
+/**
+ * getWatcherGroups()
+ *
+ * Get the current grouping in the form splitpicsOntime() produces
+ */
+void getWatcherGroups(PhotoWatcher *watcher, std::vector<picsInoneTime>& picsOT)
+{
+    picsOT.clear();
+    if (!watcher) {
+        return;
+    }
+    std::map<unsigned long long, std::set<std::string> >::iterator g;
+    for (g = watcher->groups.begin(); g != watcher->groups.end(); ++g) {
+        std::vector<std::pair<unsigned long long, std::string> > members;
+        std::set<std::string>::iterator m;
+        for (m = g->second.begin(); m != g->second.end(); ++m) {
+            members.push_back(std::make_pair(watcher->photos[*m].dateKey, *m));
+        }
+        std::sort(members.begin(), members.end(), compWatched);
+
+        picsInoneTime tmp;
+        for (size_t i = 0; i < members.size(); i++) {
+            picture pic;
+            const std::string& path = members[i].second;
+            size_t slash = path.rfind('/');
+            unpackDateKey(members[i].first, pic.date);
+            pic.filepath = path;
+            pic.filename = (slash == std::string::npos) ? path : path.substr(slash + 1);
+            pic.orien = watcher->photos[path].orientation;
+            tmp.pic.push_back(pic);
+        }
+        picsOT.push_back(tmp);
+    }
+}
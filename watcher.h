@@ -0,0 +1,149 @@
+/*
+ * Watch mode
+ *
+ * A long-running splitter that watches one or more source trees with
+ * inotify, parses every new or modified JPEG exactly once and keeps the
+ * date grouping of splitpicsOntime() up to date incrementally.  Every
+ * change of the grouping is reported through a callback as it happens.
+ *
+ *   Typical Usage:
+ *
+ *   static void onChange(const WatchEvent *ev, void *user) { ... }
+ *
+ *   int result;
+ *   PhotoWatcher *w = createPhotoWatcher(2, onChange, NULL, NULL, &result);
+ *   addWatchRoot(w, "/srv/uploads", 1);
+ *   volatile int stop = 0;
+ *   runPhotoWatcher(w, &stop, 1000);   // returns when stop becomes 1
+ *   destroyPhotoWatcher(w);
+ *
+ * note
+ * fanotify would need CAP_SYS_ADMIN, so only inotify is used; new
+ * sub-directories are added to the watch set as they appear, and those
+ * moved out of the tree are dropped from it.  If the kernel's event
+ * queue overflows, the roots are walked again and every photo on them
+ * re-read (through the cache, if one is given), so the grouping matches
+ * the disk again.  Files without a readable shooting date are not
+ * grouped and produce no events.
+ */
+#if !defined(_WATCHER_H_)
+#define _WATCHER_H_
+
+#include <vector>
+#include "fastCluster.h"
+#include "metacache.h"
+
+// kind of a group change
+typedef enum {
+    WATCH_PHOTO_ADDED = 1,   // a photo joined newGroup
+    WATCH_PHOTO_REMOVED,     // a photo left oldGroup
+    WATCH_PHOTO_MOVED,       // a photo was re-dated from oldGroup to newGroup
+    WATCH_GROUP_CREATED,     // newGroup got its first photo
+    WATCH_GROUP_DELETED      // oldGroup lost its last photo
+} WATCH_EVENT_TYPE;
+
+// group change event; groups are truncateDateKey() values for the rule
+typedef struct {
+    WATCH_EVENT_TYPE type;
+    const char *path;
+    unsigned long long oldGroup;
+    unsigned long long newGroup;
+    int orientation;
+} WatchEvent;
+
+typedef void (*WatchCallback)(const WatchEvent *ev, void *userData);
+
+typedef struct _photoWatcher PhotoWatcher;
+
+/**
+ * createPhotoWatcher()
+ *
+ * Create a watcher
+ *
+ * parameters
+ *  [in] rule : split rule as for splitpicsOntime()
+ *  [in] callback : receives the group change events (may be NULL)
+ *  [in] userData : passed through to the callback
+ *  [in] cache : optional metadata cache (may be NULL)
+ *  [out] pResult : result status
+ *   0: OK
+ *  -n: error
+ *      ERR_MEMALLOC
+ *      ERR_UNKNOWN (inotify is not available)
+ *
+ * return
+ *  NULL: error
+ * !NULL: the watcher handle
+ */
+PhotoWatcher *createPhotoWatcher(int rule, WatchCallback callback, void *userData,
+                                 MetaCache *cache, int *pResult);
+
+/**
+ * destroyPhotoWatcher()
+ *
+ * Stop watching and free the watcher
+ */
+void destroyPhotoWatcher(PhotoWatcher *watcher);
+
+/**
+ * addWatchRoot()
+ *
+ * Watch a source tree recursively
+ *
+ * parameters
+ *  [in] watcher : the watcher handle
+ *  [in] root : top directory
+ *  [in] scanExisting : 1 = index the photos already in the tree
+ *
+ * return
+ *   n: number of directories watched
+ *  -n: error
+ *      ERR_INVALID_POINTER
+ *      ERR_READ_FILE
+ */
+int addWatchRoot(PhotoWatcher *watcher, const char *root, int scanExisting);
+
+/**
+ * pollPhotoWatcher()
+ *
+ * Process the pending file system events
+ *
+ * parameters
+ *  [in] watcher : the watcher handle
+ *  [in] timeoutMs : time to wait for the first event, -1 = forever
+ *
+ * return
+ *   n: number of photos (re)parsed into a group
+ *  -n: error
+ *      ERR_READ_FILE
+ */
+int pollPhotoWatcher(PhotoWatcher *watcher, int timeoutMs);
+
+/**
+ * runPhotoWatcher()
+ *
+ * Process events until *stop becomes non-zero
+ *
+ * parameters
+ *  [in] watcher : the watcher handle
+ *  [in] stop : stop flag, checked at least every timeoutMs
+ *  [in] timeoutMs : poll interval
+ *
+ * return
+ *   0: stopped
+ *  -n: error
+ */
+int runPhotoWatcher(PhotoWatcher *watcher, volatile int *stop, int timeoutMs);
+
+/**
+ * getWatcherGroups()
+ *
+ * Get the current grouping in the form splitpicsOntime() produces
+ *
+ * parameters
+ *  [in] watcher : the watcher handle
+ *  [out] picsOT : groups in chronological order
+ */
+void getWatcherGroups(PhotoWatcher *watcher, std::vector<picsInoneTime>& picsOT);
+
+#endif // _WATCHER_H_